@@ -0,0 +1,830 @@
+/*
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// terminalwidget-bench replays recorded or synthesised terminal output
+// through Vt102Emulation and Screen, without any view attached, and
+// reports the throughput of the emulation for each scenario.  With --paint
+// the output is shown on a TerminalDisplay instead and the cost of
+// painting it is reported.
+
+// System
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <sys/resource.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+// Qt
+#include <QApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTextCodec>
+#include <QTextStream>
+
+// Konsole
+#include "BlockArray.h"
+#include "History.h"
+#include "ScreenWindow.h"
+#include "TerminalDisplay.h"
+#include "Vt102Emulation.h"
+
+#include "scenarios.h"
+
+using namespace Konsole;
+
+#if defined(__GLIBC__)
+// Count heap allocations and the bytes in use by interposing the allocator
+// entry points.  Qt containers and operator new both end up in these.
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+extern "C" void *__libc_memalign(size_t alignment, size_t size);
+extern "C" void __libc_free(void *ptr);
+
+static std::atomic<quint64> allocationCount(0);
+static std::atomic<qint64> heapBytesInUse(0);
+
+static void *allocated(void *ptr)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (ptr)
+        heapBytesInUse.fetch_add(qint64(malloc_usable_size(ptr)), std::memory_order_relaxed);
+    return ptr;
+}
+
+extern "C" void *malloc(size_t size)
+{
+    return allocated(__libc_malloc(size));
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    return allocated(__libc_calloc(count, size));
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    const qint64 before = ptr ? qint64(malloc_usable_size(ptr)) : 0;
+    void *result = __libc_realloc(ptr, size);
+    // a failed realloc() keeps the old block, realloc(ptr, 0) frees it
+    if (!result && size != 0)
+        return result;
+    heapBytesInUse.fetch_sub(before, std::memory_order_relaxed);
+    return allocated(result);
+}
+
+extern "C" void *memalign(size_t alignment, size_t size)
+{
+    return allocated(__libc_memalign(alignment, size));
+}
+
+extern "C" void *aligned_alloc(size_t alignment, size_t size)
+{
+    return allocated(__libc_memalign(alignment, size));
+}
+
+extern "C" int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    void *result = allocated(__libc_memalign(alignment, size));
+    if (!result)
+        return ENOMEM;
+    *ptr = result;
+    return 0;
+}
+
+extern "C" void free(void *ptr)
+{
+    if (ptr)
+        heapBytesInUse.fetch_sub(qint64(malloc_usable_size(ptr)), std::memory_order_relaxed);
+    __libc_free(ptr);
+}
+
+static quint64 allocations()
+{
+    return allocationCount.load(std::memory_order_relaxed);
+}
+
+static qint64 heapBytes()
+{
+    return heapBytesInUse.load(std::memory_order_relaxed);
+}
+#else
+static quint64 allocations()
+{
+    return 0;
+}
+
+static qint64 heapBytes()
+{
+    return 0;
+}
+#endif
+
+// Resets the peak resident set size of the process so that it can be
+// measured per scenario.  Only possible on Linux; elsewhere the peak of
+// the whole run is reported.
+static void resetPeakRss()
+{
+    QFile clearRefs(QStringLiteral("/proc/self/clear_refs"));
+    if (clearRefs.open(QIODevice::WriteOnly))
+        clearRefs.write("5");
+}
+
+// Peak resident set size in KiB
+static qint64 peakRss()
+{
+    QFile status(QStringLiteral("/proc/self/status"));
+    if (status.open(QIODevice::ReadOnly)) {
+        const QList<QByteArray> lines = status.readAll().split('\n');
+        for (const QByteArray &line : lines) {
+            if (line.startsWith("VmHWM:"))
+                return line.mid(6).trimmed().split(' ').first().toLongLong();
+        }
+    }
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return usage.ru_maxrss;
+    return -1;
+}
+
+struct Options
+{
+    int lines = 24;
+    int columns = 80;
+    int historySize = 5000;
+    QString historyType = QStringLiteral("compact");
+    int chunkSize = 4096;
+    int iterations = 3;
+    int snapshotBytes = 0;
+};
+
+// Measurements of a single replay
+struct Replay
+{
+    qint64 nanoseconds = 0;
+    quint64 allocations = 0;
+    // heap held by the screens and history after the replay
+    qint64 retainedBytes = 0;
+    qint64 historyLines = 0;
+    // time to copy the visible image once
+    qint64 getImageNanoseconds = 0;
+};
+
+struct Result
+{
+    QString name;
+    qint64 bytes = 0;
+    qint64 bestNanoseconds = 0;
+    quint64 allocations = 0;
+    qint64 peakRssKiB = 0;
+    qint64 getImageNanoseconds = 0;
+    // -1 if the scenario left no history, e.g. on the alternate screen
+    double historyKiBPer10kLines = -1;
+
+    double megabytesPerSecond() const
+    {
+        return bestNanoseconds ? (bytes / 1048576.0) / (bestNanoseconds / 1e9) : 0;
+    }
+    double nanosecondsPerByte() const
+    {
+        return bytes ? double(bestNanoseconds) / bytes : 0;
+    }
+};
+
+static const char *const historyTypes[] = { "compact", "buffer", "tiered" };
+
+static void setHistory(Emulation &emulation, const Options &options)
+{
+    if (options.historyType == QLatin1String("buffer"))
+        emulation.setHistory(HistoryTypeBuffer(options.historySize));
+    else if (options.historyType == QLatin1String("tiered"))
+        emulation.setHistory(TieredHistoryType(options.historySize));
+    else
+        emulation.setHistory(CompactHistoryType(options.historySize));
+}
+
+// Feeds the scenario to a fresh emulation in pty sized chunks and measures
+// the elapsed time.  Setting up the emulation is not part of the measurement.
+static Replay replay(const Scenario &scenario, const Options &options)
+{
+    Replay result;
+
+    Vt102Emulation emulation;
+    emulation.setCodec(QTextCodec::codecForName("UTF-8"));
+    setHistory(emulation, options);
+    emulation.setImageSize(options.lines, options.columns);
+    ScreenWindow *window = emulation.createWindow();
+
+    const char *data = scenario.data.constData();
+    const int size = scenario.data.size();
+    int sinceSnapshot = 0;
+
+    const qint64 heapBefore = heapBytes();
+    const quint64 allocationsBefore = allocations();
+    QElapsedTimer timer;
+    timer.start();
+
+    for (int offset = 0; offset < size; offset += options.chunkSize) {
+        const int length = qMin(options.chunkSize, size - offset);
+        emulation.receiveData(data + offset, length);
+
+        // optionally copy the visible image like a view would on each frame
+        sinceSnapshot += length;
+        if (options.snapshotBytes > 0 && sinceSnapshot >= options.snapshotBytes) {
+            window->notifyOutputChanged();
+            window->getImage();
+            sinceSnapshot = 0;
+        }
+    }
+
+    result.nanoseconds = timer.nsecsElapsed();
+    result.allocations = allocations() - allocationsBefore;
+    result.retainedBytes = heapBytes() - heapBefore;
+    result.historyLines = emulation.lineCount() - emulation.imageSize().height();
+
+    // copy the visible image like a view does for every frame
+    const int copies = 1000;
+    timer.restart();
+    for (int i = 0; i < copies; i++) {
+        window->notifyOutputChanged();
+        window->getImage();
+    }
+    result.getImageNanoseconds = timer.nsecsElapsed() / copies;
+    return result;
+}
+
+static Result runScenario(const Scenario &scenario, const Options &options)
+{
+    Result result;
+    result.name = scenario.name;
+    result.bytes = scenario.data.size();
+
+    resetPeakRss();
+    for (int i = 0; i < options.iterations; i++) {
+        const Replay run = replay(scenario, options);
+        if (i == 0 || run.nanoseconds < result.bestNanoseconds) {
+            result.bestNanoseconds = run.nanoseconds;
+            result.allocations = run.allocations;
+            result.getImageNanoseconds = run.getImageNanoseconds;
+            if (run.historyLines > 0)
+                result.historyKiBPer10kLines = run.retainedBytes / 1024.0 * 10000 / run.historyLines;
+        }
+    }
+    result.peakRssKiB = peakRss();
+    return result;
+}
+
+static void printTable(const QList<Result> &results)
+{
+    QTextStream out(stdout);
+    out << qSetFieldWidth(12) << left << "scenario" << right
+        << "MiB" << "MB/s" << "ns/byte" << "allocs" << "allocs/MiB" << "peak KiB"
+        << "KiB/10k" << "getImage ns"
+        << qSetFieldWidth(0) << endl;
+
+    for (const Result &result : results) {
+        const double megabytes = result.bytes / 1048576.0;
+        out << qSetFieldWidth(12) << left << result.name << right
+            << QString::number(megabytes, 'f', 1)
+            << QString::number(result.megabytesPerSecond(), 'f', 1)
+            << QString::number(result.nanosecondsPerByte(), 'f', 2)
+            << result.allocations
+            << QString::number(megabytes > 0 ? result.allocations / megabytes : 0, 'f', 0)
+            << result.peakRssKiB
+            << (result.historyKiBPer10kLines < 0 ? QStringLiteral("-")
+                                                 : QString::number(result.historyKiBPer10kLines, 'f', 0))
+            << result.getImageNanoseconds
+            << qSetFieldWidth(0) << endl;
+    }
+}
+
+static void printJson(const QList<Result> &results, const Options &options)
+{
+    QJsonArray scenarios;
+    for (const Result &result : results) {
+        QJsonObject object;
+        object[QStringLiteral("name")] = result.name;
+        object[QStringLiteral("bytes")] = result.bytes;
+        object[QStringLiteral("nanoseconds")] = result.bestNanoseconds;
+        object[QStringLiteral("megabytesPerSecond")] = result.megabytesPerSecond();
+        object[QStringLiteral("nanosecondsPerByte")] = result.nanosecondsPerByte();
+        object[QStringLiteral("allocations")] = double(result.allocations);
+        object[QStringLiteral("peakRssKiB")] = result.peakRssKiB;
+        object[QStringLiteral("historyKiBPer10kLines")] = result.historyKiBPer10kLines;
+        object[QStringLiteral("getImageNanoseconds")] = result.getImageNanoseconds;
+        scenarios.append(object);
+    }
+
+    QJsonObject root;
+    root[QStringLiteral("version")] = QStringLiteral(TERMINALWIDGET_VERSION);
+    root[QStringLiteral("lines")] = options.lines;
+    root[QStringLiteral("columns")] = options.columns;
+    root[QStringLiteral("historySize")] = options.historySize;
+    root[QStringLiteral("historyType")] = options.historyType;
+    root[QStringLiteral("chunkSize")] = options.chunkSize;
+    root[QStringLiteral("iterations")] = options.iterations;
+    root[QStringLiteral("snapshotBytes")] = options.snapshotBytes;
+    root[QStringLiteral("scenarios")] = scenarios;
+
+    QTextStream(stdout) << QJsonDocument(root).toJson();
+}
+
+// Throughput of appending lines to and reading random lines from a history
+struct HistoryAccess
+{
+    QString type;
+    int lines = 0;
+    int columns = 0;
+    double appendNanosecondsPerLine = 0;
+    double readNanosecondsPerLine = 0;
+};
+
+static HistoryAccess measureHistoryAccess(const QString &type, HistoryScroll *history, int lines, int columns)
+{
+    HistoryAccess result;
+    result.type = type;
+    result.lines = lines;
+    result.columns = columns;
+
+    QVector<Character> cells(columns);
+    for (int i = 0; i < columns; i++)
+        cells[i].character = 'a' + i % 26;
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int line = 0; line < lines; line++) {
+        cells[0].character = 'a' + line % 26;
+        history->addCellsVector(cells);
+        history->addLine(false);
+    }
+    result.appendNanosecondsPerLine = double(timer.nsecsElapsed()) / qMax(1, lines);
+
+    // random lines, the same ones on every run
+    const int reads = 100000;
+    const int stored = history->getLines();
+    quint32 seed = 12345;
+    qint64 checksum = 0;
+    timer.restart();
+    for (int i = 0; i < reads && stored > 0; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        const int line = int((seed >> 8) % uint(stored));
+        const int length = qMin(history->getLineLen(line), columns);
+        history->getCells(line, 0, length, cells.data());
+        checksum += cells[0].character;
+    }
+    result.readNanosecondsPerLine = stored > 0 ? double(timer.nsecsElapsed()) / reads : 0;
+    Q_UNUSED(checksum)
+    return result;
+}
+
+// Compares the file based histories, which do not keep their lines on the
+// heap, by appending a history's worth of lines and reading random ones
+static QList<HistoryAccess> runHistoryAccess(const Options &options)
+{
+    QList<HistoryAccess> results;
+    const int lines = qMax(1, options.historySize);
+
+    HistoryScroll *file = HistoryTypeFile().scroll(nullptr);
+    results << measureHistoryAccess(QStringLiteral("file"), file, lines, options.columns);
+    delete file;
+
+    // a line has to fit into one block
+    const int blockColumns = qMin(options.columns, int(ENTRIES / sizeof(Character)) - 1);
+    HistoryScroll *blocks = HistoryTypeBlockArray(lines).scroll(nullptr);
+    results << measureHistoryAccess(QStringLiteral("blockarray"), blocks, lines, blockColumns);
+    delete blocks;
+
+    return results;
+}
+
+// Cost of painting the output on a display, one frame per chunk
+struct PaintResult
+{
+    QString name;
+    quint64 frames = 0;
+    quint64 fullFrames = 0;
+    double cellsPerFrame = 0;
+    quint64 maximumCells = 0;
+    double cachedLinesPerFrame = 0;
+    double microsecondsPerFrame = 0;
+    double allocationsPerFrame = 0;
+};
+
+static PaintResult runPaint(const Scenario &scenario, const Options &options)
+{
+    PaintResult result;
+    result.name = scenario.name;
+
+    Vt102Emulation emulation;
+    emulation.setCodec(QTextCodec::codecForName("UTF-8"));
+    setHistory(emulation, options);
+    emulation.setImageSize(options.lines, options.columns);
+
+    TerminalDisplay display;
+    display.setFixedSize(options.columns, options.lines);
+    ScreenWindow *window = emulation.createWindow();
+    display.setScreenWindow(window);
+    display.show();
+    QApplication::processEvents();
+    const TerminalDisplay::PaintStatistics before = display.paintStatistics();
+
+    const char *data = scenario.data.constData();
+    const int size = scenario.data.size();
+    qint64 paintNanoseconds = 0;
+    quint64 paintAllocations = 0;
+    QElapsedTimer timer;
+
+    for (int offset = 0; offset < size; offset += options.chunkSize) {
+        emulation.receiveData(data + offset, qMin(options.chunkSize, size - offset));
+
+        // fetch the image and paint what changed, like one frame of a view
+        const quint64 allocationsBefore = allocations();
+        timer.start();
+        window->notifyOutputChanged();
+        QApplication::processEvents();
+        paintNanoseconds += timer.nsecsElapsed();
+        paintAllocations += allocations() - allocationsBefore;
+    }
+
+    const TerminalDisplay::PaintStatistics after = display.paintStatistics();
+    result.frames = after.framesPainted - before.framesPainted;
+    result.fullFrames = after.fullFrames - before.fullFrames;
+    result.maximumCells = after.maximumCellsDrawn;
+    if (result.frames > 0) {
+        result.cellsPerFrame = double(after.totalCellsDrawn - before.totalCellsDrawn) / result.frames;
+        result.cachedLinesPerFrame = double(after.linesFromCache - before.linesFromCache) / result.frames;
+        result.microsecondsPerFrame = paintNanoseconds / 1000.0 / result.frames;
+        result.allocationsPerFrame = double(paintAllocations) / result.frames;
+    }
+    return result;
+}
+
+static void printPaint(const QList<PaintResult> &results, const Options &options, bool json)
+{
+    if (json) {
+        QJsonArray scenarios;
+        for (const PaintResult &result : results) {
+            QJsonObject object;
+            object[QStringLiteral("name")] = result.name;
+            object[QStringLiteral("frames")] = double(result.frames);
+            object[QStringLiteral("fullFrames")] = double(result.fullFrames);
+            object[QStringLiteral("cellsPerFrame")] = result.cellsPerFrame;
+            object[QStringLiteral("maximumCells")] = double(result.maximumCells);
+            object[QStringLiteral("cachedLinesPerFrame")] = result.cachedLinesPerFrame;
+            object[QStringLiteral("microsecondsPerFrame")] = result.microsecondsPerFrame;
+            object[QStringLiteral("allocationsPerFrame")] = result.allocationsPerFrame;
+            scenarios.append(object);
+        }
+        QJsonObject root;
+        root[QStringLiteral("version")] = QStringLiteral(TERMINALWIDGET_VERSION);
+        root[QStringLiteral("lines")] = options.lines;
+        root[QStringLiteral("columns")] = options.columns;
+        root[QStringLiteral("chunkSize")] = options.chunkSize;
+        root[QStringLiteral("paint")] = scenarios;
+        QTextStream(stdout) << QJsonDocument(root).toJson();
+        return;
+    }
+
+    QTextStream out(stdout);
+    out << qSetFieldWidth(12) << left << "scenario" << right
+        << "frames" << "full" << "cells/frame" << "max cells" << "cached/frame" << "us/frame" << "allocs/frame"
+        << qSetFieldWidth(0) << endl;
+    for (const PaintResult &result : results) {
+        out << qSetFieldWidth(12) << left << result.name << right
+            << result.frames << result.fullFrames
+            << QString::number(result.cellsPerFrame, 'f', 0)
+            << result.maximumCells
+            << QString::number(result.cachedLinesPerFrame, 'f', 1)
+            << QString::number(result.microsecondsPerFrame, 'f', 1)
+            << QString::number(result.allocationsPerFrame, 'f', 1)
+            << qSetFieldWidth(0) << endl;
+    }
+}
+
+// Full repaints of a display, with and without the glyph cache, which
+// draw every line, and with the line cache, which copies them
+struct RedrawResult
+{
+    QString name;
+    double cellsPerFrame = 0;
+    double redrawsPerSecond = 0;
+    double uncachedRedrawsPerSecond = 0;
+    double lineCacheRedrawsPerSecond = 0;
+    // heap allocations the display counts per repaint, with the glyph
+    // cache and with the line cache, in debug builds only
+    double allocationsPerRedraw = 0;
+    double lineCacheAllocationsPerRedraw = 0;
+};
+
+// the allocations per frame between two paint statistics of a display
+static double allocationsPerFrame(const TerminalDisplay::PaintStatistics &before,
+                                  const TerminalDisplay::PaintStatistics &after)
+{
+    if (after.framesPainted <= before.framesPainted)
+        return 0;
+    return double(after.totalAllocations - before.totalAllocations)
+           / (after.framesPainted - before.framesPainted);
+}
+
+// repaints the whole display for about a second and returns the repaints per second
+static double measureRedraws(TerminalDisplay &display)
+{
+    // the first repaint fills the caches
+    display.repaint();
+
+    int frames = 0;
+    QElapsedTimer timer;
+    timer.start();
+    while (timer.elapsed() < 1000) {
+        display.repaint();
+        frames++;
+    }
+    return frames / (timer.nsecsElapsed() / 1e9);
+}
+
+static RedrawResult runRedraw(const Scenario &scenario, const Options &options)
+{
+    RedrawResult result;
+    result.name = scenario.name;
+
+    Vt102Emulation emulation;
+    emulation.setCodec(QTextCodec::codecForName("UTF-8"));
+    setHistory(emulation, options);
+    emulation.setImageSize(options.lines, options.columns);
+
+    TerminalDisplay display;
+    display.setFixedSize(options.columns, options.lines);
+    ScreenWindow *window = emulation.createWindow();
+    display.setScreenWindow(window);
+    display.show();
+
+    // the screen as the scenario leaves it
+    emulation.receiveData(scenario.data.constData(), scenario.data.size());
+    window->notifyOutputChanged();
+    QApplication::processEvents();
+
+    // the first repaint of each measurement fills the caches, so it is not
+    // counted for the allocations
+    display.setLineCacheEnabled(false);
+    display.repaint();
+    TerminalDisplay::PaintStatistics before = display.paintStatistics();
+    for (int i = 0; i < options.iterations; i++)
+        result.redrawsPerSecond = qMax(result.redrawsPerSecond, measureRedraws(display));
+    TerminalDisplay::PaintStatistics after = display.paintStatistics();
+    if (after.framesPainted > before.framesPainted)
+        result.cellsPerFrame = double(after.totalCellsDrawn - before.totalCellsDrawn)
+                               / (after.framesPainted - before.framesPainted);
+    result.allocationsPerRedraw = allocationsPerFrame(before, after);
+
+    display.setGlyphCacheEnabled(false);
+    for (int i = 0; i < options.iterations; i++)
+        result.uncachedRedrawsPerSecond = qMax(result.uncachedRedrawsPerSecond, measureRedraws(display));
+
+    display.setGlyphCacheEnabled(true);
+    display.setLineCacheEnabled(true);
+    display.repaint();
+    before = display.paintStatistics();
+    for (int i = 0; i < options.iterations; i++)
+        result.lineCacheRedrawsPerSecond = qMax(result.lineCacheRedrawsPerSecond, measureRedraws(display));
+    after = display.paintStatistics();
+    result.lineCacheAllocationsPerRedraw = allocationsPerFrame(before, after);
+    return result;
+}
+
+static void printRedraw(const QList<RedrawResult> &results, const Options &options, bool json)
+{
+    if (json) {
+        QJsonArray scenarios;
+        for (const RedrawResult &result : results) {
+            QJsonObject object;
+            object[QStringLiteral("name")] = result.name;
+            object[QStringLiteral("cellsPerFrame")] = result.cellsPerFrame;
+            object[QStringLiteral("redrawsPerSecond")] = result.redrawsPerSecond;
+            object[QStringLiteral("uncachedRedrawsPerSecond")] = result.uncachedRedrawsPerSecond;
+            object[QStringLiteral("lineCacheRedrawsPerSecond")] = result.lineCacheRedrawsPerSecond;
+#ifndef QT_NO_DEBUG
+            object[QStringLiteral("allocationsPerRedraw")] = result.allocationsPerRedraw;
+            object[QStringLiteral("lineCacheAllocationsPerRedraw")] = result.lineCacheAllocationsPerRedraw;
+#endif
+            scenarios.append(object);
+        }
+        QJsonObject root;
+        root[QStringLiteral("version")] = QStringLiteral(TERMINALWIDGET_VERSION);
+        root[QStringLiteral("lines")] = options.lines;
+        root[QStringLiteral("columns")] = options.columns;
+        root[QStringLiteral("redraw")] = scenarios;
+        QTextStream(stdout) << QJsonDocument(root).toJson();
+        return;
+    }
+
+    QTextStream out(stdout);
+    out << qSetFieldWidth(12) << left << "scenario" << right
+        << "cells/frame" << "redraws/s" << "uncached/s" << "speedup" << "lines/s"
+        << "allocs" << "lines allocs"
+        << qSetFieldWidth(0) << endl;
+    for (const RedrawResult &result : results) {
+        out << qSetFieldWidth(12) << left << result.name << right
+            << QString::number(result.cellsPerFrame, 'f', 0)
+            << QString::number(result.redrawsPerSecond, 'f', 1)
+            << QString::number(result.uncachedRedrawsPerSecond, 'f', 1)
+            << QString::number(result.uncachedRedrawsPerSecond > 0
+                               ? result.redrawsPerSecond / result.uncachedRedrawsPerSecond : 0, 'f', 2)
+            << QString::number(result.lineCacheRedrawsPerSecond, 'f', 1)
+#ifdef QT_NO_DEBUG
+            // the display does not count them in release builds
+            << "-" << "-"
+#else
+            << QString::number(result.allocationsPerRedraw, 'f', 1)
+            << QString::number(result.lineCacheAllocationsPerRedraw, 'f', 1)
+#endif
+            << qSetFieldWidth(0) << endl;
+    }
+}
+
+static void printHistoryAccess(const QList<HistoryAccess> &results, bool json)
+{
+    if (json) {
+        QJsonArray histories;
+        for (const HistoryAccess &result : results) {
+            QJsonObject object;
+            object[QStringLiteral("type")] = result.type;
+            object[QStringLiteral("lines")] = result.lines;
+            object[QStringLiteral("columns")] = result.columns;
+            object[QStringLiteral("appendNanosecondsPerLine")] = result.appendNanosecondsPerLine;
+            object[QStringLiteral("readNanosecondsPerLine")] = result.readNanosecondsPerLine;
+            histories.append(object);
+        }
+        QJsonObject root;
+        root[QStringLiteral("version")] = QStringLiteral(TERMINALWIDGET_VERSION);
+        root[QStringLiteral("histories")] = histories;
+        QTextStream(stdout) << QJsonDocument(root).toJson();
+        return;
+    }
+
+    QTextStream out(stdout);
+    out << qSetFieldWidth(12) << left << "history" << right
+        << "lines" << "columns" << "append ns" << "read ns"
+        << qSetFieldWidth(0) << endl;
+    for (const HistoryAccess &result : results) {
+        out << qSetFieldWidth(12) << left << result.type << right
+            << result.lines << result.columns
+            << QString::number(result.appendNanosecondsPerLine, 'f', 1)
+            << QString::number(result.readNanosecondsPerLine, 'f', 1)
+            << qSetFieldWidth(0) << endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // painting needs a GUI application, which runs without a display on the
+    // offscreen platform
+    bool paint = false;
+    for (int i = 1; i < argc; i++)
+        paint |= qstrcmp(argv[i], "--paint") == 0 || qstrcmp(argv[i], "--redraw") == 0;
+    if (paint && qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QScopedPointer<QCoreApplication> app(paint ? new QApplication(argc, argv)
+                                               : new QCoreApplication(argc, argv));
+    QCoreApplication::setApplicationName(QStringLiteral("terminalwidget-bench"));
+    QCoreApplication::setApplicationVersion(QStringLiteral(TERMINALWIDGET_VERSION));
+    TerminalDisplay::setAllocationCounter(allocations);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Replays terminal output through the emulation and reports its throughput."));
+    parser.addHelpOption();
+    parser.addVersionOption();
+    parser.addPositionalArgument(QStringLiteral("captures"),
+                                 QStringLiteral("Pty captures to replay, as file or name=file. "
+                                                "Without captures the built-in scenarios are run."),
+                                 QStringLiteral("[captures...]"));
+
+    QCommandLineOption scenarioOption(QStringLiteral("scenario"),
+                                      QStringLiteral("Built-in scenario to run (%1). May be repeated.")
+                                      .arg(builtinScenarioNames().join(QStringLiteral(", "))),
+                                      QStringLiteral("name"));
+    QCommandLineOption sizeOption(QStringLiteral("size"), QStringLiteral("Size of each built-in scenario in MiB."),
+                                  QStringLiteral("MiB"), QStringLiteral("16"));
+    QCommandLineOption iterationsOption(QStringLiteral("iterations"), QStringLiteral("Runs per scenario, the fastest is reported."),
+                                        QStringLiteral("count"), QStringLiteral("3"));
+    QCommandLineOption linesOption(QStringLiteral("lines"), QStringLiteral("Screen lines."),
+                                   QStringLiteral("lines"), QStringLiteral("24"));
+    QCommandLineOption columnsOption(QStringLiteral("columns"), QStringLiteral("Screen columns."),
+                                     QStringLiteral("columns"), QStringLiteral("80"));
+    QCommandLineOption historyOption(QStringLiteral("history"), QStringLiteral("History size in lines."),
+                                     QStringLiteral("lines"), QStringLiteral("5000"));
+    QStringList historyTypeNames;
+    for (const char *name : historyTypes)
+        historyTypeNames << QLatin1String(name);
+    QCommandLineOption historyTypeOption(QStringLiteral("history-type"),
+                                         QStringLiteral("History implementation (%1).").arg(historyTypeNames.join(QStringLiteral(", "))),
+                                         QStringLiteral("type"), historyTypeNames.first());
+    QCommandLineOption chunkOption(QStringLiteral("chunk"), QStringLiteral("Bytes passed to the emulation at once."),
+                                   QStringLiteral("bytes"), QStringLiteral("4096"));
+    QCommandLineOption snapshotOption(QStringLiteral("snapshot"),
+                                      QStringLiteral("Copy the visible image every N bytes, like a view would. 0 disables it."),
+                                      QStringLiteral("bytes"), QStringLiteral("0"));
+    QCommandLineOption historyAccessOption(QStringLiteral("history-access"),
+                                           QStringLiteral("Measure appending to and reading from the file based histories instead."));
+    QCommandLineOption paintOption(QStringLiteral("paint"),
+                                   QStringLiteral("Paint the output on a display, a frame per chunk, and report the cost of painting instead."));
+    QCommandLineOption redrawOption(QStringLiteral("redraw"),
+                                    QStringLiteral("Repaint the whole display showing the output, with and without the glyph cache, and report the repaints per second instead."));
+    QCommandLineOption jsonOption(QStringLiteral("json"), QStringLiteral("Print the results as JSON."));
+    parser.addOptions({ scenarioOption, sizeOption, iterationsOption, linesOption, columnsOption,
+                        historyOption, historyTypeOption, chunkOption, snapshotOption, historyAccessOption,
+                        paintOption, redrawOption, jsonOption });
+    parser.process(*app);
+
+    Options options;
+    options.lines = qMax(1, parser.value(linesOption).toInt());
+    options.columns = qMax(1, parser.value(columnsOption).toInt());
+    options.historySize = qMax(0, parser.value(historyOption).toInt());
+    options.historyType = parser.value(historyTypeOption);
+    if (!historyTypeNames.contains(options.historyType)) {
+        qWarning("Unknown history type %s", qPrintable(options.historyType));
+        return EXIT_FAILURE;
+    }
+    options.chunkSize = qMax(1, parser.value(chunkOption).toInt());
+    options.iterations = qMax(1, parser.value(iterationsOption).toInt());
+    options.snapshotBytes = qMax(0, parser.value(snapshotOption).toInt());
+
+    if (parser.isSet(historyAccessOption)) {
+        printHistoryAccess(runHistoryAccess(options), parser.isSet(jsonOption));
+        return EXIT_SUCCESS;
+    }
+
+    QList<Scenario> scenarios;
+    const QStringList captures = parser.positionalArguments();
+    for (const QString &capture : captures) {
+        const Scenario scenario = loadCapture(capture);
+        if (scenario.data.isEmpty()) {
+            qWarning("Cannot read capture %s", qPrintable(capture));
+            return EXIT_FAILURE;
+        }
+        scenarios << scenario;
+    }
+
+    QStringList names = parser.values(scenarioOption);
+    if (names.isEmpty() && captures.isEmpty())
+        names = builtinScenarioNames();
+
+    const int size = qBound(1, parser.value(sizeOption).toInt(), 1024) * 1024 * 1024;
+    for (const QString &name : qAsConst(names)) {
+        Scenario scenario;
+        scenario.name = name;
+        scenario.data = generateScenario(name, size);
+        if (scenario.data.isEmpty()) {
+            qWarning("Unknown scenario %s", qPrintable(name));
+            return EXIT_FAILURE;
+        }
+        scenarios << scenario;
+    }
+
+    if (parser.isSet(redrawOption)) {
+        QList<RedrawResult> results;
+        for (const Scenario &scenario : qAsConst(scenarios))
+            results << runRedraw(scenario, options);
+        printRedraw(results, options, parser.isSet(jsonOption));
+        return EXIT_SUCCESS;
+    }
+
+    if (parser.isSet(paintOption)) {
+        QList<PaintResult> results;
+        for (const Scenario &scenario : qAsConst(scenarios))
+            results << runPaint(scenario, options);
+        printPaint(results, options, parser.isSet(jsonOption));
+        return EXIT_SUCCESS;
+    }
+
+    QList<Result> results;
+    for (const Scenario &scenario : qAsConst(scenarios))
+        results << runScenario(scenario, options);
+
+    if (parser.isSet(jsonOption))
+        printJson(results, options);
+    else
+        printTable(results);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,292 @@
+/*
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+#include "scenarios.h"
+
+#include <QFile>
+#include <QFileInfo>
+
+namespace {
+
+// Small deterministic generator, so every build replays the same stream
+class Random
+{
+public:
+    explicit Random(quint32 seed) : _state(seed) {}
+
+    quint32 next()
+    {
+        _state = _state * 1664525u + 1013904223u;
+        return _state >> 8;
+    }
+
+    int bounded(int bound)
+    {
+        return int(next() % quint32(bound));
+    }
+
+private:
+    quint32 _state;
+};
+
+const char *const words[] = {
+    "usr", "share", "doc", "lib", "x86_64-linux-gnu", "python3", "site-packages",
+    "include", "locale", "icons", "hicolor", "scalable", "apps", "systemd",
+    "kernel", "drivers", "net", "firmware", "modules", "cache", "config"
+};
+const int wordCount = sizeof(words) / sizeof(words[0]);
+
+const char *const cjkLines[] = {
+    "深度终端是一款功能强大的终端模拟器，支持多标签页和分屏。",
+    "日志：服务已启动，正在监听端口，等待客户端连接。",
+    "ビルドが完了しました。警告は三件、エラーはありません。",
+    "빌드가 완료되었습니다. 경고 세 건, 오류 없음.",
+    "编译输出：正在链接目标文件，请稍候……"
+};
+const int cjkLineCount = sizeof(cjkLines) / sizeof(cjkLines[0]);
+
+const char *const emojis[] = {
+    "\xF0\x9F\x9A\x80",                                  // rocket
+    "\xE2\x9C\x85",                                      // check mark
+    "\xE2\x9D\x8C",                                      // cross mark
+    "\xF0\x9F\x94\xA5",                                  // fire
+    "\xE2\x9A\xA0\xEF\xB8\x8F",                          // warning + VS16
+    "\xF0\x9F\x91\x8D\xF0\x9F\x8F\xBD",                  // thumbs up + skin tone
+    "\xF0\x9F\x91\xA8\xE2\x80\x8D\xF0\x9F\x92\xBB",      // technologist (ZWJ)
+    "\xF0\x9F\x87\xA8\xF0\x9F\x87\xB3"                   // flag
+};
+const int emojiCount = sizeof(emojis) / sizeof(emojis[0]);
+
+// `find /`: long plain paths, one per line
+void generateFind(QByteArray &out, Random &random)
+{
+    out += '/';
+    const int depth = 2 + random.bounded(6);
+    for (int i = 0; i < depth; i++) {
+        out += words[random.bounded(wordCount)];
+        if (i + 1 < depth)
+            out += '/';
+    }
+    out += QByteArray::number(random.bounded(100000));
+    out += "\r\n";
+}
+
+// `dmesg`: timestamped kernel log lines
+void generateDmesg(QByteArray &out, Random &random)
+{
+    out += '[';
+    out += QByteArray::number(random.bounded(100000000) / 1e6, 'f', 6).rightJustified(12, ' ');
+    out += "] ";
+    out += words[random.bounded(wordCount)];
+    out += ": ";
+    const int count = 4 + random.bounded(12);
+    for (int i = 0; i < count; i++) {
+        out += words[random.bounded(wordCount)];
+        out += ' ';
+    }
+    out += "0x";
+    out += QByteArray::number(random.next(), 16);
+    out += "\r\n";
+}
+
+// colored `ls -R`: short names wrapped in SGR sequences, several per line
+void generateLs(QByteArray &out, Random &random)
+{
+    static const char *const colors[] = { "01;34", "01;32", "01;36", "00", "01;31", "40;33;01" };
+    if (random.bounded(20) == 0) {
+        out += "\r\n./";
+        out += words[random.bounded(wordCount)];
+        out += ":\r\n";
+    }
+    const int count = 3 + random.bounded(6);
+    for (int i = 0; i < count; i++) {
+        out += "\033[0m\033[";
+        out += colors[random.bounded(6)];
+        out += 'm';
+        out += words[random.bounded(wordCount)];
+        out += "\033[0m  ";
+    }
+    out += "\r\n";
+}
+
+// htop: full screen redraws addressing every row with cursor positioning
+void generateHtop(QByteArray &out, Random &random)
+{
+    out += "\033[?1049h\033[H";
+    for (int row = 1; row <= 24; row++) {
+        out += "\033[";
+        out += QByteArray::number(row);
+        out += ";1H";
+        if (row <= 4) {
+            out += "\033[1;37m";
+            out += QByteArray::number(row - 1).rightJustified(3, ' ');
+            out += "\033[0m[\033[32m";
+            const int used = random.bounded(40);
+            out += QByteArray(used, '|');
+            out += "\033[31m";
+            out += QByteArray(random.bounded(40 - used + 1), '|');
+            out += "\033[0m\033[K";
+            out += "]";
+        } else if (row == 6) {
+            out += "\033[30;42m  PID USER      PRI  NI  VIRT   RES   SHR S CPU% MEM%   TIME+  Command\033[K\033[0m";
+        } else {
+            out += "\033[38;5;";
+            out += QByteArray::number(16 + random.bounded(216));
+            out += 'm';
+            out += QByteArray::number(random.bounded(99999)).rightJustified(5, ' ');
+            out += "\033[0m root       20   0 ";
+            out += QByteArray::number(random.bounded(999999)).rightJustified(6, ' ');
+            out += ' ';
+            out += QByteArray::number(random.bounded(99999)).rightJustified(5, ' ');
+            out += " S \033[1m";
+            out += QByteArray::number(random.bounded(1000) / 10.0, 'f', 1).rightJustified(4, ' ');
+            out += "\033[0m  0.1  0:00.";
+            out += QByteArray::number(random.bounded(100)).rightJustified(2, '0');
+            out += ' ';
+            out += words[random.bounded(wordCount)];
+            out += "\033[K";
+        }
+    }
+}
+
+// vim: scrolling regions, insert/delete line and partial line updates
+void generateVim(QByteArray &out, Random &random)
+{
+    out += "\033[?1049h\033[1;23r";
+    const int edits = 8 + random.bounded(8);
+    for (int i = 0; i < edits; i++) {
+        switch (random.bounded(4)) {
+        case 0:
+            out += "\033[23;1H\n";                      // scroll the text area
+            break;
+        case 1:
+            out += "\033[";
+            out += QByteArray::number(1 + random.bounded(22));
+            out += ";1H\033[L";                         // open a line
+            break;
+        case 2:
+            out += "\033[";
+            out += QByteArray::number(1 + random.bounded(22));
+            out += ";1H\033[M";                         // delete a line
+            break;
+        default:
+            break;
+        }
+        out += "\033[";
+        out += QByteArray::number(1 + random.bounded(22));
+        out += ';';
+        out += QByteArray::number(1 + random.bounded(40));
+        out += "H\033[38;5;";
+        out += QByteArray::number(random.bounded(256));
+        out += "m    int ";
+        out += words[random.bounded(wordCount)];
+        out += " = ";
+        out += QByteArray::number(random.bounded(1000));
+        out += ";\033[m\033[K";
+    }
+    out += "\033[r\033[24;1H\033[7m-- INSERT --\033[m\033[K\033[24;60H";
+    out += QByteArray::number(random.bounded(500));
+    out += ",1\033[";
+    out += QByteArray::number(1 + random.bounded(22));
+    out += ";5H";
+}
+
+// CJK heavy log: double width characters and occasional colors
+void generateCjk(QByteArray &out, Random &random)
+{
+    if (random.bounded(4) == 0)
+        out += "\033[33m";
+    out += cjkLines[random.bounded(cjkLineCount)];
+    out += ' ';
+    out += cjkLines[random.bounded(cjkLineCount)];
+    out += "\033[0m\r\n";
+}
+
+// emoji heavy log: astral plane characters, ZWJ sequences and modifiers
+void generateEmoji(QByteArray &out, Random &random)
+{
+    const int count = 6 + random.bounded(10);
+    for (int i = 0; i < count; i++) {
+        out += emojis[random.bounded(emojiCount)];
+        out += ' ';
+        out += words[random.bounded(wordCount)];
+        out += ' ';
+    }
+    out += "\r\n";
+}
+
+typedef void (*Generator)(QByteArray &, Random &);
+
+struct BuiltinScenario
+{
+    const char *name;
+    Generator generator;
+};
+
+const BuiltinScenario builtinScenarios[] = {
+    { "find", generateFind },
+    { "dmesg", generateDmesg },
+    { "ls-color", generateLs },
+    { "htop", generateHtop },
+    { "vim", generateVim },
+    { "cjk", generateCjk },
+    { "emoji", generateEmoji }
+};
+
+}
+
+QStringList builtinScenarioNames()
+{
+    QStringList names;
+    for (const BuiltinScenario &scenario : builtinScenarios)
+        names << QLatin1String(scenario.name);
+    return names;
+}
+
+QByteArray generateScenario(const QString &name, int size)
+{
+    for (const BuiltinScenario &scenario : builtinScenarios) {
+        if (name != QLatin1String(scenario.name))
+            continue;
+
+        Random random(0x5eed);
+        QByteArray out;
+        out.reserve(size + 4096);
+        while (out.size() < size)
+            scenario.generator(out, random);
+        return out;
+    }
+    return QByteArray();
+}
+
+Scenario loadCapture(const QString &spec)
+{
+    Scenario scenario;
+    QString fileName = spec;
+    const int separator = spec.indexOf(QLatin1Char('='));
+    if (separator > 0) {
+        scenario.name = spec.left(separator);
+        fileName = spec.mid(separator + 1);
+    } else {
+        scenario.name = QFileInfo(spec).completeBaseName();
+    }
+
+    QFile file(fileName);
+    if (file.open(QIODevice::ReadOnly))
+        scenario.data = file.readAll();
+    return scenario;
+}
@@ -0,0 +1,53 @@
+/*
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+#ifndef BENCHMARK_SCENARIOS_H
+#define BENCHMARK_SCENARIOS_H
+
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+
+/**
+ * A stream of terminal output replayed by terminalwidget-bench, either
+ * loaded from a pty capture or synthesised by one of the built-in
+ * generators.
+ */
+struct Scenario
+{
+    QString name;
+    QByteArray data;
+};
+
+/** Names of the built-in scenarios, in the order they are run by default. */
+QStringList builtinScenarioNames();
+
+/**
+ * Synthesises about @p size bytes of output for the built-in scenario
+ * @p name.  The output is deterministic, so runs of different builds
+ * replay exactly the same bytes.  Returns an empty array for unknown names.
+ */
+QByteArray generateScenario(const QString &name, int size);
+
+/**
+ * Loads a capture recorded with e.g. `script -q -c 'find /' capture.raw`.
+ * @p spec is either a file name or name=file.  Returns a scenario with
+ * empty data if the file cannot be read.
+ */
+Scenario loadCapture(const QString &spec);
+
+#endif // BENCHMARK_SCENARIOS_H
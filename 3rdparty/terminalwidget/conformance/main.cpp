@@ -0,0 +1,211 @@
+/*
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// terminalwidget-conformance replays recorded terminal output through
+// Vt102Emulation and compares the screen it leaves, the cursor position
+// and the replies sent to the program with a recorded screen dump.  Every
+// case is replayed twice, in one piece and one byte at a time, so that
+// sequences split between two reads are covered as well.
+
+// Qt
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QTextCodec>
+#include <QTextStream>
+
+// Konsole
+#include "History.h"
+#include "ScreenWindow.h"
+#include "Vt102Emulation.h"
+
+using namespace Konsole;
+
+#define SCREEN_LINES 24
+#define SCREEN_COLUMNS 80
+
+// Escapes a reply so that it fits on one line of the dump
+static QByteArray escaped(const QByteArray &data)
+{
+    QByteArray result;
+    for (char c : data) {
+        const uchar byte = uchar(c);
+        if (byte == 0x1b)
+            result += "\\e";
+        else if (byte == '\\')
+            result += "\\\\";
+        else if (byte < 0x20 || byte == 0x7f)
+            result += "\\x" + QByteArray::number(byte, 16).rightJustified(2, '0');
+        else
+            result += c;
+    }
+    return result;
+}
+
+// Replays @p data in pieces of @p chunkSize bytes into a new emulation
+// and returns the dump of what it leaves
+static QByteArray replay(const QByteArray &data, int chunkSize)
+{
+    Vt102Emulation emulation;
+    emulation.setCodec(QTextCodec::codecForName("UTF-8"));
+    emulation.setHistory(HistoryTypeNone());
+    emulation.setImageSize(SCREEN_LINES, SCREEN_COLUMNS);
+
+    QByteArray replies;
+    QObject::connect(&emulation, &Emulation::sendData, [&replies](const char *reply, int length) {
+        replies += "reply " + escaped(QByteArray(reply, length)) + '\n';
+    });
+
+    for (int offset = 0; offset < data.size(); offset += chunkSize)
+        emulation.receiveData(data.constData() + offset, qMin(chunkSize, data.size() - offset));
+
+    ScreenWindow *window = emulation.createWindow();
+    window->setWindowLines(SCREEN_LINES);
+    window->notifyOutputChanged();
+    const Character *image = window->getImage();
+
+    QList<QByteArray> lines;
+    for (int line = 0; line < SCREEN_LINES; line++) {
+        QString text;
+        for (int column = 0; column < SCREEN_COLUMNS; column++) {
+            const Character &cell = image[line * SCREEN_COLUMNS + column];
+            // the second half of a double width character
+            if (cell.character == 0)
+                continue;
+
+            if (cell.rendition & RE_EXTENDED_CHAR) {
+                ushort length = 0;
+                const uint *chars = ExtendedCharTable::instance.lookupExtendedChar(cell.character, length);
+                if (chars != nullptr)
+                    text += QString::fromUcs4(chars, length);
+            } else {
+                const uint c = cell.character;
+                text += QString::fromUcs4(&c, 1);
+            }
+        }
+        while (text.endsWith(QLatin1Char(' ')))
+            text.chop(1);
+        lines << '|' + text.toUtf8();
+    }
+    while (!lines.isEmpty() && lines.last() == "|")
+        lines.removeLast();
+
+    QByteArray dump;
+    for (const QByteArray &line : lines)
+        dump += line + '\n';
+
+    // the column is one past the last one while a wrap is pending
+    const QPoint cursor = window->cursorPosition();
+    dump += "cursor " + QByteArray::number(cursor.y() + 1) + ',' + QByteArray::number(cursor.x() + 1) + '\n';
+    dump += replies;
+    return dump;
+}
+
+static bool readFile(const QString &fileName, QByteArray &data)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+    data = file.readAll();
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("terminalwidget-conformance"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Replays recorded terminal output and compares the screen with a recorded dump"));
+    parser.addHelpOption();
+    parser.addPositionalArgument(QStringLiteral("directory"), QStringLiteral("Directory holding the NAME.raw and NAME.screen files"));
+    QCommandLineOption updateOption(QStringLiteral("update"), QStringLiteral("Write the dumps instead of comparing them."));
+    QCommandLineOption caseOption(QStringLiteral("case"), QStringLiteral("Run only this case (repeatable)."),
+                                  QStringLiteral("name"));
+    parser.addOption(updateOption);
+    parser.addOption(caseOption);
+    parser.process(app);
+
+    if (parser.positionalArguments().size() != 1)
+        parser.showHelp(1);
+
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+
+    const QDir directory(parser.positionalArguments().first());
+    const QStringList only = parser.values(caseOption);
+    const QStringList raws = directory.entryList(QStringList() << QStringLiteral("*.raw"), QDir::Files, QDir::Name);
+    if (raws.isEmpty()) {
+        err << "no cases in " << directory.path() << endl;
+        return 1;
+    }
+
+    int failures = 0;
+    for (const QString &raw : raws) {
+        const QString name = raw.left(raw.size() - 4);
+        if (!only.isEmpty() && !only.contains(name))
+            continue;
+
+        QByteArray data;
+        if (!readFile(directory.filePath(raw), data)) {
+            err << "cannot read " << raw << endl;
+            return 1;
+        }
+
+        const QByteArray whole = replay(data, data.size() > 0 ? data.size() : 1);
+        const QByteArray bytewise = replay(data, 1);
+        const QString screenName = directory.filePath(name + QStringLiteral(".screen"));
+
+        if (parser.isSet(updateOption)) {
+            QFile screen(screenName);
+            if (!screen.open(QIODevice::WriteOnly) || screen.write(whole) != whole.size()) {
+                err << "cannot write " << screenName << endl;
+                return 1;
+            }
+            if (bytewise != whole) {
+                out << "FAIL " << name << " (differs when replayed byte by byte)" << endl;
+                failures++;
+            } else {
+                out << "updated " << name << endl;
+            }
+            continue;
+        }
+
+        QByteArray expected;
+        if (!readFile(screenName, expected)) {
+            out << "FAIL " << name << " (no " << name << ".screen)" << endl;
+            failures++;
+        } else if (whole != expected) {
+            out << "FAIL " << name << endl
+                << "expected:" << endl << expected
+                << "got:" << endl << whole;
+            failures++;
+        } else if (bytewise != expected) {
+            out << "FAIL " << name << " (replayed byte by byte)" << endl
+                << "expected:" << endl << expected
+                << "got:" << endl << bytewise;
+            failures++;
+        } else {
+            out << "ok " << name << endl;
+        }
+    }
+
+    if (failures > 0)
+        out << failures << " of " << raws.size() << " cases failed" << endl;
+    return failures > 0 ? 1 : 0;
+}
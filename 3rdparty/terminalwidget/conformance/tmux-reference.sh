@@ -0,0 +1,78 @@
+#!/bin/bash
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# Replays the conformance cases in a detached 80x24 tmux pane and compares
+# the screen and the cursor position tmux leaves with the .screen files, as
+# a reference which does not depend on Vt102Emulation.  Replies are not
+# compared, tmux answers the queries itself.  See README for the cases in
+# which tmux differs on purpose.
+#
+# usage: tmux-reference.sh [cases directory] [case...]
+
+cases=$(readlink -f "${1:-$(dirname "$0")/cases}")
+shift
+names=("$@")
+if [ ${#names[@]} -eq 0 ]; then
+    for raw in "$cases"/*.raw; do
+        names+=("$(basename "$raw" .raw)")
+    done
+fi
+
+unset TMUX
+tmux="tmux -L terminalwidget-conformance -f /dev/null"
+done_file=$(mktemp -u)
+
+# Turns the output of capture-pane -e into the lines of a dump: attributes
+# are dropped and the DEC special graphics tmux marks with SO and SI are
+# replaced with the characters Vt102Emulation shows for them
+to_dump='
+import re, sys
+graphics = dict(zip("`abcdefghijklmnopqrstuvwxyz{|}~",
+                    "\u25c6\u2592\u2409\u240c\u240d\u240a\u00b0\u00b1\u2424\u240b"
+                    "\u2518\u2510\u250c\u2514\u253c\u23ba\u23bb\u2500\u23bc\u23bd"
+                    "\u251c\u2524\u2534\u252c\u2502\u2264\u2265\u03c0\u2260\u00a3\u00b7"))
+lines = []
+for line in sys.stdin.read().split("\n")[:24]:
+    line = re.sub("\x1b\\[[0-9;:]*m", "", line)
+    line = re.sub("\x0e([^\x0f]*)\x0f?",
+                  lambda m: "".join(graphics.get(c, c) for c in m.group(1)), line)
+    line = line.replace("\x0f", "")
+    lines.append("|" + line.rstrip(" "))
+while lines and lines[-1] == "|":
+    lines.pop()
+for line in lines:
+    print(line)
+'
+
+# Prints the dump of the screen tmux leaves after the bytes of $1
+dump()
+{
+    $tmux kill-server 2>/dev/null
+    rm -f "$done_file"
+    $tmux new-session -d -x 80 -y 24 "stty raw -echo; cat '$1'; touch '$done_file'; sleep 60"
+    $tmux set-option status off >/dev/null
+    for i in $(seq 100); do
+        [ -e "$done_file" ] && break
+        sleep 0.1
+    done
+    sleep 0.2
+    $tmux capture-pane -p -e | python3 -c "$to_dump"
+    $tmux display-message -p 'cursor #{e|+:#{cursor_y},1},#{e|+:#{cursor_x},1}'
+    $tmux kill-server
+    rm -f "$done_file"
+}
+
+failures=0
+for name in "${names[@]}"; do
+    if diff -u --label "$name.screen" --label tmux \
+            <(grep -v '^reply ' "$cases/$name.screen") <(dump "$cases/$name.raw"); then
+        echo "ok $name"
+    else
+        failures=$((failures + 1))
+    fi
+done
+[ $failures -eq 0 ]
@@ -29,28 +29,63 @@
 // System
 #include <sys/mman.h>
 #include <sys/param.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <cstdio>
+#include <cstring>
 
 
 using namespace Konsole;
 
-static int blocksize = 0;
+// blocks are placed next to each other in the mapped file
+static const size_t blocksize = sizeof(Block);
+
+/*
+ * Creates an unlinked temporary file of bytes bytes and maps it for
+ * reading and writing.  Returns nullptr if that fails.
+ */
+static unsigned char * mapRingFile(size_t bytes, int & fd)
+{
+    FILE * tmp = tmpfile();
+    if (!tmp) {
+        perror("konsole: cannot open temp file.\n");
+        return nullptr;
+    }
+    fd = dup(fileno(tmp));
+    fclose(tmp);
+    if (fd < 0) {
+        perror("konsole: cannot dup temp file.\n");
+        return nullptr;
+    }
+
+    bool sized = ftruncate(fd, bytes) == 0;
+#if defined(Q_OS_LINUX)
+    // writing to a page of the mapping the disk has no room for would
+    // raise SIGBUS, so the space is reserved up front
+    sized = sized && posix_fallocate(fd, 0, bytes) == 0;
+#endif
+    void * map = sized ? mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (map == MAP_FAILED) {
+        perror("konsole: cannot map history file.\n");
+        close(fd);
+        fd = -1;
+        return nullptr;
+    }
+
+    // each line is a block of its own and read in any order, so reading
+    // ahead does not help
+    madvise(map, bytes, MADV_RANDOM);
+    return static_cast<unsigned char *>(map);
+}
 
 BlockArray::BlockArray()
         : size(0),
         current(size_t(-1)),
         index(size_t(-1)),
-        lastmap(nullptr),
-        lastmap_index(size_t(-1)),
         lastblock(nullptr), ion(-1),
-        length(0)
+        length(0),
+        blocks(nullptr)
 {
-    // lastmap_index = index = current = size_t(-1);
-    if (blocksize == 0) {
-        blocksize = ((sizeof(Block) / getpagesize()) + 1) * getpagesize();
-    }
-
 }
 
 BlockArray::~BlockArray()
@@ -70,19 +105,7 @@ size_t BlockArray::append(Block * block)
         current = 0;
     }
 
-    int rc;
-    rc = lseek(ion, current * blocksize, SEEK_SET);
-    if (rc < 0) {
-        perror("HistoryBuffer::add.seek");
-        setHistorySize(0);
-        return size_t(-1);
-    }
-    rc = write(ion, block, blocksize);
-    if (rc < 0) {
-        perror("HistoryBuffer::add.write");
-        setHistorySize(0);
-        return size_t(-1);
-    }
+    memcpy(blocks + current * blocksize, block, blocksize);
 
     length++;
     if (length > size) {
@@ -91,7 +114,6 @@ size_t BlockArray::append(Block * block)
 
     ++index;
 
-    delete block;
     return current;
 }
 
@@ -102,7 +124,8 @@ size_t BlockArray::newBlock()
     }
     append(lastblock);
 
-    lastblock = new Block();
+    // the block is reused for the next line, the caller fills it anew
+    lastblock->size = 0;
     return index + 1;
 }
 
@@ -132,10 +155,6 @@ const Block * BlockArray::at(size_t i)
         return lastblock;
     }
 
-    if (i == lastmap_index) {
-        return lastmap;
-    }
-
     if (i > index) {
         qDebug() << "BlockArray::at() i > index\n";
         return nullptr;
@@ -149,31 +168,22 @@ const Block * BlockArray::at(size_t i)
     size_t j = i; // (current - (index - i) + (index/size+1)*size) % size ;
 
     Q_ASSERT(j < size);
-    unmap();
-
-    Block * block = (Block *)mmap(nullptr, blocksize, PROT_READ, MAP_PRIVATE, ion, j * blocksize);
-
-    if (block == (Block *)-1) {
-        perror("mmap");
-        return nullptr;
-    }
-
-    lastmap = block;
-    lastmap_index = i;
-
-    return block;
+    return reinterpret_cast<const Block *>(blocks + j * blocksize);
 }
 
-void BlockArray::unmap()
+void BlockArray::release()
 {
-    if (lastmap) {
-        int res = munmap((char *)lastmap, blocksize);
+    if (blocks) {
+        int res = munmap(blocks, size * blocksize);
         if (res < 0) {
             perror("munmap");
         }
     }
-    lastmap = nullptr;
-    lastmap_index = size_t(-1);
+    blocks = nullptr;
+    if (ion >= 0) {
+        close(ion);
+    }
+    ion = -1;
 }
 
 bool BlockArray::setSize(size_t newsize)
@@ -189,190 +199,40 @@ bool BlockArray::setHistorySize(size_t newsize)
         return false;
     }
 
-    unmap();
-
     if (!newsize) {
         delete lastblock;
         lastblock = nullptr;
-        if (ion >= 0) {
-            close(ion);
-        }
-        ion = -1;
+        release();
+        size = 0;
+        length = 0;
         current = size_t(-1);
         return true;
     }
 
-    if (!size) {
-        FILE * tmp = tmpfile();
-        if (!tmp) {
-            perror("konsole: cannot open temp file.\n");
-        } else {
-            ion = dup(fileno(tmp));
-            if (ion<0) {
-                perror("konsole: cannot dup temp file.\n");
-                fclose(tmp);
-            }
-        }
-        if (ion < 0) {
-            return false;
-        }
-
-        Q_ASSERT(!lastblock);
-
-        lastblock = new Block();
-        size = newsize;
-        return false;
-    }
-
-    if (newsize > size) {
-        increaseBuffer();
-        size = newsize;
+    int newIon = -1;
+    unsigned char * newBlocks = mapRingFile(newsize * blocksize, newIon);
+    if (!newBlocks) {
         return false;
-    } else {
-        decreaseBuffer(newsize);
-        ftruncate(ion, length*blocksize);
-        size = newsize;
-
-        return true;
-    }
-}
-
-void moveBlock(FILE * fion, int cursor, int newpos, char * buffer2)
-{
-    int res = fseek(fion, cursor * blocksize, SEEK_SET);
-    if (res) {
-        perror("fseek");
-    }
-    res = fread(buffer2, blocksize, 1, fion);
-    if (res != 1) {
-        perror("fread");
-    }
-
-    res = fseek(fion, newpos * blocksize, SEEK_SET);
-    if (res) {
-        perror("fseek");
-    }
-    res = fwrite(buffer2, blocksize, 1, fion);
-    if (res != 1) {
-        perror("fwrite");
-    }
-    //    printf("moving block %d to %d\n", cursor, newpos);
-}
-
-void BlockArray::decreaseBuffer(size_t newsize)
-{
-    if (index < newsize) { // still fits in whole
-        return;
-    }
-
-    int offset = (current - (newsize - 1) + size) % size;
-
-    if (!offset) {
-        return;
-    }
-
-    // The Block constructor could do somthing in future...
-    char * buffer1 = new char[blocksize];
-
-    FILE * fion = fdopen(dup(ion), "w+b");
-    if (!fion) {
-        delete [] buffer1;
-        perror("fdopen/dup");
-        return;
     }
 
-    int firstblock;
-    if (current <= newsize) {
-        firstblock = current + 1;
-    } else {
-        firstblock = 0;
+    // the blocks which are kept are copied to the new ring oldest first,
+    // so the ring starts at its beginning again
+    const size_t kept = qMin(length, newsize);
+    for (size_t i = 0; i < kept; i++) {
+        const size_t from = (current + size + 1 - kept + i) % size;
+        memcpy(newBlocks + i * blocksize, blocks + from * blocksize, blocksize);
     }
 
-    size_t oldpos;
-    for (size_t i = 0, cursor=firstblock; i < newsize; i++) {
-        oldpos = (size + cursor + offset) % size;
-        moveBlock(fion, oldpos, cursor, buffer1);
-        if (oldpos < newsize) {
-            cursor = oldpos;
-        } else {
-            cursor++;
-        }
-    }
-
-    current = newsize - 1;
-    length = newsize;
-
-    delete [] buffer1;
-
-    fclose(fion);
-
-}
-
-void BlockArray::increaseBuffer()
-{
-    if (index < size) { // not even wrapped once
-        return;
-    }
-
-    int offset = (current + size + 1) % size;
-    if (!offset) { // no moving needed
-        return;
-    }
-
-    // The Block constructor could do somthing in future...
-    char * buffer1 = new char[blocksize];
-    char * buffer2 = new char[blocksize];
-
-    int runs = 1;
-    int bpr = size; // blocks per run
-
-    if (size % offset == 0) {
-        bpr = size / offset;
-        runs = offset;
-    }
-
-    FILE * fion = fdopen(dup(ion), "w+b");
-    if (!fion) {
-        perror("fdopen/dup");
-        delete [] buffer1;
-        delete [] buffer2;
-        return;
-    }
-
-    int res;
-    for (int i = 0; i < runs; i++) {
-        // free one block in chain
-        int firstblock = (offset + i) % size;
-        res = fseek(fion, firstblock * blocksize, SEEK_SET);
-        if (res) {
-            perror("fseek");
-        }
-        res = fread(buffer1, blocksize, 1, fion);
-        if (res != 1) {
-            perror("fread");
-        }
-        int newpos = 0;
-        for (int j = 1, cursor=firstblock; j < bpr; j++) {
-            cursor = (cursor + offset) % size;
-            newpos = (cursor - offset + size) % size;
-            moveBlock(fion, cursor, newpos, buffer2);
-        }
-        res = fseek(fion, i * blocksize, SEEK_SET);
-        if (res) {
-            perror("fseek");
-        }
-        res = fwrite(buffer1, blocksize, 1, fion);
-        if (res != 1) {
-            perror("fwrite");
-        }
+    const bool dropped = newsize < size;
+    release();
+    blocks = newBlocks;
+    ion = newIon;
+    if (!lastblock) {
+        lastblock = new Block();
     }
-    current = size - 1;
-    length = size;
-
-    delete [] buffer1;
-    delete [] buffer2;
-
-    fclose(fion);
+    current = kept - 1;
+    length = kept;
+    size = newsize;
 
+    return dropped;
 }
-
@@ -42,6 +42,13 @@ struct Block {
 
 // ///////////////////////////////////////////////////////
 
+/**
+ * A ring of blocks in a temporary file.
+ *
+ * The file is mapped into memory as a whole, so appending and reading a
+ * block are plain copies without any system calls.  It is only created
+ * again, with the blocks reordered, when the size of the ring changes.
+ */
 class BlockArray {
 public:
     /**
@@ -59,7 +66,7 @@ public:
     * adds the Block at the end of history.
     * This may drop other blocks.
     *
-    * The ownership on the block is transfered.
+    * The block is copied, the caller keeps it.
     * An unique index number is returned for accessing
     * it later (if not yet dropped then)
     *
@@ -72,9 +79,9 @@ public:
     * gets the block at the index. Function may return
     * 0 if the block isn't available any more.
     *
-    * The returned block is strictly readonly as only
-    * maped in memory - and will be invalid on the next
-    * operation on this class.
+    * The returned block is strictly readonly as it
+    * points into the mapped file - and will be invalid
+    * once it is overwritten or the size changes.
     */
     const Block * at(size_t index);
 
@@ -107,22 +114,21 @@ public:
     }
 
 private:
-    void unmap();
-    void increaseBuffer();
-    void decreaseBuffer(size_t newsize);
+    void release();
 
     size_t size;
     // current always shows to the last inserted block
     size_t current;
     size_t index;
 
-    Block * lastmap;
-    size_t lastmap_index;
     Block * lastblock;
 
     int ion;
     size_t length;
 
+    // the ring file mapped into memory, size blocks
+    unsigned char * blocks;
+
 };
 
 }
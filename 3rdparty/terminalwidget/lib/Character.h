@@ -23,9 +23,17 @@
 #ifndef CHARACTER_H
 #define CHARACTER_H
 
+// System
+#include <cstring>
+
 // Qt
+#include <QAtomicInt>
 #include <QHash>
+#include <QtAlgorithms>
+#include <QMutex>
+#include <QSet>
 #include <QVector>
+#include <QWaitCondition>
 
 // Local
 #include "CharacterColor.h"
@@ -34,6 +42,8 @@
 namespace Konsole
 {
 
+class Emulation;
+
 typedef unsigned char LineProperty;
 
 static const int LINE_DEFAULT        = 0;
@@ -69,10 +79,21 @@ inline bool isSupportedLineChar(quint16 codePoint)
            && !(0x2504 <= codePoint && codePoint <= 0x250B); // Triple and quadruple dash range
 }
 
+/**
+ * The largest value which can be stored in Character::character.  Code
+ * points above it (plane 16, which is for private use only) are stored in
+ * the ExtendedCharTable like character sequences.
+ */
+static const uint MAX_CHARACTER_VALUE = 0xFFFFF;
+
 /**
  * A single character in the terminal which consists of a unicode character
  * value, foreground and background colors and a set of rendition attributes
  * which specify how it should be drawn.
+ *
+ * The screen, history and view hold large arrays of characters, so a
+ * character is packed into 8 bytes: 20 bits of character value, 11 bits
+ * of rendition flags, the isRealCharacter bit and two 16 bit colors.
  */
 class Character
 {
@@ -88,30 +109,20 @@ public:
     inline Character(quint16 _c = ' ',
             CharacterColor  _f = CharacterColor(COLOR_SPACE_DEFAULT,DEFAULT_FORE_COLOR),
             CharacterColor  _b = CharacterColor(COLOR_SPACE_DEFAULT,DEFAULT_BACK_COLOR),
-            quint8  _r = DEFAULT_RENDITION)
-       : character(_c), rendition(_r), foregroundColor(_f), backgroundColor(_b) {}
+            quint16 _r = DEFAULT_RENDITION)
+       : character(_c), rendition(_r), isRealCharacter(true), foregroundColor(_f), backgroundColor(_b) {}
 
-    union
-    {
-        /** The unicode character value for this character. */
-        uint character;
-        /**
-         * Experimental addition which allows a single Character instance to contain more than
-         * one unicode character.
-         *
-         * charSequence is a hash code which can be used to look up the unicode
-         * character sequence in the ExtendedCharTable used to create the sequence.
-         */
-        quint16 charSequence;
-    };
+    /**
+     * The unicode character value for this character.
+     *
+     * If the RE_EXTENDED_CHAR rendition flag is set this is instead the hash
+     * code which can be used to look up the unicode character sequence in the
+     * ExtendedCharTable used to create the sequence.
+     */
+    uint character : 20;
 
     /** A combination of RENDITION flags which specify options for drawing the character. */
-    quint8  rendition;
-
-    /** The foreground color used to draw this character. */
-    CharacterColor  foregroundColor;
-    /** The color used to draw this character's background. */
-    CharacterColor  backgroundColor;
+    uint rendition : 11;
 
     /** Indicate whether this character really exists, or exists simply as place holder.
      *
@@ -122,7 +133,12 @@ public:
      *    PlaceHolderCharacter: a character which exists as place holder
      *    TabStopCharacter: a special place holder for HT("\t")
      */
-    bool isRealCharacter;
+    uint isRealCharacter : 1;
+
+    /** The foreground color used to draw this character. */
+    CharacterColor  foregroundColor;
+    /** The color used to draw this character's background. */
+    CharacterColor  backgroundColor;
 
     /**
     * Returns true if this character has a transparent background when
@@ -141,6 +157,14 @@ public:
     */
     bool equalsFormat(const Character &other) const;
 
+    /**
+    * Returns true if the compared characters are drawn with the same colors and
+    * rendition, that is if they may be part of the same style run.  Unlike
+    * equalsFormat() it ignores RE_EXTENDED_CHAR, which only says how the character
+    * value is stored.
+    */
+    bool equalsStyle(const Character &other) const;
+
     /**
     * Compares two characters and returns true if they have the same unicode character value,
     * rendition and colors.
@@ -207,10 +231,8 @@ inline bool operator != (const Character& a, const Character& b)
 
 inline bool Character::isTransparent(const ColorEntry* base) const
 {
-  return ((backgroundColor._colorSpace == COLOR_SPACE_DEFAULT) &&
-          base[backgroundColor._u+0+(backgroundColor._v?BASE_COLORS:0)].transparent)
-      || ((backgroundColor._colorSpace == COLOR_SPACE_SYSTEM) &&
-          base[backgroundColor._u+2+(backgroundColor._v?BASE_COLORS:0)].transparent);
+  const int index = backgroundColor.tableIndex();
+  return index >= 0 && base[index].transparent;
 }
 
 inline bool Character::equalsFormat(const Character& other) const
@@ -220,24 +242,78 @@ inline bool Character::equalsFormat(const Character& other) const
            && rendition == other.rendition;
 }
 
+inline bool Character::equalsStyle(const Character& other) const
+{
+    return backgroundColor == other.backgroundColor
+           && foregroundColor == other.foregroundColor
+           && ((rendition ^ other.rendition) & ~RE_EXTENDED_CHAR) == 0;
+}
+
 inline ColorEntry::FontWeight Character::fontWeight(const ColorEntry* base) const
 {
-    if (backgroundColor._colorSpace == COLOR_SPACE_DEFAULT)
-        return base[backgroundColor._u+0+(backgroundColor._v?BASE_COLORS:0)].fontWeight;
-    else if (backgroundColor._colorSpace == COLOR_SPACE_SYSTEM)
-        return base[backgroundColor._u+2+(backgroundColor._v?BASE_COLORS:0)].fontWeight;
+    const int index = backgroundColor.tableIndex();
+    if (index >= 0)
+        return base[index].fontWeight;
     else
         return ColorEntry::UseCurrentFormat;
 }
 
+/**
+ * The style runs of a line of characters are kept as one bit per column, set
+ * where a run of characters which are equalsStyle() starts.  The first column
+ * always starts a run.  More bits than needed may be set, which only splits a
+ * run, but none may be missing.  A line takes styleRunWords() words.
+ */
+inline int styleRunWords(int columns)
+{
+    return (columns + 31) / 32;
+}
+
+inline bool startsStyleRun(const quint32* runs, int column)
+{
+    return (runs[column >> 5] >> (column & 31)) & 1u;
+}
+
+inline void setStyleRunStart(quint32* runs, int column, bool start)
+{
+    if (start)
+        runs[column >> 5] |= 1u << (column & 31);
+    else
+        runs[column >> 5] &= ~(1u << (column & 31));
+}
+
+/** Returns the column of the first run which starts after @p column, or @p columns. */
+inline int nextStyleRun(const quint32* runs, int column, int columns)
+{
+    int next = column + 1;
+    while (next < columns) {
+        const quint32 word = runs[next >> 5] >> (next & 31);
+        if (word != 0)
+            return qMin(next + int(qCountTrailingZeroBits(word)), columns);
+        next = (next | 31) + 1;
+    }
+    return columns;
+}
+
+/** Finds the style runs of the @p count characters at @p characters. */
+inline void findStyleRuns(const Character* characters, int count, quint32* runs)
+{
+    memset(runs, 0, styleRunWords(count) * sizeof(quint32));
+    if (count > 0)
+        runs[0] = 1u;
+    for (int column = 1; column < count; column++) {
+        if (!characters[column].equalsStyle(characters[column - 1]))
+            runs[column >> 5] |= 1u << (column & 31);
+    }
+}
+
 extern unsigned short vt100_graphics[32];
 
 
 /**
  * A table which stores sequences of unicode characters, referenced
- * by hash keys.  The hash key itself is the same size as a unicode
- * character ( ushort ) so that it can occupy the same space in
- * a structure.
+ * by hash keys.  The hash key itself fits into the value of a
+ * Character so that it can occupy the same space in a structure.
  */
 class ExtendedCharTable
 {
@@ -270,6 +346,12 @@ public:
      */
     uint* lookupExtendedChar(uint hash, ushort& length) const;
 
+    /**
+     * Returns a number which changes whenever sequences no screen uses any
+     * more are removed from the table and their hashes may be reused.
+     */
+    int generation() const { return _generation.load(); }
+
     /** The global ExtendedCharTable instance. */
     static ExtendedCharTable instance;
 private:
@@ -278,14 +360,30 @@ private:
     // tests whether the entry in the table specified by 'hash' matches the
     // character sequence 'unicodePoints' of size 'length'
     bool extendedCharMatch(uint hash, const uint* unicodePoints, ushort length) const;
+    // removes the sequences which no emulation uses any more, or helps a
+    // purge which is running on another thread and waits for it to finish
+    void purge();
+    // adds the sequences used by the emulations not scanned yet in this
+    // purge, returns true once every emulation has been scanned
+    bool scanEmulations();
     // internal, maps hash keys to character sequence buffers.  The first ushort
     // in each value is the length of the buffer, followed by the ushorts in the buffer
     // themselves.
     QHash<uint,uint*> extendedCharTable;
+    // the table is shared by all sessions, whose output may be processed
+    // on different emulation threads
+    mutable QMutex _lock;
+    QAtomicInt _generation;
+    // state of the purge in progress, see purge()
+    bool _purging;
+    QSet<uint> _purgeUsed;
+    QSet<const Emulation*> _purgeScanned;
+    QWaitCondition _purgeChanged;
 };
 
 }
 Q_DECLARE_TYPEINFO(Konsole::Character, Q_MOVABLE_TYPE);
+Q_STATIC_ASSERT(sizeof(Konsole::Character) == 8);
 
 #endif // CHARACTER_H
 
@@ -24,7 +24,12 @@
 #define CHARACTERCOLOR_H
 
 // Qt
+#include <QAtomicInt>
 #include <QColor>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#include <QVector>
 
 //#include <kdemacros.h>
 #define KDE_NO_EXPORT
@@ -134,6 +139,16 @@ extern const ColorEntry base_color_table[TABLE_COLORS] KDE_NO_EXPORT;
 
    Default colour space has two separate colours, namely
    default foreground and default background colour.
+
+   Every character stores two colors, so the color is packed into a
+   16 bit code:
+
+   Code          - Space
+   0             - Undefined
+   2..5          - Default     (u*2+v)
+   6..21         - System      (u*2+v)
+   22..277       - Index(256)  (u)
+   278..65535    - RGB         (index into RgbColorTable)
 */
 
 #define COLOR_SPACE_UNDEFINED   0
@@ -142,6 +157,71 @@ extern const ColorEntry base_color_table[TABLE_COLORS] KDE_NO_EXPORT;
 #define COLOR_SPACE_256         3
 #define COLOR_SPACE_RGB         4
 
+static const int DEFAULT_COLOR_CODE = 2;
+static const int SYSTEM_COLOR_CODE  = DEFAULT_COLOR_CODE + 2*2;
+static const int INDEX_COLOR_CODE   = SYSTEM_COLOR_CODE + 8*2;
+static const int RGB_COLOR_CODE     = INDEX_COLOR_CODE + 256;
+
+/**
+ * A table of the RGB colors used by characters, which is shared by all
+ * screens.  CharacterColor only keeps the index of an RGB color in this
+ * table, so that it fits into 16 bits.
+ *
+ * Indexes are resolved without locking, each color is an atomic word, so
+ * a color may be read on any thread while the index is handed out again.
+ * When the table is full, the colors which no emulation uses any more on
+ * its screens or in their history are removed, the way ExtendedCharTable
+ * purges its sequences, and their indexes are handed out again.  Views
+ * which keep colors by index must drop them when generation() changes.
+ */
+class RgbColorTable
+{
+public:
+    /** The number of RGB colors the table can hold. */
+    static const int MAX_COLORS = 65536 - RGB_COLOR_CODE;
+
+    RgbColorTable();
+
+    /**
+     * Returns the index of @p rgb in the table, adding it if it is not
+     * there yet, or -1 if the table is full and no unused color could
+     * be removed.
+     */
+    int indexOf(QRgb rgb);
+
+    /** Returns the color at @p index, which was returned by indexOf(). */
+    QRgb rgb(int index) const { return _colors[index].loadAcquire(); }
+
+    /**
+     * Returns a number which changes whenever unused colors are removed
+     * from the table and their indexes may be reused.
+     */
+    int generation() const { return _generation.load(); }
+
+    /** The global RgbColorTable instance. */
+    static RgbColorTable instance;
+private:
+    // removes the colors which are not used by any emulation, returns true
+    // if any index became free
+    bool purge();
+
+    // a color is written before its index is handed out and not touched
+    // until no character uses the index any more; pages which are never
+    // used are never touched.  Copies of characters outside the screens,
+    // which the purge does not see, may still read an index which is
+    // handed out again, so the colors are atomic.  QBasicAtomicInteger has
+    // no constructor, which would touch every page.
+    QBasicAtomicInteger<QRgb> _colors[MAX_COLORS];
+    QHash<QRgb, int> _indexes;
+    // indexes below _nextIndex which were freed by purge()
+    QVector<int> _freeIndexes;
+    int _nextIndex;
+    // colors approximated since the last purge, to retry it only now and then
+    int _misses;
+    QAtomicInt _generation;
+    QMutex _lock;
+};
+
 /**
  * Describes the color of a single character in the terminal.
  */
@@ -152,10 +232,7 @@ class CharacterColor
 public:
   /** Constructs a new CharacterColor whoose color and color space are undefined. */
   CharacterColor()
-      : _colorSpace(COLOR_SPACE_UNDEFINED),
-        _u(0),
-        _v(0),
-        _w(0)
+      : _code(0)
   {}
 
   /**
@@ -169,39 +246,47 @@ public:
    * TODO : Add documentation about available color spaces.
    */
   CharacterColor(quint8 colorSpace, int co)
-      : _colorSpace(colorSpace),
-        _u(0),
-        _v(0),
-        _w(0)
+      : _code(0)
   {
     switch (colorSpace)
     {
         case COLOR_SPACE_DEFAULT:
-            _u = co & 1;
+            _code = DEFAULT_COLOR_CODE + (co & 1)*2;
             break;
         case COLOR_SPACE_SYSTEM:
-            _u = co & 7;
-            _v = (co >> 3) & 1;
+            _code = SYSTEM_COLOR_CODE + (co & 7)*2 + ((co >> 3) & 1);
             break;
         case COLOR_SPACE_256:
-            _u = co & 255;
+            _code = INDEX_COLOR_CODE + (co & 255);
             break;
         case COLOR_SPACE_RGB:
-            _u = co >> 16;
-            _v = co >> 8;
-            _w = co;
+        {
+            const int index = RgbColorTable::instance.indexOf(qRgb(co >> 16, co >> 8, co));
+            // once the table is full further colors are approximated
+            _code = index >= 0 ? RGB_COLOR_CODE + index
+                               : INDEX_COLOR_CODE + nearestColor256(co);
             break;
+        }
         default:
-            _colorSpace = COLOR_SPACE_UNDEFINED;
+            break;
     }
   }
 
+  /**
+   * Returns the index of this color in RgbColorTable, or -1 if it is not
+   * an RGB color.
+   */
+  int rgbIndex() const
+  {
+        return _code >= RGB_COLOR_CODE ? _code - RGB_COLOR_CODE : -1;
+  }
+
   /**
    * Returns true if this character color entry is valid.
    */
   bool isValid() const
   {
-        return _colorSpace != COLOR_SPACE_UNDEFINED;
+        return _code != 0;
   }
 
   /**
@@ -221,6 +306,14 @@ public:
    */
   QColor color(const ColorEntry* palette) const;
 
+  /**
+   * Returns the parameters of the SGR escape sequence which selects this
+   * color as the foreground color, or the background color if
+   * @p foreground is false, e.g. "31" or "38;5;208".  The palette is left
+   * to the terminal which reads the sequence.
+   */
+  QString sgrParameters(bool foreground) const;
+
   /**
    * Compares two colors and returns true if they represent the same color value and
    * use the same color space.
@@ -233,20 +326,30 @@ public:
   friend bool operator != (const CharacterColor& a, const CharacterColor& b);
 
 private:
-  quint8 _colorSpace;
+  // index of this color in a TABLE_COLORS palette, or -1 if it is not
+  // a default or system color
+  int tableIndex() const
+  {
+    if (_code >= DEFAULT_COLOR_CODE && _code < SYSTEM_COLOR_CODE)
+        return (_code - DEFAULT_COLOR_CODE)/2 + 0 + ((_code & 1) ? BASE_COLORS : 0);
+    if (_code >= SYSTEM_COLOR_CODE && _code < INDEX_COLOR_CODE)
+        return (_code - SYSTEM_COLOR_CODE)/2 + 2 + ((_code & 1) ? BASE_COLORS : 0);
+    return -1;
+  }
 
-  // bytes storing the character color
-  quint8 _u;
-  quint8 _v;
-  quint8 _w;
+  // the closest color of the 6x6x6 color cube of the 256 color palette
+  static int nearestColor256(int rgb)
+  {
+    const auto level = [](int value) { value &= 255; return value < 48 ? 0 : value < 115 ? 1 : (value - 35)/40; };
+    return 16 + level(rgb >> 16)*36 + level(rgb >> 8)*6 + level(rgb);
+  }
+
+  quint16 _code;
 };
 
 inline bool operator == (const CharacterColor& a, const CharacterColor& b)
 {
-    return     a._colorSpace == b._colorSpace &&
-            a._u == b._u &&
-            a._v == b._v &&
-            a._w == b._w;
+    return a._code == b._code;
 }
 inline bool operator != (const CharacterColor& a, const CharacterColor& b)
 {
@@ -273,25 +376,43 @@ inline const QColor color256(quint8 u, const ColorEntry* base)
 
 inline QColor CharacterColor::color(const ColorEntry* base) const
 {
-  switch (_colorSpace)
-  {
-    case COLOR_SPACE_DEFAULT: return base[_u+0+(_v?BASE_COLORS:0)].color;
-    case COLOR_SPACE_SYSTEM: return base[_u+2+(_v?BASE_COLORS:0)].color;
-    case COLOR_SPACE_256: return color256(_u,base);
-    case COLOR_SPACE_RGB: return {_u,_v,_w};
-    case COLOR_SPACE_UNDEFINED: return QColor();
-  }
+  if (_code >= RGB_COLOR_CODE)
+    return QColor(RgbColorTable::instance.rgb(_code - RGB_COLOR_CODE));
+  if (_code >= INDEX_COLOR_CODE)
+    return color256(_code - INDEX_COLOR_CODE, base);
 
-  Q_ASSERT(false); // invalid color space
+  const int index = tableIndex();
+  return index >= 0 ? base[index].color : QColor();
+}
 
-  return QColor();
+inline QString CharacterColor::sgrParameters(bool foreground) const
+{
+  if (_code >= RGB_COLOR_CODE)
+  {
+    const QRgb rgb = RgbColorTable::instance.rgb(_code - RGB_COLOR_CODE);
+    return QString::fromLatin1("%1;2;%2;%3;%4").arg(foreground ? 38 : 48)
+           .arg(qRed(rgb)).arg(qGreen(rgb)).arg(qBlue(rgb));
+  }
+  if (_code >= INDEX_COLOR_CODE)
+    return QString::fromLatin1("%1;5;%2").arg(foreground ? 38 : 48).arg(_code - INDEX_COLOR_CODE);
+  if (_code >= SYSTEM_COLOR_CODE)
+  {
+    // intensive colors are the bright ones, 90..97 and 100..107
+    const int base = (foreground ? 30 : 40) + ((_code & 1) ? 60 : 0);
+    return QString::number(base + (_code - SYSTEM_COLOR_CODE)/2);
+  }
+  if (_code >= DEFAULT_COLOR_CODE)
+    return QString::number(foreground ? 39 : 49);
+  return QString();
 }
 
 inline void CharacterColor::setIntensive()
 {
-  if (_colorSpace == COLOR_SPACE_SYSTEM || _colorSpace == COLOR_SPACE_DEFAULT)
+  if (_code >= DEFAULT_COLOR_CODE && _code < INDEX_COLOR_CODE)
   {
-    _v = 1;
+    // the default and system codes start at even numbers, so the
+    // intensity is the lowest bit
+    _code |= 1;
   }
 }
 
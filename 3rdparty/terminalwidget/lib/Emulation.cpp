@@ -26,10 +26,12 @@
 #include <cstdio>
 #include <cstdlib>
 #include <unistd.h>
+#include <cstring>
 #include <string>
 
 // Qt
 #include <QApplication>
+#include <QScreen>
 #include <QClipboard>
 #include <QHash>
 #include <QKeyEvent>
@@ -51,24 +53,49 @@
 #include "Session.h"
 #include "SessionManager.h"
 #include "TerminalDisplay.h"
+#include "Utf8Decoder.h"
 
 using namespace Konsole;
 
+// Frame interval used when the refresh rate of the screen is unknown (60 Hz)
+#define DEFAULT_FRAME_INTERVAL 16
+#define MIN_FRAME_INTERVAL 4
+// Longest time pending output is held back while the views are busy
+#define MAX_FRAME_DELAY 40
+
+// every emulation, for ExtendedCharTable::purge() and RgbColorTable::purge()
+static QMutex emulationsLock;
+static QList<Emulation *> emulations;
+
 Emulation::Emulation() :
     _currentScreen(nullptr),
     _codec(nullptr),
     _decoder(nullptr),
+    _utf8Decoder(nullptr),
     _keyTranslator(nullptr),
     _usesMouse(false),
-    _bracketedPasteMode(false)
+    _bracketedPasteMode(false),
+    _frameInterval(DEFAULT_FRAME_INTERVAL),
+    _pendingWindows(0),
+    _screenLock(QMutex::Recursive)
 {
     // create screens with a default size
     _screen[0] = new Screen(40, 80);
     _screen[1] = new Screen(40, 80);
     _currentScreen = _screen[0];
 
-    QObject::connect(&_bulkTimer1, SIGNAL(timeout()), this, SLOT(showBulk()));
-    QObject::connect(&_bulkTimer2, SIGNAL(timeout()), this, SLOT(showBulk()));
+    // programs using the alternate screen redraw it themselves when resized
+    _screen[0]->setReflowLines(true);
+
+    // pace updates of the views to the refresh rate of the screen
+    if (qobject_cast<QGuiApplication *>(QCoreApplication::instance())) {
+        QScreen *screen = QGuiApplication::primaryScreen();
+        if (screen && screen->refreshRate() > 0)
+            _frameInterval = qBound(MIN_FRAME_INTERVAL, qRound(1000 / screen->refreshRate()), MAX_FRAME_DELAY);
+    }
+    _frameTimer.setSingleShot(true);
+    _frameTimer.setTimerType(Qt::PreciseTimer);
+    QObject::connect(&_frameTimer, SIGNAL(timeout()), this, SLOT(frameTimeout()));
 
     // listen for mouse status changes
     connect(this, SIGNAL(programUsesMouseChanged(bool)),
@@ -76,7 +103,8 @@ Emulation::Emulation() :
     connect(this, SIGNAL(programBracketedPasteModeChanged(bool)),
             SLOT(bracketedPasteModeChanged(bool)));
 
-    connect(this, &Emulation::cursorChanged, [this](KeyboardCursorShape cursorShape, bool blinkingCursorEnabled) {
+    // queued when the output is processed on an emulation thread
+    connect(this, &Emulation::cursorChanged, this, [this](KeyboardCursorShape cursorShape, bool blinkingCursorEnabled) {
         emit titleChanged(50, QString(QLatin1String("CursorShape=%1;BlinkingCursorEnabled=%2"))
                           .arg(static_cast<int>(cursorShape)).arg(blinkingCursorEnabled));
     });
@@ -84,6 +112,9 @@ Emulation::Emulation() :
 //    _lastcol = _currentScreen->getColumns();
 //    _lastline = _currentScreen->getLines();
     /******** Add by ut001000 renfeixiang 2020-07-16:增加 End***************/
+
+    QMutexLocker locker(&emulationsLock);
+    emulations.append(this);
 }
 
 bool Emulation::programUsesMouse() const
@@ -108,7 +139,10 @@ void Emulation::bracketedPasteModeChanged(bool bracketedPasteMode)
 
 ScreenWindow *Emulation::createWindow()
 {
+    QMutexLocker locker(&_screenLock);
+
     ScreenWindow *window = new ScreenWindow();
+    window->setScreenLock(&_screenLock);
     window->setScreen(_currentScreen);
     _windows << window;
 
@@ -117,11 +151,22 @@ ScreenWindow *Emulation::createWindow()
 
     connect(this, SIGNAL(outputChanged()),
             window, SLOT(notifyOutputChanged()));
+    connect(window, SIGNAL(frameScheduled()),
+            this, SLOT(frameScheduled()));
+    connect(window, SIGNAL(framePainted()),
+            this, SLOT(framePainted()));
+    connect(window, SIGNAL(frameDropped()),
+            this, SLOT(frameDropped()));
     return window;
 }
 
 Emulation::~Emulation()
 {
+    {
+        QMutexLocker locker(&emulationsLock);
+        emulations.removeOne(this);
+    }
+
     QListIterator<ScreenWindow *> windowIter(_windows);
 
     while (windowIter.hasNext()) {
@@ -131,10 +176,13 @@ Emulation::~Emulation()
     delete _screen[0];
     delete _screen[1];
     delete _decoder;
+    delete _utf8Decoder;
 }
 
 void Emulation::setScreen(int n)
 {
+    QMutexLocker locker(&_screenLock);
+
     Screen *old = _currentScreen;
     _currentScreen = _screen[n & 1];
     if (_currentScreen != old) {
@@ -146,10 +194,77 @@ void Emulation::setScreen(int n)
 
 void Emulation::clearHistory()
 {
+    QMutexLocker locker(&_screenLock);
     _screen[0]->setScroll(_screen[0]->getScroll(), false);
 }
+void Emulation::setHistoryJournal(const QString &fileName)
+{
+    QMutexLocker locker(&_screenLock);
+    _screen[0]->setHistoryJournal(fileName);
+}
+
+void Emulation::discardHistoryJournal()
+{
+    QMutexLocker locker(&_screenLock);
+    _screen[0]->discardHistoryJournal();
+}
+
+bool Emulation::restoreHistory(const QString &fileName)
+{
+    QMutexLocker locker(&_screenLock);
+    const bool restored = _screen[0]->restoreHistoryJournal(fileName);
+    bufferedUpdate();
+    return restored;
+}
+
+qint64 Emulation::historyMemoryUsage() const
+{
+    QMutexLocker locker(&_screenLock);
+    return _screen[0]->historyMemoryUsage() + _screen[1]->historyMemoryUsage();
+}
+
+void Emulation::reduceHistoryMemoryUsage(qint64 maximum)
+{
+    QMutexLocker locker(&_screenLock);
+
+    // the alternate screen does not normally keep a history
+    const qint64 alternate = _screen[1]->historyMemoryUsage();
+    _screen[0]->reduceHistoryMemoryUsage(qMax(Q_INT64_C(0), maximum - alternate));
+
+    // let the windows account for the dropped lines
+    bufferedUpdate();
+}
+
+bool Emulation::usedExtendedChars(QSet<uint> &used) const
+{
+    // a session thread may be waiting for the character table while
+    // holding this lock, so don't wait for it here
+    if (!_screenLock.tryLock())
+        return false;
+
+    used += _screen[0]->usedExtendedChars();
+    used += _screen[1]->usedExtendedChars();
+    _screenLock.unlock();
+    return true;
+}
+
+bool Emulation::usedRgbColors(QSet<int> &used) const
+{
+    // a session thread may be waiting for the color table while holding
+    // this lock, so don't wait for it here
+    if (!_screenLock.tryLock())
+        return false;
+
+    _screen[0]->usedRgbColors(used);
+    _screen[1]->usedRgbColors(used);
+    _screenLock.unlock();
+    return true;
+}
+
 void Emulation::setHistory(const HistoryType &t)
 {
+    QMutexLocker locker(&_screenLock);
+
     _screen[0]->setScroll(t);
 
     showBulk();
@@ -162,6 +277,8 @@ const HistoryType &Emulation::history() const
 
 void Emulation::setCodec(const QTextCodec *qtc)
 {
+    QMutexLocker locker(&_screenLock);
+
     if (qtc)
         _codec = qtc;
     else
@@ -170,6 +287,11 @@ void Emulation::setCodec(const QTextCodec *qtc)
     delete _decoder;
     _decoder = _codec->makeDecoder();
 
+    // codecs chosen through the encoding plugin other than UTF-8 keep
+    // using the QTextCodec path
+    delete _utf8Decoder;
+    _utf8Decoder = utf8() ? new Utf8Decoder() : nullptr;
+
     emit useUtf8Request(utf8());
 }
 
@@ -258,6 +380,12 @@ void Emulation::receiveChar(wchar_t c)
     };
 }
 
+void Emulation::receiveChars(const uint *chars, int count)
+{
+    for (int i = 0; i < count; i++)
+        receiveChar(wchar_t(chars[i]));
+}
+
 void Emulation::sendKeyEvent(QKeyEvent *ev)
 {
     emit stateSet(NOTIFYNORMAL);
@@ -287,15 +415,25 @@ TODO: Character composition from the old code.  See #96536
 
 void Emulation::receiveData(const char *text, int length)
 {
+    QMutexLocker locker(&_screenLock);
+
     emit stateSet(NOTIFYACTIVITY);
 
     bufferedUpdate();
 
-    /* XXX: the following code involves encoding & decoding of "UTF-16
-     * surrogate pairs", which does not work with characters higher than
-     * U+10FFFF
-     * https://unicodebook.readthedocs.io/unicode_encodings.html#surrogates
-     */
+    if (_utf8Decoder) {
+        if (_decodedBuffer.size() < length + 1)
+            _decodedBuffer.resize(length + 1);
+
+        uint *codePoints = _decodedBuffer.data();
+        receiveChars(codePoints, _utf8Decoder->decode(text, length, codePoints));
+        // once per block of output rather than by each view as it reads the screen
+        _currentScreen->updateStyleRuns();
+
+        detectZModem(text, length);
+        return;
+    }
+
     QString utf16Text = _decoder->toUnicode(text, length);
 
     /******** Add by ut001000 renfeixiang 2020-07-16:增加 过滤收到的数据中的“\r\n\r”，“\r\n\r”在不同的bash版本可能不同，需要修改 Begin***************/
@@ -349,7 +487,6 @@ void Emulation::receiveData(const char *text, int length)
 //    }
     /******** Add by wangliang 2020-07-09 解决bug 22619:当shell名称较长时，鼠标拖动窗口大小会出现shell名称显示重复现象 End ***************/
 
-    std::wstring unicodeText = utf16Text.toStdWString();
 
     /******** Add by ut001000 renfeixiang 2020-07-16:增加 当终端宽高度变化时，收到数据，显示之前先清空界面上的信息 Begin***************/
 //    if(_lastcol != _currentScreen->getColumns() || _lastline != _currentScreen->getLines()){
@@ -359,18 +496,38 @@ void Emulation::receiveData(const char *text, int length)
 //    _lastline = _currentScreen->getLines();
     /******** Add by ut001000 renfeixiang 2020-07-16:增加 End***************/
 
-    //send characters to terminal emulator
-    for (size_t i = 0; i < unicodeText.length(); i++)
-        receiveChar(unicodeText[i]);
+    //send characters to terminal emulator, joining surrogate pairs in place
+    //instead of converting the whole block with toStdWString()
+    const ushort *utf16 = utf16Text.utf16();
+    const int utf16Length = utf16Text.length();
+    if (_decodedBuffer.size() < utf16Length)
+        _decodedBuffer.resize(utf16Length);
+
+    uint *codePoints = _decodedBuffer.data();
+    int count = 0;
+    for (int i = 0; i < utf16Length; i++) {
+        uint c = utf16[i];
+        if (QChar::isHighSurrogate(c) && i + 1 < utf16Length
+                && QChar::isLowSurrogate(utf16[i + 1])) {
+            c = QChar::surrogateToUcs4(ushort(c), utf16[++i]);
+        }
+        codePoints[count++] = c;
+    }
+    receiveChars(codePoints, count);
+    _currentScreen->updateStyleRuns();
+
+    detectZModem(text, length);
+}
 
+void Emulation::detectZModem(const char *text, int length)
+{
     //look for z-modem indicator
     //-- someone who understands more about z-modems that I do may be able to move
-    //this check into the above for loop?
-    for (int i = 0; i < length; i++) {
-        if (text[i] == '\030') {
-            if ((length - i - 1 > 3) && (strncmp(text + i + 1, "B00", 3) == 0))
-                emit zmodemDetected();
-        }
+    //this check into the decoding loops?
+    const char *end = text + length;
+    for (const char *p = text; (p = static_cast<const char *>(memchr(p, '\030', end - p))) != nullptr; p++) {
+        if ((end - p - 1 > 3) && (strncmp(p + 1, "B00", 3) == 0))
+            emit zmodemDetected();
     }
 }
 
@@ -427,37 +584,167 @@ void Emulation::writeToStream(TerminalCharacterDecoder *_decoder,
                               int startLine,
                               int endLine)
 {
+    QMutexLocker locker(&_screenLock);
     _currentScreen->writeLinesToStream(_decoder, startLine, endLine);
 }
 
+void Emulation::writeWholeLinesToStream(TerminalCharacterDecoder *decoder,
+                                        int startLine,
+                                        int endLine)
+{
+    QMutexLocker locker(&_screenLock);
+    _currentScreen->writeWholeLinesToStream(decoder, startLine, endLine);
+}
+
+int Emulation::historyGeneration() const
+{
+    QMutexLocker locker(&_screenLock);
+    return _currentScreen->historyGeneration();
+}
+
+qint64 Emulation::droppedHistoryLines() const
+{
+    QMutexLocker locker(&_screenLock);
+    return _currentScreen->droppedHistoryLines();
+}
+
+int Emulation::completeHistoryLines() const
+{
+    QMutexLocker locker(&_screenLock);
+    return _currentScreen->completeHistoryLines();
+}
+
+QVector<QPair<int, int> > Emulation::historySearchRanges(const QString &text, int fromLine, int toLine) const
+{
+    QMutexLocker locker(&_screenLock);
+    return _currentScreen->historySearchRanges(text, fromLine, toLine);
+}
+
 int Emulation::lineCount() const
 {
     // sum number of lines currently on _screen plus number of lines in history
+    QMutexLocker locker(&_screenLock);
     return _currentScreen->getLines() + _currentScreen->getHistLines();
 }
 
-#define BULK_TIMEOUT1 10
-#define BULK_TIMEOUT2 40
-
 void Emulation::showBulk()
 {
-    _bulkTimer1.stop();
-    _bulkTimer2.stop();
+    // the views fetch the new image in their slots, so keep the emulation
+    // thread from changing the screen until they are done
+    QMutexLocker locker(&_screenLock);
 
+    _frameTimer.stop();
+
+    if (_pendingOutput.isValid()) {
+        if (!_unpaintedOutput.isValid())
+            _unpaintedOutput = _pendingOutput;
+        _pendingOutput.invalidate();
+    }
+    _lastFrame.start();
+    _frameStatistics.framesRendered++;
+
+    // the views tell whether they paint the frame while handling the signal
     emit outputChanged();
 
+    // nobody paints the output, so it does not wait for a paint either
+    if (_pendingWindows == 0)
+        _unpaintedOutput.invalidate();
+
     _currentScreen->resetScrolledLines();
     _currentScreen->resetDroppedLines();
 }
 
 void Emulation::bufferedUpdate()
 {
-    _bulkTimer1.setSingleShot(true);
-    _bulkTimer1.start(BULK_TIMEOUT1);
-    if (!_bulkTimer2.isActive()) {
-        _bulkTimer2.setSingleShot(true);
-        _bulkTimer2.start(BULK_TIMEOUT2);
+    if (QThread::currentThread() != thread()) {
+        // output processed on the emulation thread: the frame timer belongs to
+        // the thread of the emulation object, so schedule the update there
+        if (_updateQueued.testAndSetOrdered(0, 1))
+            QMetaObject::invokeMethod(this, "bufferedUpdate", Qt::QueuedConnection);
+        return;
+    }
+    _updateQueued.storeRelease(0);
+
+    if (!_pendingOutput.isValid())
+        _pendingOutput.start();
+    if (_frameTimer.isActive())
+        return;
+
+    // output after an idle frame, such as the echo of a key press, is shown
+    // right away; anything closer to the last frame waits for the next one
+    int delay = 0;
+    if (_lastFrame.isValid()) {
+        const qint64 sinceLastFrame = _lastFrame.elapsed();
+        if (sinceLastFrame < _frameInterval)
+            delay = int(_frameInterval - sinceLastFrame);
+    }
+    _frameTimer.start(delay);
+}
+
+void Emulation::frameTimeout()
+{
+    // the views have not painted the previous frame yet: drop this one rather
+    // than queueing more work for them, but never hold output back for longer
+    // than MAX_FRAME_DELAY in case a view is slow to paint
+    if (_pendingWindows > 0 && _lastFrame.elapsed() < MAX_FRAME_DELAY) {
+        _frameStatistics.framesSkipped++;
+        _frameTimer.start(_frameInterval);
+        return;
     }
+
+    showBulk();
+}
+
+void Emulation::frameScheduled()
+{
+    _pendingWindows++;
+}
+
+void Emulation::framePainted()
+{
+    if (_pendingWindows == 0)
+        return;
+    _pendingWindows--;
+
+    if (_unpaintedOutput.isValid()) {
+        const qint64 latency = _unpaintedOutput.nsecsElapsed() / 1000;
+        _frameStatistics.framesPainted++;
+        _frameStatistics.lastLatency = latency;
+        _frameStatistics.maximumLatency = qMax(_frameStatistics.maximumLatency, latency);
+        _frameStatistics.totalLatency += latency;
+        _unpaintedOutput.invalidate();
+    }
+}
+
+void Emulation::frameDropped()
+{
+    if (_pendingWindows > 0)
+        _pendingWindows--;
+}
+
+Emulation::FrameStatistics Emulation::frameStatistics() const
+{
+    return _frameStatistics;
+}
+
+QMutex *Emulation::screenLock() const
+{
+    return &_screenLock;
+}
+
+void Emulation::emitSendData(const char *data, int length)
+{
+    if (QThread::currentThread() != thread()) {
+        QMetaObject::invokeMethod(this, "sendQueuedData", Qt::QueuedConnection,
+                                  Q_ARG(QByteArray, QByteArray(data, length)));
+        return;
+    }
+    emit sendData(data, length);
+}
+
+void Emulation::sendQueuedData(const QByteArray &data)
+{
+    emit sendData(data.constData(), data.size());
 }
 
 char Emulation::eraseChar() const
@@ -470,6 +757,8 @@ void Emulation::setImageSize(int lines, int columns)
     if ((lines < 1) || (columns < 1))
         return;
 
+    QMutexLocker locker(&_screenLock);
+
     QSize screenSize[2] = { QSize(_screen[0]->getColumns(),
                                   _screen[0]->getLines()),
                             QSize(_screen[1]->getColumns(),
@@ -482,6 +771,8 @@ void Emulation::setImageSize(int lines, int columns)
 
     _screen[0]->resizeImage(lines, columns);
     _screen[1]->resizeImage(lines, columns);
+    _screen[0]->updateStyleRuns();
+    _screen[1]->updateStyleRuns();
 
     emit imageSizeChanged(lines, columns);
 
@@ -490,6 +781,7 @@ void Emulation::setImageSize(int lines, int columns)
 
 QSize Emulation::imageSize() const
 {
+    QMutexLocker locker(&_screenLock);
     return {_currentScreen->getColumns(), _currentScreen->getLines()};
 }
 
@@ -499,7 +791,8 @@ uint ExtendedCharTable::extendedCharHash(const uint *unicodePoints, ushort lengt
     for (ushort i = 0 ; i < length ; i++) {
         hash = 31 * hash + unicodePoints[i];
     }
-    return hash;
+    // the hash is stored in Character::character
+    return hash & MAX_CHARACTER_VALUE;
 }
 bool ExtendedCharTable::extendedCharMatch(uint hash, const uint *unicodePoints, ushort length) const
 {
@@ -520,6 +813,8 @@ bool ExtendedCharTable::extendedCharMatch(uint hash, const uint *unicodePoints,
 
 uint ExtendedCharTable::createExtendedChar(const uint *unicodePoints, ushort length)
 {
+    QMutexLocker locker(&_lock);
+
     // look for this sequence of points in the table
     uint hash = extendedCharHash(unicodePoints, length);
     const uint initialHash = hash;
@@ -530,39 +825,24 @@ uint ExtendedCharTable::createExtendedChar(const uint *unicodePoints, ushort len
         if (extendedCharMatch(hash, unicodePoints, length)) {
             // this sequence already has an entry in the table,
             // return its hash
+            if (_purging)
+                _purgeUsed.insert(hash);
             return hash;
         }
         // if hash is already used by another, different sequence of unicode character
         // points then try next hash
-        hash++;
+        hash = (hash + 1) & MAX_CHARACTER_VALUE;
 
         if (hash == initialHash) {
-            if (!triedCleaningSolution) {
-                triedCleaningSolution = true;
-                // All the hashes are full, go to all Screens and try to free any
-                // This is slow but should happen very rarely
-                QSet<uint> usedExtendedChars;
-                const QList<Session *> sessionsList = SessionManager::instance()->sessions();
-                for (const Session *s : sessionsList) {
-                    const QList<TerminalDisplay *> displayList = s->views();
-                    for (const TerminalDisplay *display : displayList) {
-                        usedExtendedChars += display->screenWindow()->screen()->usedExtendedChars();
-                    }
-                }
-
-                QHash<uint, uint *>::iterator it = extendedCharTable.begin();
-                QHash<uint, uint *>::iterator itEnd = extendedCharTable.end();
-                while (it != itEnd) {
-                    if (usedExtendedChars.contains(it.key())) {
-                        ++it;
-                    } else {
-                        it = extendedCharTable.erase(it);
-                    }
-                }
-            } else {
+            if (triedCleaningSolution) {
                 qDebug() << "Using all the extended char hashes, going to miss this extended character";
                 return 0;
             }
+            // All the hashes are full, go to all Screens and try to free any
+            // This is slow but should happen very rarely.  The search starts
+            // again, the sequence may have been added meanwhile.
+            triedCleaningSolution = true;
+            purge();
         }
     }
 
@@ -575,14 +855,73 @@ uint ExtendedCharTable::createExtendedChar(const uint *unicodePoints, ushort len
     }
 
     extendedCharTable.insert(hash, buffer);
+    if (_purging)
+        _purgeUsed.insert(hash);
 
     return hash;
 }
 
+// How long a purge waits for a busy screen before trying it again, in ms
+#define PURGE_RETRY_INTERVAL 5
+
+void ExtendedCharTable::purge()
+{
+    // The purge may run on any emulation thread or the GUI thread, all of
+    // which hold the lock of a screen while they use the table.  So _lock is
+    // given up while waiting for a busy screen, and a thread which runs out
+    // of hashes meanwhile scans the screens it holds and waits for the purge
+    // to finish instead of starting its own.  Sequences handed out during
+    // the purge are kept, their screens may have been scanned already.
+    scanEmulations();
+    if (_purging) {
+        _purgeChanged.wakeAll();
+        while (_purging)
+            _purgeChanged.wait(&_lock);
+        return;
+    }
+
+    _purging = true;
+    while (!scanEmulations())
+        _purgeChanged.wait(&_lock, PURGE_RETRY_INTERVAL);
+
+    QHash<uint, uint *>::iterator it = extendedCharTable.begin();
+    QHash<uint, uint *>::iterator itEnd = extendedCharTable.end();
+    while (it != itEnd) {
+        if (_purgeUsed.contains(it.key())) {
+            ++it;
+        } else {
+            it = extendedCharTable.erase(it);
+        }
+    }
+    _purgeUsed.clear();
+    _purgeScanned.clear();
+    _purging = false;
+    _generation.ref();
+    _purgeChanged.wakeAll();
+}
+
+bool ExtendedCharTable::scanEmulations()
+{
+    bool complete = true;
+    QMutexLocker locker(&emulationsLock);
+    for (const Emulation *emulation : qAsConst(emulations)) {
+        if (_purgeScanned.contains(emulation))
+            continue;
+        // the screens held by this thread can always be scanned
+        if (emulation->usedExtendedChars(_purgeUsed))
+            _purgeScanned.insert(emulation);
+        else
+            complete = false;
+    }
+    return complete;
+}
+
 uint *ExtendedCharTable::lookupExtendedChar(uint hash, ushort &length) const
 {
     // lookup index in table and if found, set the length
     // argument and return a pointer to the character sequence
+    // (buffers are never freed while the table exists)
+    QMutexLocker locker(&_lock);
 
     uint *buffer = extendedCharTable[hash];
     if (buffer != nullptr) {
@@ -594,6 +933,7 @@ uint *ExtendedCharTable::lookupExtendedChar(uint hash, ushort &length) const
 }
 
 ExtendedCharTable::ExtendedCharTable()
+    : _purging(false)
 {
 }
 ExtendedCharTable::~ExtendedCharTable()
@@ -609,6 +949,67 @@ ExtendedCharTable::~ExtendedCharTable()
 // global instance
 ExtendedCharTable ExtendedCharTable::instance;
 
+RgbColorTable::RgbColorTable()
+    : _nextIndex(0)
+    , _misses(0)
+    , _generation(0)
+{
+}
+
+int RgbColorTable::indexOf(QRgb rgb)
+{
+    QMutexLocker locker(&_lock);
+
+    const QHash<QRgb, int>::const_iterator it = _indexes.constFind(rgb);
+    if (it != _indexes.constEnd())
+        return it.value();
+
+    if (_freeIndexes.isEmpty() && _nextIndex == MAX_COLORS) {
+        // scanning every screen and history is slow, so after a purge
+        // which freed nothing further colors are approximated for a while
+        if (_misses++ % 4096 != 0 || !purge())
+            return -1;
+        _misses = 0;
+    }
+
+    const int index = _freeIndexes.isEmpty() ? _nextIndex++ : _freeIndexes.takeLast();
+    _colors[index].storeRelease(rgb);
+    _indexes.insert(rgb, index);
+    return index;
+}
+
+bool RgbColorTable::purge()
+{
+    QSet<int> usedColors;
+    {
+        QMutexLocker locker(&emulationsLock);
+        for (const Emulation *emulation : qAsConst(emulations)) {
+            if (!emulation->usedRgbColors(usedColors)) {
+                qDebug() << "Using all the RGB colors, going to approximate this color";
+                return false;
+            }
+        }
+    }
+
+    QHash<QRgb, int>::iterator it = _indexes.begin();
+    while (it != _indexes.end()) {
+        if (usedColors.contains(it.value())) {
+            ++it;
+        } else {
+            _freeIndexes.append(it.value());
+            it = _indexes.erase(it);
+        }
+    }
+    if (_freeIndexes.isEmpty())
+        return false;
+
+    _generation.ref();
+    return true;
+}
+
+// global instance
+RgbColorTable RgbColorTable::instance;
+
 
 //#include "Emulation.moc"
 
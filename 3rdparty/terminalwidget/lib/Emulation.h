@@ -27,11 +27,17 @@
 #include <cstdio>
 
 // Qt
+#include <QAtomicInt>
+#include <QElapsedTimer>
 #include <QKeyEvent>
+#include <QMutex>
+#include <QPair>
+#include <QSet>
 //#include <QPointer>
 #include <QTextCodec>
 #include <QTextStream>
 #include <QTimer>
+#include <QVector>
 
 #include "qtermwidget_export.h"
 
@@ -42,6 +48,7 @@ class HistoryType;
 class Screen;
 class ScreenWindow;
 class TerminalCharacterDecoder;
+class Utf8Decoder;
 
 /**
  * This enum describes the available states which
@@ -140,6 +147,31 @@ public:
          */
         IBeamCursor = 2
     };
+    Q_ENUM(KeyboardCursorShape)
+
+    /**
+     * Counters describing how output has been delivered to the views.
+     * See frameStatistics()
+     */
+    struct FrameStatistics {
+        /** Number of times outputChanged() has been emitted */
+        quint64 framesRendered = 0;
+        /**
+         * Number of frames which were dropped because the views had not
+         * yet painted the previous one
+         */
+        quint64 framesSkipped = 0;
+        /** Number of frames whose paint was acknowledged by a view */
+        quint64 framesPainted = 0;
+        /**
+         * Time in microseconds between the arrival of output and the paint
+         * which first showed it: of the last painted frame, the largest seen
+         * and the sum over all painted frames.
+         */
+        qint64 lastLatency = 0;
+        qint64 maximumLatency = 0;
+        qint64 totalLatency = 0;
+    };
 
 
     /** Constructs a new terminal emulation */
@@ -174,6 +206,68 @@ public:
     const HistoryType &history() const;
     /** Clears the history scroll. */
     void clearHistory();
+    /**
+     * Keeps a copy of the history on disk in the journal @p fileName, so it
+     * can be restored with restoreHistory() after a restart.  An empty name
+     * stops keeping one.  See Screen::setHistoryJournal()
+     */
+    void setHistoryJournal(const QString &fileName);
+    /**
+     * Stops keeping the history journal and removes its file, without
+     * waiting for it to be written.  See Screen::discardHistoryJournal()
+     */
+    void discardHistoryJournal();
+    /**
+     * Adds the lines of the history journal @p fileName to the history.
+     * Returns false if the journal cannot be read.
+     */
+    bool restoreHistory(const QString &fileName);
+    /**
+     * Returns the number of bytes of memory used by the history of the
+     * emulation's screens.  History kept on disk is not counted.
+     */
+    qint64 historyMemoryUsage() const;
+    /**
+     * Shrinks the history until it uses at most @p maximum bytes of memory.
+     * History stores which support it compress their lines or move them to
+     * disk, the others drop their oldest lines.
+     */
+    void reduceHistoryMemoryUsage(qint64 maximum);
+    /**
+     * Adds the indexes into RgbColorTable used by the screens of the
+     * emulation and their history to @p used.  Returns false if the screens
+     * are busy on another thread.  See RgbColorTable::indexOf()
+     */
+    bool usedRgbColors(QSet<int> &used) const;
+    /**
+     * Adds the hashes of the extended characters on the screens of the
+     * emulation to @p used.  Returns false if the screens are busy on
+     * another thread.  See ExtendedCharTable::createExtendedChar()
+     */
+    bool usedExtendedChars(QSet<uint> &used) const;
+
+    /**
+     * Returns the generation of the history of the current screen, which
+     * changes when its lines are numbered differently.  See
+     * Screen::historyGeneration()
+     */
+    int historyGeneration() const;
+    /**
+     * Returns the number of lines dropped from the history of the current
+     * screen since historyGeneration() changed.  Adding it to a line number
+     * gives a number which stays the same while old lines are dropped.
+     */
+    qint64 droppedHistoryLines() const;
+    /**
+     * Returns the number of lines at the top of the history which no output
+     * can change any more.  See Screen::completeHistoryLines()
+     */
+    int completeHistoryLines() const;
+    /**
+     * Returns the history lines from @p fromLine to @p toLine which may
+     * contain @p text, as pairs of first and last line.
+     */
+    QVector<QPair<int, int> > historySearchRanges(const QString &text, int fromLine, int toLine) const;
 
     /**
      * Copies the output history from @p startLine to @p endLine
@@ -187,6 +281,12 @@ public:
      * @param endLine Index of last line to copy
      */
     virtual void writeToStream(TerminalCharacterDecoder *decoder, int startLine, int endLine);
+    /**
+     * Copies the whole lines from @p startLine to @p endLine into
+     * @p decoder, so that the output can be copied a range of lines
+     * at a time.  See Screen::writeWholeLinesToStream()
+     */
+    void writeWholeLinesToStream(TerminalCharacterDecoder *decoder, int startLine, int endLine);
 
     /** Returns the codec used to decode incoming characters.  See setCodec() */
     const QTextCodec *codec() const
@@ -254,6 +354,20 @@ public:
     //用于保存当前Emulator对应的sessionId
     void setSessionId(int sessionId);
 
+    /** Returns the counters of the frame scheduler.  See bufferedUpdate() */
+    FrameStatistics frameStatistics() const;
+
+    /**
+     * Returns the lock which guards the screens, their history and the state of
+     * the emulation.  receiveData() holds it while processing output, which may
+     * happen on an emulation thread (see Session::setEmulationThreaded()).  Code
+     * on other threads which reads or changes the screens directly, rather than
+     * through the emulation or a ScreenWindow, must hold it as well.
+     *
+     * The lock is recursive.
+     */
+    QMutex *screenLock() const;
+
 public slots:
 
     /** Change the size of the emulation's image */
@@ -289,7 +403,8 @@ public slots:
     /**
      * Processes an incoming stream of characters.  receiveData() decodes the incoming
      * character buffer using the current codec(), and then calls receiveChar() for
-     * each unicode character in the resulting buffer.
+     * each unicode character in the resulting buffer.  UTF-8 input is decoded
+     * directly into code points by a Utf8Decoder rather than through QTextDecoder.
      *
      * receiveData() also starts a timer which causes the outputChanged() signal
      * to be emitted when it expires.  The timer allows multiple updates in quick
@@ -468,6 +583,13 @@ protected:
      */
     virtual void receiveChar(wchar_t ch);
 
+    /**
+     * Processes a block of incoming characters.  The default implementation
+     * calls receiveChar() for each of them; emulations can override it to
+     * handle runs of plain text in one go.
+     */
+    virtual void receiveChars(const uint *chars, int count);
+
     /**
      * Sets the active screen.  The terminal has two screens, primary and alternate.
      * The primary screen is used by default.  When certain interactive programs such
@@ -483,6 +605,9 @@ protected:
     };
     void setCodec(EmulationCodec codec); // codec number, 0 = locale, 1=utf8
 
+    // emits zmodemDetected() if the received block starts a z-modem transfer
+    void detectZModem(const char *text, int length);
+
 
     QList<ScreenWindow *> _windows;
 
@@ -499,6 +624,11 @@ protected:
     //the current text codec.  (this allows for rendering of non-ASCII characters in text files etc.)
     const QTextCodec *_codec;
     QTextDecoder *_decoder;
+    //used instead of _decoder when the codec is UTF-8, decodes straight into
+    //code points without going through QString
+    Utf8Decoder *_utf8Decoder;
+    //scratch buffer receiving the decoded code points of each block
+    QVector<uint> _decodedBuffer;
     /******** Modify by ut000610 daizhengwen 2020-06-02: 让这个值能被修改****************/
     /*const */KeyboardTranslator *_keyTranslator; // the keyboard layout
     /********************* Modify by ut000610 daizhengwen End ************************/
@@ -508,15 +638,42 @@ protected slots:
      * Schedules an update of attached views.
      * Repeated calls to bufferedUpdate() in close succession will result in only a single update,
      * much like the Qt buffered update of widgets.
+     *
+     * Output which arrives after the views have been idle for a frame, such as the echo
+     * of a key press, is shown right away.  Continuous output is coalesced into at most
+     * one update per refresh interval of the screen, and an update is dropped while the
+     * views are still painting the previous one.
      */
     void bufferedUpdate();
 
+protected:
+    /**
+     * Emits sendData() on the thread of the emulation object.  When called while
+     * output is processed on an emulation thread, @p data is copied and the signal
+     * is emitted later, as receivers may not keep the pointer.
+     */
+    void emitSendData(const char *data, int length);
+
 private slots:
 
+    // emits sendData() for data produced on the emulation thread
+    void sendQueuedData(const QByteArray &data);
+
     // triggered by timer, causes the emulation to send an updated screen image to each
     // view
     void showBulk();
 
+    // triggered by the frame timer, shows the pending output unless the views are
+    // still busy with the previous frame
+    void frameTimeout();
+
+    // called when a view has scheduled a paint of one of the windows
+    void frameScheduled();
+    // called when a view has painted the contents of one of the windows
+    void framePainted();
+    // called when a view will not paint the frame it scheduled
+    void frameDropped();
+
     void usesMouseChanged(bool usesMouse);
 
     void bracketedPasteModeChanged(bool bracketedPasteMode);
@@ -524,8 +681,16 @@ private slots:
 private:
     bool _usesMouse;
     bool _bracketedPasteMode;
-    QTimer _bulkTimer1;
-    QTimer _bulkTimer2;
+    QTimer _frameTimer;
+    int _frameInterval;           // refresh interval of the screen in ms
+    QElapsedTimer _lastFrame;     // time since outputChanged() was last emitted
+    QElapsedTimer _pendingOutput; // time since the oldest output not yet shown
+    QElapsedTimer _unpaintedOutput; // same, for the frame shown but not yet painted
+    int _pendingWindows;          // windows with a paint scheduled but not done yet
+    FrameStatistics _frameStatistics;
+    QAtomicInt _updateQueued;     // bufferedUpdate() was posted from the emulation thread
+
+    mutable QMutex _screenLock;
 
     int _sessionId;
 
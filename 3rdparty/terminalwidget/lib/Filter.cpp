@@ -115,6 +115,16 @@ QList<Filter::HotSpot *> FilterChain::hotSpots() const
     }
     return list;
 }
+
+void FilterChain::hotSpots(QVector<Filter::HotSpot *> &list) const
+{
+    list.resize(0);
+    for (const Filter *filter : *this) {
+        const QList<Filter::HotSpot *> spots = filter->hotSpots();
+        for (Filter::HotSpot *spot : spots)
+            list.append(spot);
+    }
+}
 //QList<Filter::HotSpot*> FilterChain::hotSpotsAtLine(int line) const;
 
 void FilterChain::setSessionId(int sessionId)
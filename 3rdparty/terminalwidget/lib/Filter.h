@@ -27,6 +27,7 @@
 #include <QStringList>
 #include <QHash>
 #include <QRegExp>
+#include <QVector>
 
 // Local
 #include "qtermwidget_export.h"
@@ -350,6 +351,11 @@ public:
     Filter::HotSpot *hotSpotAt(int line, int column) const;
     /** Returns a list of all the hotspots in all the chain's filters */
     QList<Filter::HotSpot *> hotSpots() const;
+    /**
+     * Fills @p list with all the hotspots in all the chain's filters.  The
+     * list keeps its buffer, so filling it again does not allocate.
+     */
+    void hotSpots(QVector<Filter::HotSpot *> &list) const;
     /** Returns a list of all hotspots at the given line in all the chain's filters */
     QList<Filter::HotSpot> hotSpotsAtLine(int line) const;
 
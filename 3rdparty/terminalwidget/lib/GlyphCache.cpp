@@ -0,0 +1,213 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// Own
+#include "GlyphCache.h"
+
+// System
+#include <cmath>
+
+// Qt
+#include <QPainter>
+
+using namespace Konsole;
+
+// Smallest side of an atlas page, in device pixels
+#define GLYPH_PAGE_SIZE 512
+// Pages the atlas keeps, the least recently used beyond them are dropped
+#define GLYPH_PAGE_BUDGET 8
+
+namespace
+{
+
+int fontStyle(const QFont &font)
+{
+    return (font.bold() ? 1 : 0)
+           | (font.italic() ? 2 : 0)
+           | (font.underline() ? 4 : 0)
+           | (font.strikeOut() ? 8 : 0)
+           | (font.overline() ? 16 : 0);
+}
+
+}
+
+namespace Konsole
+{
+
+uint qHash(const GlyphCache::Key &key, uint seed)
+{
+    return ::qHash(key.character, seed) ^ ::qHash(key.cluster, seed)
+           ^ ::qHash(uint(key.style << 2 | key.columns), seed) ^ ::qHash(key.color, seed);
+}
+
+}
+
+bool GlyphCache::Key::operator==(const Key &other) const
+{
+    return character == other.character && columns == other.columns
+           && style == other.style && color == other.color && cluster == other.cluster;
+}
+
+GlyphCache::GlyphCache()
+    : _cellWidth(0)
+    , _textHeight(0)
+    , _devicePixelRatio(1)
+    , _pageSize(GLYPH_PAGE_SIZE)
+    , _paint(0)
+    , _fillPage(-1)
+    , _slotX(0)
+    , _slotY(0)
+{
+}
+
+void GlyphCache::prepare(const QFont &font, int cellWidth, int textHeight, qreal devicePixelRatio)
+{
+    _paint++;
+    if (font == _font && cellWidth == _cellWidth && textHeight == _textHeight
+            && qFuzzyCompare(devicePixelRatio, _devicePixelRatio)) {
+        dropPages();
+        return;
+    }
+
+    clear();
+    _font = font;
+    _cellWidth = cellWidth;
+    _textHeight = textHeight;
+    _devicePixelRatio = devicePixelRatio;
+    _margin = QPoint(qMax(2, cellWidth / 2), qMax(2, textHeight / 8));
+
+    // a page holds a few rows of the widest slots at least
+    const int slotHeight = int(std::ceil((textHeight + 2 * _margin.y()) * devicePixelRatio));
+    _pageSize = GLYPH_PAGE_SIZE;
+    while (_pageSize < 4 * slotHeight)
+        _pageSize *= 2;
+}
+
+void GlyphCache::clear()
+{
+    _glyphs.clear();
+    _pages.clear();
+    _pageUsed.clear();
+    _freePages.clear();
+    _fillPage = -1;
+    _slotX = 0;
+    _slotY = 0;
+}
+
+void GlyphCache::dropPages()
+{
+    while (_pages.count() - _freePages.count() > GLYPH_PAGE_BUDGET) {
+        int oldest = -1;
+        for (int i = 0; i < _pages.count(); i++) {
+            if (!_pages.at(i).isNull() && (oldest < 0 || _pageUsed.at(i) < _pageUsed.at(oldest)))
+                oldest = i;
+        }
+
+        QHash<Key, Glyph>::iterator it = _glyphs.begin();
+        while (it != _glyphs.end()) {
+            if (it.value().page == oldest)
+                it = _glyphs.erase(it);
+            else
+                ++it;
+        }
+        _pages[oldest] = QPixmap();
+        _freePages.append(oldest);
+        if (oldest == _fillPage)
+            _fillPage = -1;
+    }
+}
+
+const GlyphCache::Glyph &GlyphCache::glyph(uint character, const QString &cluster, int columns,
+                                           const QFont &font, QRgb color)
+{
+    Key key;
+    key.character = character;
+    key.cluster = cluster;
+    key.columns = columns;
+    key.style = fontStyle(font);
+    key.color = color;
+
+    QHash<Key, Glyph>::iterator it = _glyphs.find(key);
+    if (it == _glyphs.end())
+        it = _glyphs.insert(key, addGlyph(key, font));
+    _pageUsed[it.value().page] = _paint;
+    return it.value();
+}
+
+const QPixmap &GlyphCache::page(int index) const
+{
+    return _pages.at(index);
+}
+
+QPoint GlyphCache::margin() const
+{
+    return _margin;
+}
+
+qreal GlyphCache::devicePixelRatio() const
+{
+    return _devicePixelRatio;
+}
+
+GlyphCache::Glyph GlyphCache::addGlyph(const Key &key, const QFont &font)
+{
+    const QSize logicalSize(key.columns * _cellWidth + 2 * _margin.x(), _textHeight + 2 * _margin.y());
+    const QSize size(int(std::ceil(logicalSize.width() * _devicePixelRatio)),
+                     int(std::ceil(logicalSize.height() * _devicePixelRatio)));
+
+    // all slots have the same height, so they are filled in rows
+    if (_fillPage >= 0 && _slotX + size.width() > _pageSize) {
+        _slotX = 0;
+        _slotY += size.height();
+    }
+    if (_fillPage < 0 || _slotY + size.height() > _pageSize) {
+        QPixmap page(_pageSize, _pageSize);
+        page.fill(Qt::transparent);
+        // the index of a dropped page is used again, so the pages keep
+        // their indexes
+        if (_freePages.isEmpty()) {
+            _fillPage = _pages.count();
+            _pages.append(page);
+            _pageUsed.append(_paint);
+        } else {
+            _fillPage = _freePages.takeLast();
+            _pages[_fillPage] = page;
+        }
+        _slotX = 0;
+        _slotY = 0;
+    }
+
+    Glyph glyph;
+    glyph.page = _fillPage;
+    glyph.source = QRect(QPoint(_slotX, _slotY), size);
+    _slotX += size.width();
+
+    // the text is laid out like TerminalDisplay::drawCharacters() does
+    const QString text = key.cluster.isEmpty() ? QString::fromUcs4(&key.character, 1) : key.cluster;
+    QPainter painter(&_pages[glyph.page]);
+    painter.translate(glyph.source.topLeft());
+    painter.scale(_devicePixelRatio, _devicePixelRatio);
+    painter.setRenderHint(QPainter::TextAntialiasing, font.styleStrategy() & QFont::PreferAntialias);
+    painter.setFont(font);
+    painter.setPen(QColor::fromRgba(key.color));
+    painter.setLayoutDirection(Qt::LeftToRight);
+    painter.drawText(QRectF(_margin, QSizeF(key.columns * _cellWidth, _textHeight)),
+                     Qt::AlignBottom, LTR_OVERRIDE_CHAR + text);
+    return glyph;
+}
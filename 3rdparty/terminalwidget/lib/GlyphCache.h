@@ -0,0 +1,135 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+#ifndef GLYPHCACHE_H
+#define GLYPHCACHE_H
+
+// Qt
+#include <QColor>
+#include <QFont>
+#include <QHash>
+#include <QList>
+#include <QPixmap>
+#include <QRect>
+#include <QString>
+#include <QVector>
+
+namespace Konsole
+{
+
+// we use this to force QPainter to display text in LTR mode, by the
+// display and the glyph cache alike
+// more information can be found in: http://unicode.org/reports/tr9/
+const QChar LTR_OVERRIDE_CHAR( 0x202D );
+
+/**
+ * Keeps the glyphs a TerminalDisplay draws in atlas pixmaps, so text can be
+ * drawn by copying them instead of laying it out again for every paint.
+ *
+ * A glyph is the text of one cell, a character or a cluster of combining
+ * characters, drawn with a font style and a colour into a slot of one or
+ * two cells.  The slot has a margin around the cells for the parts of the
+ * glyph which reach beyond them, e.g. italic overhangs.  Glyphs are drawn
+ * into the atlas the first time they are asked for, at the device pixel
+ * ratio of the display.
+ *
+ * The glyphs are drawn on a transparent background, so they are
+ * antialiased in grey even where the display would use subpixel
+ * antialiasing.
+ *
+ * The atlas keeps a budget of pages.  When it has grown beyond it, the
+ * pages which were used least recently are dropped with their glyphs.
+ */
+class GlyphCache
+{
+public:
+    struct Glyph
+    {
+        // the atlas page and the glyph's slot in it, in device pixels
+        int page;
+        QRect source;
+    };
+
+    GlyphCache();
+
+    /**
+     * Sets the font, the size of a cell and the height text is drawn in,
+     * and the device pixel ratio of the glyphs.  Forgets all glyphs if any
+     * of them has changed, and drops the pages used least recently if the
+     * atlas has grown beyond its budget.  Call it before each paint, not
+     * while glyphs are in use.
+     */
+    void prepare(const QFont &font, int cellWidth, int textHeight, qreal devicePixelRatio);
+
+    /**
+     * Returns the glyph of a cell which is @p columns (1 or 2) wide.  Its
+     * text is @p character, or @p cluster if that is not empty.  The style
+     * is taken from the bold, italic and line attributes of @p font.
+     */
+    const Glyph &glyph(uint character, const QString &cluster, int columns,
+                       const QFont &font, QRgb color);
+
+    const QPixmap &page(int index) const;
+    /** Returns the offset of the cells in a glyph's slot, in logical pixels. */
+    QPoint margin() const;
+    qreal devicePixelRatio() const;
+
+private:
+    struct Key
+    {
+        uint character;
+        QString cluster;
+        int columns;
+        int style;
+        QRgb color;
+
+        bool operator==(const Key &other) const;
+    };
+    friend uint qHash(const Key &key, uint seed);
+
+    void clear();
+    // drops the least recently used pages beyond the budget
+    void dropPages();
+    // draws the glyph into a free slot of the atlas
+    Glyph addGlyph(const Key &key, const QFont &font);
+
+    QFont _font;
+    int _cellWidth;
+    int _textHeight;
+    qreal _devicePixelRatio;
+    QPoint _margin;
+
+    QHash<Key, Glyph> _glyphs;
+    QList<QPixmap> _pages;
+    int _pageSize;
+    // the paint each page was last used in, counted by prepare()
+    QVector<quint64> _pageUsed;
+    quint64 _paint;
+    // dropped pages, whose index is given to the next new page
+    QVector<int> _freePages;
+    // the page new slots go on, -1 if a new page is needed, and where the
+    // next slot goes on it
+    int _fillPage;
+    int _slotX;
+    int _slotY;
+};
+
+}
+
+#endif // GLYPHCACHE_H
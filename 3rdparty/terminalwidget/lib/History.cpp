@@ -29,7 +29,10 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <cerrno>
+#include <climits>
+#include <cstring>
 
 #include <QtDebug>
 
@@ -90,7 +93,8 @@ FIXME: There is noticeable decrease in speed, also. Perhaps,
 HistoryFile::HistoryFile()
   : ion(-1),
     length(0),
-    fileMap(nullptr)
+    fileMap(nullptr),
+    capacity(0)
 {
   if (tmpFile.open())
   {
@@ -101,78 +105,87 @@ HistoryFile::HistoryFile()
 
 HistoryFile::~HistoryFile()
 {
-    if (fileMap)
-        unmap();
-}
-
-//TODO:  Mapping the entire file in will cause problems if the history file becomes exceedingly large,
-//(ie. larger than available memory).  HistoryFile::map() should only map in sections of the file at a time,
-//to avoid this.
-void HistoryFile::map()
-{
-    Q_ASSERT( fileMap == nullptr );
-
-    fileMap = (char*)mmap( nullptr , length , PROT_READ , MAP_PRIVATE , ion , 0 );
-
-    //if mmap'ing fails, fall back to the read-lseek combination
-    if ( fileMap == MAP_FAILED )
-    {
-            readWriteBalance = 0;
-            fileMap = nullptr;
-            //qDebug() << __FILE__ << __LINE__ << ": mmap'ing history failed.  errno = " << errno;
-    }
+    unmap();
 }
 
 void HistoryFile::unmap()
 {
-    int result = munmap( fileMap , length );
-    Q_ASSERT( result == 0 ); Q_UNUSED( result );
-
+  if (fileMap)
+  {
+    munmap( fileMap , capacity );
     fileMap = nullptr;
+  }
 }
 
-bool HistoryFile::isMapped() const
+bool HistoryFile::reserve(qint64 bytes)
 {
-    return (fileMap != nullptr);
+  qint64 newCapacity = qMax(qint64(capacity), qint64(MIN_CAPACITY));
+  while (newCapacity < bytes)
+    newCapacity += qMin(newCapacity, qint64(CAPACITY_STEP));
+  if (ion < 0 || newCapacity > INT_MAX)
+  {
+    //the data mapped so far stays in the file, it is read with pread()
+    unmap();
+    capacity = -1;
+    return false;
+  }
+
+  unmap();
+
+  bool sized = ftruncate(ion, newCapacity) == 0;
+#if defined(Q_OS_LINUX)
+  //writing to a page of the mapping the disk has no room for would raise
+  //SIGBUS, so the space is reserved up front
+  sized = sized && posix_fallocate(ion, capacity, newCapacity - capacity) == 0;
+#endif
+  void* map = sized ? mmap( nullptr , newCapacity , PROT_READ | PROT_WRITE , MAP_SHARED , ion , 0 ) : MAP_FAILED;
+
+  //if mmap'ing fails, fall back to pwrite and pread for good
+  if ( map == MAP_FAILED )
+  {
+    perror("HistoryFile::reserve");
+    capacity = -1;
+    return false;
+  }
+
+  fileMap = static_cast<char*>(map);
+  capacity = int(newCapacity);
+  //data is added at the end and mostly read near it
+  madvise( fileMap , capacity , MADV_SEQUENTIAL );
+  return true;
 }
 
 void HistoryFile::add(const unsigned char* bytes, int len)
 {
-  if ( fileMap )
-          unmap();
-
-  readWriteBalance++;
+  if ( length + qint64(len) > capacity && capacity >= 0 )
+    reserve(length + qint64(len));
 
-  int rc = 0;
+  if ( fileMap && length + len <= capacity )
+  {
+    memcpy( fileMap + length , bytes , len );
+    length += len;
+    return;
+  }
 
-  rc = KDE_lseek(ion,length,SEEK_SET); if (rc < 0) { perror("HistoryFile::add.seek"); return; }
-  rc = write(ion,bytes,len);       if (rc < 0) { perror("HistoryFile::add.write"); return; }
+  int rc = pwrite(ion,bytes,len,length); if (rc < 0) { perror("HistoryFile::add.write"); return; }
   length += rc;
 }
 
 void HistoryFile::get(unsigned char* bytes, int len, int loc)
 {
-  //count number of get() calls vs. number of add() calls.
-  //If there are many more get() calls compared with add()
-  //calls (decided by using MAP_THRESHOLD) then mmap the log
-  //file to improve performance.
-  readWriteBalance--;
-  if ( !fileMap && readWriteBalance < MAP_THRESHOLD )
-          map();
+  if (loc < 0 || len < 0 || loc + len > length)
+  {
+    fprintf(stderr,"getHist(...,%d,%d): invalid args.\n",len,loc);
+    return;
+  }
 
-  if ( fileMap )
+  if ( fileMap && loc + len <= capacity )
   {
-    for (int i=0;i<len;i++)
-            bytes[i]=fileMap[loc+i];
+    memcpy( bytes , fileMap + loc , len );
   }
   else
   {
-      int rc = 0;
-
-      if (loc < 0 || len < 0 || loc + len > length)
-        fprintf(stderr,"getHist(...,%d,%d): invalid args.\n",len,loc);
-      rc = KDE_lseek(ion,loc,SEEK_SET); if (rc < 0) { perror("HistoryFile::get.seek"); return; }
-      rc = read(ion,bytes,len);     if (rc < 0) { perror("HistoryFile::get.read"); return; }
+    int rc = pread(ion,bytes,len,loc); if (rc < 0) { perror("HistoryFile::get.read"); return; }
   }
 }
 
@@ -248,10 +261,6 @@ int HistoryScrollFile::startOfLine(int lineno)
   if (lineno <= 0) return 0;
   if (lineno <= getLines())
     {
-
-    if (!index.isMapped())
-            index.map();
-
     int res;
     index.get((unsigned char*)&res,sizeof(int),(lineno-1)*sizeof(int));
     return res;
@@ -271,9 +280,6 @@ void HistoryScrollFile::addCells(const Character text[], int count)
 
 void HistoryScrollFile::addLine(bool previousWrapped)
 {
-  if (index.isMapped())
-          index.unmap();
-
   int locn = cells.len();
   index.add((unsigned char*)&locn,sizeof(int));
   unsigned char flags = previousWrapped ? 0x01 : 0x00;
@@ -288,6 +294,7 @@ HistoryScrollBuffer::HistoryScrollBuffer(unsigned int maxLineCount)
    ,_maxLineCount(0)
    ,_usedLines(0)
    ,_head(0)
+   ,_cellBytes(0)
 {
   setMaxNbLines(maxLineCount);
 }
@@ -308,7 +315,9 @@ void HistoryScrollBuffer::addCellsVector(const QVector<Character>& cells)
         _head = 0;
     }
 
-    _historyBuffer[bufferIndex(_usedLines-1)] = cells;
+    HistoryLine& line = _historyBuffer[bufferIndex(_usedLines-1)];
+    _cellBytes += qint64(cells.size() - line.size()) * qint64(sizeof(Character));
+    line = cells;
     _wrappedLine[bufferIndex(_usedLines-1)] = false;
 }
 void HistoryScrollBuffer::addCells(const Character a[], int count)
@@ -396,10 +405,59 @@ void HistoryScrollBuffer::setMaxNbLines(unsigned int lineCount)
     _historyBuffer = newBuffer;
     delete[] oldBuffer;
 
+    _cellBytes = 0;
+    for ( int i = 0 ; i < _usedLines ; i++ )
+        _cellBytes += qint64(_historyBuffer[i].size()) * sizeof(Character);
+
     _wrappedLine.resize(lineCount);
     dynamic_cast<HistoryTypeBuffer*>(m_histType)->m_nbLines = lineCount;
 }
 
+qint64 HistoryScrollBuffer::memoryUsage()
+{
+    return qint64(_maxLineCount) * sizeof(HistoryLine) + _cellBytes;
+}
+
+int HistoryScrollBuffer::reduceMemoryUsage(qint64 maximum)
+{
+    // the slots for the lines are always there, only the lines can go
+    qint64 usage = memoryUsage();
+    int lineCount = _usedLines;
+    while ( lineCount > 0 && usage > maximum )
+    {
+        usage -= qint64(_historyBuffer[bufferIndex(_usedLines-lineCount)].size()) * sizeof(Character);
+        lineCount--;
+    }
+
+    const int dropped = _usedLines - lineCount;
+    if ( dropped > 0 )
+        keepNewestLines(lineCount);
+    return dropped;
+}
+
+void HistoryScrollBuffer::keepNewestLines(int lineCount)
+{
+    Q_ASSERT( lineCount < _maxLineCount );
+
+    HistoryLine* newBuffer = new HistoryLine[_maxLineCount];
+    QBitArray newWrappedLine(_maxLineCount);
+    const int first = _usedLines - lineCount;
+
+    _cellBytes = 0;
+    for ( int i = 0 ; i < lineCount ; i++ )
+    {
+        newBuffer[i] = _historyBuffer[bufferIndex(first+i)];
+        newWrappedLine[i] = _wrappedLine[bufferIndex(first+i)];
+        _cellBytes += qint64(newBuffer[i].size()) * sizeof(Character);
+    }
+
+    delete[] _historyBuffer;
+    _historyBuffer = newBuffer;
+    _wrappedLine = newWrappedLine;
+    _usedLines = lineCount;
+    _head = _usedLines-1;
+}
+
 int HistoryScrollBuffer::bufferIndex(int lineNumber)
 {
     Q_ASSERT( lineNumber >= 0 );
@@ -560,6 +618,7 @@ void* CompactHistoryBlockList::allocate(size_t size)
   {
     block = new CompactHistoryBlock();
     list.append ( block );
+    _memoryUsage += block->length();
     //kDebug() << "new block created, remaining " << block->remaining() << "number of blocks=" << list.size();
   }
   else
@@ -589,6 +648,7 @@ void CompactHistoryBlockList::deallocate(void* ptr)
   if (!block->isInUse())
   {
     list.removeAt(i);
+    _memoryUsage -= block->length();
     delete block;
     //kDebug() << "block deleted, new size = " << list.size();
   }
@@ -630,7 +690,7 @@ CompactHistoryLine::CompactHistoryLine ( const TextLine& line, CompactHistoryBlo
     //kDebug() << "number of different formats in string: " << formatLength;
     formatArray = (CharacterFormat*) blockList.allocate(sizeof(CharacterFormat)*formatLength);
     Q_ASSERT (formatArray!=nullptr);
-    text = (quint16*) blockList.allocate(sizeof(quint16)*line.size());
+    text = (uint*) blockList.allocate(sizeof(uint)*line.size());
     Q_ASSERT (text!=nullptr);
 
     length=line.size();
@@ -676,6 +736,17 @@ CompactHistoryLine::~CompactHistoryLine()
   blockList.deallocate(this);
 }
 
+inline void CompactHistoryLine::setCharacter ( int index, const CharacterFormat& format, Character &r ) const
+{
+  r.character = text[index];
+  r.rendition = format.rendition;
+  r.foregroundColor = format.fgColor;
+  r.backgroundColor = format.bgColor;
+  // the placeholders for the second half of double width characters are
+  // the only characters without a value, so they are not kept in the format
+  r.isRealCharacter = text[index] != 0 || (format.rendition & RE_EXTENDED_CHAR);
+}
+
 void CompactHistoryLine::getCharacter ( int index, Character &r )
 {
   Q_ASSERT ( index < length );
@@ -683,11 +754,7 @@ void CompactHistoryLine::getCharacter ( int index, Character &r )
   while ( ( formatPos+1 ) < formatLength && index >= formatArray[formatPos+1].startPos )
     formatPos++;
 
-  r.character=text[index];
-  r.rendition = formatArray[formatPos].rendition;
-  r.foregroundColor = formatArray[formatPos].fgColor;
-  r.backgroundColor = formatArray[formatPos].bgColor;
-  r.isRealCharacter = formatArray[formatPos].isRealCharacter;
+  setCharacter ( index, formatArray[formatPos], r );
 }
 
 void CompactHistoryLine::getCharacters ( Character* array, int length, int startColumn )
@@ -695,9 +762,19 @@ void CompactHistoryLine::getCharacters ( Character* array, int length, int start
   Q_ASSERT ( startColumn >= 0 && length >= 0 );
   Q_ASSERT ( startColumn+length <= ( int ) getLength() );
 
+  if ( length == 0 )
+    return;
+
+  // look up the format of the first character once, then follow the runs
+  int formatPos=0;
+  while ( ( formatPos+1 ) < formatLength && startColumn >= formatArray[formatPos+1].startPos )
+    formatPos++;
+
   for ( int i=startColumn; i<length+startColumn; i++ )
   {
-    getCharacter ( i, array[i-startColumn] );
+    if ( ( formatPos+1 ) < formatLength && i >= formatArray[formatPos+1].startPos )
+      formatPos++;
+    setCharacter ( i, formatArray[formatPos], array[i-startColumn] );
   }
 }
 
@@ -718,13 +795,18 @@ CompactHistoryScroll::~CompactHistoryScroll()
 
 void CompactHistoryScroll::addCellsVector ( const TextLine& cells )
 {
-  CompactHistoryLine *line;
-  line = new(blockList) CompactHistoryLine ( cells, blockList );
+  // the line would be dropped again right away
+  if ( _maxLineCount == 0 )
+    return;
 
-  if ( lines.size() > ( int ) _maxLineCount )
+  // make room first, so the slab of the oldest line can be reused
+  while ( !lines.isEmpty() && lines.size() >= ( int ) _maxLineCount )
   {
     delete lines.takeAt ( 0 );
   }
+
+  CompactHistoryLine *line;
+  line = new(blockList) CompactHistoryLine ( cells, blockList );
   lines.append ( line );
 }
 
@@ -737,6 +819,9 @@ void CompactHistoryScroll::addCells ( const Character a[], int count )
 
 void CompactHistoryScroll::addLine ( bool previousWrapped )
 {
+  if ( lines.isEmpty() )
+    return;
+
   CompactHistoryLine *line = lines.last();
   //kDebug() << "last line at address " << line;
   line->setWrapped(previousWrapped);
@@ -776,12 +861,635 @@ void CompactHistoryScroll::setMaxNbLines ( unsigned int lineCount )
   //kDebug() << "set max lines to: " << _maxLineCount;
 }
 
+qint64 CompactHistoryScroll::memoryUsage()
+{
+  return blockList.memoryUsage() + qint64 ( lines.size() ) * sizeof ( CompactHistoryLine* );
+}
+
+int CompactHistoryScroll::reduceMemoryUsage ( qint64 maximum )
+{
+  // lines are allocated in order, so dropping the oldest lines releases
+  // the blocks one after the other
+  int dropped = 0;
+  while ( !lines.isEmpty() && memoryUsage() > maximum )
+  {
+    delete lines.takeAt ( 0 );
+    dropped++;
+  }
+  return dropped;
+}
+
 bool CompactHistoryScroll::isWrappedLine ( int lineNumber )
 {
   Q_ASSERT ( lineNumber < lines.size() );
   return lines[lineNumber]->isWrapped();
 }
 
+////////////////////////////////////////////////////////////////
+// Tiered History Scroll ///////////////////////////////////////
+////////////////////////////////////////////////////////////////
+
+/*
+   Lines enter the history as they are ("hot" lines).  Once the hot
+   lines use more than a quarter of the memory limit, the oldest
+   BLOCK_LINES of them are packed into a block:
+
+     for each line:  length, wrapped flag, runs
+     for each run:   run length, format, character values
+
+   where the format is a Character with its value cleared and the
+   values are stored as varints, so plain ASCII takes one byte per
+   cell.  The block is then compressed with zlib.
+
+   When the compressed blocks use more than the rest of the memory
+   limit, the oldest ones are moved to a temporary file which is
+   mapped again to read them.  Reading a compressed line decompresses
+   its whole block, the last few blocks are kept decompressed since
+   the history is usually read in sequence.
+*/
+
+static void appendVarint(QByteArray& out, quint32 value)
+{
+  while (value >= 0x80) {
+    out.append(char(value | 0x80));
+    value >>= 7;
+  }
+  out.append(char(value));
+}
+
+static bool readVarint(const uchar*& in, const uchar* end, quint32& value)
+{
+  value = 0;
+  for (int shift = 0; in < end && shift < 32; shift += 7) {
+    const uchar byte = *in++;
+    value |= quint32(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+static bool sameFormat(const Character& a, const Character& b)
+{
+  return a.equalsFormat(b) && a.isRealCharacter == b.isRealCharacter;
+}
+
+static void encodeLine(QByteArray& out, const QVector<Character>& cells, bool wrapped)
+{
+  const int length = cells.size();
+  appendVarint(out, length);
+  out.append(char(wrapped));
+
+  int start = 0;
+  while (start < length) {
+    int end = start + 1;
+    while (end < length && sameFormat(cells[end], cells[start]))
+      end++;
+
+    Character format = cells[start];
+    format.character = 0;
+    appendVarint(out, end - start);
+    out.append(reinterpret_cast<const char*>(&format), sizeof(Character));
+    for (int i = start; i < end; i++)
+      appendVarint(out, cells[i].character);
+    start = end;
+  }
+}
+
+static bool decodeLine(const uchar*& in, const uchar* end, QVector<Character>& cells, bool& wrapped)
+{
+  quint32 length;
+  if (!readVarint(in, end, length) || in >= end)
+    return false;
+  wrapped = *in++;
+
+  cells.resize(length);
+  quint32 position = 0;
+  while (position < length) {
+    quint32 runLength;
+    if (!readVarint(in, end, runLength) || runLength > length - position
+        || end - in < int(sizeof(Character)))
+      return false;
+
+    Character format;
+    memcpy(static_cast<void*>(&format), in, sizeof(Character));
+    in += sizeof(Character);
+    for (quint32 i = 0; i < runLength; i++) {
+      quint32 value;
+      if (!readVarint(in, end, value))
+        return false;
+      format.character = value;
+      cells[position++] = format;
+    }
+  }
+  return true;
+}
+
+TieredHistoryScroll::TieredHistoryScroll(unsigned int maxLineCount, qint64 memoryLimit)
+  : HistoryScroll(new TieredHistoryType(maxLineCount, memoryLimit))
+   ,_droppedBlockLines(0)
+   ,_nextSerial(0)
+   ,_hotBytes(0)
+   ,_compressedBytes(0)
+   ,_spillFileSize(0)
+   ,_spillFailed(false)
+   ,_maxLineCount(maxLineCount)
+   ,_memoryLimit(memoryLimit)
+{
+}
+
+TieredHistoryScroll::~TieredHistoryScroll()
+{
+}
+
+int TieredHistoryScroll::compressedLines() const
+{
+  return _blocks.size() * BLOCK_LINES - _droppedBlockLines;
+}
+
+int TieredHistoryScroll::getLines()
+{
+  return compressedLines() + _hotLines.size();
+}
+
+const TieredHistoryScroll::HotLine& TieredHistoryScroll::hotLine(int lineNumber)
+{
+  return _hotLines.at(lineNumber - compressedLines());
+}
+
+const TieredHistoryScroll::DecodedBlock& TieredHistoryScroll::decodedBlock(int blockIndex)
+{
+  const Block& block = _blocks.at(blockIndex);
+  for (int i = 0; i < _decodedBlocks.size(); i++) {
+    if (_decodedBlocks.at(i).serial == block.serial) {
+      if (i > 0)
+        _decodedBlocks.move(i, 0);
+      return _decodedBlocks.first();
+    }
+  }
+
+  QByteArray data = block.data;
+  if (block.fileOffset >= 0) {
+    uchar* map = _spillFile.map(block.fileOffset, block.fileSize);
+    if (map) {
+      data = QByteArray(reinterpret_cast<const char*>(map), block.fileSize);
+      _spillFile.unmap(map);
+    } else {
+      qWarning() << "TieredHistoryScroll: cannot map history file" << _spillFile.errorString();
+    }
+  }
+
+  DecodedBlock decoded;
+  decoded.serial = block.serial;
+  decoded.lines.resize(BLOCK_LINES);
+
+  const QByteArray raw = qUncompress(data);
+  const uchar* in = reinterpret_cast<const uchar*>(raw.constData());
+  const uchar* end = in + raw.size();
+  for (int i = 0; i < BLOCK_LINES; i++) {
+    bool wrapped = false;
+    if (!decodeLine(in, end, decoded.lines[i], wrapped)) {
+      // damaged block, leave the remaining lines empty
+      decoded.lines[i].clear();
+      break;
+    }
+  }
+
+  if (_decodedBlocks.size() >= DECODED_BLOCKS)
+    _decodedBlocks.removeLast();
+  _decodedBlocks.prepend(decoded);
+  return _decodedBlocks.first();
+}
+
+int TieredHistoryScroll::getLineLen(int lineNumber)
+{
+  Q_ASSERT( lineNumber >= 0 && lineNumber < getLines() );
+
+  if (lineNumber >= compressedLines())
+    return hotLine(lineNumber).cells.size();
+
+  const int position = lineNumber + _droppedBlockLines;
+  return _blocks.at(position / BLOCK_LINES).lengths.at(position % BLOCK_LINES);
+}
+
+bool TieredHistoryScroll::isWrappedLine(int lineNumber)
+{
+  if (lineNumber < 0 || lineNumber >= getLines())
+    return false;
+
+  if (lineNumber >= compressedLines())
+    return hotLine(lineNumber).wrapped;
+
+  const int position = lineNumber + _droppedBlockLines;
+  return _blocks.at(position / BLOCK_LINES).wrapped.testBit(position % BLOCK_LINES);
+}
+
+void TieredHistoryScroll::getCells(int lineNumber, int startColumn, int count, Character buffer[])
+{
+  if ( count == 0 ) return;
+
+  Q_ASSERT( lineNumber >= 0 && lineNumber < getLines() );
+
+  const HistoryLine* line;
+  if (lineNumber >= compressedLines()) {
+    line = &hotLine(lineNumber).cells;
+  } else {
+    const int position = lineNumber + _droppedBlockLines;
+    line = &decodedBlock(position / BLOCK_LINES).lines.at(position % BLOCK_LINES);
+  }
+
+  // only a damaged block can be shorter than the length it reported
+  const int available = qBound(0, line->size() - startColumn, count);
+  if (available < count)
+    memset(static_cast<void*>(buffer), 0, count * sizeof(Character));
+  if (available > 0)
+    memcpy(buffer, line->constData() + startColumn, available * sizeof(Character));
+}
+
+void TieredHistoryScroll::addCellsVector(const QVector<Character>& cells)
+{
+  HotLine line;
+  line.cells = cells;
+  line.wrapped = false;
+  _hotLines.append(line);
+  _hotBytes += cells.size() * sizeof(Character) + sizeof(HotLine);
+
+  enforceLimits();
+}
+
+void TieredHistoryScroll::addCells(const Character a[], int count)
+{
+  HistoryLine newLine(count);
+  std::copy(a,a+count,newLine.begin());
+
+  addCellsVector(newLine);
+}
+
+void TieredHistoryScroll::addLine(bool previousWrapped)
+{
+  if (!_hotLines.isEmpty())
+    _hotLines.last().wrapped = previousWrapped;
+}
+
+void TieredHistoryScroll::compressOldestLines()
+{
+  Block block;
+  block.lengths.resize(BLOCK_LINES);
+  block.wrapped.resize(BLOCK_LINES);
+
+  QByteArray raw;
+  for (int i = 0; i < BLOCK_LINES; i++) {
+    const HotLine line = _hotLines.takeFirst();
+    _hotBytes -= line.cells.size() * sizeof(Character) + sizeof(HotLine);
+    encodeLine(raw, line.cells, line.wrapped);
+    block.lengths[i] = line.cells.size();
+    block.wrapped.setBit(i, line.wrapped);
+  }
+
+  block.serial = _nextSerial++;
+  block.data = qCompress(raw, 1);
+  block.fileOffset = -1;
+  block.fileSize = 0;
+  _compressedBytes += block.data.size();
+  _blocks.append(block);
+}
+
+bool TieredHistoryScroll::spillBlock(Block& block)
+{
+  if (_spillFailed)
+    return false;
+
+  if (!_spillFile.isOpen() && !_spillFile.open()) {
+    qWarning() << "TieredHistoryScroll: cannot create history file" << _spillFile.errorString();
+    _spillFailed = true;
+    return false;
+  }
+
+  if (!_spillFile.seek(_spillFileSize)
+      || _spillFile.write(block.data) != block.data.size()
+      || !_spillFile.flush()) {
+    qWarning() << "TieredHistoryScroll: cannot write history file" << _spillFile.errorString();
+    _spillFailed = true;
+    return false;
+  }
+
+  block.fileOffset = _spillFileSize;
+  block.fileSize = block.data.size();
+  _spillFileSize += block.fileSize;
+  _compressedBytes -= block.data.size();
+  block.data = QByteArray();
+  return true;
+}
+
+void TieredHistoryScroll::dropOldestLine()
+{
+  if (_blocks.isEmpty()) {
+    const HotLine line = _hotLines.takeFirst();
+    _hotBytes -= line.cells.size() * sizeof(Character) + sizeof(HotLine);
+    return;
+  }
+
+  if (++_droppedBlockLines < BLOCK_LINES)
+    return;
+
+  // the whole block is gone, its space in the file is not reused
+  const Block block = _blocks.takeFirst();
+  _compressedBytes -= block.data.size();
+  for (int i = 0; i < _decodedBlocks.size(); i++) {
+    if (_decodedBlocks.at(i).serial == block.serial) {
+      _decodedBlocks.removeAt(i);
+      break;
+    }
+  }
+  _droppedBlockLines = 0;
+}
+
+void TieredHistoryScroll::enforceLimits()
+{
+  if (_maxLineCount > 0) {
+    while (getLines() > (int) _maxLineCount)
+      dropOldestLine();
+  }
+
+  // a quarter of the memory is for the hot lines, the rest for the
+  // compressed blocks which have not been moved to the file yet
+  const qint64 hotLimit = _memoryLimit / 4;
+  while (_hotLines.size() >= 2 * BLOCK_LINES && _hotBytes > hotLimit)
+    compressOldestLines();
+
+  for (int i = 0; i < _blocks.size() && _compressedBytes > _memoryLimit - hotLimit; i++) {
+    Block& block = _blocks[i];
+    if (block.fileOffset < 0 && !spillBlock(block))
+      break;
+  }
+}
+
+int TieredHistoryScroll::reduceMemoryUsage(qint64 maximum)
+{
+  // compressing the lines and moving the blocks to the file keeps all of
+  // them; the last lines which do not fill a block stay as they are
+  while (_hotLines.size() >= BLOCK_LINES && memoryUsage() > maximum)
+    compressOldestLines();
+
+  for (int i = 0; i < _blocks.size() && memoryUsage() > maximum; i++) {
+    Block& block = _blocks[i];
+    if (block.fileOffset < 0 && !spillBlock(block))
+      break;
+  }
+  _decodedBlocks.clear();
+
+  // only when the file cannot be written are lines lost
+  int dropped = 0;
+  while (_compressedBytes > 0 && memoryUsage() > maximum) {
+    dropOldestLine();
+    dropped++;
+  }
+  return dropped;
+}
+
+void TieredHistoryScroll::setMaxNbLines(unsigned int lineCount)
+{
+  _maxLineCount = lineCount;
+  static_cast<TieredHistoryType*>(m_histType)->m_nbLines = lineCount;
+  enforceLimits();
+}
+
+void TieredHistoryScroll::setMemoryLimit(qint64 bytes)
+{
+  _memoryLimit = bytes;
+  static_cast<TieredHistoryType*>(m_histType)->m_memoryLimit = bytes;
+  enforceLimits();
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Reflowed history
+//////////////////////////////////////////////////////////////////////
+
+HistoryReflow::HistoryReflow()
+  : _history(nullptr)
+   ,_columns(0)
+   ,_firstLogicalLine(0)
+   ,_storedLineCount(0)
+   ,_reflowedLineCount(0)
+   ,_droppedStoredLines(0)
+   ,_droppedReflowedLines(0)
+   ,_cachedLine(-1)
+{
+}
+
+void HistoryReflow::setHistory(HistoryScroll* history)
+{
+  _history = history;
+
+  // the new history may hold fewer lines, or none at all
+  if (isActive())
+    reflow(_columns);
+}
+
+void HistoryReflow::reflow(int columns)
+{
+  reset();
+
+  const int lineCount = _history->getLines();
+  if (lineCount == 0 || columns <= 0)
+    return;
+
+  _columns = columns;
+  _logicalLines.reserve(lineCount);
+
+  int reflowedLine = 0;
+  int line = 0;
+  while (line < lineCount) {
+    LogicalLine logical;
+    logical.firstLine = line;
+    logical.length = 0;
+    logical.firstReflowedLine = reflowedLine;
+
+    bool wrapped;
+    do {
+      logical.length += _history->getLineLen(line);
+      wrapped = _history->isWrappedLine(line);
+      line++;
+    } while (wrapped && line < lineCount);
+    logical.wrapped = wrapped;
+
+    reflowedLine += segmentCount(logical.length);
+    _logicalLines.append(logical);
+  }
+
+  _storedLineCount = lineCount;
+  _reflowedLineCount = reflowedLine;
+}
+
+void HistoryReflow::reset()
+{
+  _columns = 0;
+  _logicalLines.clear();
+  _firstLogicalLine = 0;
+  _storedLineCount = 0;
+  _reflowedLineCount = 0;
+  _droppedStoredLines = 0;
+  _droppedReflowedLines = 0;
+  _cachedLine = -1;
+  _cachedCells.clear();
+}
+
+void HistoryReflow::dropLines(int count)
+{
+  if (!isActive() || count <= 0)
+    return;
+
+  _droppedStoredLines += count;
+  if (_droppedStoredLines >= _storedLineCount) {
+    // only lines added after the reflow are left
+    reset();
+    return;
+  }
+
+  // a logical line goes together with its first stored line, the rest of
+  // its lines are not shown any more
+  while (_firstLogicalLine < _logicalLines.size()
+         && _logicalLines.at(_firstLogicalLine).firstLine < _droppedStoredLines)
+    _firstLogicalLine++;
+
+  if (_firstLogicalLine < _logicalLines.size())
+    _droppedReflowedLines = _logicalLines.at(_firstLogicalLine).firstReflowedLine;
+  else
+    _droppedReflowedLines = _reflowedLineCount;
+
+  // release the dropped entries now and then
+  if (_firstLogicalLine > 1024 && _firstLogicalLine > _logicalLines.size() / 2) {
+    _logicalLines.remove(0, _firstLogicalLine);
+    _firstLogicalLine = 0;
+  }
+}
+
+int HistoryReflow::getLines() const
+{
+  if (!isActive())
+    return _history->getLines();
+
+  // the lines added since the reflow are shown as they are stored
+  return reflowedLines() + _history->getLines() - (_storedLineCount - _droppedStoredLines);
+}
+
+int HistoryReflow::logicalLineAt(int lineno) const
+{
+  Q_ASSERT( lineno >= 0 && lineno < reflowedLines() );
+
+  const int reflowedLine = lineno + _droppedReflowedLines;
+  QVector<LogicalLine>::const_iterator it =
+      std::upper_bound(_logicalLines.constBegin() + _firstLogicalLine, _logicalLines.constEnd(), reflowedLine,
+                       [](int line, const LogicalLine& logical) { return line < logical.firstReflowedLine; });
+  return int(it - _logicalLines.constBegin()) - 1;
+}
+
+int HistoryReflow::logicalLineOfStoredLine(int lineno) const
+{
+  QVector<LogicalLine>::const_iterator it =
+      std::upper_bound(_logicalLines.constBegin() + _firstLogicalLine, _logicalLines.constEnd(), lineno,
+                       [](int line, const LogicalLine& logical) { return line < logical.firstLine; });
+  return int(it - _logicalLines.constBegin()) - 1;
+}
+
+int HistoryReflow::firstLineOfStoredLine(int lineno) const
+{
+  if (!isActive())
+    return lineno;
+
+  const int line = lineno + _droppedStoredLines;
+  if (line >= _storedLineCount)
+    return reflowedLines() + line - _storedLineCount;
+
+  const int index = logicalLineOfStoredLine(line);
+  if (index < _firstLogicalLine)
+    return 0;
+  return _logicalLines.at(index).firstReflowedLine - _droppedReflowedLines;
+}
+
+int HistoryReflow::lastLineOfStoredLine(int lineno) const
+{
+  if (!isActive())
+    return lineno;
+
+  const int line = lineno + _droppedStoredLines;
+  if (line >= _storedLineCount)
+    return reflowedLines() + line - _storedLineCount;
+
+  const int index = logicalLineOfStoredLine(line);
+  if (index < _firstLogicalLine)
+    return -1;
+  const LogicalLine& logical = _logicalLines.at(index);
+  return logical.firstReflowedLine + segmentCount(logical.length) - 1 - _droppedReflowedLines;
+}
+
+const QVector<Character>& HistoryReflow::logicalLineCells(int index) const
+{
+  const LogicalLine& logical = _logicalLines.at(index);
+  if (_cachedLine == logical.firstLine)
+    return _cachedCells;
+
+  const int endLine = (index + 1 < _logicalLines.size()) ? _logicalLines.at(index + 1).firstLine
+                                                          : _storedLineCount;
+  _cachedCells.resize(logical.length);
+  int position = 0;
+  for (int line = logical.firstLine; line < endLine; line++) {
+    const int storedLine = line - _droppedStoredLines;
+    const int length = _history->getLineLen(storedLine);
+    _history->getCells(storedLine, 0, length, _cachedCells.data() + position);
+    position += length;
+  }
+  _cachedLine = logical.firstLine;
+  return _cachedCells;
+}
+
+int HistoryReflow::getLineLen(int lineno) const
+{
+  if (!isActive())
+    return _history->getLineLen(lineno);
+  if (lineno >= reflowedLines())
+    return _history->getLineLen(storedLine(lineno));
+
+  const LogicalLine& logical = _logicalLines.at(logicalLineAt(lineno));
+  const int offset = (lineno + _droppedReflowedLines - logical.firstReflowedLine) * _columns;
+  return qMin(_columns, logical.length - offset);
+}
+
+bool HistoryReflow::isWrappedLine(int lineno) const
+{
+  if (!isActive())
+    return _history->isWrappedLine(lineno);
+  if (lineno >= reflowedLines())
+    return _history->isWrappedLine(storedLine(lineno));
+
+  const LogicalLine& logical = _logicalLines.at(logicalLineAt(lineno));
+  const int segment = lineno + _droppedReflowedLines - logical.firstReflowedLine;
+  return segment < segmentCount(logical.length) - 1 || logical.wrapped;
+}
+
+void HistoryReflow::getCells(int lineno, int colno, int count, Character res[]) const
+{
+  if (!isActive()) {
+    _history->getCells(lineno, colno, count, res);
+    return;
+  }
+  if (lineno >= reflowedLines()) {
+    _history->getCells(storedLine(lineno), colno, count, res);
+    return;
+  }
+  if (count == 0)
+    return;
+
+  const int index = logicalLineAt(lineno);
+  const LogicalLine& logical = _logicalLines.at(index);
+  const int offset = (lineno + _droppedReflowedLines - logical.firstReflowedLine) * _columns;
+
+  const QVector<Character>& cells = logicalLineCells(index);
+  Q_ASSERT( offset + colno + count <= cells.size() );
+  memcpy(res, cells.constData() + offset + colno, count * sizeof(Character));
+}
+
 
 //////////////////////////////////////////////////////////////////////
 // History Types
@@ -981,7 +1689,84 @@ HistoryScroll* CompactHistoryType::scroll ( HistoryScroll *old ) const
       oldBuffer->setMaxNbLines ( m_nbLines );
       return oldBuffer;
     }
+
+    // keep the lines of the old history
+    HistoryScroll *newScroll = new CompactHistoryScroll ( m_nbLines );
+    int lines = old->getLines();
+    int startLine = 0;
+    if ( lines > ( int ) m_nbLines )
+      startLine = lines - m_nbLines;
+
+    QVector<Character> line;
+    for ( int i = startLine; i < lines; i++ )
+    {
+      line.resize ( old->getLineLen ( i ) );
+      old->getCells ( i, 0, line.size(), line.data() );
+      newScroll->addCellsVector ( line );
+      newScroll->addLine ( old->isWrappedLine ( i ) );
+    }
     delete old;
+    return newScroll;
   }
   return new CompactHistoryScroll ( m_nbLines );
 }
+
+//////////////////////////////
+
+TieredHistoryType::TieredHistoryType(unsigned int nbLines, qint64 memoryLimit)
+  : m_nbLines(nbLines)
+  , m_memoryLimit(memoryLimit)
+{
+}
+
+bool TieredHistoryType::isEnabled() const
+{
+  return true;
+}
+
+int TieredHistoryType::maximumLineCount() const
+{
+  return m_nbLines;
+}
+
+qint64 TieredHistoryType::memoryLimit() const
+{
+  return m_memoryLimit;
+}
+
+HistoryScroll* TieredHistoryType::scroll(HistoryScroll *old) const
+{
+  TieredHistoryScroll *tieredScroll = dynamic_cast<TieredHistoryScroll*>(old);
+  if (tieredScroll)
+  {
+    tieredScroll->setMaxNbLines(m_nbLines);
+    tieredScroll->setMemoryLimit(m_memoryLimit);
+    return tieredScroll;
+  }
+
+  HistoryScroll *newScroll = new TieredHistoryScroll(m_nbLines, m_memoryLimit);
+
+  Character line[LINE_SIZE];
+  int lines = (old != nullptr) ? old->getLines() : 0;
+  for(int i = 0; i < lines; i++)
+  {
+     int size = old->getLineLen(i);
+     if (size > LINE_SIZE)
+     {
+        Character *tmp_line = new Character[size];
+        old->getCells(i, 0, size, tmp_line);
+        newScroll->addCells(tmp_line, size);
+        newScroll->addLine(old->isWrappedLine(i));
+        delete [] tmp_line;
+     }
+     else
+     {
+        old->getCells(i, 0, size, line);
+        newScroll->addCells(line, size);
+        newScroll->addLine(old->isWrappedLine(i));
+     }
+  }
+
+  delete old;
+  return newScroll;
+}
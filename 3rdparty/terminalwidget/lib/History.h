@@ -55,30 +55,27 @@ public:
   virtual void get(unsigned char* bytes, int len, int loc);
   virtual int  len();
 
-  //mmaps the file in read-only mode
-  void map();
-  //un-mmaps the file
+private:
+  //grows the file and its mapping to hold at least bytes bytes
+  bool reserve(qint64 bytes);
+  //unmaps the file, the data is read and written with pread() and pwrite() then
   void unmap();
-  //returns true if the file is mmap'ed
-  bool isMapped() const;
-
 
-private:
   int  ion;
   int  length;
   QTemporaryFile tmpFile;
 
-  //pointer to start of mmap'ed file data, or 0 if the file is not mmap'ed
+  //the file is mapped for reading and writing and grown in steps, so adding
+  //and getting data are plain copies.  fileMap is 0 if the file could not be
+  //mapped, then it is written and read with pwrite() and pread().
   char* fileMap;
+  //bytes of the file which are mapped
+  int capacity;
 
-  //incremented whenver 'add' is called and decremented whenever
-  //'get' is called.
-  //this is used to detect when a large number of lines are being read and processed from the history
-  //and automatically mmap the file for better performance (saves the overhead of many lseek-read calls).
-  int readWriteBalance;
-
-  //when readWriteBalance goes below this threshold, the file will be mmap'ed automatically
-  static const int MAP_THRESHOLD = -1000;
+  //the mapping starts with this size and doubles up to the step size,
+  //then grows by the step size
+  static const int MIN_CAPACITY = 64 * 1024;
+  static const int CAPACITY_STEP = 64 * 1024 * 1024;
 };
 #endif
 
@@ -117,6 +114,15 @@ public:
 
   virtual void addLine(bool previousWrapped=false) = 0;
 
+  // memory budget.
+  // Returns the number of bytes of memory used by the lines, histories
+  // kept on disk report 0.
+  virtual qint64 memoryUsage() { return 0; }
+  // Tries to bring the memory used down to maximum bytes, by compressing
+  // lines where possible and by dropping the oldest lines otherwise.
+  // Returns the number of lines dropped from the top of the history.
+  virtual int reduceMemoryUsage(qint64 maximum) { Q_UNUSED(maximum); return 0; }
+
   //
   // FIXME:  Passing around constant references to HistoryType instances
   // is very unsafe, because those references will no longer
@@ -179,18 +185,25 @@ public:
   void addCellsVector(const QVector<Character>& cells) override;
   void addLine(bool previousWrapped=false) override;
 
+  qint64 memoryUsage() override;
+  int reduceMemoryUsage(qint64 maximum) override;
+
   void setMaxNbLines(unsigned int nbLines);
   unsigned int maxNbLines() const { return _maxLineCount; }
 
 
 private:
   int bufferIndex(int lineNumber);
+  // drops all but the newest lineCount lines
+  void keepNewestLines(int lineCount);
 
   HistoryLine* _historyBuffer;
   QBitArray _wrappedLine;
   int _maxLineCount;
   int _usedLines;
   int _head;
+  // bytes used by the characters of the lines
+  qint64 _cellBytes;
 
   //QVector<histline*> m_histBuffer;
   //QBitArray m_wrappedLine;
@@ -280,13 +293,11 @@ public:
     rendition = c.rendition;
     fgColor = c.foregroundColor;
     bgColor = c.backgroundColor;
-    isRealCharacter = c.isRealCharacter;
   }
 
   CharacterColor fgColor, bgColor;
   quint16 startPos;
-  quint8 rendition;
-  bool isRealCharacter;
+  quint16 rendition;
 };
 
 class CompactHistoryBlock
@@ -295,16 +306,16 @@ public:
 
   CompactHistoryBlock(){
     blockLength = 4096*64; // 256kb
-    head = (quint8*) mmap(nullptr, blockLength, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
-    //head = (quint8*) malloc(blockLength);
-    Q_ASSERT(head != MAP_FAILED);
+    // blocks are released in the order they were allocated, so malloc
+    // can hand the space of the oldest block to the next one
+    head = (quint8*) malloc(blockLength);
+    Q_ASSERT(head != nullptr);
     tail = blockStart = head;
     allocCount=0;
   }
 
   virtual ~CompactHistoryBlock(){
-    //free(blockStart);
-    munmap(blockStart, blockLength);
+    free(blockStart);
   }
 
   virtual unsigned int remaining(){ return blockStart+blockLength-tail;}
@@ -324,14 +335,17 @@ private:
 
 class CompactHistoryBlockList {
 public:
-  CompactHistoryBlockList() {};
+  CompactHistoryBlockList() : _memoryUsage(0) {};
   ~CompactHistoryBlockList();
 
   void *allocate( size_t size );
   void deallocate(void *);
   int length() {return list.size();}
+  qint64 memoryUsage() const { return _memoryUsage; }
 private:
   QList<CompactHistoryBlock*> list;
+  // the length of all blocks in the list, kept as they come and go
+  qint64 _memoryUsage;
 };
 
 class CompactHistoryLine
@@ -351,10 +365,12 @@ public:
   virtual unsigned int getLength() const {return length;};
 
 protected:
+  void setCharacter(int index, const CharacterFormat& format, Character& r) const;
+
   CompactHistoryBlockList& blockList;
   CharacterFormat* formatArray;
   quint16 length;
-  quint16* text;
+  uint* text;
   quint16 formatLength;
   bool wrapped;
 };
@@ -376,6 +392,9 @@ public:
   void addCellsVector(const TextLine& cells) override;
   void addLine(bool previousWrapped=false) override;
 
+  qint64 memoryUsage() override;
+  int reduceMemoryUsage(qint64 maximum) override;
+
   void setMaxNbLines(unsigned int nbLines);
   unsigned int maxNbLines() const { return _maxLineCount; }
 
@@ -387,6 +406,175 @@ private:
   unsigned int _maxLineCount;
 };
 
+//////////////////////////////////////////////////////////////////////
+// Tiered history
+// Recent lines are kept as they are, older lines are packed into
+// compressed blocks and the oldest blocks are moved to a temporary
+// file once the memory limit is reached, so the history can grow
+// (almost) without limit.
+//////////////////////////////////////////////////////////////////////
+class TieredHistoryScroll : public HistoryScroll
+{
+public:
+  typedef QVector<Character> HistoryLine;
+
+  // maxNbLines is 0 for an unlimited history, memoryLimit in bytes
+  TieredHistoryScroll(unsigned int maxNbLines = 0, qint64 memoryLimit = DEFAULT_MEMORY_LIMIT);
+  ~TieredHistoryScroll() override;
+
+  int  getLines() override;
+  int  getLineLen(int lineno) override;
+  void getCells(int lineno, int colno, int count, Character res[]) override;
+  bool isWrappedLine(int lineno) override;
+
+  void addCells(const Character a[], int count) override;
+  void addCellsVector(const QVector<Character>& cells) override;
+  void addLine(bool previousWrapped=false) override;
+
+  // bytes used by the lines in memory, compressed or not
+  qint64 memoryUsage() override { return _hotBytes + _compressedBytes + _blocks.size() * BLOCK_INDEX_BYTES; }
+  int reduceMemoryUsage(qint64 maximum) override;
+
+  void setMaxNbLines(unsigned int nbLines);
+  unsigned int maxNbLines() const { return _maxLineCount; }
+
+  void setMemoryLimit(qint64 bytes);
+  qint64 memoryLimit() const { return _memoryLimit; }
+
+  static const qint64 DEFAULT_MEMORY_LIMIT = 32 * 1024 * 1024;
+
+private:
+  // number of lines packed together into a compressed block
+  static const int BLOCK_LINES = 256;
+  // number of decompressed blocks kept for reading
+  static const int DECODED_BLOCKS = 2;
+  // bytes used by the lengths and wrap flags kept for every block
+  static const int BLOCK_INDEX_BYTES = BLOCK_LINES * sizeof(int) + BLOCK_LINES / 8;
+
+  struct HotLine
+  {
+    HistoryLine cells;
+    bool wrapped;
+  };
+
+  struct Block
+  {
+    int serial;
+    // compressed lines, empty once the block has been moved to the file
+    QByteArray data;
+    qint64 fileOffset;
+    int fileSize;
+    // kept uncompressed, so the layout of the lines can be read without
+    // decoding the block, e.g. to reflow the history
+    QVector<int> lengths;
+    QBitArray wrapped;
+  };
+
+  struct DecodedBlock
+  {
+    int serial;
+    QVector<HistoryLine> lines;
+  };
+
+  int compressedLines() const;
+  const HotLine& hotLine(int lineNumber);
+  const DecodedBlock& decodedBlock(int blockIndex);
+  void compressOldestLines();
+  bool spillBlock(Block& block);
+  void enforceLimits();
+  void dropOldestLine();
+
+  QList<HotLine> _hotLines;
+  QList<Block> _blocks;
+  QList<DecodedBlock> _decodedBlocks;
+  // lines of the first block which have already been dropped
+  int _droppedBlockLines;
+  int _nextSerial;
+
+  qint64 _hotBytes;
+  qint64 _compressedBytes;
+  QTemporaryFile _spillFile;
+  qint64 _spillFileSize;
+  bool _spillFailed;
+
+  unsigned int _maxLineCount;
+  qint64 _memoryLimit;
+};
+
+//////////////////////////////////////////////////////////////////////
+// Reflowed history
+// Shows the lines of a history scroll split again at the width of the
+// screen.  When the width changes only the lengths and wrap flags of the
+// stored lines are read, the characters of a line are joined and split
+// when it is read, i.e. when it is scrolled into view.  Lines added after
+// the width changed are shown as they are stored.
+//////////////////////////////////////////////////////////////////////
+class HistoryReflow
+{
+public:
+  HistoryReflow();
+
+  void setHistory(HistoryScroll* history);
+
+  // splits the lines stored so far at columns
+  void reflow(int columns);
+  // shows all lines as they are stored again
+  void reset();
+  bool isActive() const { return _columns > 0; }
+
+  // to be called when the oldest count lines have been dropped from the history
+  void dropLines(int count);
+
+  // access to the lines, in the same way as HistoryScroll
+  int  getLines() const;
+  int  getLineLen(int lineno) const;
+  void getCells(int lineno, int colno, int count, Character res[]) const;
+  bool isWrappedLine(int lineno) const;
+
+  // first and last line showing the stored line lineno, the last one is
+  // before the first one if the stored line is not shown any more
+  int firstLineOfStoredLine(int lineno) const;
+  int lastLineOfStoredLine(int lineno) const;
+
+private:
+  // a line together with the lines it wraps onto
+  struct LogicalLine
+  {
+    int firstLine;          // first stored line, counted since the reflow
+    int length;
+    int firstReflowedLine;  // counted since the reflow
+    bool wrapped;           // the last stored line wraps onto the screen
+  };
+
+  int reflowedLines() const { return _reflowedLineCount - _droppedReflowedLines; }
+  // stored line shown on line lineno, for lines after the reflowed ones
+  int storedLine(int lineno) const { return lineno - reflowedLines() + _storedLineCount - _droppedStoredLines; }
+  int segmentCount(int length) const { return qMax(1, (length + _columns - 1) / _columns); }
+  // index in _logicalLines of the logical line shown on reflowed line lineno
+  int logicalLineAt(int lineno) const;
+  // index in _logicalLines of the logical line holding stored line lineno,
+  // counted since the reflow
+  int logicalLineOfStoredLine(int lineno) const;
+  const QVector<Character>& logicalLineCells(int index) const;
+
+  HistoryScroll* _history;
+  int _columns;
+
+  QVector<LogicalLine> _logicalLines;
+  // logical lines before it have been dropped
+  int _firstLogicalLine;
+  // stored lines covered by _logicalLines and their number of reflowed lines
+  int _storedLineCount;
+  int _reflowedLineCount;
+  // lines dropped from the history since the reflow
+  int _droppedStoredLines;
+  int _droppedReflowedLines;
+
+  // characters of the logical line read last
+  mutable int _cachedLine;
+  mutable QVector<Character> _cachedCells;
+};
+
 //////////////////////////////////////////////////////////////////////
 // History type
 //////////////////////////////////////////////////////////////////////
@@ -487,6 +675,26 @@ protected:
   unsigned int m_nbLines;
 };
 
+class TieredHistoryType : public HistoryType
+{
+    friend class TieredHistoryScroll;
+
+public:
+  // nbLines is 0 for an unlimited history, memoryLimit in bytes
+  TieredHistoryType(unsigned int nbLines = 0,
+                    qint64 memoryLimit = TieredHistoryScroll::DEFAULT_MEMORY_LIMIT);
+
+  bool isEnabled() const override;
+  int maximumLineCount() const override;
+  qint64 memoryLimit() const;
+
+  HistoryScroll* scroll(HistoryScroll *) const override;
+
+protected:
+  unsigned int m_nbLines;
+  qint64 m_memoryLimit;
+};
+
 
 #endif
 
@@ -0,0 +1,296 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// Own
+#include "HistoryExport.h"
+
+// System
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+// Qt
+#include <QDebug>
+#include <QTextStream>
+#include <QThread>
+
+// Konsole
+#include "Emulation.h"
+#include "TerminalCharacterDecoder.h"
+
+using namespace Konsole;
+
+// Lines which are read while the emulation is locked
+#define EXPORT_BLOCK_LINES 2000
+// Bytes written at once, a pipe which can be written to takes this many
+// without blocking
+#define WRITE_CHUNK_SIZE PIPE_BUF
+
+namespace Konsole
+{
+
+class HistoryExportThread : public QThread
+{
+public:
+    explicit HistoryExportThread(HistoryExport *historyExport)
+        : _historyExport(historyExport)
+    {
+    }
+
+protected:
+    void run() override
+    {
+        _historyExport->_success = _historyExport->exportLines();
+    }
+
+private:
+    HistoryExport *_historyExport;
+};
+
+}
+
+HistoryExport::HistoryExport(Emulation *emulation, QObject *parent)
+    : QObject(parent)
+    , _emulation(emulation)
+    , _thread(nullptr)
+    , _fd(-1)
+    , _format(PlainText)
+    , _success(false)
+{
+    _cancelPipe[0] = _cancelPipe[1] = -1;
+}
+
+HistoryExport::~HistoryExport()
+{
+    if (_thread != nullptr) {
+        // wakes up a write() which waits for the file, so the wait ends
+        cancel();
+        _thread->wait();
+        delete _thread;
+    }
+    if (_fd >= 0)
+        ::close(_fd);
+    for (int fd : _cancelPipe) {
+        if (fd >= 0)
+            ::close(fd);
+    }
+}
+
+bool HistoryExport::start(int fd, Format format, const ColorEntry *colorTable)
+{
+    if (isRunning())
+        return false;
+
+    const int ownFd = fd >= 0 ? ::dup(fd) : -1;
+    if (ownFd < 0) {
+        qWarning() << "Cannot export the history, invalid file descriptor" << fd;
+        return false;
+    }
+
+    if (_cancelPipe[0] < 0) {
+        if (::pipe(_cancelPipe) != 0) {
+            qWarning() << "Cannot export the history:" << qt_error_string(errno);
+            ::close(ownFd);
+            _cancelPipe[0] = _cancelPipe[1] = -1;
+            return false;
+        }
+        for (int fd : _cancelPipe) {
+            ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+            ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+    }
+    // the wake-ups of an earlier cancel()
+    char discarded[16];
+    while (::read(_cancelPipe[0], discarded, sizeof(discarded)) > 0) {
+    }
+
+    if (_thread == nullptr) {
+        _thread = new HistoryExportThread(this);
+        connect(_thread, SIGNAL(finished()), this, SLOT(threadFinished()));
+    }
+
+    _fd = ownFd;
+    _format = format;
+    for (int i = 0; i < TABLE_COLORS; i++)
+        _colorTable[i] = colorTable != nullptr ? colorTable[i] : base_color_table[i];
+    _cancelled.store(0);
+    _success = false;
+    _errorString.clear();
+    _thread->start();
+    return true;
+}
+
+void HistoryExport::cancel()
+{
+    _cancelled.store(1);
+    if (_cancelPipe[1] >= 0) {
+        const char wakeUp = 0;
+        // the pipe may be full of earlier wake-ups already, that is enough
+        ssize_t result;
+        do {
+            result = ::write(_cancelPipe[1], &wakeUp, 1);
+        } while (result < 0 && errno == EINTR);
+    }
+}
+
+bool HistoryExport::isRunning() const
+{
+    // the descriptor is closed once the thread has finished
+    return _fd >= 0;
+}
+
+QString HistoryExport::errorString() const
+{
+    return _errorString;
+}
+
+void HistoryExport::reportProgress(int percent)
+{
+    if (isRunning())
+        emit progress(percent);
+}
+
+void HistoryExport::threadFinished()
+{
+    if (::close(_fd) != 0 && _success)
+        _success = fail(qt_error_string(errno));
+    _fd = -1;
+    emit finished(_success);
+}
+
+bool HistoryExport::fail(const QString &error)
+{
+    qWarning() << "Cannot export the history:" << error;
+    _errorString = error;
+    return false;
+}
+
+bool HistoryExport::write(const QString &text)
+{
+    const QByteArray data = text.toUtf8();
+    const char *position = data.constData();
+    qint64 remaining = data.size();
+    while (remaining > 0) {
+        // a pipe or socket may not take the data for a long time, wait for
+        // it together with cancel() instead of blocking in write()
+        pollfd fds[2];
+        fds[0].fd = _fd;
+        fds[0].events = POLLOUT;
+        fds[1].fd = _cancelPipe[0];
+        fds[1].events = POLLIN;
+        if (::poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return fail(qt_error_string(errno));
+        }
+        if (fds[1].revents != 0 || _cancelled.load())
+            return false;
+
+        const ssize_t written = ::write(_fd, position, size_t(qMin(remaining, qint64(WRITE_CHUNK_SIZE))));
+        if (written < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return fail(qt_error_string(errno));
+        }
+        position += written;
+        remaining -= written;
+    }
+    return true;
+}
+
+bool HistoryExport::exportLines()
+{
+    int generation;
+    qint64 line;
+    qint64 endLine;
+    {
+        QMutexLocker locker(_emulation->screenLock());
+        generation = _emulation->historyGeneration();
+        // lines are counted from the first line of the history generation,
+        // so that they stay the same while old lines are dropped
+        line = _emulation->droppedHistoryLines();
+        endLine = line + _emulation->lineCount();
+    }
+    const qint64 firstLine = line;
+
+    QString text;
+    QTextStream stream(&text);
+
+    PlainTextDecoder plainTextDecoder;
+    AnsiDecoder ansiDecoder;
+    HTMLDecoder htmlDecoder;
+    TerminalCharacterDecoder *decoder;
+    switch (_format) {
+    case AnsiText:
+        decoder = &ansiDecoder;
+        break;
+    case Html:
+        htmlDecoder.setColorTable(_colorTable);
+        decoder = &htmlDecoder;
+        stream << QString::fromLatin1("<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n</head>\n"
+                                      "<body style=\"background-color:%1;color:%2\">\n")
+               .arg(_colorTable[DEFAULT_BACK_COLOR].color.name(), _colorTable[DEFAULT_FORE_COLOR].color.name());
+        break;
+    default:
+        decoder = &plainTextDecoder;
+        break;
+    }
+    decoder->begin(&stream);
+
+    int lastPercent = 0;
+    while (line < endLine) {
+        if (_cancelled.load())
+            return false;
+
+        {
+            QMutexLocker locker(_emulation->screenLock());
+            if (_emulation->historyGeneration() != generation)
+                return fail(tr("The output was reflowed or cleared while it was saved"));
+
+            const qint64 droppedLines = _emulation->droppedHistoryLines();
+            line = qMax(line, droppedLines);
+            const qint64 blockEndLine = qMin(qMin(line + EXPORT_BLOCK_LINES, endLine),
+                                             droppedLines + _emulation->lineCount());
+            if (line >= blockEndLine)
+                break;
+
+            _emulation->writeWholeLinesToStream(decoder, int(line - droppedLines), int(blockEndLine - droppedLines - 1));
+            line = blockEndLine;
+        }
+
+        stream.flush();
+        if (!write(text))
+            return false;
+        text.clear();
+
+        const int percent = int((line - firstLine) * 100 / qMax(endLine - firstLine, qint64(1)));
+        if (percent != lastPercent) {
+            lastPercent = percent;
+            QMetaObject::invokeMethod(this, "reportProgress", Qt::QueuedConnection, Q_ARG(int, percent));
+        }
+    }
+
+    decoder->end();
+    if (_format == Html)
+        stream << QLatin1String("\n</body>\n</html>\n");
+    stream.flush();
+    return write(text);
+}
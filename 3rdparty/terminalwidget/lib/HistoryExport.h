@@ -0,0 +1,120 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+#ifndef HISTORYEXPORT_H
+#define HISTORYEXPORT_H
+
+// Qt
+#include <QAtomicInt>
+#include <QObject>
+#include <QString>
+
+// Konsole
+#include "CharacterColor.h"
+
+class QThread;
+
+namespace Konsole
+{
+
+class Emulation;
+
+/**
+ * Writes the output of an emulation, the history and the screen, to a file
+ * on a worker thread.
+ *
+ * The lines are read a block at a time, so the emulation is only locked
+ * briefly and goes on with the output meanwhile.  Lines which leave the
+ * history before they are written are lost, lines added after the export
+ * started are left out.
+ */
+class HistoryExport : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum Format {
+        /** Text without colours */
+        PlainText,
+        /** Text with the escape sequences for the colours, e.g. for "less -R" */
+        AnsiText,
+        /** An HTML page */
+        Html
+    };
+
+    explicit HistoryExport(Emulation *emulation, QObject *parent = nullptr);
+    ~HistoryExport() override;
+
+    /**
+     * Starts writing the output to @p fd in @p format.  The descriptor is
+     * duplicated, the caller may close its own right away.  HTML is written
+     * with the colours of @p colorTable.
+     *
+     * Returns false if an export is running already or the descriptor is
+     * not valid.
+     */
+    bool start(int fd, Format format, const ColorEntry *colorTable);
+    /**
+     * Stops the running export, finished() follows once it has stopped.  A
+     * write which waits for the file to take more data is interrupted.
+     */
+    void cancel();
+    /** Returns true while an export is running. */
+    bool isRunning() const;
+    /**
+     * Returns why the last export failed, or an empty string if it
+     * succeeded or was cancelled.
+     */
+    QString errorString() const;
+
+signals:
+    /** Emitted when another percent of the lines has been written */
+    void progress(int percent);
+    /** Emitted when the export has ended, @p success is false if it was cancelled or failed */
+    void finished(bool success);
+
+private slots:
+    void reportProgress(int percent);
+    void threadFinished();
+
+private:
+    friend class HistoryExportThread;
+
+    // writes the lines, on the worker thread
+    bool exportLines();
+    bool write(const QString &text);
+    bool fail(const QString &error);
+
+    Emulation *_emulation;
+    QThread *_thread;
+    int _fd;
+    Format _format;
+    ColorEntry _colorTable[TABLE_COLORS];
+    QAtomicInt _cancelled;
+    // cancel() writes to the second descriptor to wake up write()
+    int _cancelPipe[2];
+    bool _success;
+    QString _errorString;
+
+    Q_DISABLE_COPY(HistoryExport)
+};
+
+}
+
+#endif // HISTORYEXPORT_H
@@ -0,0 +1,258 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// Own
+#include "HistoryIndex.h"
+
+// System
+#include <cstring>
+
+// Qt
+#include <QVarLengthArray>
+
+using namespace Konsole;
+
+static inline ushort foldCase(ushort unit)
+{
+    if (unit < 0x80)
+        return (unit >= 'A' && unit <= 'Z') ? unit + ('a' - 'A') : unit;
+    return QChar::toCaseFolded(unit);
+}
+
+static inline void appendFolded(QVarLengthArray<ushort, 1024> &text, uint character)
+{
+    if (QChar::requiresSurrogates(character)) {
+        text.append(QChar::highSurrogate(character));
+        text.append(QChar::lowSurrogate(character));
+    } else {
+        text.append(foldCase(ushort(character)));
+    }
+}
+
+// the text of a line as PlainTextDecoder writes it, which is what the
+// history search reads
+static void lineText(const Character *cells, int count, QVarLengthArray<ushort, 1024> &text)
+{
+    int realCharacterGuard = -1;
+    for (int i = count - 1; i >= 0; i--) {
+        if (cells[i].isRealCharacter && cells[i].character != '\n') {
+            realCharacterGuard = i;
+            break;
+        }
+    }
+
+    for (int i = 0; i < count;) {
+        const Character &cell = cells[i];
+        if (cell.rendition & RE_EXTENDED_CHAR) {
+            ushort length = 0;
+            const uint *chars = ExtendedCharTable::instance.lookupExtendedChar(cell.character, length);
+            if (chars != nullptr) {
+                for (int j = 0; j < length; j++)
+                    appendFolded(text, chars[j]);
+                i += qMax(1, Character::stringWidth(chars, length));
+            } else {
+                ++i;
+            }
+        } else if (cell.isRealCharacter || i <= realCharacterGuard) {
+            appendFolded(text, cell.character);
+            // nothing below U+1100 is double width
+            i += cell.character < 0x1100 ? 1 : qMax(1, cell.width());
+        } else {
+            ++i;
+        }
+    }
+}
+
+static inline uint trigramHash(ushort a, ushort b, ushort c)
+{
+    return ((uint(a) * 0x9E3779B1u) ^ (uint(b) * 0x85EBCA77u) ^ (uint(c) * 0xC2B2AE3Du)) * 0x27D4EB2Fu;
+}
+
+HistoryIndex::HistoryIndex()
+    : _lineCount(0)
+    , _droppedLines(0)
+    , _firstIndexedLine(0)
+    , _carryLength(0)
+{
+}
+
+HistoryIndex::~HistoryIndex()
+{
+    qDeleteAll(_blocks);
+}
+
+void HistoryIndex::reset(int unindexedLines)
+{
+    qDeleteAll(_blocks);
+    _blocks.clear();
+    _lineCount = unindexedLines;
+    _droppedLines = 0;
+    _firstIndexedLine = unindexedLines;
+    _carryLength = 0;
+}
+
+void HistoryIndex::addTrigram(Block *block, uint hash)
+{
+    // two bits per trigram
+    const uint first = hash >> 18;
+    const uint second = (hash >> 4) & (FILTER_WORDS * 64 - 1);
+    block->filter[first >> 6] |= Q_UINT64_C(1) << (first & 63);
+    block->filter[second >> 6] |= Q_UINT64_C(1) << (second & 63);
+}
+
+bool HistoryIndex::hasTrigram(const Block *block, uint hash)
+{
+    const uint first = hash >> 18;
+    const uint second = (hash >> 4) & (FILTER_WORDS * 64 - 1);
+    return (block->filter[first >> 6] & (Q_UINT64_C(1) << (first & 63)))
+           && (block->filter[second >> 6] & (Q_UINT64_C(1) << (second & 63)));
+}
+
+void HistoryIndex::addLine(const Character *cells, int count, bool wrapped)
+{
+    const int blockIndex = (_lineCount - _firstIndexedLine) / BLOCK_LINES;
+    if (blockIndex == _blocks.count()) {
+        Block *block = new Block;
+        memset(block->filter, 0, sizeof(block->filter));
+        _blocks.append(block);
+    }
+    Block *block = _blocks.at(blockIndex);
+
+    QVarLengthArray<ushort, 1024> text;
+    for (int i = 0; i < _carryLength; i++)
+        text.append(_carry[i]);
+    lineText(cells, count, text);
+
+    for (int i = 2; i < text.size(); i++)
+        addTrigram(block, trigramHash(text[i - 2], text[i - 1], text[i]));
+
+    _carryLength = 0;
+    if (wrapped) {
+        _carryLength = qMin(text.size(), 2);
+        for (int i = 0; i < _carryLength; i++)
+            _carry[i] = text[text.size() - _carryLength + i];
+    }
+    block->wrapped = wrapped;
+
+    // neighbouring cells mostly share their colors
+    int lastColor = -1;
+    for (int i = 0; i < count; i++) {
+        const int foreground = cells[i].foregroundColor.rgbIndex();
+        const int background = cells[i].backgroundColor.rgbIndex();
+        if (foreground >= 0 && foreground != lastColor)
+            block->rgbColors.insert(lastColor = foreground);
+        if (background >= 0 && background != lastColor)
+            block->rgbColors.insert(lastColor = background);
+    }
+
+    _lineCount++;
+}
+
+void HistoryIndex::dropLines(int count)
+{
+    if (count <= 0)
+        return;
+
+    _droppedLines += count;
+    while (!_blocks.isEmpty() && _firstIndexedLine + BLOCK_LINES <= _droppedLines) {
+        delete _blocks.takeFirst();
+        _firstIndexedLine += BLOCK_LINES;
+    }
+}
+
+QVector<uint> HistoryIndex::trigrams(const ushort *text, int length)
+{
+    QVector<uint> hashes;
+    for (int i = 2; i < length; i++) {
+        const uint hash = trigramHash(text[i - 2], text[i - 1], text[i]);
+        if (!hashes.contains(hash))
+            hashes.append(hash);
+    }
+    return hashes;
+}
+
+QVector<QPair<int, int> > HistoryIndex::candidateLines(const QString &text) const
+{
+    QVector<QPair<int, int> > lines;
+    if (_lineCount == _droppedLines)
+        return lines;
+
+    QVarLengthArray<ushort, 1024> folded;
+    for (int i = 0; i < text.size(); i++)
+        folded.append(foldCase(text.at(i).unicode()));
+    const QVector<uint> hashes = trigrams(folded.constData(), folded.size());
+
+    // lines are returned with the current numbering
+    if (hashes.isEmpty()) {
+        lines.append(qMakePair(0, _lineCount - _droppedLines - 1));
+        return lines;
+    }
+    if (_firstIndexedLine > _droppedLines)
+        lines.append(qMakePair(0, _firstIndexedLine - _droppedLines - 1));
+
+    // a match may start in one block and go on in the following ones if
+    // their lines wrap, though not further than its length
+    const int spannedBlocks = 1 + folded.size() / BLOCK_LINES;
+
+    for (int first = 0; first < _blocks.count(); first++) {
+        int last = first;
+        while (last < _blocks.count() - 1 && last - first < spannedBlocks && _blocks.at(last)->wrapped)
+            last++;
+
+        bool found = true;
+        for (uint hash : hashes) {
+            bool inBlock = false;
+            for (int block = first; block <= last && !inBlock; block++)
+                inBlock = hasTrigram(_blocks.at(block), hash);
+            if (!inBlock) {
+                found = false;
+                break;
+            }
+        }
+        if (!found)
+            continue;
+
+        const int firstLine = qMax(0, _firstIndexedLine + first * BLOCK_LINES - _droppedLines);
+        const int lastLine = qMin(_firstIndexedLine + (last + 1) * BLOCK_LINES, _lineCount) - _droppedLines - 1;
+        if (!lines.isEmpty() && lines.last().second >= firstLine - 1)
+            lines.last().second = qMax(lines.last().second, lastLine);
+        else
+            lines.append(qMakePair(firstLine, lastLine));
+    }
+    return lines;
+}
+
+void HistoryIndex::usedRgbColors(QSet<int> &used) const
+{
+    for (const Block *block : _blocks)
+        used += block->rgbColors;
+}
+
+int HistoryIndex::unindexedLines() const
+{
+    return qMax(0, _firstIndexedLine - _droppedLines);
+}
+
+qint64 HistoryIndex::memoryUsage() const
+{
+    qint64 usage = qint64(_blocks.count()) * qint64(sizeof(Block) + sizeof(Block *));
+    for (const Block *block : _blocks)
+        usage += qint64(block->rgbColors.count()) * qint64(sizeof(int) + 2 * sizeof(void *));
+    return usage;
+}
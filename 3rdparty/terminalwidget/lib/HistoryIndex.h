@@ -0,0 +1,122 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+#ifndef HISTORYINDEX_H
+#define HISTORYINDEX_H
+
+// Qt
+#include <QList>
+#include <QPair>
+#include <QSet>
+#include <QString>
+#include <QVector>
+
+// Konsole
+#include "Character.h"
+
+namespace Konsole
+{
+
+/**
+ * An index of the text in the lines of a history, which tells the history
+ * search which lines are worth reading.
+ *
+ * The lines are indexed as they are added, in blocks of BLOCK_LINES lines.
+ * Each block keeps a bloom filter of the trigrams (three consecutive UTF-16
+ * units, case folded) of its text, so a block can only contain a piece of
+ * text if all of the text's trigrams are set in its filter.  Text which
+ * continues from a wrapped line is indexed together with the end of that
+ * line, so matches which span lines are found as well.
+ *
+ * Each block also keeps the indexes into RgbColorTable its lines use, so
+ * that the color table can be purged without reading the history.
+ *
+ * Lines are numbered as in the history they are added to, from its oldest
+ * line.  Lines which were in the history before the index was reset are not
+ * indexed and may contain anything.
+ */
+class HistoryIndex
+{
+public:
+    HistoryIndex();
+    ~HistoryIndex();
+
+    /**
+     * Forgets all lines.  The first @p unindexedLines lines of the history
+     * are not indexed.
+     */
+    void reset(int unindexedLines = 0);
+
+    /** Indexes the text of the next line of the history. */
+    void addLine(const Character *cells, int count, bool wrapped);
+    /** To be called when the oldest @p count lines have been dropped from the history. */
+    void dropLines(int count);
+
+    /**
+     * Returns the lines, as pairs of first and last line, which may contain
+     * @p text with any case.  Text shorter than a trigram may be anywhere.
+     */
+    QVector<QPair<int, int> > candidateLines(const QString &text) const;
+
+    /**
+     * Adds the indexes into RgbColorTable used by the indexed lines to
+     * @p used.  Blocks of which some lines were dropped still count.
+     */
+    void usedRgbColors(QSet<int> &used) const;
+    /** Returns the number of lines at the start of the history which are not indexed. */
+    int unindexedLines() const;
+
+    /** Returns the number of bytes of memory used by the index. */
+    qint64 memoryUsage() const;
+
+    static const int BLOCK_LINES = 256;
+
+private:
+    static const int FILTER_WORDS = 256;    // 16384 bits
+
+    struct Block
+    {
+        quint64 filter[FILTER_WORDS];
+        // the last line added to the block wraps onto the next one
+        bool wrapped;
+        QSet<int> rgbColors;
+    };
+
+    void addTrigram(Block *block, uint hash);
+    static bool hasTrigram(const Block *block, uint hash);
+    // hashes of the trigrams of case folded text
+    static QVector<uint> trigrams(const ushort *text, int length);
+
+    Q_DISABLE_COPY(HistoryIndex)
+
+    QList<Block *> _blocks;
+    // lines are counted since the last reset()
+    int _lineCount;
+    int _droppedLines;
+    // the first line of _blocks.first(), lines before it are not indexed
+    int _firstIndexedLine;
+
+    // end of the text of the previous line if it wraps
+    ushort _carry[2];
+    int _carryLength;
+};
+
+}
+
+#endif // HISTORYINDEX_H
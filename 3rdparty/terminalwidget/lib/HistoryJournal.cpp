@@ -0,0 +1,585 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// Own
+#include "HistoryJournal.h"
+
+// System
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Qt
+#include <QDebug>
+#include <QFile>
+#include <QThread>
+#include <QVarLengthArray>
+#include <QVector>
+
+using namespace Konsole;
+
+// Uncompressed size at which a batch is handed to the writer
+#define JOURNAL_BATCH_BYTES (256 * 1024)
+// Longest time lines wait for the writer, in milliseconds
+#define JOURNAL_FLUSH_INTERVAL 1000
+// Size at which the journal of an unlimited history is compacted to half
+#define JOURNAL_UNLIMITED_BYTES (64 * 1024 * 1024)
+
+namespace
+{
+
+// Bump when the Character layout or the record format changes
+const quint32 JOURNAL_VERSION = 2;
+const char JOURNAL_MAGIC[8] = { 'K', 'J', 'O', 'U', 'R', 'N', 'A', 'L' };
+const quint32 RECORD_MAGIC = 0x4452434a;    // "JCRD"
+
+// set in the line header if the line wraps onto the next one
+const quint32 WRAPPED_LINE = 0x80000000u;
+
+struct FileHeader
+{
+    char magic[8];
+    quint32 version;
+    quint32 characterSize;
+};
+
+struct RecordHeader
+{
+    quint32 magic;
+    quint32 lines;
+    // size of the lines before and after compression
+    quint32 dataSize;
+    quint32 compressedSize;
+    // CRC-32 of the compressed lines
+    quint32 checksum;
+};
+
+quint32 crc32(const uchar *data, qint64 size)
+{
+    static const QVector<quint32> table = [] {
+        QVector<quint32> entries(256);
+        for (quint32 i = 0; i < 256; i++) {
+            quint32 crc = i;
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+            entries[int(i)] = crc;
+        }
+        return entries;
+    }();
+
+    quint32 crc = 0xFFFFFFFFu;
+    for (qint64 i = 0; i < size; i++)
+        crc = table.at(int((crc ^ data[i]) & 0xFF)) ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+}
+
+namespace Konsole
+{
+
+class HistoryJournalThread : public QThread
+{
+public:
+    explicit HistoryJournalThread(HistoryJournal *journal)
+        : _journal(journal)
+        , _ownsJournal(false)
+    {
+    }
+
+    ~HistoryJournalThread() override
+    {
+        // see HistoryJournal::discard()
+        if (_ownsJournal) {
+            _journal->_thread = nullptr;
+            delete _journal;
+        }
+    }
+
+    void takeJournal()
+    {
+        _ownsJournal = true;
+    }
+
+protected:
+    void run() override
+    {
+        _journal->writeBatches();
+    }
+
+private:
+    HistoryJournal *_journal;
+    bool _ownsJournal;
+};
+
+}
+
+HistoryJournal::HistoryJournal(const QString &fileName)
+    : _fileName(fileName)
+    , _maximumLines(0)
+    , _closing(false)
+    , _discarded(false)
+    , _thread(new HistoryJournalThread(this))
+    , _fd(-1)
+    , _newFd(-1)
+    , _rewriting(false)
+    , _compactFailed(false)
+{
+    _thread->start(QThread::LowPriority);
+}
+
+HistoryJournal::~HistoryJournal()
+{
+    // a discarded journal is deleted by its thread once it has stopped
+    if (_thread == nullptr)
+        return;
+
+    _mutex.lock();
+    queueBatch();
+    _closing = true;
+    _wakeWriter.wakeOne();
+    _mutex.unlock();
+
+    _thread->wait();
+    delete _thread;
+
+    if (_fd >= 0)
+        ::close(_fd);
+    // an unfinished rewrite is thrown away
+    if (_newFd >= 0) {
+        ::close(_newFd);
+        QFile::remove(_fileName + QLatin1String(".new"));
+    }
+}
+
+void HistoryJournal::discard(HistoryJournal *journal)
+{
+    QMutexLocker locker(&journal->_mutex);
+    journal->_queue.clear();
+    journal->_current = Batch();
+    journal->_closing = true;
+    journal->_discarded = true;
+    journal->_wakeWriter.wakeOne();
+
+    // the thread is deleted by the event loop of the thread which created
+    // the journal, and deletes the journal in turn
+    HistoryJournalThread *thread = journal->_thread;
+    thread->takeJournal();
+    QObject::connect(thread, SIGNAL(finished()), thread, SLOT(deleteLater()));
+}
+
+QString HistoryJournal::fileName() const
+{
+    return _fileName;
+}
+
+void HistoryJournal::addLine(const Character *cells, int count, bool wrapped)
+{
+    QMutexLocker locker(&_mutex);
+
+    const quint32 header = quint32(count) | (wrapped ? WRAPPED_LINE : 0);
+    _current.data.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    _current.data.append(reinterpret_cast<const char *>(cells), count * int(sizeof(Character)));
+
+    // the tables of combined characters and RGB colors are not saved, the
+    // text and the colors of the cells which refer to them follow the line
+    for (int i = 0; i < count; i++) {
+        const Character &cell = cells[i];
+        if (cell.rendition & RE_EXTENDED_CHAR) {
+            ushort length = 0;
+            const uint *chars = ExtendedCharTable::instance.lookupExtendedChar(cell.character, length);
+            if (chars == nullptr)
+                length = 0;
+            _current.data.append(reinterpret_cast<const char *>(&length), sizeof(length));
+            _current.data.append(reinterpret_cast<const char *>(chars), length * int(sizeof(uint)));
+        }
+        for (const CharacterColor &color : { cell.foregroundColor, cell.backgroundColor }) {
+            if (color.rgbIndex() < 0)
+                continue;
+            const QRgb rgb = RgbColorTable::instance.rgb(color.rgbIndex());
+            _current.data.append(reinterpret_cast<const char *>(&rgb), sizeof(rgb));
+        }
+    }
+
+    _current.lines++;
+    if (_current.data.size() >= JOURNAL_BATCH_BYTES)
+        queueBatch();
+}
+
+void HistoryJournal::beginRewrite()
+{
+    QMutexLocker locker(&_mutex);
+    queueBatch();
+    _current.begin = true;
+}
+
+void HistoryJournal::endRewrite()
+{
+    QMutexLocker locker(&_mutex);
+    _current.end = true;
+    queueBatch();
+}
+
+void HistoryJournal::setMaximumLines(int lines)
+{
+    QMutexLocker locker(&_mutex);
+    _maximumLines = lines;
+}
+
+void HistoryJournal::queueBatch()
+{
+    if (_current.lines == 0 && !_current.begin && !_current.end)
+        return;
+
+    _queue.append(_current);
+    _current = Batch();
+    _wakeWriter.wakeOne();
+}
+
+void HistoryJournal::writeBatches()
+{
+    QMutexLocker locker(&_mutex);
+    forever {
+        if (_queue.isEmpty() && !_closing)
+            _wakeWriter.wait(&_mutex, JOURNAL_FLUSH_INTERVAL);
+        // lines which have waited long enough are written as they are
+        queueBatch();
+        if (_queue.isEmpty() && _closing)
+            break;
+
+        QList<Batch> batches;
+        batches.swap(_queue);
+        const int maximumLines = _maximumLines;
+        locker.unlock();
+        for (const Batch &batch : qAsConst(batches))
+            writeBatch(batch);
+        if (!batches.isEmpty())
+            compact(maximumLines);
+        locker.relock();
+    }
+
+    if (_discarded) {
+        locker.unlock();
+        removeFiles();
+    }
+}
+
+bool HistoryJournal::writeBatch(const Batch &batch)
+{
+    const QString newFileName = _fileName + QLatin1String(".new");
+
+    if (batch.begin) {
+        if (_newFd >= 0)
+            ::close(_newFd);
+        _newFd = ::open(QFile::encodeName(newFileName).constData(),
+                        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        _rewriting = true;
+        _newRecords.clear();
+        _compactFailed = false;
+
+        if (_newFd >= 0 && !writeHeader(_newFd)) {
+            ::close(_newFd);
+            _newFd = -1;
+        }
+        if (_newFd < 0)
+            qWarning() << "Cannot write the history journal" << newFileName << strerror(errno);
+    }
+
+    // while rewriting, the lines go to the new file only, or nowhere if it
+    // could not be written
+    bool success = true;
+    const int fd = _rewriting ? _newFd : _fd;
+    if (batch.lines > 0 && fd >= 0) {
+        const QByteArray compressed = qCompress(batch.data, 1);
+
+        RecordHeader header;
+        header.magic = RECORD_MAGIC;
+        header.lines = quint32(batch.lines);
+        header.dataSize = quint32(batch.data.size());
+        header.compressedSize = quint32(compressed.size());
+        header.checksum = crc32(reinterpret_cast<const uchar *>(compressed.constData()), compressed.size());
+
+        // one write per record
+        QByteArray record(reinterpret_cast<const char *>(&header), sizeof(header));
+        record.append(compressed);
+        success = writeData(fd, record.constData(), record.size());
+        if (!success && _rewriting) {
+            ::close(_newFd);
+            _newFd = -1;
+        }
+
+        // a record which was cut short is left out, the ones which follow
+        // it are found by their offset
+        const qint64 end = success ? ::lseek(fd, 0, SEEK_CUR) : -1;
+        if (end >= 0) {
+            const Record written = { end - record.size(), qint64(record.size()), batch.lines };
+            (_rewriting ? _newRecords : _records).append(written);
+        }
+    }
+
+    if (batch.end && _rewriting) {
+        _rewriting = false;
+        if (_newFd >= 0) {
+            // the new file has to be complete before it replaces the old one
+            if (::fdatasync(_newFd) == 0
+                    && ::rename(QFile::encodeName(newFileName).constData(),
+                                QFile::encodeName(_fileName).constData()) == 0) {
+                if (_fd >= 0)
+                    ::close(_fd);
+                _fd = _newFd;
+                _records.swap(_newRecords);
+            } else {
+                qWarning() << "Cannot replace the history journal" << _fileName << strerror(errno);
+                ::close(_newFd);
+                QFile::remove(newFileName);
+                success = false;
+            }
+            _newFd = -1;
+        }
+    }
+    return success;
+}
+
+bool HistoryJournal::writeHeader(int fd)
+{
+    FileHeader header;
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    header.characterSize = sizeof(Character);
+    return writeData(fd, reinterpret_cast<const char *>(&header), sizeof(header));
+}
+
+bool HistoryJournal::writeData(int fd, const char *data, qint64 size)
+{
+    while (size > 0) {
+        const ssize_t written = ::write(fd, data, size_t(size));
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            qWarning() << "Cannot write the history journal" << _fileName << strerror(errno);
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+void HistoryJournal::compact(int maximumLines)
+{
+    if (_rewriting || _fd < 0 || _records.isEmpty() || _compactFailed)
+        return;
+
+    // the first record to keep: the newest records which hold maximumLines
+    // lines, or half the size limit if the history is unlimited
+    int first = _records.count();
+    if (maximumLines > 0) {
+        qint64 totalLines = 0;
+        for (const Record &record : qAsConst(_records))
+            totalLines += record.lines;
+        if (totalLines < 2 * qint64(maximumLines))
+            return;
+
+        qint64 keptLines = 0;
+        while (first > 0 && keptLines < maximumLines)
+            keptLines += _records.at(--first).lines;
+    } else {
+        const qint64 fileSize = _records.last().offset + _records.last().size;
+        if (fileSize < JOURNAL_UNLIMITED_BYTES)
+            return;
+
+        // at least the newest record
+        qint64 keptBytes = _records.at(--first).size;
+        while (first > 0 && keptBytes + _records.at(first - 1).size <= JOURNAL_UNLIMITED_BYTES / 2)
+            keptBytes += _records.at(--first).size;
+    }
+    if (first == 0)
+        return;
+
+    // the records are copied one by one as they are, without a record
+    // which was cut short between them
+    const QString newFileName = _fileName + QLatin1String(".new");
+    const int newFd = ::open(QFile::encodeName(newFileName).constData(),
+                             O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool success = newFd >= 0 && writeHeader(newFd);
+
+    QVector<Record> kept;
+    QByteArray buffer;
+    qint64 offset = sizeof(FileHeader);
+    for (int i = first; success && i < _records.count(); i++) {
+        const Record &record = _records.at(i);
+        buffer.resize(int(record.size));
+        ssize_t bytes;
+        do {
+            bytes = ::pread(_fd, buffer.data(), size_t(record.size), record.offset);
+        } while (bytes < 0 && errno == EINTR);
+        success = bytes == record.size && writeData(newFd, buffer.constData(), record.size);
+
+        const Record copied = { offset, record.size, record.lines };
+        kept.append(copied);
+        offset += record.size;
+    }
+
+    success = success && ::fdatasync(newFd) == 0
+              && ::rename(QFile::encodeName(newFileName).constData(),
+                          QFile::encodeName(_fileName).constData()) == 0;
+    if (!success) {
+        qWarning() << "Cannot compact the history journal" << _fileName << strerror(errno);
+        // not tried again until the journal is rewritten
+        _compactFailed = true;
+        if (newFd >= 0)
+            ::close(newFd);
+        QFile::remove(newFileName);
+        return;
+    }
+
+    ::close(_fd);
+    _fd = newFd;
+    _records.swap(kept);
+}
+
+void HistoryJournal::removeFiles()
+{
+    for (int *fd : { &_fd, &_newFd }) {
+        if (*fd >= 0)
+            ::close(*fd);
+        *fd = -1;
+    }
+    _rewriting = false;
+    QFile::remove(_fileName);
+    QFile::remove(_fileName + QLatin1String(".new"));
+}
+
+bool HistoryJournal::readLines(const QString &fileName, int maximumLines, const LineReader &readLine)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    const qint64 size = file.size();
+    if (size < qint64(sizeof(FileHeader)))
+        return false;
+    const uchar *map = file.map(0, size);
+    if (map == nullptr)
+        return false;
+
+    FileHeader fileHeader;
+    memcpy(&fileHeader, map, sizeof(fileHeader));
+    if (memcmp(fileHeader.magic, JOURNAL_MAGIC, sizeof(fileHeader.magic)) != 0
+            || fileHeader.version != JOURNAL_VERSION
+            || fileHeader.characterSize != sizeof(Character))
+        return false;
+
+    // the records up to the first one which was not written completely
+    QVector<qint64> offsets;
+    QVector<RecordHeader> records;
+    qint64 totalLines = 0;
+    qint64 offset = sizeof(FileHeader);
+    while (offset + qint64(sizeof(RecordHeader)) <= size) {
+        RecordHeader header;
+        memcpy(&header, map + offset, sizeof(header));
+        const qint64 dataOffset = offset + sizeof(RecordHeader);
+        if (header.magic != RECORD_MAGIC || dataOffset + header.compressedSize > size
+                || crc32(map + dataOffset, header.compressedSize) != header.checksum)
+            break;
+
+        offsets.append(dataOffset);
+        records.append(header);
+        totalLines += header.lines;
+        offset = dataOffset + header.compressedSize;
+    }
+
+    // only the lines which fit into the history are decoded
+    qint64 skipLines = maximumLines > 0 ? qMax(Q_INT64_C(0), totalLines - maximumLines) : 0;
+    QVector<Character> cells;
+    for (int i = 0; i < records.count(); i++) {
+        const RecordHeader &header = records.at(i);
+        if (skipLines >= header.lines) {
+            skipLines -= header.lines;
+            continue;
+        }
+
+        const QByteArray data = qUncompress(map + offsets.at(i), int(header.compressedSize));
+        if (data.size() != int(header.dataSize))
+            break;
+
+        const char *position = data.constData();
+        const char *end = position + data.size();
+        while (end - position >= qint64(sizeof(quint32))) {
+            quint32 lineHeader;
+            memcpy(&lineHeader, position, sizeof(lineHeader));
+            position += sizeof(lineHeader);
+
+            const int count = int(lineHeader & ~WRAPPED_LINE);
+            if (count < 0 || qint64(count) * qint64(sizeof(Character)) > end - position)
+                return true;
+            cells.resize(count);
+            memcpy(cells.data(), position, count * sizeof(Character));
+            position += count * sizeof(Character);
+
+            // the lines which are skipped are only stepped over, entering
+            // their characters and colors into the tables would leak entries
+            const bool skip = skipLines > 0;
+            for (Character &cell : cells) {
+                if (cell.rendition & RE_EXTENDED_CHAR) {
+                    ushort length = 0;
+                    if (end - position < qint64(sizeof(length)))
+                        return true;
+                    memcpy(&length, position, sizeof(length));
+                    position += sizeof(length);
+                    if (end - position < qint64(length * sizeof(uint)))
+                        return true;
+
+                    if (!skip && length > 0) {
+                        QVarLengthArray<uint, 8> chars(length);
+                        memcpy(chars.data(), position, length * sizeof(uint));
+                        cell.character = ExtendedCharTable::instance.createExtendedChar(chars.constData(), length);
+                    } else if (!skip) {
+                        cell.character = ' ';
+                        cell.rendition &= ~RE_EXTENDED_CHAR;
+                    }
+                    position += length * sizeof(uint);
+                }
+
+                // the indexes are those of the process which wrote the journal,
+                // RGB colors are entered into this one's table again
+                for (CharacterColor *color : { &cell.foregroundColor, &cell.backgroundColor }) {
+                    if (color->rgbIndex() < 0)
+                        continue;
+                    QRgb rgb;
+                    if (end - position < qint64(sizeof(rgb)))
+                        return true;
+                    memcpy(&rgb, position, sizeof(rgb));
+                    position += sizeof(rgb);
+                    if (!skip)
+                        *color = CharacterColor(COLOR_SPACE_RGB, int(rgb & 0xFFFFFF));
+                }
+            }
+
+            if (skip) {
+                skipLines--;
+                continue;
+            }
+            readLine(cells.constData(), cells.count(), lineHeader & WRAPPED_LINE);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,166 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+#ifndef HISTORYJOURNAL_H
+#define HISTORYJOURNAL_H
+
+// System
+#include <functional>
+
+// Qt
+#include <QByteArray>
+#include <QList>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+#include <QWaitCondition>
+
+// Konsole
+#include "Character.h"
+
+namespace Konsole
+{
+
+class HistoryJournalThread;
+
+/**
+ * Keeps a copy of the lines of a history in a file, so they can be read
+ * back into the history of a new emulation, e.g. after a restart.
+ *
+ * The file is append only: a header followed by records which each hold a
+ * batch of lines, compressed and with a CRC-32 of the compressed data.
+ * Lines are collected in memory and a writer thread compresses and appends
+ * them once a batch is full or has waited for a second, so adding a line
+ * costs no system call.  A record which was cut short by a crash fails its
+ * checksum and is ignored with everything after it.
+ *
+ * The lines are kept as they are added, the cells as they are in memory
+ * plus the text of combined characters and the values of RGB colors, which
+ * the cells only refer to by their index in a table of this process.  A
+ * journal can only be read by a build with the same Character layout.
+ *
+ * The history drops old lines while the journal only grows.  Once it holds
+ * twice as many lines as the history keeps, see setMaximumLines(), the
+ * writer thread copies the newest records which hold enough lines to a new
+ * file, without decoding them.  The journal of an unlimited history is
+ * compacted the same way to half its size once it reaches a size limit.
+ * The new file replaces the old one once it is complete.
+ */
+class HistoryJournal
+{
+public:
+    /** Starts a journal in @p fileName.  The file is written by beginRewrite(). */
+    explicit HistoryJournal(const QString &fileName);
+    /** Writes the lines added so far and waits for the writer thread. */
+    ~HistoryJournal();
+
+    /**
+     * Stops @p journal and removes its file without waiting for the writer
+     * thread: the lines which are not written yet are dropped and the
+     * journal deletes itself once the writer has stopped.
+     */
+    static void discard(HistoryJournal *journal);
+
+    QString fileName() const;
+
+    /** Adds a line to the journal. */
+    void addLine(const Character *cells, int count, bool wrapped);
+
+    /**
+     * Starts writing a new file.  The lines added until endRewrite() are
+     * written to a temporary file which then replaces the journal.
+     */
+    void beginRewrite();
+    void endRewrite();
+    /**
+     * Sets the number of lines the history keeps, the journal keeps at
+     * least as many.  0 stands for an unlimited history.
+     */
+    void setMaximumLines(int lines);
+
+    typedef std::function<void(const Character *cells, int count, bool wrapped)> LineReader;
+
+    /**
+     * Reads the lines of the journal in @p fileName, at most the last
+     * @p maximumLines of them if it is greater than 0, and passes each to
+     * @p readLine.  The file is mapped, not read into memory.  Returns false
+     * if the file is missing or was not written by a journal like this one.
+     */
+    static bool readLines(const QString &fileName, int maximumLines, const LineReader &readLine);
+
+private:
+    friend class HistoryJournalThread;
+
+    struct Batch
+    {
+        QByteArray data;
+        int lines = 0;
+        // the batch starts (or ends) a rewrite
+        bool begin = false;
+        bool end = false;
+    };
+
+    // hands the collected lines to the writer, with _mutex locked
+    void queueBatch();
+
+    // a record written to the journal
+    struct Record
+    {
+        qint64 offset;
+        qint64 size;
+        int lines;
+    };
+
+    // on the writer thread
+    void writeBatches();
+    bool writeBatch(const Batch &batch);
+    bool writeHeader(int fd);
+    bool writeData(int fd, const char *data, qint64 size);
+    // drops the oldest records once there are too many lines
+    void compact(int maximumLines);
+    // closes the files and removes them, when the journal was discarded
+    void removeFiles();
+
+    QString _fileName;
+
+    QMutex _mutex;
+    QWaitCondition _wakeWriter;
+    Batch _current;
+    QList<Batch> _queue;
+    int _maximumLines;
+    bool _closing;
+    bool _discarded;
+
+    HistoryJournalThread *_thread;
+    // used by the writer thread only: the journal, the file being
+    // rewritten and whether the batches go to the latter
+    int _fd;
+    int _newFd;
+    bool _rewriting;
+    // the records of the journal and of the file being rewritten
+    QVector<Record> _records;
+    QVector<Record> _newRecords;
+    bool _compactFailed;
+
+    Q_DISABLE_COPY(HistoryJournal)
+};
+
+}
+
+#endif // HISTORYJOURNAL_H
@@ -18,197 +18,623 @@
 */
 #include <QApplication>
 #include <QTextStream>
+#include <QThread>
+#include <QTimer>
 #include <QDebug>
 
+#include <algorithm>
+#include <climits>
+#include <vector>
+
 #include "TerminalCharacterDecoder.h"
 #include "Emulation.h"
 #include "HistorySearch.h"
+#include "TerminalDisplay.h"
 
-HistorySearch::HistorySearch(EmulationPtr emulation, QRegExp regExp,
-                             bool forwards, int startColumn, int startLine,
-                             QObject *parent) :
-    QObject(parent),
-    m_emulation(emulation),
-    m_regExp(regExp),
-    m_forwards(forwards),
-    m_startColumn(startColumn),
-    m_startLine(startLine)
+// Lines which are read at once, so that we do not use unhealthy amounts of memory
+#define SEARCH_BLOCK_LINES 10000
+// Lines added to the history which are searched without the worker thread
+#define SYNCHRONOUS_SEARCH_LINES 1000
+// Milliseconds the output may change before the matches are updated
+#define UPDATE_INTERVAL 100
+
+static int findLineNumberInString(const QList<int> &linePositions, int position)
 {
+    QList<int>::const_iterator it = std::upper_bound(linePositions.constBegin(), linePositions.constEnd(), position);
+    return qMax(0, int(it - linePositions.constBegin()) - 1);
 }
 
-HistorySearch::~HistorySearch()
+/*
+ * Keeps copies of the lines passed to it, so that they can be decoded
+ * after the emulation has been unlocked again.
+ */
+class LineRecorder : public TerminalCharacterDecoder
 {
-}
+public:
+    void begin(QTextStream *) override {}
+    void end() override {}
+
+    void decodeLine(const Character *const characters, int count, LineProperty properties) override
+    {
+        const RecordedLine line = { int(_characters.size()), count, properties };
+        _lines.append(line);
+        _characters.insert(_characters.end(), characters, characters + count);
+    }
 
-void HistorySearch::search()
+    /** Passes the recorded lines to @p decoder in the order they came in */
+    void replay(TerminalCharacterDecoder *decoder) const
+    {
+        for (const RecordedLine &line : _lines)
+            decoder->decodeLine(_characters.data() + line.start, line.count, line.properties);
+    }
+
+private:
+    struct RecordedLine {
+        int start;
+        int count;
+        LineProperty properties;
+    };
+    std::vector<Character> _characters;
+    QVector<RecordedLine> _lines;
+};
+
+/*
+ * Appends the matches of regExp which start in the lines from fromLine to
+ * toLine to matches.  The lines are counted in history generation generation,
+ * false is returned if the history has another one by now.
+ */
+static bool findMatches(Emulation *emulation, const QRegExp &regExp, int generation,
+                        qint64 fromLine, qint64 toLine, QVector<HistoryMatch> &matches)
 {
-    bool found = false;
+    // only the cells are copied while the emulation is locked, they are
+    // decoded into text afterwards
+    LineRecorder recorder;
+    qint64 droppedLines;
+    {
+        QMutexLocker locker(emulation->screenLock());
+        if (emulation->historyGeneration() != generation)
+            return false;
+
+        droppedLines = emulation->droppedHistoryLines();
+        const int startLine = int(qMax(fromLine - droppedLines, qint64(0)));
+        const int endLine = int(qMin(toLine - droppedLines, qint64(emulation->lineCount() - 1)));
+        if (startLine > endLine)
+            return true;
+        fromLine = startLine + droppedLines;
 
-    if (! m_regExp.isEmpty()) {
-        if (m_forwards) {
-            found = search(m_startColumn, m_startLine, -1, m_emulation->lineCount()) || search(0, 0, m_startColumn, m_startLine);
-        } else {
-            found = search(0, 0, m_startColumn, m_startLine) || search(m_startColumn, m_startLine, -1, m_emulation->lineCount());
-        }
+        emulation->writeToStream(&recorder, startLine, endLine);
+    }
 
-        if (found) {
-            emit matchFound(m_foundStartColumn, m_foundStartLine, m_foundEndColumn, m_foundEndLine, m_loseChinese, m_matchChinese);
+    QString string;
+    QTextStream searchStream(&string);
+    PlainTextDecoder decoder;
+    decoder.begin(&searchStream);
+    decoder.setRecordLinePositions(true);
+    recorder.replay(&decoder);
+    decoder.end();
+    searchStream.flush();
+    const QList<int> linePositions = decoder.linePositions();
+
+    // The String that Emulator.writeToStream produces has a newline at the end, and so ends with an
+    // empty line - we ignore that.
+    const int numberOfLinesInString = linePositions.size() - 1;
+
+    /***add begin by ut001121 zhangmeng 20200515 修复BUG22626***/
+    //中文字符正则表达式
+    const QRegExp regEx("[\u4E00-\u9FA5，《。》、？；：【】～！￥（）]+");
+    const int patternChinese = regExp.pattern().count(regEx);
+    /***add end by ut001121***/
+
+    int matchStart = 0;
+    while ((matchStart = regExp.indexIn(string, matchStart)) > -1) {
+        const int matchLength = regExp.matchedLength();
+        if (matchLength == 0) {
+            // a pattern like "a*" matches nothing everywhere
+            matchStart++;
+            continue;
+        }
+        const int matchEnd = matchStart + matchLength - 1;
+
+        // Translate matchStart and matchEnd to startColum, startLine, endColumn and endLine in history.
+        const int startLineNumberInString = findLineNumberInString(linePositions, matchStart);
+        if (startLineNumberInString >= numberOfLinesInString)
+            break;
+
+        HistoryMatch match;
+        match.startColumn = matchStart - linePositions.at(startLineNumberInString);
+        match.startLine = startLineNumberInString + fromLine;
+
+        const int endLineNumberInString = findLineNumberInString(linePositions, matchEnd);
+        match.endColumn = matchEnd - linePositions.at(endLineNumberInString);
+        match.endLine = endLineNumberInString + fromLine;
+
+        /***add begin by ut001121 zhangmeng 20200515 修复BUG22626***/
+        /**
+          string:   aaa-------------bbbbbbbbbbbbb-------ccc
+                    |              ||           |
+          match pos:|              |matchStart  matchEnd
+          lose pos: loseStart      loseEnd      |
+          line pos: lineStart                   lineEnd
+
+          存在特殊情况:一个完整的物理行显示在终端被分成多个逻辑行
+        */
+        //未匹配的串-物理行开始和结束位置
+        const int loseEnd = matchStart;
+        const int loseStart = string.lastIndexOf('\n', loseEnd) + 1;
+
+        //未匹配的串-逻辑行字符串
+        const QString logicLoseStr = string.mid(loseStart, loseEnd - loseStart).right(match.startColumn);
+        match.loseChinese = logicLoseStr.count(regEx);
+
+        //匹配内容是否跨多个逻辑行
+        if (match.startLine == match.endLine) {
+            //单逻辑行匹配情况:匹配字符包含中文字符数量
+            match.matchChinese = patternChinese + match.loseChinese;
         } else {
-            emit noMatchFound();
+            //多逻辑行匹配情况:匹配字符的尾行逻辑行,跨行匹配不计算loseChinese
+            const QString tailMatchStr = string.mid(loseStart, matchEnd - loseStart + 1).right(match.endColumn + 1);
+            match.matchChinese = tailMatchStr.count(regEx);
         }
+        /***add end by ut001121***/
+
+        matches.append(match);
+        matchStart = matchEnd + 1;
     }
 
-    deleteLater();
+    return true;
 }
 
-bool HistorySearch::search(int startColumn, int startLine, int endColumn, int endLine)
+HistorySearchWorker::HistorySearchWorker(Emulation *emulation)
+    : m_emulation(emulation)
+    , m_job(0)
+    , m_runningJob(0)
+    , m_generation(0)
+    , m_fromLine(0)
+    , m_resultJob(0)
+    , m_resultGeneration(0)
+    , m_resultEndLine(0)
 {
-    qDebug() << "search from" << startColumn << "," << startLine
-             <<  "to" << endColumn << "," << endLine;
-
-    int linesRead = 0;
-    int linesToRead = endLine - startLine + 1;
+}
 
-    qDebug() << "linesToRead:" << linesToRead;
+void HistorySearchWorker::start(int job, const QRegExp &regExp, int generation, qint64 fromLine)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_job = job;
+        m_regExp = regExp;
+        m_generation = generation;
+        m_fromLine = fromLine;
+        m_cancelled.store(1);
+    }
+    QMetaObject::invokeMethod(this, "run", Qt::QueuedConnection);
+}
 
-    // We read process history from (and including) startLine to (and including) endLine in
-    // blocks of at most 10K lines so that we do not use unhealthy amounts of memory
-    int blockSize;
-    while ((blockSize = qMin(10000, linesToRead - linesRead)) > 0) {
+void HistorySearchWorker::cancel()
+{
+    m_cancelled.store(1);
+}
 
-        QString string;
-        QTextStream searchStream(&string);
-        PlainTextDecoder decoder;
-        decoder.begin(&searchStream);
-        decoder.setRecordLinePositions(true);
+bool HistorySearchWorker::takeResult(int job, QVector<HistoryMatch> &matches, int &generation, qint64 &endLine)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_resultJob != job)
+        return false;
+
+    matches.swap(m_resultMatches);
+    m_resultMatches.clear();
+    generation = m_resultGeneration;
+    endLine = m_resultEndLine;
+    m_resultJob = 0;
+    return true;
+}
 
-        // Calculate lines to read and read them
-        int blockStartLine = m_forwards ? startLine + linesRead : endLine - linesRead - blockSize + 1;
-        int chunkEndLine = blockStartLine + blockSize - 1;
-        m_emulation->writeToStream(&decoder, blockStartLine, chunkEndLine);
+void HistorySearchWorker::run()
+{
+    int job;
+    QRegExp regExp;
+    int generation;
+    qint64 fromLine;
+    {
+        QMutexLocker locker(&m_mutex);
+        // several runs may be queued for the last search
+        if (m_job == m_runningJob)
+            return;
+        m_runningJob = job = m_job;
+        regExp = m_regExp;
+        generation = m_generation;
+        fromLine = m_fromLine;
+        m_cancelled.store(0);
+    }
 
-        // We search between startColumn in the first line of the string and endColumn in the last
-        // line of the string. First we calculate the position (in the string) of endColumn in the
-        // last line of the string
-        int endPosition;
+    // the lines to read, only those which may contain a fixed string
+    QVector<QPair<qint64, qint64> > ranges;
+    qint64 endLine;
+    {
+        QMutexLocker locker(m_emulation->screenLock());
+        const qint64 droppedLines = m_emulation->droppedHistoryLines();
+        if (m_emulation->historyGeneration() != generation) {
+            generation = m_emulation->historyGeneration();
+            fromLine = 0;
+        }
 
-        // The String that Emulator.writeToStream produces has a newline at the end, and so ends with an
-        // empty line - we ignore that.
-        int numberOfLinesInString = decoder.linePositions().size() - 1;
-        if (numberOfLinesInString > 0 && endColumn > -1) {
-            endPosition = decoder.linePositions().at(numberOfLinesInString - 1) + endColumn;
-        } else {
-            endPosition = string.size();
+        const int startLine = int(qMax(fromLine - droppedLines, qint64(0)));
+        const int endLineInHistory = m_emulation->completeHistoryLines();
+        endLine = endLineInHistory + droppedLines;
+
+        if (regExp.patternSyntax() == QRegExp::FixedString) {
+            const QVector<QPair<int, int> > lines =
+                m_emulation->historySearchRanges(regExp.pattern(), startLine, endLineInHistory - 1);
+            for (const QPair<int, int> &range : lines)
+                ranges.append(qMakePair(range.first + droppedLines, range.second + droppedLines));
+        } else if (startLine < endLineInHistory) {
+            ranges.append(qMakePair(startLine + droppedLines, endLine - 1));
         }
+    }
 
-        // So now we can log for m_regExp in the string between startColumn and endPosition
-        int matchStart;
-        if (m_forwards) {
-            matchStart = string.indexOf(m_regExp, startColumn);
-            if (matchStart >= endPosition) {
-                matchStart = -1;
+    QVector<HistoryMatch> matches;
+    for (const QPair<qint64, qint64> &range : ranges) {
+        for (qint64 line = range.first; line <= range.second; line += SEARCH_BLOCK_LINES) {
+            if (m_cancelled.load()) {
+                emit finished(job);
+                return;
             }
-        } else {
-            matchStart = string.lastIndexOf(m_regExp, endPosition - 1);
-            if (matchStart < startColumn) {
-                matchStart = -1;
+
+            const qint64 blockEndLine = qMin(line + SEARCH_BLOCK_LINES - 1, range.second);
+            if (!findMatches(m_emulation, regExp, generation, line, blockEndLine, matches)) {
+                generation = 0;
+                break;
             }
         }
+        if (generation == 0)
+            break;
+    }
 
-        if (matchStart > -1) {
-            int matchEnd = matchStart + m_regExp.matchedLength() - 1;
-            qDebug() << "Found in string from" << matchStart << "to" << matchEnd;
-
-            // Translate startPos and endPos to startColum, startLine, endColumn and endLine in history.
-            int startLineNumberInString = findLineNumberInString(decoder.linePositions(), matchStart);
-            m_foundStartColumn = matchStart - decoder.linePositions().at(startLineNumberInString);
-            m_foundStartLine = startLineNumberInString + startLine + linesRead;
-
-            int endLineNumberInString = findLineNumberInString(decoder.linePositions(), matchEnd);
-            m_foundEndColumn = matchEnd - decoder.linePositions().at(endLineNumberInString);
-            m_foundEndLine = endLineNumberInString + startLine + linesRead;
-
-            qDebug() << "m_foundStartColumn" << m_foundStartColumn
-                     << "m_foundStartLine" << m_foundStartLine
-                     << "m_foundEndColumn" << m_foundEndColumn
-                     << "m_foundEndLine" << m_foundEndLine;
-
-            /***add begin by ut001121 zhangmeng 20200515 修复BUG22626***/
-            /**
-              string:   aaa-------------bbbbbbbbbbbbb-------ccc
-                        |              ||           |
-              match pos:|              |matchStart  matchEnd
-              lose pos: loseStart      loseEnd      |
-              line pos: lineStart                   lineEnd
-
-              存在特殊情况:一个完整的物理行显示在终端被分成多个逻辑行
-            */
-            //中文字符正则表达式
-            QRegExp regEx("[\u4E00-\u9FA5，《。》、？；：【】～！￥（）]+");
-
-            //未匹配的串-物理行开始和结束位置
-            int loseEnd = matchStart;
-            int loseStart = string.lastIndexOf('\n', loseEnd) + 1;
-            //qDebug() << "loseStart" << loseStart << "loseEnd" << loseEnd ;
-
-//            if (loseStart < 0 || loseStart > loseEnd) {
-//                qDebug() << "========loseStart and loseEnd is not expected" << loseStart << loseEnd;
-//                exit(-1);
-//            }
-
-            //未匹配的串-物理行字符串
-            QString loseStr = string.mid(loseStart, loseEnd - loseStart);
-            //qDebug() << "loseStr" << loseStr << m_lineChinese;
-
-            //未匹配的串-逻辑行字符串
-            int loseEndLineNumberInString = findLineNumberInString(decoder.linePositions(), loseEnd);
-            int loseEndColumn = matchStart - decoder.linePositions().at(loseEndLineNumberInString);
-            QString logicLoseStr = loseStr.right(loseEndColumn);
-            m_loseChinese = logicLoseStr.count(regEx);
-            //qDebug() << "logicLoseStr" << logicLoseStr << m_lineChinese << loseEndColumn;
-
-            //匹配内容是否跨多个逻辑行
-            if (m_foundStartLine == m_foundEndLine) {
-                /*
-                 * 单逻辑行匹配情况
-                 * 匹配字符的当前逻辑行:(匹配字符-当前逻辑行-开始位置)--->(匹配字符-当前逻辑行-结束位置
-                */
-                //匹配字符包含中文字符数量
-                QString txt = m_regExp.pattern();
-                m_matchChinese = txt.count(regEx);
-                m_matchChinese += m_loseChinese;
-            } else {
-                /*
-                 * 多逻辑行匹配情况
-                 * 匹配字符的尾行逻辑行:(匹配字符-尾行逻辑行-开始位置)--->(匹配字符-尾行逻辑行-结束位置)
-                */
-                QString macthStr = string.mid(loseStart, matchEnd - loseStart + 1);
-                QString tailMacthStr = macthStr.right(m_foundEndColumn + 1);
-                //qDebug() << "tailMacthStr" << tailMacthStr;
-                m_matchChinese = tailMacthStr.count(regEx) ;
-                /*
-                 * 跨行匹配不计算m_loseChinese
-                 * m_matchChinese += m_loseChinese;
-                 */
-            }
-            /***add end by ut001121***/
-            return true;
+    {
+        QMutexLocker locker(&m_mutex);
+        m_resultJob = job;
+        m_resultMatches.swap(matches);
+        m_resultGeneration = generation;
+        m_resultEndLine = endLine;
+    }
+    emit finished(job);
+}
+
+HistorySearch::HistorySearch(EmulationPtr emulation, QObject *parent) :
+    QObject(parent),
+    m_emulation(emulation),
+    m_thread(nullptr),
+    m_worker(nullptr),
+    m_job(0),
+    m_workerRunning(false),
+    m_generation(0),
+    m_endLine(0),
+    m_screenLine(0),
+    m_hasCurrentMatch(false),
+    m_currentLine(0),
+    m_currentColumn(0),
+    m_updateTimer(new QTimer(this)),
+    m_pending(false),
+    m_forwards(true),
+    m_startColumn(0),
+    m_startLine(0)
+{
+    m_updateTimer->setSingleShot(true);
+    m_updateTimer->setInterval(UPDATE_INTERVAL);
+    connect(m_updateTimer, SIGNAL(timeout()), this, SLOT(updateMatches()));
+
+    if (!m_emulation.isNull())
+        connect(m_emulation.data(), SIGNAL(outputChanged()), this, SLOT(outputChanged()));
+}
+
+HistorySearch::~HistorySearch()
+{
+    if (m_thread != nullptr) {
+        m_worker->cancel();
+        m_thread->quit();
+        m_thread->wait();
+        delete m_worker;
+        delete m_thread;
+    }
+}
+
+void HistorySearch::search(const QRegExp &regExp, bool forwards, int startColumn, int startLine)
+{
+    if (m_emulation.isNull() || regExp.isEmpty()) {
+        cancel();
+        return;
+    }
+
+    if (regExp != m_regExp) {
+        // the worker reads the history for the previous pattern
+        cancel();
+        m_regExp = regExp;
+        m_generation = 0;
+        m_matches.clear();
+        m_endLine = 0;
+        m_screenMatches.clear();
+        m_hasCurrentMatch = false;
+    }
+
+    m_pending = true;
+    m_forwards = forwards;
+    m_startColumn = startColumn;
+    m_startLine = startLine;
+    continueSearch(true);
+}
+
+void HistorySearch::cancel()
+{
+    m_pending = false;
+    if (m_workerRunning) {
+        m_worker->cancel();
+        m_workerRunning = false;
+    }
+}
+
+void HistorySearch::clear()
+{
+    cancel();
+    m_updateTimer->stop();
+    if (m_regExp.isEmpty())
+        return;
+
+    m_regExp = QRegExp();
+    m_generation = 0;
+    m_matches.clear();
+    m_endLine = 0;
+    m_screenMatches.clear();
+    m_hasCurrentMatch = false;
+    emit matchesChanged();
+}
+
+int HistorySearch::matchCount() const
+{
+    return matchTotal();
+}
+
+int HistorySearch::currentMatchIndex() const
+{
+    if (!m_hasCurrentMatch)
+        return -1;
+
+    const int index = lowerBound(m_currentLine, m_currentColumn);
+    if (index == matchTotal())
+        return -1;
+    const HistoryMatch &match = matchAt(index);
+    if (match.startLine != m_currentLine || match.startColumn != m_currentColumn)
+        return -1;
+    return index;
+}
+
+QVector<HistoryMatch> HistorySearch::matchesInLines(int firstLine, int lastLine) const
+{
+    QVector<HistoryMatch> matches;
+    if (m_emulation.isNull() || m_regExp.isEmpty())
+        return matches;
+
+    QMutexLocker locker(m_emulation->screenLock());
+    if (m_emulation->historyGeneration() != m_generation)
+        return matches;
+
+    const qint64 droppedLines = m_emulation->droppedHistoryLines();
+    const qint64 fromLine = firstLine + droppedLines;
+    const qint64 toLine = lastLine + droppedLines;
+
+    // matches do not overlap, so only the one starting last before the
+    // lines can reach into them
+    const int count = matchTotal();
+    for (int index = qMax(0, lowerBound(fromLine, 0) - 1); index < count; index++) {
+        HistoryMatch match = matchAt(index);
+        if (match.startLine > toLine)
+            break;
+        if (match.endLine < fromLine)
+            continue;
+        match.startLine -= droppedLines;
+        match.endLine -= droppedLines;
+        matches.append(match);
+    }
+    return matches;
+}
+
+void HistorySearch::outputChanged()
+{
+    if (!m_regExp.isEmpty() && !m_updateTimer->isActive())
+        m_updateTimer->start();
+}
+
+void HistorySearch::updateMatches()
+{
+    if (m_emulation.isNull() || m_regExp.isEmpty() || m_workerRunning)
+        return;
+    continueSearch(false);
+}
+
+void HistorySearch::continueSearch(bool wait)
+{
+    qint64 endLine;
+    {
+        QMutexLocker locker(m_emulation->screenLock());
+        const int generation = m_emulation->historyGeneration();
+        if (generation != m_generation) {
+            // the history has been reflowed or replaced
+            m_generation = generation;
+            m_matches.clear();
+            m_endLine = 0;
+            m_hasCurrentMatch = false;
         }
+        endLine = m_emulation->completeHistoryLines() + m_emulation->droppedHistoryLines();
 
+        // a few lines added since the last search are read right away
+        if (!m_workerRunning && endLine - m_endLine <= SYNCHRONOUS_SEARCH_LINES) {
+            findMatches(m_emulation, m_regExp, m_generation, m_endLine, endLine - 1, m_matches);
+            m_endLine = endLine;
+        }
+    }
 
-        linesRead += blockSize;
+    if (m_endLine < endLine) {
+        if (!m_workerRunning)
+            startWorker();
+        // output may come in faster than the worker reads it, so it is
+        // waited for once and the lines added meanwhile are left out
+        if (wait)
+            return;
     }
 
-    qDebug() << "Not found";
-    return false;
+    updateScreenMatches(qMax(m_endLine, endLine));
+    if (m_pending)
+        reportMatch();
+    emit matchesChanged();
 }
 
+void HistorySearch::startWorker()
+{
+    if (m_thread == nullptr) {
+        m_thread = new QThread();
+        m_worker = new HistorySearchWorker(m_emulation.data());
+        m_worker->moveToThread(m_thread);
+        connect(m_worker, SIGNAL(finished(int)), this, SLOT(workerFinished(int)));
+        m_thread->start();
+    }
 
-int HistorySearch::findLineNumberInString(QList<int> linePositions, int position)
+    m_workerRunning = true;
+    m_worker->start(++m_job, m_regExp, m_generation, m_endLine);
+}
+
+void HistorySearch::workerFinished(int job)
 {
-    int lineNum = 0;
-    while (lineNum + 1 < linePositions.size() && linePositions[lineNum + 1] <= position)
-        lineNum++;
+    if (job != m_job || !m_workerRunning)
+        return;
+    m_workerRunning = false;
+
+    QVector<HistoryMatch> matches;
+    int generation;
+    qint64 endLine;
+    if (!m_worker->takeResult(job, matches, generation, endLine) || m_emulation.isNull())
+        return;
+
+    // the history may have been reflowed or replaced since
+    if (generation != 0 && generation == m_emulation->historyGeneration()) {
+        if (generation != m_generation) {
+            // the worker has searched all of the new generation
+            m_generation = generation;
+            m_matches.clear();
+            m_hasCurrentMatch = false;
+        }
+        m_matches += matches;
+        m_endLine = endLine;
+    }
+
+    continueSearch(false);
+}
+
+void HistorySearch::updateScreenMatches(qint64 screenLine)
+{
+    QMutexLocker locker(m_emulation->screenLock());
+    const qint64 droppedLines = m_emulation->droppedHistoryLines();
+
+    // forget the matches in lines which have left the history
+    int dropped = 0;
+    while (dropped < m_matches.size() && m_matches.at(dropped).startLine < droppedLines)
+        dropped++;
+    m_matches.remove(0, dropped);
+
+    // the lines after the complete history change with the output,
+    // they are read every time
+    m_screenMatches.clear();
+    m_screenLine = screenLine;
+    findMatches(m_emulation, m_regExp, m_generation, screenLine,
+                m_emulation->lineCount() - 1 + droppedLines, m_screenMatches);
+}
+
+void HistorySearch::reportMatch()
+{
+    m_pending = false;
+
+    const int count = matchTotal();
+    if (count == 0) {
+        m_hasCurrentMatch = false;
+        emit noMatchFound();
+        return;
+    }
+
+    const qint64 droppedLines = m_emulation->droppedHistoryLines();
+
+    // the first match which starts at or after the start position
+    const int startColumn = (!m_forwards && m_startColumn == -1) ? INT_MAX : m_startColumn;
+    const int low = lowerBound(m_startLine + droppedLines, startColumn);
+
+    int index;
+    if (m_forwards)
+        index = low < count ? low : 0;
+    else
+        index = low > 0 ? low - 1 : count - 1;
+
+    const HistoryMatch &match = matchAt(index);
+    m_hasCurrentMatch = true;
+    m_currentLine = match.startLine;
+    m_currentColumn = match.startColumn;
+    emit matchFound(match.startColumn, int(match.startLine - droppedLines),
+                    match.endColumn, int(match.endLine - droppedLines),
+                    match.loseChinese, match.matchChinese);
+}
+
+int HistorySearch::matchTotal() const
+{
+    return m_matches.size() + m_screenMatches.size();
+}
 
-    return lineNum;
+const HistoryMatch &HistorySearch::matchAt(int index) const
+{
+    return index < m_matches.size() ? m_matches.at(index) : m_screenMatches.at(index - m_matches.size());
+}
+
+int HistorySearch::lowerBound(qint64 line, int column) const
+{
+    int low = 0;
+    int high = matchTotal();
+    while (low < high) {
+        const int middle = (low + high) / 2;
+        const HistoryMatch &match = matchAt(middle);
+        if (match.startLine < line || (match.startLine == line && match.startColumn < column))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+HistorySearchFilter::HistorySearchFilter(HistorySearch *search, TerminalDisplay *display)
+    : m_search(search)
+    , m_display(display)
+{
+}
+
+void HistorySearchFilter::process()
+{
+    ScreenWindow *window = m_display->screenWindow();
+    if (m_search.isNull() || window == nullptr || m_search->matchCount() == 0)
+        return;
+
+    const int firstLine = window->currentLine();
+    const int lines = window->windowLines();
+    const int columns = window->windowColumns();
+
+    const QVector<HistoryMatch> matches = m_search->matchesInLines(firstLine, firstLine + lines - 1);
+    for (const HistoryMatch &match : matches) {
+        // the marked columns are counted like those of the selection which
+        // QTermWidget makes for a match, and end after the last one
+        int startLine = int(match.startLine) - firstLine;
+        int startColumn = match.startColumn + match.loseChinese;
+        int endLine = int(match.endLine) - firstLine;
+        int endColumn = match.endColumn + match.matchChinese + 1;
+        if (startLine < 0) {
+            startLine = 0;
+            startColumn = 0;
+        }
+        if (endLine >= lines) {
+            endLine = lines - 1;
+            endColumn = columns;
+        }
+        addHotSpot(new RegExpFilter::HotSpot(startLine, startColumn, endLine, qMin(endColumn, columns)));
+    }
 }
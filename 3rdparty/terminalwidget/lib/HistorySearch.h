@@ -22,51 +22,220 @@
 #include <QObject>
 #include <QPointer>
 #include <QMap>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QVector>
 
 #include <Session.h>
 #include <ScreenWindow.h>
 
 #include "Emulation.h"
+#include "Filter.h"
 #include "TerminalCharacterDecoder.h"
 
+class QThread;
+class QTimer;
+
+namespace Konsole
+{
+class TerminalDisplay;
+}
+
 using namespace Konsole;
 
 typedef QPointer<Emulation> EmulationPtr;
 
+/**
+ * A match of a history search.  Its lines are counted from the first line of
+ * the history generation it was found in (see Emulation::droppedHistoryLines()),
+ * so they stay the same while old lines are dropped from the history.
+ */
+struct HistoryMatch
+{
+    qint64 startLine;
+    int startColumn;
+    qint64 endLine;
+    int endColumn;
+
+    // corrections of the columns for double width characters, see BUG22626
+    int loseChinese;
+    int matchChinese;
+};
+
+/**
+ * Finds the matches in the complete lines of a history on a worker thread.
+ * See HistorySearch
+ */
+class HistorySearchWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit HistorySearchWorker(Emulation *emulation);
+
+    /**
+     * Queues a search for @p regExp in the complete history lines from
+     * @p fromLine on, cancelling the one which is running.  @p fromLine is
+     * counted in history generation @p generation, if the history has
+     * another one by now, all of it is searched.
+     *
+     * Thread safe.
+     */
+    void start(int job, const QRegExp &regExp, int generation, qint64 fromLine);
+    /** Stops the running search, thread safe. */
+    void cancel();
+
+    /**
+     * Takes the matches found by @p job, with the history generation they
+     * were found in and the end of the lines searched.  Returns false if the
+     * job did not finish.  The generation is 0 if it changed during the search.
+     */
+    bool takeResult(int job, QVector<HistoryMatch> &matches, int &generation, qint64 &endLine);
+
+signals:
+    /** Emitted when @p job has finished or was cancelled */
+    void finished(int job);
+
+private slots:
+    void run();
+
+private:
+    Emulation *m_emulation;
+
+    // the queued search
+    QMutex m_mutex;
+    int m_job;
+    int m_runningJob;
+    QRegExp m_regExp;
+    int m_generation;
+    qint64 m_fromLine;
+    QAtomicInt m_cancelled;
+
+    // the result of the last search which finished
+    int m_resultJob;
+    QVector<HistoryMatch> m_resultMatches;
+    int m_resultGeneration;
+    qint64 m_resultEndLine;
+};
+
+/**
+ * Searches the output of an emulation.
+ *
+ * All matches of the pattern in the history are found once, on a worker
+ * thread, and kept.  A further search for the same pattern, e.g. to step to
+ * the next or previous match, then only reads the lines added to the history
+ * since and the lines on the screen.  The matches are kept up to date with
+ * the output until clear() is called, so they can all be shown, see
+ * HistorySearchFilter.
+ */
 class HistorySearch : public QObject
 {
     Q_OBJECT
 
 public:
-    explicit HistorySearch(EmulationPtr emulation, QRegExp regExp, bool forwards,
-                           int startColumn, int startLine, QObject* parent);
+    explicit HistorySearch(EmulationPtr emulation, QObject* parent);
 
     ~HistorySearch() override;
 
-    void search();
+    /**
+     * Looks for the match of @p regExp after (or before if @p forwards is
+     * false) @p startColumn in @p startLine, wrapping around at the end of
+     * the output.  Emits matchFound() or noMatchFound(), right away or once
+     * the history has been searched.  A column of -1 stands for the end of
+     * the line when searching backwards.
+     */
+    void search(const QRegExp &regExp, bool forwards, int startColumn, int startLine);
+    /** Abandons the search which waits for the history to be searched. */
+    void cancel();
+    /** Abandons the search and forgets the pattern and its matches. */
+    void clear();
+
+    /** Returns the number of matches of the pattern searched for last. */
+    int matchCount() const;
+    /** Returns the index of the match reported last among all matches, or -1. */
+    int currentMatchIndex() const;
+    /**
+     * Returns the matches which cover any of the lines from @p firstLine to
+     * @p lastLine.  Lines are numbered as Emulation::lineCount() counts them
+     * now, not from the start of the history generation.
+     */
+    QVector<HistoryMatch> matchesInLines(int firstLine, int lastLine) const;
 
 signals:
     void matchFound(int startColumn, int startLine, int endColumn, int endLine, int loseChinese, int matchChinese);
     void noMatchFound();
+    /** Emitted when the matches or the current match have changed */
+    void matchesChanged();
 
-private:
-    bool search(int startColumn, int startLine, int endColumn, int endLine);
-    int findLineNumberInString(QList<int> linePositions, int position);
+private slots:
+    void workerFinished(int job);
+    void outputChanged();
+    void updateMatches();
 
+private:
+    // searches the history lines the cached matches do not cover yet,
+    // rereads the lines after them and reports the pending match, unless
+    // @p wait is true and the worker has to read the history first
+    void continueSearch(bool wait);
+    void startWorker();
+    // reads the matches in the lines from screenLine on again
+    void updateScreenMatches(qint64 screenLine);
+    // reports the match from the cached ones and the screen matches
+    void reportMatch();
+
+    int matchTotal() const;
+    const HistoryMatch &matchAt(int index) const;
+    // index of the first match which starts at or after the position
+    int lowerBound(qint64 line, int column) const;
 
     EmulationPtr m_emulation;
+
+    QThread *m_thread;
+    HistorySearchWorker *m_worker;
+    int m_job;
+    bool m_workerRunning;
+
+    // the matches of m_regExp in the complete history lines before
+    // m_endLine, both in history generation m_generation
     QRegExp m_regExp;
+    int m_generation;
+    QVector<HistoryMatch> m_matches;
+    qint64 m_endLine;
+
+    // the matches in the lines from m_screenLine on, which change with the
+    // output and are read again
+    QVector<HistoryMatch> m_screenMatches;
+    qint64 m_screenLine;
+
+    // start of the match reported last
+    bool m_hasCurrentMatch;
+    qint64 m_currentLine;
+    int m_currentColumn;
+
+    // coalesces the output changes the matches are updated for
+    QTimer *m_updateTimer;
+
+    // the search waiting for the worker
+    bool m_pending;
     bool m_forwards;
     int m_startColumn;
     int m_startLine;
+};
 
-    int m_foundStartColumn;
-    int m_foundStartLine;
-    int m_foundEndColumn;
-    int m_foundEndLine;
+/**
+ * Marks the matches of a HistorySearch which are visible on a display.
+ * Add it to the display's filterChain().
+ */
+class HistorySearchFilter : public Filter
+{
+public:
+    HistorySearchFilter(HistorySearch *search, TerminalDisplay *display);
 
-    int m_loseChinese;
-    int m_matchChinese;
+    void process() override;
+
+private:
+    QPointer<HistorySearch> m_search;
+    TerminalDisplay *m_display;
 };
 
 #endif	/* TASK_H */
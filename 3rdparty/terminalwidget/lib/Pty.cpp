@@ -37,6 +37,9 @@
 #include <cerrno>
 #include <termios.h>
 #include <csignal>
+#include <limits>
+#include <algorithm>
+#include <cstring>
 
 // Qt
 #include <QStringList>
@@ -261,6 +264,9 @@ Pty::Pty(QObject *parent)
     init();
 }
 
+// Output passed on to the emulation in one iteration of the event loop
+#define DEFAULT_RECEIVE_BUDGET (256 * 1024)
+
 void Pty::init()
 {
     _windowColumns = 0;
@@ -269,8 +275,22 @@ void Pty::init()
     _xonXoff = true;
     _utf8 = true;
     _bUninstall = false;
+    _receiveBudget = DEFAULT_RECEIVE_BUDGET;
+    _throttled = false;
+    _receiveSuspended = false;
+    _keepReceivedData = false;
+    _chunkTailLength = 0;
+    _firstChunk = true;
+    _dropRead = false;
+    _leadByteHeld = false;
+
+    _resumeTimer.setSingleShot(true);
+    _resumeTimer.setInterval(0);
+    connect(&_resumeTimer, SIGNAL(timeout()), this, SLOT(continueReceiving()));
 
     connect(pty(), SIGNAL(readyRead()), this, SLOT(dataReceived()));
+    // don't lose output which is still waiting for its turn when the process exits
+    connect(this, SIGNAL(finished(int,QProcess::ExitStatus)), this, SLOT(flushReceived()));
     setPtyChannels(KPtyProcess::AllChannels);
 }
 
@@ -492,31 +512,223 @@ void Pty::sendData(const char *data, int length)
 
 void Pty::dataReceived()
 {
-    QByteArray data = pty()->readAll();
+    // a new read from the pty, see dispatchData().  The messages are only
+    // looked for within one read, like when the read was handled as a whole.
+    _firstChunk = true;
+    _dropRead = false;
+    _chunkTailLength = 0;
+    continueReceiving();
+}
+
+void Pty::continueReceiving()
+{
+    receiveBufferedData(_receiveBudget > 0 ? _receiveBudget : std::numeric_limits<qint64>::max());
+}
+
+void Pty::flushReceived()
+{
+    _resumeTimer.stop();
+
+    int length = 0;
+    while (const char *data = nextChunk(&length)) {
+        dispatchData(data, length);
+        releaseChunk(length);
+    }
+
+    // nothing follows a byte which was held back any more
+    if (_leadByteHeld) {
+        _leadByteHeld = false;
+        emit receivedData("\xC2", 1);
+    }
+}
+
+void Pty::receiveBufferedData(qint64 budget)
+{
+    if (_receiveSuspended)
+        return;
+
+    // Hand the buffered chunks of the pty straight to the receivers instead
+    // of copying them out with readAll() first.  Whole chunks are passed on,
+    // so the budget may be exceeded by up to one chunk.
+    int length = 0;
+    while (budget > 0 && !_receiveSuspended) {
+        const char *data = nextChunk(&length);
+        if (!data)
+            break;
+        dispatchData(data, length);
+        releaseChunk(length);
+        budget -= length;
+    }
+
+    if (pty()->bytesAvailable() > 0) {
+        // Stop reading until the rest has been handled in the next iterations.
+        if (!_throttled) {
+            _throttled = true;
+            pty()->setSuspended(true);
+        }
+        // setReceiveSuspended(false) restarts the timer
+        if (!_receiveSuspended)
+            _resumeTimer.start();
+    } else if (_throttled) {
+        _throttled = false;
+        pty()->setSuspended(_receiveSuspended);
+    }
+}
+
+void Pty::setReceiveSuspended(bool suspended)
+{
+    if (_receiveSuspended == suspended)
+        return;
 
-    QString recvData = QString(data);
+    _receiveSuspended = suspended;
+    if (_receiveSuspended) {
+        pty()->setSuspended(true);
+    } else if (_throttled) {
+        // carry on with the output left in the buffer
+        _resumeTimer.start();
+    } else {
+        pty()->setSuspended(false);
+    }
+}
+
+void Pty::setReceiveBudget(int bytes)
+{
+    _receiveBudget = qMax(0, bytes);
+}
+
+int Pty::receiveBudget() const
+{
+    return _receiveBudget;
+}
+
+void Pty::setKeepReceivedData(bool keep)
+{
+    _keepReceivedData = keep;
+}
+
+QByteArray Pty::receivedBuffer() const
+{
+    return _receivedBuffer;
+}
+
+// Chunks smaller than this stay in the pty's buffer even while the receivers
+// keep the output, copying them is cheaper than keeping the memory around them
+#define MIN_KEPT_CHUNK 1024
+
+const char *Pty::nextChunk(int *length)
+{
+    const char *data = pty()->bufferedChunk(length);
+    if (!data || !_keepReceivedData || *length < MIN_KEPT_CHUNK)
+        return data;
+
+    int offset = 0;
+    _receivedBuffer = pty()->takeBufferedChunk(&offset, length);
+    return _receivedBuffer.constData() + offset;
+}
+
+void Pty::releaseChunk(int length)
+{
+    if (!_receivedBuffer.isNull())
+        _receivedBuffer.clear();
+    else
+        pty()->releaseBufferedChunk(length);
+}
+
+// The messages of an interrupted zmodem transfer which are not shown
+static const char *const hiddenMessages[] = {
+    "bash: $'\\212",
+    "bash: **0800000000022d：",
+    "**^XB0800000000022d"
+};
+
+// Returns whether the @p length bytes at @p data contain @p message
+static bool containsMessage(const char *data, int length, const char *message)
+{
+    const char *end = data + length;
+    return std::search(data, end, message, message + qstrlen(message)) != end;
+}
+
+// Returns whether the @p length bytes at @p data start with @p message
+static bool startsWithMessage(const char *data, int length, const char *message)
+{
+    const int messageLength = qstrlen(message);
+    return length >= messageLength && memcmp(data, message, messageLength) == 0;
+}
+
+void Pty::dispatchData(const char *data, int length)
+{
+    // The fixups below used to see the whole output of a read at once, now
+    // they see it chunk by chunk.  A message which was found hides the rest
+    // of the read, like it hid all of it before.  The chunk is searched where
+    // it lies in the pty buffer, only the fixups which change it copy it.
+    if (_dropRead)
+        return;
+
+    const bool firstChunk = _firstChunk;
+    _firstChunk = false;
 
     /******** Modify by m000714 daizhengwen 2020-04-30: 处理上传下载时乱码显示命令不执行****************/
     // 乱码提示信息不显示
-    if (recvData.contains("bash: $'\\212")
-            || recvData.contains("bash: **0800000000022d：")
-            || recvData.contains("**^XB0800000000022d")
-            || recvData.startsWith("**\u0018B0800000000022d\r\u008A")) {
+    // a message may start at the end of the previous chunk of the read, so
+    // that end is searched together with the start of this chunk
+    char boundary[2 * CHUNK_TAIL_LENGTH];
+    const int previousLength = _chunkTailLength;
+    const int headLength = qMin(length, CHUNK_TAIL_LENGTH);
+    memcpy(boundary, _chunkTail, previousLength);
+    memcpy(boundary + previousLength, data, headLength);
+    const int boundaryLength = previousLength + headLength;
+
+    _chunkTailLength = qMin(boundaryLength, CHUNK_TAIL_LENGTH);
+    if (length >= CHUNK_TAIL_LENGTH)
+        memcpy(_chunkTail, data + length - CHUNK_TAIL_LENGTH, CHUNK_TAIL_LENGTH);
+    else
+        memcpy(_chunkTail, boundary + boundaryLength - _chunkTailLength, _chunkTailLength);
+
+    bool hidden = firstChunk && startsWithMessage(data, length, "**\x18" "B0800000000022d\r\xC2\x8A");
+    for (const char *message : hiddenMessages) {
+        hidden = hidden || containsMessage(data, length, message)
+                 || (previousLength > 0 && containsMessage(boundary, boundaryLength, message));
+    }
+    if (hidden) {
+        _dropRead = true;
+        _leadByteHeld = false;
         return;
     }
 
-    // "\u008A"这个乱码不替换调会导致显示时有\b的效果导致命令错乱bug#23741
-    if (recvData.contains("\u008A")) {
-        recvData.replace("\u008A", "\b \b #");
-        data = recvData.toUtf8();
+    // the message is the whole read, so nothing may follow the chunk, which
+    // is still in the pty's buffer unless it was moved out of it
+    static const char waitingMessage[] = "rz waiting to receive.";
+    if (firstChunk && !_leadByteHeld && length == int(sizeof(waitingMessage)) - 1
+            && startsWithMessage(data, length, waitingMessage)
+            && pty()->bytesAvailable() == (_receivedBuffer.isNull() ? length : 0)) {
+        const QByteArray fixedData = QByteArray(data, length) + "\r\n";
+        emit receivedData(fixedData.constData(), fixedData.count());
+        return;
     }
 
-    if (recvData == "rz waiting to receive.") {
-        recvData += "\r\n";
-        data = recvData.toUtf8();
+    // "\u008A"这个乱码不替换调会导致显示时有\b的效果导致命令错乱bug#23741
+    // (U+008A is "\xC2\x8A" in the UTF-8 byte stream).  The pair may be
+    // split between two chunks, so a "\xC2" at the end of a chunk is held
+    // back until the next one; the decoder would wait for the byte after it
+    // anyway.
+    const bool leadByteHeld = _leadByteHeld;
+    _leadByteHeld = length > 0 && data[length - 1] == '\xC2';
+    if (_leadByteHeld)
+        --length;
+    if (length == 0 && !leadByteHeld)
+        return;
+
+    if (leadByteHeld || containsMessage(data, length, "\xC2\x8A")) {
+        QByteArray fixedData;
+        if (leadByteHeld)
+            fixedData += '\xC2';
+        fixedData.append(data, length);
+        fixedData.replace("\xC2\x8A", "\b \b #");
+        emit receivedData(fixedData.constData(), fixedData.count());
+        return;
     }
     /********************* Modify by m000714 daizhengwen End ************************/
-    emit receivedData(data.constData(), data.count());
+    emit receivedData(data, length);
 }
 
 void Pty::lockPty(bool lock)
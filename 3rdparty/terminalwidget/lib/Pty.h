@@ -36,12 +36,17 @@
 #include <QVector>
 #include <QList>
 #include <QSize>
+#include <QTimer>
 
 // KDE
 #include "kptyprocess.h"
 
 namespace Konsole {
 
+// Bytes of a chunk kept to find the zmodem messages which start in it and
+// end in the next one, at least one less than the longest message
+#define CHUNK_TAIL_LENGTH 31
+
 /**
  * The Pty class is used to start the terminal process,
  * send data to it, receive data from it and manipulate
@@ -152,6 +157,44 @@ Q_OBJECT
 
     void setSessionId(int sessionId);
 
+    /**
+     * Sets how many bytes of output are passed on through receivedData() in one
+     * iteration of the event loop.  When the budget is used up, reading from the
+     * pty is suspended and the rest of the buffered output is handled in the next
+     * iteration, after pending user input.  Meanwhile the kernel's pty buffer fills
+     * up and blocks the terminal process, so a flood of output cannot starve the GUI.
+     *
+     * @param bytes The budget in bytes, or 0 to pass on all output at once.
+     */
+    void setReceiveBudget(int bytes);
+    /** Returns the receive budget in bytes.  See setReceiveBudget() */
+    int receiveBudget() const;
+
+    /**
+     * Stops or resumes passing on output through receivedData().  While
+     * suspended, the pty is not read, so the terminal process blocks once the
+     * kernel's pty buffer is full.  Used to keep a busy emulation thread from
+     * falling behind without bound.
+     */
+    void setReceiveSuspended(bool suspended);
+
+    /**
+     * Sets whether the receivers keep the output passed on through
+     * receivedData(), for example to process it on another thread.  If so,
+     * larger chunks are moved out of the pty's buffer instead of being
+     * borrowed from it, and receivedBuffer() returns the array holding the
+     * chunk while receivedData() is emitted, so that it can be kept without
+     * a copy.
+     */
+    void setKeepReceivedData(bool keep);
+    /**
+     * Returns the array holding the output passed on by the receivedData()
+     * signal being emitted, or a null array if the output has to be copied
+     * to keep it.  Output changed by the zmodem fixups is never in it.  See
+     * setKeepReceivedData()
+     */
+    QByteArray receivedBuffer() const;
+
   public slots:
 
     /**
@@ -200,9 +243,22 @@ Q_OBJECT
   private slots:
     // called when data is received from the terminal process
     void dataReceived();
+    // passes on the output which was deferred in the previous iteration
+    void continueReceiving();
+    // passes on all buffered output, regardless of the budget
+    void flushReceived();
 
   private:
     void init();
+    // passes on up to @p budget bytes of the buffered output and suspends
+    // reading from the pty while output is left over
+    void receiveBufferedData(qint64 budget);
+    // returns the next chunk of buffered output, or nullptr if there is none
+    const char *nextChunk(int *length);
+    // drops the chunk returned by nextChunk()
+    void releaseChunk(int length);
+    // applies the zmodem fixups to a chunk of output and emits receivedData()
+    void dispatchData(const char *data, int length);
     bool isTerminalRemoved();
     bool bWillRemoveTerminal(QString strCommand);
     /******** Add by nt001000 renfeixiang 2020-05-14:增加 Purge卸载命令的判断，显示不同的卸载提示框 Begin***************/
@@ -221,6 +277,20 @@ Q_OBJECT
 
     int _sessionId;
     bool _bUninstall;
+
+    int _receiveBudget;
+    bool _throttled;        // reading is suspended until the buffer is drained
+    bool _receiveSuspended; // see setReceiveSuspended()
+    bool _keepReceivedData; // see setKeepReceivedData()
+    QByteArray _receivedBuffer; // the chunk moved out of the pty's buffer
+
+    // state of the zmodem fixups of dispatchData() between the chunks of a read
+    char _chunkTail[CHUNK_TAIL_LENGTH]; // the end of the read passed on so far
+    int _chunkTailLength;
+    bool _firstChunk;       // the next chunk starts a read from the pty
+    bool _dropRead;         // the rest of the current read is not shown
+    bool _leadByteHeld;     // a "\xC2" at the end of a chunk was held back
+    QTimer _resumeTimer;
 };
 
 }
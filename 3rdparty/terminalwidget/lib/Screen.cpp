@@ -29,8 +29,10 @@
 #include <unistd.h>
 #include <cstring>
 #include <cctype>
+#include <algorithm>
 
 // Qt
+#include <QAtomicInt>
 #include <QTextStream>
 #include <QDate>
 
@@ -38,6 +40,7 @@
 //#include <kdebug.h>
 
 // Konsole
+#include "HistoryJournal.h"
 #include "konsole_wcwidth.h"
 #include "TerminalCharacterDecoder.h"
 
@@ -75,6 +78,10 @@ Character Screen::defaultChar = Character(' ',
     _scrolledLines(0),
     _droppedLines(0),
     history(new HistoryScrollNone()),
+    _reflowLines(false),
+    _historyGeneration(0),
+    _droppedHistoryLines(0),
+    _historyJournal(nullptr),
     cuX(0), cuY(0),
     currentRendition(0),
     _topMargin(0), _bottomMargin(0),
@@ -87,6 +94,11 @@ Character Screen::defaultChar = Character(' ',
     for (int i=0;i<lines+1;i++)
         lineProperties[i]=LINE_DEFAULT;
 
+    _historyReflow.setHistory(history);
+    renumberHistory();
+
+    resetStyleRuns();
+
     initTabStops();
     clearSelection();
     reset();
@@ -97,6 +109,7 @@ Character Screen::defaultChar = Character(' ',
 
 Screen::~Screen()
 {
+    setHistoryJournal(QString());
     delete[] screenLines;
     delete history;
 }
@@ -211,6 +224,7 @@ void Screen::deleteChars(int n)
     Q_ASSERT( cuX+n <= screenLines[cuY].count() );
 
     screenLines[cuY].remove(cuX,n);
+    _staleStyleRuns[cuY] = true;
 }
 
 void Screen::insertChars(int n)
@@ -224,6 +238,7 @@ void Screen::insertChars(int n)
 
     if ( screenLines[cuY].count() > columns )
         screenLines[cuY].resize(columns);
+    _staleStyleRuns[cuY] = true;
 }
 
 void Screen::repeatChars(int count)
@@ -316,36 +331,44 @@ void Screen::resizeImage(int new_lines, int new_columns)
 {
     if ((new_lines==lines) && (new_columns==columns)) return;
 
-    if (cuY > new_lines-1)
-    { // attempt to preserve focus and lines
-        _bottomMargin = lines-1; //FIXME: margin lost
-        for (int i = 0; i < cuY-(new_lines-1); i++)
-        {
-            addHistLine(); scrollUp(0,1);
-        }
+    if (_reflowLines && new_columns != columns)
+    {
+        reflowImage(new_lines, new_columns);
     }
+    else
+    {
+        if (cuY > new_lines-1)
+        { // attempt to preserve focus and lines
+            _bottomMargin = lines-1; //FIXME: margin lost
+            for (int i = 0; i < cuY-(new_lines-1); i++)
+            {
+                addHistLine(); scrollUp(0,1);
+            }
+        }
 
-    // create new screen lines and copy from old to new
+        // create new screen lines and copy from old to new
 
-    ImageLine* newScreenLines = new ImageLine[new_lines+1];
-    for (int i=0; i < qMin(lines,new_lines+1) ;i++)
-        newScreenLines[i]=screenLines[i];
-    for (int i=lines;(i > 0) && (i<new_lines+1);i++)
-        newScreenLines[i].resize( new_columns );
+        ImageLine* newScreenLines = new ImageLine[new_lines+1];
+        for (int i=0; i < qMin(lines,new_lines+1) ;i++)
+            newScreenLines[i]=screenLines[i];
+        for (int i=lines;(i > 0) && (i<new_lines+1);i++)
+            newScreenLines[i].resize( new_columns );
 
-    lineProperties.resize(new_lines+1);
-    for (int i=lines;(i > 0) && (i<new_lines+1);i++)
-        lineProperties[i] = LINE_DEFAULT;
+        lineProperties.resize(new_lines+1);
+        for (int i=lines;(i > 0) && (i<new_lines+1);i++)
+            lineProperties[i] = LINE_DEFAULT;
 
-    clearSelection();
+        delete[] screenLines;
+        screenLines = newScreenLines;
+    }
 
-    delete[] screenLines;
-    screenLines = newScreenLines;
+    clearSelection();
 
     lines = new_lines;
     columns = new_columns;
     cuX = qMin(cuX,columns-1);
     cuY = qMin(cuY,lines-1);
+    resetStyleRuns();
 
     // FIXME: try to keep values, evtl.
     _topMargin=0;
@@ -354,6 +377,113 @@ void Screen::resizeImage(int new_lines, int new_columns)
     clearSelection();
 }
 
+void Screen::reflowImage(int new_lines, int new_columns)
+{
+    // the history is only split again as it is read, which must start
+    // before lines of the new width are added to it
+    _historyReflow.reflow(new_columns);
+    renumberHistory();
+
+    QVector<ImageLine> newLines;
+    QVector<LineProperty> newProperties;
+    int cursorLine = 0;
+    int cursorColumn = 0;
+
+    int first = 0;
+    while (first < lines)
+    {
+        // join a line with the lines it wraps onto
+        int last = first;
+        while (last < lines-1 && (lineProperties[last] & LINE_WRAPPED))
+            last++;
+
+        ImageLine line;
+        int cursorOffset = -1;
+        for (int y = first; y <= last; y++)
+        {
+            if (y == cuY)
+                cursorOffset = line.size() + cuX;
+            line += screenLines[y];
+        }
+
+        // trailing blanks would only add empty lines
+        int length = line.size();
+        while (length > 0 && line[length-1] == defaultChar)
+            length--;
+
+        // and split it again at the new width
+        const LineProperty property = (LineProperty)(lineProperties[first] & ~LINE_WRAPPED);
+        const int firstNewLine = newLines.size();
+        int start = 0;
+        do
+        {
+            int end = qMin(start + new_columns, length);
+            // keep double width characters in one piece
+            if (end < length && end > start + 1 && line[end].character == 0 && !line[end].isRealCharacter)
+                end--;
+
+            newLines.append(line.mid(start, end - start));
+            newProperties.append(end < length ? (LineProperty)(property | LINE_WRAPPED) : property);
+            start = end;
+        } while (start < length);
+
+        if (lineProperties[last] & LINE_WRAPPED)
+            newProperties.last() = (LineProperty)(newProperties.last() | LINE_WRAPPED);
+
+        if (cursorOffset >= 0)
+        {
+            cursorLine = firstNewLine;
+            while (cursorLine < newLines.size()-1 && cursorOffset >= newLines[cursorLine].size())
+            {
+                cursorOffset -= newLines[cursorLine].size();
+                cursorLine++;
+            }
+
+            // the cursor may be past the end of the text
+            cursorLine += cursorOffset / new_columns;
+            cursorColumn = cursorOffset % new_columns;
+            while (newLines.size() <= cursorLine)
+            {
+                newLines.append(ImageLine());
+                newProperties.append(LINE_DEFAULT);
+            }
+        }
+
+        first = last + 1;
+    }
+
+    // keep the cursor on the screen, the lines above it which no longer
+    // fit go to the history and those below it are lost
+    const int scrolledLines = qMax(0, cursorLine - (new_lines-1));
+    if (hasScroll())
+    {
+        for (int i = 0; i < scrolledLines; i++)
+            appendHistoryLine(newLines[i], newProperties[i] & LINE_WRAPPED);
+    }
+
+    ImageLine* newScreenLines = new ImageLine[new_lines+1];
+    lineProperties.resize(new_lines+1);
+    for (int i = 0; i < new_lines+1; i++)
+    {
+        const int line = scrolledLines + i;
+        if (i < new_lines && line < newLines.size())
+        {
+            newScreenLines[i] = newLines[line];
+            lineProperties[i] = newProperties[line];
+        }
+        else
+        {
+            lineProperties[i] = LINE_DEFAULT;
+        }
+    }
+
+    delete[] screenLines;
+    screenLines = newScreenLines;
+
+    cuX = cursorColumn;
+    cuY = cursorLine - scrolledLines;
+}
+
 void Screen::setDefaultMargins()
 {
     _topMargin = 0;
@@ -424,14 +554,14 @@ void Screen::updateEffectiveRendition()
 
 void Screen::copyFromHistory(Character* dest, int startLine, int count) const
 {
-    Q_ASSERT( startLine >= 0 && count > 0 && startLine + count <= history->getLines() );
+    Q_ASSERT( startLine >= 0 && count > 0 && startLine + count <= _historyReflow.getLines() );
 
     for (int line = startLine; line < startLine + count; line++)
     {
-        const int length = qMin(columns,history->getLineLen(line));
+        const int length = qMin(columns,_historyReflow.getLineLen(line));
         const int destLineOffset  = (line-startLine)*columns;
 
-        history->getCells(line,0,length,dest + destLineOffset);
+        _historyReflow.getCells(line,0,length,dest + destLineOffset);
 
         for (int column = length; column < columns; column++)
             dest[destLineOffset+column] = defaultChar;
@@ -467,24 +597,83 @@ void Screen::copyFromScreen(Character* dest , int startLine , int count) const
             dest[destIndex] = screenLines[srcIndex/columns].value(srcIndex%columns,defaultChar);
 
             // invert selected text
-            if (selBegin != -1 && isSelected(column,line + history->getLines()))
+            if (selBegin != -1 && isSelected(column,line + _historyReflow.getLines()))
                 reverseRendition(dest[destIndex]);
         }
 
     }
 }
 
-void Screen::getImage( Character* dest, int size, int startLine, int endLine ) const
+void Screen::resetStyleRuns()
+{
+    _styleRuns.fill(0, (lines+1) * styleRunWords(columns));
+    _staleStyleRuns.fill(true, lines+1);
+}
+
+void Screen::updateStyleRuns()
+{
+    const int words = styleRunWords(columns);
+    for (int line = 0; line < lines; line++)
+    {
+        if (!_staleStyleRuns[line])
+            continue;
+        findLineStyleRuns(line, _styleRuns.data() + line*words);
+        _staleStyleRuns[line] = false;
+    }
+}
+
+void Screen::updateStyleRuns(int line, int column, int count)
+{
+    if (_staleStyleRuns[line])
+        return;
+
+    // only the written characters and the one after them can start a run
+    const ImageLine& cells = screenLines[line];
+    quint32* runs = _styleRuns.data() + line*styleRunWords(columns);
+    const int end = qMin(column + count, columns - 1);
+    for (int x = qMax(1, column); x <= end; x++)
+    {
+        const Character& previous = x - 1 < cells.size() ? cells[x-1] : defaultChar;
+        const Character& current = x < cells.size() ? cells[x] : defaultChar;
+        setStyleRunStart(runs, x, !current.equalsStyle(previous));
+    }
+}
+
+void Screen::findLineStyleRuns(int line, quint32* runs) const
+{
+    // a line may be longer than the screen after a resize, or shorter,
+    // in which case it continues with default characters
+    const ImageLine& cells = screenLines[line];
+    const int length = qMin(cells.size(), columns);
+    findStyleRuns(cells.constData(), length, runs);
+    for (int word = styleRunWords(length); word < styleRunWords(columns); word++)
+        runs[word] = 0;
+    if (length == 0)
+        runs[0] = 1u;
+    else if (length < columns && !cells[length-1].equalsStyle(defaultChar))
+        setStyleRunStart(runs, length, true);
+}
+
+void Screen::moveStyleRuns(int dest, int source)
+{
+    const int words = styleRunWords(columns);
+    memcpy(_styleRuns.data() + dest*words, _styleRuns.constData() + source*words,
+           words * sizeof(quint32));
+    _staleStyleRuns[dest] = _staleStyleRuns[source];
+}
+
+void Screen::getImage( Character* dest, int size, int startLine, int endLine,
+                       quint32* styleRuns ) const
 {
     Q_ASSERT( startLine >= 0 );
-    Q_ASSERT( endLine >= startLine && endLine < history->getLines() + lines );
+    Q_ASSERT( endLine >= startLine && endLine < _historyReflow.getLines() + lines );
 
     const int mergedLines = endLine - startLine + 1;
 
     Q_ASSERT( size >= mergedLines * columns );
     Q_UNUSED( size );
 
-    const int linesInHistoryBuffer = qBound(0,history->getLines()-startLine,mergedLines);
+    const int linesInHistoryBuffer = qBound(0,_historyReflow.getLines()-startLine,mergedLines);
     const int linesInScreenBuffer = mergedLines - linesInHistoryBuffer;
 
     // copy lines from history buffer
@@ -494,7 +683,7 @@ void Screen::getImage( Character* dest, int size, int startLine, int endLine ) c
     // copy lines from screen buffer
     if (linesInScreenBuffer > 0)
         copyFromScreen(dest + linesInHistoryBuffer*columns,
-                startLine + linesInHistoryBuffer - history->getLines(),
+                startLine + linesInHistoryBuffer - _historyReflow.getLines(),
                 linesInScreenBuffer);
 
     // invert display when in screen mode
@@ -504,19 +693,67 @@ void Screen::getImage( Character* dest, int size, int startLine, int endLine ) c
             reverseRendition(dest[i]); // for reverse display
     }
 
-    // mark the character at the current cursor position
-    int cursorIndex = loc(cuX, cuY + linesInHistoryBuffer);
-    if(getMode(MODE_Cursor) && cursorIndex < columns*mergedLines)
-        dest[cursorIndex].rendition |= RE_CURSOR;
+    // mark the character at the current cursor position, startLine may
+    // be below the first line of the screen
+    int cursorLine = cuY + _historyReflow.getLines() - startLine;
+    if(getMode(MODE_Cursor) && cursorLine >= 0 && cursorLine < mergedLines)
+        dest[loc(cuX, cursorLine)].rendition |= RE_CURSOR;
+
+    if (styleRuns == nullptr)
+        return;
+
+    // the history lines are only read when they come into view, their
+    // runs are found as they are copied.  Reversing the whole screen
+    // keeps the runs as they are.
+    const int words = styleRunWords(columns);
+    for (int line = 0; line < linesInHistoryBuffer; line++)
+        findStyleRuns(dest + line*columns, columns, styleRuns + line*words);
+
+    const int firstScreenLine = startLine + linesInHistoryBuffer - _historyReflow.getLines();
+    for (int line = linesInHistoryBuffer; line < mergedLines; line++)
+    {
+        const int screenLine = firstScreenLine + line - linesInHistoryBuffer;
+        quint32* runs = styleRuns + line*words;
+        if (_staleStyleRuns[screenLine])
+            findLineStyleRuns(screenLine, runs);
+        else
+            memcpy(runs, _styleRuns.constData() + screenLine*words, words * sizeof(quint32));
+
+        // selected text is inverted
+        if (selBegin != -1)
+        {
+            const int imageLine = screenLine + _historyReflow.getLines();
+            bool selected = isSelected(0, imageLine);
+            for (int column = 1; column < columns; column++)
+            {
+                if (isSelected(column, imageLine) != selected)
+                {
+                    selected = !selected;
+                    setStyleRunStart(runs, column, true);
+                }
+            }
+        }
+    }
+
+    // the cursor is drawn past the end of the line when it waits to wrap
+    const int cursorIndex = loc(cuX, cursorLine);
+    if (getMode(MODE_Cursor) && cursorLine >= 0 && cursorIndex < mergedLines*columns)
+    {
+        quint32* runs = styleRuns + (cursorIndex / columns)*words;
+        const int cursorColumn = cursorIndex % columns;
+        setStyleRunStart(runs, cursorColumn, true);
+        if (cursorColumn + 1 < columns)
+            setStyleRunStart(runs, cursorColumn + 1, true);
+    }
 }
 
 QVector<LineProperty> Screen::getLineProperties( int startLine , int endLine ) const
 {
     Q_ASSERT( startLine >= 0 );
-    Q_ASSERT( endLine >= startLine && endLine < history->getLines() + lines );
+    Q_ASSERT( endLine >= startLine && endLine < _historyReflow.getLines() + lines );
 
     const int mergedLines = endLine-startLine+1;
-    const int linesInHistory = qBound(0,history->getLines()-startLine,mergedLines);
+    const int linesInHistory = qBound(0,_historyReflow.getLines()-startLine,mergedLines);
     const int linesInScreen = mergedLines - linesInHistory;
 
     QVector<LineProperty> result(mergedLines);
@@ -526,7 +763,7 @@ QVector<LineProperty> Screen::getLineProperties( int startLine , int endLine ) c
     for (int line = startLine; line < startLine + linesInHistory; line++)
     {
         //TODO Support for line properties other than wrapped lines
-        if (history->isWrappedLine(line))
+        if (_historyReflow.isWrappedLine(line))
         {
             result[index] = (LineProperty)(result[index] | LINE_WRAPPED);
         }
@@ -534,7 +771,7 @@ QVector<LineProperty> Screen::getLineProperties( int startLine , int endLine ) c
     }
 
     // copy properties for lines in screen buffer
-    const int firstScreenLine = startLine + linesInHistory - history->getLines();
+    const int firstScreenLine = startLine + linesInHistory - _historyReflow.getLines();
     for (int line = firstScreenLine; line < firstScreenLine+linesInScreen; line++)
     {
         result[index]=lineProperties[line];
@@ -638,7 +875,7 @@ void Screen::checkSelection(int from, int to)
 {
     if (selBegin == -1)
         return;
-    int scr_TL = loc(0, history->getLines());
+    int scr_TL = loc(0, _historyReflow.getLines());
     //Clear entire selection if it overlaps region [from, to]
     if ( (selBottomRight >= (from+scr_TL)) && (selTopLeft <= (to+scr_TL)) )
         clearSelection();
@@ -736,11 +973,17 @@ void Screen::displayCharacter(uint c)
 
     Character& currentChar = screenLines[cuY][cuX];
 
-    currentChar.character = c;
     currentChar.foregroundColor = effectiveForeground;
     currentChar.backgroundColor = effectiveBackground;
     currentChar.rendition = effectiveRendition;
     currentChar.isRealCharacter = true;
+    if (c <= MAX_CHARACTER_VALUE) {
+        currentChar.character = c;
+    } else {
+        // private use code points which do not fit into a character
+        currentChar.character = ExtendedCharTable::instance.createExtendedChar(&c, 1);
+        currentChar.rendition |= RE_EXTENDED_CHAR;
+    }
 
     lastDrawnChar = c;
 
@@ -764,9 +1007,72 @@ void Screen::displayCharacter(uint c)
 
         w--;
     }
+    updateStyleRuns(cuY, cuX, newCursorX - cuX);
     cuX = newCursorX;
 }
 
+void Screen::displayCharacters(const uint *chars, int count)
+{
+    // insertion shifts the rest of the line for every character, there is
+    // nothing to gain from batching here
+    if (getMode(MODE_Insert))
+    {
+        for (int i = 0; i < count; i++)
+            displayCharacter(chars[i]);
+        return;
+    }
+
+    int i = 0;
+    while (i < count)
+    {
+        if (Character::width(chars[i]) != 1 || chars[i] > MAX_CHARACTER_VALUE)
+        {
+            displayCharacter(chars[i]);
+            i++;
+            continue;
+        }
+
+        // same wrapping rules as displayCharacter()
+        if (cuX + 1 > columns) {
+            if (getMode(MODE_Wrap)) {
+                lineProperties[cuY] = (LineProperty)(lineProperties[cuY] | LINE_WRAPPED);
+                nextLine();
+            }
+            else
+                cuX = columns - 1;
+        }
+
+        // collect the single-width characters which fit on this line
+        const int limit = qMin(count, i + columns - cuX);
+        int end = i + 1;
+        while (end < limit && Character::width(chars[end]) == 1 && chars[end] <= MAX_CHARACTER_VALUE)
+            end++;
+        const int length = end - i;
+
+        ImageLine& line = screenLines[cuY];
+        if (line.size() < cuX + length)
+            line.resize(cuX + length);
+
+        lastPos = loc(cuX + length - 1, cuY);
+        checkSelection(loc(cuX, cuY), lastPos);
+
+        Character* cell = line.data() + cuX;
+        for (int j = 0; j < length; j++)
+        {
+            cell[j].character = chars[i + j];
+            cell[j].foregroundColor = effectiveForeground;
+            cell[j].backgroundColor = effectiveBackground;
+            cell[j].rendition = effectiveRendition;
+            cell[j].isRealCharacter = true;
+        }
+        updateStyleRuns(cuY, cuX, length);
+
+        lastDrawnChar = chars[end - 1];
+        cuX += length;
+        i = end;
+    }
+}
+
 void Screen::compose(const QString& /*compose*/)
 {
     Q_ASSERT( 0 /*Not implemented yet*/ );
@@ -889,7 +1195,7 @@ int Screen::getCursorY() const
 
 void Screen::clearImage(int loca, int loce, char c)
 {
-    int scr_TL=loc(0,history->getLines());
+    int scr_TL=loc(0,_historyReflow.getLines());
     //FIXME: check positions
 
     //Clear entire selection if it overlaps region to be moved...
@@ -929,6 +1235,7 @@ void Screen::clearImage(int loca, int loce, char c)
             for (int i=startCol;i<=endCol;i++)
                 data[i]=clearCh;
         }
+        updateStyleRuns(y, startCol, endCol - startCol + 1);
     }
 }
 
@@ -949,6 +1256,7 @@ void Screen::moveImage(int dest, int sourceBegin, int sourceEnd)
         {
             screenLines[ (dest/columns)+i ] = screenLines[ (sourceBegin/columns)+i ];
             lineProperties[(dest/columns)+i]=lineProperties[(sourceBegin/columns)+i];
+            moveStyleRuns((dest/columns)+i, (sourceBegin/columns)+i);
         }
     }
     else
@@ -957,6 +1265,7 @@ void Screen::moveImage(int dest, int sourceBegin, int sourceEnd)
         {
             screenLines[ (dest/columns)+i ] = screenLines[ (sourceBegin/columns)+i ];
             lineProperties[(dest/columns)+i]=lineProperties[(sourceBegin/columns)+i];
+            moveStyleRuns((dest/columns)+i, (sourceBegin/columns)+i);
         }
     }
 
@@ -973,7 +1282,7 @@ void Screen::moveImage(int dest, int sourceBegin, int sourceEnd)
     {
         bool beginIsTL = (selBegin == selTopLeft);
         int diff = dest - sourceBegin; // Scroll by this amount
-        int scr_TL=loc(0,history->getLines());
+        int scr_TL=loc(0,_historyReflow.getLines());
         int srca = sourceBegin+scr_TL; // Translate index from screen to global
         int srce = sourceEnd+scr_TL; // Translate index from screen to global
         int desta = srca+diff;
@@ -1218,6 +1527,11 @@ QString Screen::selectedText(bool preserveLineBreaks) const
     return result;
 }
 
+bool Screen::hasSelection() const
+{
+    return selBegin != -1;
+}
+
 bool Screen::isSelectionValid() const
 {
     return selTopLeft >= 0 && selBottomRight >= 0;
@@ -1285,16 +1599,17 @@ int Screen::copyLineToStream(int line ,
     //element on each call to copyLineToStream
     //(which is unnecessary since all elements will be overwritten anyway)
     static const int MAX_CHARS = 1024;
-    static Character characterBuffer[MAX_CHARS];
+    // per thread, the history search reads lines on a worker thread
+    static thread_local Character characterBuffer[MAX_CHARS];
 
     Q_ASSERT( count < MAX_CHARS );
 
     LineProperty currentLineProperties = 0;
 
     //determine if the line is in the history buffer or the screen image
-    if (line < history->getLines())
+    if (line < _historyReflow.getLines())
     {
-        const int lineLength = history->getLineLen(line);
+        const int lineLength = _historyReflow.getLineLen(line);
 
         // ensure that start position is before end of line
         start = qMin(start,qMax(0,lineLength-1));
@@ -1314,11 +1629,11 @@ int Screen::copyLineToStream(int line ,
         // safety checks
         Q_ASSERT( start >= 0 );
         Q_ASSERT( count >= 0 );
-        Q_ASSERT( (start+count) <= history->getLineLen(line) );
+        Q_ASSERT( (start+count) <= _historyReflow.getLineLen(line) );
 
-        history->getCells(line,start,count,characterBuffer);
+        _historyReflow.getCells(line,start,count,characterBuffer);
 
-        if ( history->isWrappedLine(line) )
+        if ( _historyReflow.isWrappedLine(line) )
             currentLineProperties |= LINE_WRAPPED;
     }
     else
@@ -1328,7 +1643,7 @@ int Screen::copyLineToStream(int line ,
 
         Q_ASSERT( count >= 0 );
 
-        const int screenLine = line-history->getLines();
+        const int screenLine = line-_historyReflow.getLines();
 
         Character* data = screenLines[screenLine].data();
         int length = screenLines[screenLine].count();
@@ -1368,6 +1683,37 @@ void Screen::writeLinesToStream(TerminalCharacterDecoder* decoder, int fromLine,
     writeToStream(decoder,loc(0,fromLine),loc(columns-1,toLine));
 }
 
+void Screen::writeWholeLinesToStream(TerminalCharacterDecoder* decoder, int fromLine, int toLine) const
+{
+    for (int y=fromLine;y<=toLine;y++)
+        copyLineToStream(y, 0, -1, decoder, true, true);
+}
+
+void Screen::appendHistoryLine(const ImageLine& line, bool wrapped)
+{
+    const int oldStoredLines = history->getLines();
+    const int oldHistLines = _historyReflow.getLines();
+
+    history->addCellsVector(line);
+    history->addLine(wrapped);
+    _historyIndex.addLine(line.constData(), line.count(), wrapped);
+
+    // the journal also keeps the lines the history drops, until its writer
+    // thread compacts it
+    if (_historyJournal)
+        _historyJournal->addLine(line.constData(), line.count(), wrapped);
+
+    // If the history is full, increment the count
+    // of dropped lines
+    const int droppedStoredLines = oldStoredLines + 1 - history->getLines();
+    _historyReflow.dropLines(droppedStoredLines);
+    _historyIndex.dropLines(droppedStoredLines);
+
+    const int dropped = qMax(0, oldHistLines + 1 - _historyReflow.getLines());
+    _droppedLines += dropped;
+    _droppedHistoryLines += dropped;
+}
+
 void Screen::addHistLine()
 {
     // add line to history buffer
@@ -1375,19 +1721,18 @@ void Screen::addHistLine()
 
     if (hasScroll())
     {
-        int oldHistLines = history->getLines();
+        int oldHistLines = _historyReflow.getLines();
 
-        history->addCellsVector(screenLines[0]);
-        history->addLine( lineProperties[0] & LINE_WRAPPED );
+        appendHistoryLine(screenLines[0], lineProperties[0] & LINE_WRAPPED);
 
-        int newHistLines = history->getLines();
+        int newHistLines = _historyReflow.getLines();
 
         bool beginIsTL = (selBegin == selTopLeft);
 
-        // If the history is full, increment the count
-        // of dropped lines
-        if ( newHistLines == oldHistLines )
-            _droppedLines++;
+        // a reflowed line which lost its first part to a full history
+        // is dropped as a whole
+        if ( newHistLines < oldHistLines )
+            clearSelection();
 
         // Adjust selection for the new point of reference
         if (newHistLines > oldHistLines)
@@ -1429,7 +1774,7 @@ void Screen::addHistLine()
 
 int Screen::getHistLines() const
 {
-    return history->getLines();
+    return _historyReflow.getLines();
 }
 
 void Screen::setScroll(const HistoryType& t , bool copyPreviousScroll)
@@ -1444,6 +1789,99 @@ void Screen::setScroll(const HistoryType& t , bool copyPreviousScroll)
         history = t.scroll(nullptr);
         delete oldScroll;
     }
+    _historyReflow.setHistory(history);
+    // the lines copied from the previous history are not indexed
+    _historyIndex.reset(history->getLines());
+    renumberHistory();
+
+    // lines the new history does not keep are dropped when the journal is
+    // compacted, only a cleared history is written anew
+    if (_historyJournal)
+    {
+        _historyJournal->setMaximumLines(history->getType().maximumLineCount());
+        if (!copyPreviousScroll)
+            writeHistoryToJournal();
+    }
+}
+
+void Screen::setHistoryJournal(const QString& fileName)
+{
+    if (_historyJournal)
+    {
+        if (_historyJournal->fileName() == fileName)
+            return;
+
+        // the lines on the screen down to the cursor or the last one with text
+        int lastLine = cuY;
+        for (int y = lines-1; y > lastLine; y--)
+        {
+            for (const Character& cell : qAsConst(screenLines[y]))
+            {
+                if (cell.character != ' ')
+                {
+                    lastLine = y;
+                    break;
+                }
+            }
+        }
+        for (int y = 0; y <= qMin(lastLine, lines-1); y++)
+            _historyJournal->addLine(screenLines[y].constData(), screenLines[y].count(),
+                                     lineProperties[y] & LINE_WRAPPED);
+
+        delete _historyJournal;
+        _historyJournal = nullptr;
+    }
+
+    if (!fileName.isEmpty())
+    {
+        _historyJournal = new HistoryJournal(fileName);
+        _historyJournal->setMaximumLines(history->getType().maximumLineCount());
+        writeHistoryToJournal();
+    }
+}
+
+void Screen::discardHistoryJournal()
+{
+    if (_historyJournal)
+    {
+        HistoryJournal::discard(_historyJournal);
+        _historyJournal = nullptr;
+    }
+}
+
+QString Screen::historyJournal() const
+{
+    return _historyJournal ? _historyJournal->fileName() : QString();
+}
+
+void Screen::writeHistoryToJournal()
+{
+    _historyJournal->beginRewrite();
+    ImageLine line;
+    const int storedLines = history->getLines();
+    for (int i = 0; i < storedLines; i++)
+    {
+        const int length = history->getLineLen(i);
+        line.resize(length);
+        history->getCells(i, 0, length, line.data());
+        _historyJournal->addLine(line.constData(), length, history->isWrappedLine(i));
+    }
+    _historyJournal->endRewrite();
+}
+
+bool Screen::restoreHistoryJournal(const QString& fileName)
+{
+    if (!hasScroll())
+        return false;
+
+    clearSelection();
+    ImageLine line;
+    return HistoryJournal::readLines(fileName, history->getType().maximumLineCount(),
+                                     [this, &line](const Character* cells, int count, bool wrapped) {
+        line.resize(count);
+        std::copy(cells, cells + count, line.begin());
+        appendHistoryLine(line, wrapped);
+    });
 }
 
 bool Screen::hasScroll() const
@@ -1451,6 +1889,111 @@ bool Screen::hasScroll() const
     return history->hasScroll();
 }
 
+qint64 Screen::historyMemoryUsage() const
+{
+    return history->memoryUsage() + _historyIndex.memoryUsage();
+}
+
+void Screen::usedRgbColors(QSet<int>& used) const
+{
+    const auto addColor = [&used](const CharacterColor& color)
+    {
+        const int index = color.rgbIndex();
+        if (index >= 0)
+            used.insert(index);
+    };
+    const auto addCells = [&addColor](const Character* cells, int count)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            addColor(cells[i].foregroundColor);
+            addColor(cells[i].backgroundColor);
+        }
+    };
+
+    for (int i = 0; i < lines; i++)
+        addCells(screenLines[i].constData(), screenLines[i].length());
+
+    // the history index tracks the colors of the lines added since it was
+    // reset, only the lines copied into the history before are read
+    _historyIndex.usedRgbColors(used);
+    ImageLine line;
+    const int storedLines = qMin(history->getLines(), _historyIndex.unindexedLines());
+    for (int i = 0; i < storedLines; i++)
+    {
+        const int length = history->getLineLen(i);
+        line.resize(length);
+        history->getCells(i, 0, length, line.data());
+        addCells(line.constData(), length);
+    }
+
+    addColor(currentForeground);
+    addColor(currentBackground);
+    addColor(effectiveForeground);
+    addColor(effectiveBackground);
+    addColor(savedState.foreground);
+    addColor(savedState.background);
+}
+
+void Screen::reduceHistoryMemoryUsage(qint64 maximum)
+{
+    const int oldHistLines = _historyReflow.getLines();
+    const int dropped = history->reduceMemoryUsage(maximum);
+    if (dropped > 0)
+    {
+        // the selection would now point at different lines
+        clearSelection();
+        _historyReflow.dropLines(dropped);
+        _historyIndex.dropLines(dropped);
+        _droppedLines += oldHistLines - _historyReflow.getLines();
+        _droppedHistoryLines += oldHistLines - _historyReflow.getLines();
+    }
+}
+
+void Screen::renumberHistory()
+{
+    static QAtomicInt lastGeneration;
+    _historyGeneration = lastGeneration.fetchAndAddRelaxed(1) + 1;
+    _droppedHistoryLines = 0;
+}
+
+int Screen::historyGeneration() const
+{
+    return _historyGeneration;
+}
+
+qint64 Screen::droppedHistoryLines() const
+{
+    return _droppedHistoryLines;
+}
+
+int Screen::completeHistoryLines() const
+{
+    int count = _historyReflow.getLines();
+    while (count > 0 && _historyReflow.isWrappedLine(count-1))
+        count--;
+    return count;
+}
+
+QVector<QPair<int,int> > Screen::historySearchRanges(const QString& text, int fromLine, int toLine) const
+{
+    QVector<QPair<int,int> > ranges;
+    const QVector<QPair<int,int> > storedRanges = _historyIndex.candidateLines(text);
+    for (const QPair<int,int>& stored : storedRanges)
+    {
+        const int first = qMax(fromLine, _historyReflow.firstLineOfStoredLine(stored.first));
+        const int last = qMin(toLine, _historyReflow.lastLineOfStoredLine(stored.second));
+        if (first > last)
+            continue;
+
+        if (!ranges.isEmpty() && ranges.last().second >= first-1)
+            ranges.last().second = qMax(ranges.last().second, last);
+        else
+            ranges.append(qMakePair(first, last));
+    }
+    return ranges;
+}
+
 const HistoryType& Screen::getScroll() const
 {
     return history->getType();
@@ -32,6 +32,7 @@
 // Konsole
 #include "Character.h"
 #include "History.h"
+#include "HistoryIndex.h"
 
 #define MODE_Origin    0
 #define MODE_Wrap      1
@@ -44,6 +45,8 @@
 namespace Konsole
 {
 
+class HistoryJournal;
+
 class TerminalCharacterDecoder;
 
 /**
@@ -349,6 +352,15 @@ public:
      */
     void displayCharacter(uint c);
 
+    /**
+     * Displays @p count characters starting at the current cursor position,
+     * with the same effect as calling displayCharacter() for each of them.
+     *
+     * Runs of single-width characters are written straight into the current
+     * line, with the wrap and bounds checks done once per line segment.
+     */
+    void displayCharacters(const uint *chars, int count);
+
     // Do composition with last shown character FIXME: Not implemented yet for KDE 4
     void compose(const QString& compose);
 
@@ -358,12 +370,24 @@ public:
      * existing lines are not truncated.  This prevents characters from being lost
      * if the terminal display is resized smaller and then larger again.
      *
+     * If reflowing lines is enabled (see setReflowLines()) and the number of
+     * columns changes, lines which were wrapped are joined and wrapped again at
+     * the new width instead, both on the screen and in the history.
+     *
      * The top and bottom margins are reset to the top and bottom of the new
      * screen size.  Tab stops are also reset and the current selection is
      * cleared.
      */
     void resizeImage(int new_lines, int new_columns);
 
+    /**
+     * Sets whether lines are wrapped again at the new width when the number
+     * of columns changes.  This is off by default; it suits the primary screen
+     * but not the alternate screen, whose programs redraw it after a resize.
+     */
+    void setReflowLines(bool enable) { _reflowLines = enable; }
+    bool reflowLines() const { return _reflowLines; }
+
     /**
      * Returns the current screen image.
      * The result is an array of Characters of size [getLines()][getColumns()] which
@@ -373,8 +397,22 @@ public:
      * @param size Size of @p dest in Characters
      * @param startLine Index of first line to copy
      * @param endLine Index of last line to copy
+     * @param styleRuns If not null, the style runs of the copied lines are
+     * written to it, styleRunWords(getColumns()) words per line.  Those of
+     * the lines on the screen are kept as the lines are written, see
+     * updateStyleRuns(), and are split where the selection or the cursor
+     * change the style.
+     */
+    void getImage( Character* dest , int size , int startLine , int endLine,
+                   quint32* styleRuns = nullptr ) const;
+
+    /**
+     * Finds the style runs of the lines on the screen which have changed in
+     * ways the screen does not follow as it writes characters, e.g. by
+     * inserting characters.  The emulation calls it after each block of
+     * output, so getImage() only copies them.
      */
-    void getImage( Character* dest , int size , int startLine , int endLine ) const;
+    void updateStyleRuns();
 
     /**
      * Returns the additional attributes associated with lines in the image.
@@ -406,6 +444,58 @@ public:
      * in a history buffer.
      */
     bool hasScroll() const;
+    /** Returns the number of bytes of memory used by the history. */
+    qint64 historyMemoryUsage() const;
+    /**
+     * Shrinks the history until it uses at most @p maximum bytes of memory.
+     * Lines dropped from the history are added to droppedLines().
+     */
+    void reduceHistoryMemoryUsage(qint64 maximum);
+
+    /**
+     * Returns a number which changes whenever the lines of the history are
+     * numbered differently, other than by dropping the oldest ones: when they
+     * are reflowed at a new width or the history is replaced.  No two screens
+     * share a generation.
+     */
+    int historyGeneration() const;
+    /**
+     * Returns the number of lines dropped from the top of the history since
+     * historyGeneration() changed.  Unlike droppedLines() it is never reset.
+     */
+    qint64 droppedHistoryLines() const;
+    /**
+     * Returns the number of lines at the top of the history which do not
+     * wrap onto a line after them.  They read the same whatever is added.
+     */
+    int completeHistoryLines() const;
+    /**
+     * Returns the history lines from @p fromLine to @p toLine which may
+     * contain @p text, as pairs of first and last line.  The other lines do
+     * not contain it with any case.  See HistoryIndex
+     */
+    QVector<QPair<int,int> > historySearchRanges(const QString& text, int fromLine, int toLine) const;
+
+    /**
+     * Keeps a copy of the history lines in the journal @p fileName, or stops
+     * keeping one if it is empty.  The journal is written with the lines of
+     * the history first.  When it is stopped, or the screen is destroyed,
+     * the lines on the screen are added to it, so they are part of the
+     * history once the journal is restored.  See HistoryJournal
+     */
+    void setHistoryJournal(const QString& fileName);
+    /**
+     * Stops keeping the history journal and removes its file.  Unlike
+     * setHistoryJournal(), this does not wait for the journal's writer.
+     */
+    void discardHistoryJournal();
+    /** Returns the file name of the history journal, or an empty string. */
+    QString historyJournal() const;
+    /**
+     * Adds the lines of the journal @p fileName to the history, as many as
+     * it keeps.  Returns false if the journal cannot be read.
+     */
+    bool restoreHistoryJournal(const QString& fileName);
 
     /**
      * Sets the start of the selection.
@@ -452,6 +542,8 @@ public:
       *  current selection.
       */
     bool isSelected(const int column,const int line) const;
+    /** Returns true if any text is selected. */
+    bool hasSelection() const;
 
     /**
      * Convenience method.  Returns the currently selected text.
@@ -469,6 +561,14 @@ public:
      */
     void writeLinesToStream(TerminalCharacterDecoder* decoder, int fromLine, int toLine) const;
 
+    /**
+     * Copies whole lines of the output to a stream, each followed by a new
+     * line character unless it wraps onto the next line.  Unlike
+     * writeLinesToStream(), consecutive ranges of lines can be copied one
+     * after another to get the output in pieces.
+     */
+    void writeWholeLinesToStream(TerminalCharacterDecoder* decoder, int fromLine, int toLine) const;
+
     /**
      * Copies the selected characters, set using @see setSelBeginXY and @see setSelExtentXY
      * into a stream.
@@ -572,6 +672,12 @@ public:
         }
         return result;
     }
+
+    /**
+     * Adds the indexes into RgbColorTable used by the screen, its history
+     * and its current and saved colors to @p used.
+     */
+    void usedRgbColors(QSet<int> &used) const;
 private:
 
     //copies a line of text from the screen or history into a stream using a
@@ -609,6 +715,15 @@ private:
     void scrollDown(int from, int i);
 
     void addHistLine();
+    // adds a line to the history, keeping track of the lines it drops
+    void appendHistoryLine(const QVector<Character>& line, bool wrapped);
+    // writes the journal anew with the lines of the history
+    void writeHistoryToJournal();
+
+    // rewraps the lines on the screen at new_columns, see resizeImage()
+    void reflowImage(int new_lines, int new_columns);
+    // starts a new historyGeneration()
+    void renumberHistory();
 
     void initTabStops();
 
@@ -627,6 +742,16 @@ private:
     // starting from 'startLine', where 0 is the first line in the history
     void copyFromHistory(Character* dest, int startLine, int count) const;
 
+    // forgets the style runs of all lines, after a resize
+    void resetStyleRuns();
+    // finds the style runs of the characters from 'column' to 'column+count'
+    // again, after they have been written
+    void updateStyleRuns(int line, int column, int count);
+    // finds the style runs of a whole screen line into 'runs'
+    void findLineStyleRuns(int line, quint32* runs) const;
+    // moves the style runs of a screen line along with the line
+    void moveStyleRuns(int dest, int source);
+
 
     // screen image ----------------
     int lines;
@@ -642,8 +767,22 @@ private:
 
     QVarLengthArray<LineProperty,64> lineProperties;
 
+    // the style runs of the screen lines, styleRunWords(columns) words per
+    // line, and the lines whose runs have to be found again
+    QVector<quint32> _styleRuns;
+    QVector<bool> _staleStyleRuns;
+
     // history buffer ---------------
     HistoryScroll* history;
+    // the history as it is shown, split again at the current width
+    HistoryReflow _historyReflow;
+    bool _reflowLines;
+    // the text of the stored history lines, for the history search
+    HistoryIndex _historyIndex;
+    int _historyGeneration;
+    qint64 _droppedHistoryLines;
+    // a copy of the history on disk, or nullptr
+    HistoryJournal* _historyJournal;
 
     // cursor location
     int cuX;
@@ -652,7 +791,7 @@ private:
     // cursor color and rendition info
     CharacterColor currentForeground;
     CharacterColor currentBackground;
-    quint8 currentRendition;
+    quint16 currentRendition;
 
     // margins ----------------
     int _topMargin;
@@ -675,7 +814,7 @@ private:
     // effective colors and rendition ------------
     CharacterColor effectiveForeground; // These are derived from
     CharacterColor effectiveBackground; // the cu_* variables above
-    quint8 effectiveRendition;          // to speed up operation
+    quint16 effectiveRendition;         // to speed up operation
 
     class SavedState
     {
@@ -685,7 +824,7 @@ private:
 
         int cursorColumn;
         int cursorLine;
-        quint8 rendition;
+        quint16 rendition;
         CharacterColor foreground;
         CharacterColor background;
     };
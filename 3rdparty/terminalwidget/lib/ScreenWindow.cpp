@@ -20,6 +20,9 @@
 // Own
 #include "ScreenWindow.h"
 
+// System
+#include <cstring>
+
 // Qt
 #include <QtDebug>
 
@@ -33,10 +36,20 @@ ScreenWindow::ScreenWindow(QObject* parent)
     , _windowBuffer(nullptr)
     , _windowBufferSize(0)
     , _bufferNeedsUpdate(true)
+    , _bufferScreen(nullptr)
+    , _bufferColumns(0)
+    , _bufferGeneration(0)
+    , _bufferFirstLine(0)
+    , _bufferStableRows(0)
+    , _bufferReversed(false)
+    , _bufferCharGeneration(0)
+    , _bufferColorGeneration(0)
     , _windowLines(1)
     , _currentLine(0)
     , _trackOutput(true)
+    , _screenLock(nullptr)
     , _scrollCount(0)
+    , _framePending(false)
 {
 }
 ScreenWindow::~ScreenWindow()
@@ -45,6 +58,7 @@ ScreenWindow::~ScreenWindow()
 }
 void ScreenWindow::setScreen(Screen* screen)
 {
+    QMutexLocker locker(_screenLock);
     Q_ASSERT( screen );
 
     _screen = screen;
@@ -55,8 +69,19 @@ Screen* ScreenWindow::screen() const
     return _screen;
 }
 
+void ScreenWindow::setScreenLock(QMutex* lock)
+{
+    _screenLock = lock;
+}
+
+QMutex* ScreenWindow::screenLock() const
+{
+    return _screenLock;
+}
+
 Character* ScreenWindow::getImage()
 {
+    QMutexLocker locker(_screenLock);
     // reallocate internal buffer if the window size has changed
     int size = windowLines() * windowColumns();
     if (_windowBuffer == nullptr || _windowBufferSize != size)
@@ -65,23 +90,86 @@ Character* ScreenWindow::getImage()
         _windowBufferSize = size;
         _windowBuffer = new Character[size];
         _bufferNeedsUpdate = true;
+        _bufferScreen = nullptr;
     }
+    // the same size may be split into lines differently
+    _styleRunBuffer.resize(windowLines() * styleRunWords(windowColumns()));
 
      if (!_bufferNeedsUpdate)
         return _windowBuffer;
 
-    _screen->getImage(_windowBuffer,size,
-                      currentLine(),endWindowLine());
+    // when scrolling through the history, only the lines which have come
+    // into view are read, the others are moved within the buffer
+    const int startLine = currentLine();
+    const int endLine = endWindowLine();
+    const int columns = windowColumns();
+    const int words = styleRunWords(columns);
+    const qint64 firstLine = startLine + _screen->droppedHistoryLines();
+    const QPair<int,int> kept = keepHistoryRows(firstLine);
+
+    if (kept.first > 0)
+        _screen->getImage(_windowBuffer, kept.first*columns,
+                          startLine, startLine + kept.first - 1,
+                          _styleRunBuffer.data());
+    if (startLine + kept.second <= endLine)
+        _screen->getImage(_windowBuffer + kept.second*columns, size - kept.second*columns,
+                          startLine + kept.second, endLine,
+                          _styleRunBuffer.data() + kept.second*words);
 
     // this window may look beyond the end of the screen, in which
     // case there will be an unused area which needs to be filled
     // with blank characters
     fillUnusedArea();
 
+    _bufferScreen = _screen;
+    _bufferColumns = columns;
+    _bufferGeneration = _screen->historyGeneration();
+    _bufferFirstLine = firstLine;
+    _bufferStableRows = _screen->hasSelection() ? 0
+                        : qBound(0, _screen->completeHistoryLines() - startLine, endLine - startLine + 1);
+    _bufferReversed = _screen->getMode(MODE_Screen);
+    _bufferCharGeneration = ExtendedCharTable::instance.generation();
+    _bufferColorGeneration = RgbColorTable::instance.generation();
+
     _bufferNeedsUpdate = false;
     return _windowBuffer;
 }
 
+const quint32* ScreenWindow::getStyleRuns() const
+{
+    return _styleRunBuffer.constData();
+}
+
+QPair<int,int> ScreenWindow::keepHistoryRows(qint64 firstLine)
+{
+    // selected text is drawn into the buffer and moves with the history
+    if (_bufferScreen != _screen || _bufferColumns != windowColumns()
+            || _bufferGeneration != _screen->historyGeneration()
+            || _bufferReversed != _screen->getMode(MODE_Screen)
+            || _bufferCharGeneration != ExtendedCharTable::instance.generation()
+            || _bufferColorGeneration != RgbColorTable::instance.generation()
+            || _screen->hasSelection())
+        return qMakePair(0, 0);
+
+    const qint64 keptFirstLine = qMax(firstLine, _bufferFirstLine);
+    const qint64 keptEndLine = qMin(firstLine + windowLines(), _bufferFirstLine + _bufferStableRows);
+    if (keptFirstLine >= keptEndLine)
+        return qMakePair(0, 0);
+
+    const int columns = _bufferColumns;
+    const int from = int(keptFirstLine - _bufferFirstLine);
+    const int to = int(keptFirstLine - firstLine);
+    const int rows = int(keptEndLine - keptFirstLine);
+    if (from != to)
+    {
+        const int words = styleRunWords(columns);
+        memmove(_windowBuffer + to*columns, _windowBuffer + from*columns, rows*columns*sizeof(Character));
+        memmove(_styleRunBuffer.data() + to*words, _styleRunBuffer.constData() + from*words,
+                rows*words*sizeof(quint32));
+    }
+    return qMakePair(to, to + rows);
+}
+
 void ScreenWindow::fillUnusedArea()
 {
     int screenEndLine = _screen->getHistLines() + _screen->getLines() - 1;
@@ -91,6 +179,15 @@ void ScreenWindow::fillUnusedArea()
     int charsToFill = unusedLines * windowColumns();
 
     Screen::fillWithDefaultChar(_windowBuffer + _windowBufferSize - charsToFill,charsToFill);
+
+    // blank lines are a single run
+    const int words = styleRunWords(windowColumns());
+    for (int line = windowLines() - qMax(0, unusedLines); line < windowLines(); line++)
+    {
+        quint32* runs = _styleRunBuffer.data() + line*words;
+        memset(runs, 0, words*sizeof(quint32));
+        runs[0] = 1u;
+    }
 }
 
 // return the index of the line at the end of this window, or if this window
@@ -102,11 +199,13 @@ void ScreenWindow::fillUnusedArea()
 //
 int ScreenWindow::endWindowLine() const
 {
+    QMutexLocker locker(_screenLock);
     return qMin(currentLine() + windowLines() - 1,
                 lineCount() - 1);
 }
 QVector<LineProperty> ScreenWindow::getLineProperties()
 {
+    QMutexLocker locker(_screenLock);
     QVector<LineProperty> result = _screen->getLineProperties(currentLine(),endWindowLine());
 
     if (result.count() != windowLines())
@@ -117,21 +216,25 @@ QVector<LineProperty> ScreenWindow::getLineProperties()
 
 QString ScreenWindow::selectedText( bool preserveLineBreaks ) const
 {
+    QMutexLocker locker(_screenLock);
     return _screen->selectedText( preserveLineBreaks );
 }
 
 void ScreenWindow::getSelectionStart( int& column , int& line )
 {
+    QMutexLocker locker(_screenLock);
     _screen->getSelectionStart(column,line);
     line -= currentLine();
 }
 void ScreenWindow::getSelectionEnd( int& column , int& line )
 {
+    QMutexLocker locker(_screenLock);
     _screen->getSelectionEnd(column,line);
     line -= currentLine();
 }
 void ScreenWindow::setSelectionStart( int column , int line , bool columnMode )
 {
+    QMutexLocker locker(_screenLock);
     _screen->setSelectionStart( column , qMin(line + currentLine(),endWindowLine())  , columnMode);
 
     _bufferNeedsUpdate = true;
@@ -140,6 +243,7 @@ void ScreenWindow::setSelectionStart( int column , int line , bool columnMode )
 
 void ScreenWindow::setSelectionEnd( int column , int line )
 {
+    QMutexLocker locker(_screenLock);
     _screen->setSelectionEnd( column , qMin(line + currentLine(),endWindowLine()) );
 
     _bufferNeedsUpdate = true;
@@ -153,6 +257,7 @@ void ScreenWindow::setSelectionEnd( int column , int line )
 ********************************************************************/
 void ScreenWindow::setSelectionAll()
 {
+    QMutexLocker locker(_screenLock);
     _screen->setSelectionAll();
 
     _bufferNeedsUpdate = true;
@@ -161,11 +266,13 @@ void ScreenWindow::setSelectionAll()
 
 bool ScreenWindow::isSelected(int column, int line)
 {
+    QMutexLocker locker(_screenLock);
     return _screen->isSelected(column, qMin(line + currentLine(), endWindowLine()));
 }
 
 void ScreenWindow::clearSelection()
 {
+    QMutexLocker locker(_screenLock);
     _screen->clearSelection();
 
     emit selectionChanged();
@@ -184,21 +291,25 @@ int ScreenWindow::windowLines() const
 
 int ScreenWindow::windowColumns() const
 {
+    QMutexLocker locker(_screenLock);
     return _screen->getColumns();
 }
 
 int ScreenWindow::lineCount() const
 {
+    QMutexLocker locker(_screenLock);
     return _screen->getHistLines() + _screen->getLines();
 }
 
 int ScreenWindow::columnCount() const
 {
+    QMutexLocker locker(_screenLock);
     return _screen->getColumns();
 }
 
 QPoint ScreenWindow::cursorPosition() const
 {
+    QMutexLocker locker(_screenLock);
     QPoint position;
 
     position.setX( _screen->getCursorX() );
@@ -209,11 +320,13 @@ QPoint ScreenWindow::cursorPosition() const
 
 int ScreenWindow::currentLine() const
 {
+    QMutexLocker locker(_screenLock);
     return qBound(0,_currentLine,lineCount()-windowLines());
 }
 
 void ScreenWindow::scrollBy( RelativeScrollMode mode , int amount )
 {
+    QMutexLocker locker(_screenLock);
     if ( mode == ScrollLines )
     {
         scrollTo( currentLine() + amount );
@@ -226,11 +339,13 @@ void ScreenWindow::scrollBy( RelativeScrollMode mode , int amount )
 
 bool ScreenWindow::atEndOfOutput() const
 {
+    QMutexLocker locker(_screenLock);
     return currentLine() == (lineCount()-windowLines());
 }
 
 void ScreenWindow::scrollTo( int line )
 {
+    QMutexLocker locker(_screenLock);
     int maxCurrentLineNumber = lineCount() - windowLines();
     line = qBound(0,line,maxCurrentLineNumber);
 
@@ -268,6 +383,7 @@ void ScreenWindow::resetScrollCount()
 
 QRect ScreenWindow::scrollRegion() const
 {
+    QMutexLocker locker(_screenLock);
     bool equalToScreenSize = windowLines() == _screen->getLines();
 
     if ( atEndOfOutput() && equalToScreenSize )
@@ -278,6 +394,7 @@ QRect ScreenWindow::scrollRegion() const
 
 void ScreenWindow::notifyOutputChanged()
 {
+    QMutexLocker locker(_screenLock);
     // move window to the bottom of the screen and update scroll count
     // if this window is currently tracking the bottom of the screen
     if ( _trackOutput )
@@ -305,4 +422,28 @@ void ScreenWindow::notifyOutputChanged()
     emit outputChanged();
 }
 
+void ScreenWindow::notifyFrameScheduled()
+{
+    if (_framePending)
+        return;
+    _framePending = true;
+    emit frameScheduled();
+}
+
+void ScreenWindow::notifyFramePainted()
+{
+    if (!_framePending)
+        return;
+    _framePending = false;
+    emit framePainted();
+}
+
+void ScreenWindow::notifyFrameDropped()
+{
+    if (!_framePending)
+        return;
+    _framePending = false;
+    emit frameDropped();
+}
+
 //#include "ScreenWindow.moc"
@@ -21,7 +21,9 @@
 #define SCREENWINDOW_H
 
 // Qt
+#include <QMutex>
 #include <QObject>
+#include <QPair>
 #include <QPoint>
 #include <QRect>
 
@@ -72,6 +74,14 @@ public:
     /** Returns the screen which this window looks onto */
     Screen* screen() const;
 
+    /**
+     * Sets the lock which guards the screen, see Emulation::screenLock().
+     * The window holds it while it accesses the screen.
+     */
+    void setScreenLock(QMutex* lock);
+    /** Returns the lock which guards the screen.  See setScreenLock() */
+    QMutex* screenLock() const;
+
     /**
      * Returns the image of characters which are currently visible through this window
      * onto the screen.
@@ -81,6 +91,12 @@ public:
      */
     Character* getImage();
 
+    /**
+     * Returns the style runs of the image returned by getImage(),
+     * styleRunWords(windowColumns()) words per line.  See Screen::getImage()
+     */
+    const quint32* getStyleRuns() const;
+
     /**
      * Returns the line attributes associated with the lines of characters which
      * are currently visible through this window
@@ -228,12 +244,41 @@ public slots:
      */
     void notifyOutputChanged();
 
+    /**
+     * Notifies the window that a view has scheduled a paint of its contents.  Until the
+     * view calls notifyFramePainted() or notifyFrameDropped(), the window has a frame
+     * pending, and the emulation holds back further output changes for a while.  Views
+     * which have nothing to paint, or are hidden, must not call this.
+     */
+    void notifyFrameScheduled();
+
+    /**
+     * Notifies the window that a view has painted its contents.  This causes the
+     * framePainted() signal to be emitted if a frame was pending, which the emulation
+     * uses to pace its updates.
+     */
+    void notifyFramePainted();
+
+    /**
+     * Notifies the window that the paint scheduled with notifyFrameScheduled() will not
+     * happen, for example because the view was hidden.  This causes the frameDropped()
+     * signal to be emitted if a frame was pending.
+     */
+    void notifyFrameDropped();
+
 signals:
     /**
      * Emitted when the contents of the associated terminal screen (see screen()) changes.
      */
     void outputChanged();
 
+    /** Emitted when a view has scheduled a paint of the window.  See notifyFrameScheduled() */
+    void frameScheduled();
+    /** Emitted when a view has painted the contents of the window.  See notifyFramePainted() */
+    void framePainted();
+    /** Emitted when a scheduled paint will not happen.  See notifyFrameDropped() */
+    void frameDropped();
+
     /**
      * Emitted when the screen window is scrolled to a different position.
      *
@@ -250,17 +295,40 @@ signals:
 private:
     int endWindowLine() const;
     void fillUnusedArea();
+    // moves the rows of the buffer which hold history lines that are in
+    // the window again to their new place and returns the range of rows
+    // they now cover, or an empty range if none can be kept
+    QPair<int,int> keepHistoryRows(qint64 firstLine);
 
     Screen* _screen; // see setScreen() , screen()
     Character* _windowBuffer;
     int _windowBufferSize;
+    QVector<quint32> _styleRunBuffer;
     bool _bufferNeedsUpdate;
 
+    // what the buffer holds: the line of its first row, counted from the
+    // start of history generation _bufferGeneration (see
+    // Screen::droppedHistoryLines()), and how many of its rows are
+    // complete history lines, which read the same until the history is
+    // renumbered.  The other rows are read again on every update.
+    Screen* _bufferScreen;
+    int _bufferColumns;
+    int _bufferGeneration;
+    qint64 _bufferFirstLine;
+    int _bufferStableRows;
+    bool _bufferReversed;
+    // the rows keep extended characters and RGB colors by index, which are
+    // only the same while ExtendedCharTable and RgbColorTable were not purged
+    int _bufferCharGeneration;
+    int _bufferColorGeneration;
+
     int  _windowLines;
     int  _currentLine; // see scrollTo() , currentLine()
     bool _trackOutput; // see setTrackOutput() , trackOutput()
+    QMutex* _screenLock;
     int  _scrollCount; // count of lines which the window has been scrolled by since
                        // the last call to resetScrollCount()
+    bool _framePending; // a view has scheduled a paint it has not done yet
 };
 
 }
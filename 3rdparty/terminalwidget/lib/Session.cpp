@@ -49,6 +49,20 @@ using namespace Konsole;
 
 int Session::lastSessionId = 0;
 
+// Output queued for the emulation thread before the pty stops being read
+#define MAX_PENDING_EMULATION_BYTES (1024 * 1024)
+
+EmulationWorker::EmulationWorker(Emulation * emulation)
+    : _emulation(emulation)
+{
+}
+
+void EmulationWorker::receiveData(const QByteArray & buffer, int offset, int length)
+{
+    _emulation->receiveData(buffer.constData() + offset, length);
+    emit dataProcessed(length);
+}
+
 Session::Session(QObject* parent) :
     QObject(parent),
         _shellProcess(nullptr)
@@ -74,6 +88,9 @@ Session::Session(QObject* parent) :
 //   , _zmodemProc(0)
 //   , _zmodemProgress(0)
         , _hasDarkBackground(false)
+        , _emulationThread(nullptr)
+        , _emulationWorker(nullptr)
+        , _pendingEmulationBytes(0)
 {
     //prepare DBus communication
 //    new SessionAdaptor(this);
@@ -599,6 +616,13 @@ Session::~Session()
     if(nullptr != _sessionProcessInfo){
         delete _sessionProcessInfo;
     }
+    if(nullptr != _emulationThread){
+        // output still queued for the emulation is dropped
+        _emulationThread->quit();
+        _emulationThread->wait();
+        delete _emulationWorker;
+        delete _emulationThread;
+    }
     if(nullptr != _emulation){
         delete _emulation;
     }
@@ -759,6 +783,31 @@ void Session::clearHistory()
     _emulation->clearHistory();
 }
 
+void Session::setHistoryJournal(const QString &fileName)
+{
+    _emulation->setHistoryJournal(fileName);
+}
+
+void Session::discardHistoryJournal()
+{
+    _emulation->discardHistoryJournal();
+}
+
+bool Session::restoreHistory(const QString &fileName)
+{
+    return _emulation->restoreHistory(fileName);
+}
+
+qint64 Session::historyMemoryUsage() const
+{
+    return _emulation->historyMemoryUsage();
+}
+
+void Session::reduceHistoryMemoryUsage(qint64 maximum)
+{
+    _emulation->reduceHistoryMemoryUsage(maximum);
+}
+
 QStringList Session::arguments() const
 {
     return _arguments;
@@ -835,6 +884,16 @@ bool Session::flowControlEnabled() const
 {
     return _flowControl;
 }
+
+void Session::setReceiveBudget(int bytes)
+{
+    _shellProcess->setReceiveBudget(bytes);
+}
+
+int Session::receiveBudget() const
+{
+    return _shellProcess->receiveBudget();
+}
 //void Session::fireZModemDetected()
 //{
 //  if (!_zmodemBusy)
@@ -950,10 +1009,71 @@ void Session::zmodemFinished()
 */
 void Session::onReceiveBlock( const char * buf, int len )
 {
-    _emulation->receiveData( buf, len );
+    if (_emulationWorker) {
+        // the emulation thread shares the chunk the pty has moved out of its
+        // buffer, only small chunks and output changed by the pty are copied
+        QByteArray buffer = _shellProcess->receivedBuffer();
+        int offset = 0;
+        if (!buffer.isNull() && buf >= buffer.constData()
+                && buf + len <= buffer.constData() + buffer.size())
+            offset = int(buf - buffer.constData());
+        else
+            buffer = QByteArray(buf, len);
+        _pendingEmulationBytes += len;
+        QMetaObject::invokeMethod(_emulationWorker, "receiveData", Qt::QueuedConnection,
+                                  Q_ARG(QByteArray, buffer), Q_ARG(int, offset), Q_ARG(int, len));
+
+        // don't let the emulation thread fall behind without bound
+        if (_pendingEmulationBytes > MAX_PENDING_EMULATION_BYTES)
+            _shellProcess->setReceiveSuspended(true);
+    } else {
+        _emulation->receiveData( buf, len );
+    }
     emit receivedData( QString::fromLatin1( buf, len ) );
 }
 
+void Session::onEmulationDataProcessed(int length)
+{
+    _pendingEmulationBytes -= length;
+    if (_pendingEmulationBytes <= MAX_PENDING_EMULATION_BYTES / 2)
+        _shellProcess->setReceiveSuspended(false);
+}
+
+void Session::setEmulationThreaded(bool threaded)
+{
+    if (threaded == isEmulationThreaded())
+        return;
+
+    if (isRunning()) {
+        qWarning() << "Session::setEmulationThreaded - Cannot be changed while the session is running.";
+        return;
+    }
+
+    if (threaded) {
+        _emulationThread = new QThread();
+        _emulationWorker = new EmulationWorker(_emulation);
+        _emulationWorker->moveToThread(_emulationThread);
+        connect(_emulationWorker, SIGNAL(dataProcessed(int)),
+                this, SLOT(onEmulationDataProcessed(int)));
+        _emulationThread->start();
+        _shellProcess->setKeepReceivedData(true);
+    } else {
+        _emulationThread->quit();
+        _emulationThread->wait();
+        delete _emulationWorker;
+        delete _emulationThread;
+        _emulationWorker = nullptr;
+        _emulationThread = nullptr;
+        _pendingEmulationBytes = 0;
+        _shellProcess->setKeepReceivedData(false);
+    }
+}
+
+bool Session::isEmulationThreaded() const
+{
+    return _emulationThread != nullptr;
+}
+
 QSize Session::size()
 {
     return _emulation->imageSize();
@@ -26,6 +26,7 @@
 #define SESSION_H
 
 #include <QStringList>
+#include <QThread>
 #include <QWidget>
 
 #include "Emulation.h"
@@ -41,6 +42,31 @@ class TerminalDisplay;
 class ProcessInfo;
 //class ZModemDialog;
 
+/**
+ * Passes the output of a session's terminal process to its emulation on
+ * the session's emulation thread.  See Session::setEmulationThreaded()
+ */
+class EmulationWorker : public QObject {
+    Q_OBJECT
+
+public:
+    explicit EmulationWorker(Emulation * emulation);
+
+public slots:
+    /**
+     * Processes the @p length bytes at @p offset in @p buffer with the
+     * emulation and emits dataProcessed()
+     */
+    void receiveData(const QByteArray & buffer, int offset, int length);
+
+signals:
+    /** Emitted when @p length bytes of output have been processed */
+    void dataProcessed(int length);
+
+private:
+    Emulation * _emulation;
+};
+
 /**
  * Represents a terminal session consisting of a pseudo-teletype and a terminal emulation.
  * The pseudo-teletype (or PTY) handles I/O between the terminal process and Konsole.
@@ -215,6 +241,31 @@ public:
      * Clears the history store used by this session.
      */
     void clearHistory();
+    /**
+     * Keeps a journal of the history in @p fileName, see
+     * Emulation::setHistoryJournal()
+     */
+    void setHistoryJournal(const QString &fileName);
+    /**
+     * Stops keeping the journal of the history and removes it, see
+     * Emulation::discardHistoryJournal()
+     */
+    void discardHistoryJournal();
+    /**
+     * Adds the lines of the history journal @p fileName to the history, see
+     * Emulation::restoreHistory()
+     */
+    bool restoreHistory(const QString &fileName);
+    /**
+     * Returns the number of bytes of memory used by the history store of
+     * this session.  See SessionManager::setHistoryMemoryBudget()
+     */
+    qint64 historyMemoryUsage() const;
+    /**
+     * Shrinks the history store of this session until it uses at most
+     * @p maximum bytes of memory.
+     */
+    void reduceHistoryMemoryUsage(qint64 maximum);
 
     /**
      * Enables monitoring for activity in the session.
@@ -315,6 +366,26 @@ public:
     /** Returns whether flow control is enabled for this terminal session. */
     bool flowControlEnabled() const;
 
+    /**
+     * Sets how many bytes of output are processed in one iteration of the
+     * event loop, or 0 for no limit.  See Pty::setReceiveBudget()
+     */
+    void setReceiveBudget(int bytes);
+    /** Returns the receive budget in bytes.  See setReceiveBudget() */
+    int receiveBudget() const;
+
+    /**
+     * Sets whether the output of the terminal process is processed on a separate
+     * emulation thread, so that a busy session does not stall the GUI.  The views
+     * are still updated on the GUI thread, from a copy of the screen image taken
+     * while holding Emulation::screenLock().
+     *
+     * This can only be changed before the session is started.
+     */
+    void setEmulationThreaded(bool threaded);
+    /** Returns true if output is processed on an emulation thread.  See setEmulationThreaded() */
+    bool isEmulationThreaded() const;
+
     /**
      * Sends @p text to the current foreground terminal program.
      */
@@ -537,6 +608,7 @@ private slots:
 //  void fireZModemDetected();
 
     void onReceiveBlock( const char * buffer, int len );
+    void onEmulationDataProcessed(int length);
     void monitorTimerDone();
 
     void onViewSizeChange(int height, int width);
@@ -619,6 +691,10 @@ private:
 
     int ptySlaveFd;
 
+    QThread *      _emulationThread;
+    EmulationWorker * _emulationWorker;
+    int            _pendingEmulationBytes; // output queued for the emulation thread
+
 };
 
 /**
@@ -23,6 +23,9 @@
 // Own
 #include "SessionManager.h"
 
+// Standard Library
+#include <algorithm>
+
 // Qt
 #include <QStringList>
 #include <QTextCodec>
@@ -39,8 +42,15 @@ SessionManager *SessionManager::instance()
     return theSessionManager;
 }
 
+// interval at which the history memory budget is checked
+static const int HISTORY_MEMORY_CHECK_INTERVAL = 1000;
+
 SessionManager::SessionManager()
+    : _historyMemoryBudget(0)
+    , _sessionViewCount(0)
 {
+    _historyMemoryTimer.setInterval(HISTORY_MEMORY_CHECK_INTERVAL);
+    connect(&_historyMemoryTimer, SIGNAL(timeout()), this, SLOT(enforceHistoryMemoryBudget()));
 }
 
 SessionManager::~SessionManager()
@@ -68,6 +78,7 @@ void SessionManager::sessionTerminated(Session *session)
     Q_ASSERT(session);
 
     _sessions.removeAll(session);
+    _sessionViewOrderMap.remove(session->sessionId());
 
     session->deleteLater();
 }
@@ -94,6 +105,7 @@ bool SessionManager::removeSession(int id)
 
     if (removeIndex >= 0) {
         _sessions.removeAt(removeIndex);
+        _sessionViewOrderMap.remove(id);
         return true;
     }
 
@@ -159,3 +171,69 @@ int SessionManager::getTerminalPathDepth(int sessionId)
 {
     return _terminalPathDepthMap.value(sessionId);
 }
+
+void SessionManager::setHistoryMemoryBudget(qint64 bytes)
+{
+    _historyMemoryBudget = qMax(Q_INT64_C(0), bytes);
+
+    if (_historyMemoryBudget > 0) {
+        _historyMemoryTimer.start();
+        enforceHistoryMemoryBudget();
+    } else {
+        _historyMemoryTimer.stop();
+    }
+}
+
+qint64 SessionManager::historyMemoryBudget() const
+{
+    return _historyMemoryBudget;
+}
+
+qint64 SessionManager::historyMemoryUsage() const
+{
+    qint64 usage = 0;
+    for (Session *session : _sessions)
+        usage += session->historyMemoryUsage();
+    return usage;
+}
+
+qint64 SessionManager::historyMemoryUsage(int sessionId) const
+{
+    for (Session *session : _sessions) {
+        if (session->sessionId() == sessionId)
+            return session->historyMemoryUsage();
+    }
+    return 0;
+}
+
+void SessionManager::setSessionViewed(int sessionId)
+{
+    _sessionViewOrderMap.insert(sessionId, ++_sessionViewCount);
+}
+
+void SessionManager::enforceHistoryMemoryBudget()
+{
+    if (_historyMemoryBudget <= 0)
+        return;
+
+    qint64 usage = historyMemoryUsage();
+    if (usage <= _historyMemoryBudget)
+        return;
+
+    // sessions which have never been shown come first, the one viewed last
+    // is only reduced if the others cannot make enough room
+    QList<Session *> sessions = _sessions;
+    std::stable_sort(sessions.begin(), sessions.end(), [this](Session *first, Session *second) {
+        return _sessionViewOrderMap.value(first->sessionId())
+               < _sessionViewOrderMap.value(second->sessionId());
+    });
+
+    for (Session *session : qAsConst(sessions)) {
+        const qint64 sessionUsage = session->historyMemoryUsage();
+        const qint64 excess = usage - _historyMemoryBudget;
+        session->reduceHistoryMemoryUsage(qMax(Q_INT64_C(0), sessionUsage - excess));
+        usage -= sessionUsage - session->historyMemoryUsage();
+        if (usage <= _historyMemoryBudget)
+            break;
+    }
+}
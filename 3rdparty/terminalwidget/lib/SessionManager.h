@@ -28,6 +28,7 @@
 #include <QHash>
 #include <QList>
 #include <QMap>
+#include <QTimer>
 
 namespace Konsole {
 class Session;
@@ -87,6 +88,26 @@ public:
     void setTerminalPathDepth(int sessionId, int pathDepth);
     int getTerminalPathDepth(int sessionId);
 
+    /**
+     * Sets the number of bytes of memory the history of all sessions together
+     * may use, or 0 for no limit.  When the histories grow beyond it, the
+     * histories of the sessions which were viewed least recently are
+     * compressed or lose their oldest lines first.
+     */
+    void setHistoryMemoryBudget(qint64 bytes);
+    qint64 historyMemoryBudget() const;
+
+    /** Returns the number of bytes of memory used by the history of all sessions. */
+    qint64 historyMemoryUsage() const;
+    /** Returns the number of bytes of memory used by the history of session @p sessionId. */
+    qint64 historyMemoryUsage(int sessionId) const;
+
+    /**
+     * Called when the output of session @p sessionId is shown to the user.
+     * Used to decide whose history is reduced first, see setHistoryMemoryBudget()
+     */
+    void setSessionViewed(int sessionId);
+
 signals:
     void sessionIdle(bool isIdle);
 
@@ -98,6 +119,10 @@ protected Q_SLOTS:
      */
     void sessionTerminated(Session *session);
 
+private Q_SLOTS:
+    // reduces the histories until they fit into the memory budget
+    void enforceHistoryMemoryBudget();
+
 private:
     QList<Session *> _sessions; // list of running sessions
     QHash<Session *, int> _restoreMapping;
@@ -111,6 +136,12 @@ private:
     QMap<int, bool> _terminalResizeStateMap;
     //存储当前shell提示符的路径深度Map
     QMap<int, int> _terminalPathDepthMap;
+
+    qint64 _historyMemoryBudget;
+    QTimer _historyMemoryTimer;
+    //存储session最近一次被查看的顺序Map，数值越大越晚被查看
+    QMap<int, quint64> _sessionViewOrderMap;
+    quint64 _sessionViewCount;
 };
 
 }
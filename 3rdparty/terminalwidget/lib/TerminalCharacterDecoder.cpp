@@ -22,9 +22,6 @@
 // Own
 #include "TerminalCharacterDecoder.h"
 
-// std
-#include <cwctype>
-
 // Qt
 #include <QTextStream>
 
@@ -34,8 +31,6 @@
 // Konsole
 #include "konsole_wcwidth.h"
 
-#include <cwctype>
-
 using namespace Konsole;
 PlainTextDecoder::PlainTextDecoder()
  : _output(nullptr)
@@ -142,7 +137,13 @@ void PlainTextDecoder::decodeLine(const Character* const characters, int count,
             // lost in some situation. One typical example is copying the result
             // of `dialog --infobox "qwe" 10 10` .
             if (characters[i].isRealCharacter || i <= realCharacterGuard) {
-                plainText.append(QString::fromUcs4(&characters[i].character, 1));
+                const uint character = characters[i].character;
+                if (QChar::requiresSurrogates(character)) {
+                    plainText.append(QChar(QChar::highSurrogate(character)));
+                    plainText.append(QChar(QChar::lowSurrogate(character)));
+                } else {
+                    plainText.append(QChar(character));
+                }
                 i += qMax(1, characters[i].width());
             } else {
                 ++i;  // should we 'break' directly here?
@@ -152,6 +153,30 @@ void PlainTextDecoder::decodeLine(const Character* const characters, int count,
     *_output << plainText;
 }
 
+// appends a character to HTML text, escaping the characters used by tags
+static void appendHtmlEscaped(QString& text, uint character)
+{
+    switch (character) {
+    case '<':
+        text.append(QLatin1String("&lt;"));
+        break;
+    case '>':
+        text.append(QLatin1String("&gt;"));
+        break;
+    case '&':
+        text.append(QLatin1String("&amp;"));
+        break;
+    default:
+        if (QChar::requiresSurrogates(character)) {
+            text.append(QChar(QChar::highSurrogate(character)));
+            text.append(QChar(QChar::lowSurrogate(character)));
+        } else {
+            text.append(QChar(character));
+        }
+        break;
+    }
+}
+
 HTMLDecoder::HTMLDecoder() :
         _output(nullptr)
     ,_colorTable(base_color_table)
@@ -165,58 +190,67 @@ void HTMLDecoder::begin(QTextStream* output)
 {
     _output = output;
 
-    std::wstring text;
+    QString text;
 
     //open monospace span
     openSpan(text,QLatin1String("font-family:monospace"));
 
-    *output << QString::fromStdWString(text);
+    *output << text;
 }
 
 void HTMLDecoder::end()
 {
     Q_ASSERT( _output );
 
-    std::wstring text;
+    QString text;
 
     closeSpan(text);
 
-    *_output << QString::fromStdWString(text);
+    *_output << text;
 
     _output = nullptr;
 
 }
 
 //TODO: Support for LineProperty (mainly double width , double height)
-void HTMLDecoder::decodeLine(const Character* const characters, int count, LineProperty /*properties*/)
+void HTMLDecoder::decodeLine(const Character* const characters, int count, LineProperty properties)
 {
     Q_ASSERT( _output );
 
-    std::wstring text;
+    QString text;
+    text.reserve(count * 2);
 
     int spaceCount = 0;
 
-    for (int i=0;i<count;i++)
+    for (int i=0;i<count;)
     {
-        wchar_t ch(characters[i].character);
+        const Character& character = characters[i];
+        const bool extended = character.rendition & RE_EXTENDED_CHAR;
+
+        // the line break is added below
+        if (!extended && character.character == '\n')
+        {
+            i++;
+            continue;
+        }
 
         //check if appearance of character is different from previous char
-        if ( characters[i].rendition != _lastRendition  ||
-             characters[i].foregroundColor != _lastForeColor  ||
-             characters[i].backgroundColor != _lastBackColor )
+        if ( character.rendition != _lastRendition  ||
+             character.foregroundColor != _lastForeColor  ||
+             character.backgroundColor != _lastBackColor )
         {
             if ( _innerSpanOpen )
                     closeSpan(text);
 
-            _lastRendition = characters[i].rendition;
-            _lastForeColor = characters[i].foregroundColor;
-            _lastBackColor = characters[i].backgroundColor;
+            _lastRendition = character.rendition;
+            _lastForeColor = character.foregroundColor;
+            _lastBackColor = character.backgroundColor;
 
             //build up style string
             QString style;
 
             bool useBold;
-            ColorEntry::FontWeight weight = characters[i].fontWeight(_colorTable);
+            ColorEntry::FontWeight weight = character.fontWeight(_colorTable);
             if (weight == ColorEntry::UseCurrentFormat)
                 useBold = _lastRendition & RE_BOLD;
             else
@@ -233,7 +267,7 @@ void HTMLDecoder::decodeLine(const Character* const characters, int count, LineP
             {
                 style.append( QString::fromLatin1("color:%1;").arg(_lastForeColor.color(_colorTable).name() ) );
 
-                if (!characters[i].isTransparent(_colorTable))
+                if (!character.isTransparent(_colorTable))
                 {
                     style.append( QString::fromLatin1("background-color:%1;").arg(_lastBackColor.color(_colorTable).name() ) );
                 }
@@ -244,51 +278,218 @@ void HTMLDecoder::decodeLine(const Character* const characters, int count, LineP
             _innerSpanOpen = true;
         }
 
+        if (extended)
+        {
+            ushort extendedCharLength = 0;
+            const uint* chars = ExtendedCharTable::instance.lookupExtendedChar(character.character, extendedCharLength);
+            if (chars != nullptr)
+            {
+                for (int j = 0; j < extendedCharLength; j++)
+                    appendHtmlEscaped(text, chars[j]);
+                i += qMax(1, Character::stringWidth(chars, extendedCharLength));
+            }
+            else
+            {
+                i++;
+            }
+            spaceCount = 0;
+            continue;
+        }
+
         //handle whitespace
-        if (std::iswspace(ch))
+        if (QChar::isSpace(character.character))
             spaceCount++;
         else
             spaceCount = 0;
 
-
         //output current character
         if (spaceCount < 2)
         {
             //escape HTML tag characters and just display others as they are
-            if ( ch == '<' )
-                text.append(L"&lt;");
-            else if (ch == '>')
-                    text.append(L"&gt;");
-            else
-                    text.push_back(ch);
+            if (character.character != 0)
+                appendHtmlEscaped(text, character.character);
         }
         else
         {
-            text.append(L"&nbsp;"); //HTML truncates multiple spaces, so use a space marker instead
+            text.append(QLatin1String("&nbsp;")); //HTML truncates multiple spaces, so use a space marker instead
         }
 
+        // the cells after a double width character only hold its place
+        i += qMax(1, character.width());
     }
 
     //close any remaining open inner spans
     if ( _innerSpanOpen )
         closeSpan(text);
 
-    //start new line
-    text.append(L"<br>");
+    //start new line, unless the line goes on in the next one
+    if ( !(properties & LINE_WRAPPED) )
+        text.append(QLatin1String("<br>"));
 
-    *_output << QString::fromStdWString(text);
+    *_output << text;
 }
-void HTMLDecoder::openSpan(std::wstring& text , const QString& style)
+void HTMLDecoder::openSpan(QString& text , const QString& style)
 {
-    text.append( QString(QLatin1String("<span style=\"%1\">")).arg(style).toStdWString() );
+    text.append( QString(QLatin1String("<span style=\"%1\">")).arg(style) );
 }
 
-void HTMLDecoder::closeSpan(std::wstring& text)
+void HTMLDecoder::closeSpan(QString& text)
 {
-    text.append(L"</span>");
+    text.append(QLatin1String("</span>"));
 }
 
 void HTMLDecoder::setColorTable(const ColorEntry* table)
 {
     _colorTable = table;
 }
+
+// renditions which are written as SGR attributes.  The colours of reversed
+// characters are swapped on the screen already.
+static const quint16 ANSI_RENDITIONS = RE_BOLD | RE_BLINK | RE_UNDERLINE | RE_ITALIC | RE_FAINT
+                                       | RE_STRIKEOUT | RE_CONCEAL | RE_OVERLINE;
+
+static bool isDefaultColor(const CharacterColor& color, int which)
+{
+    CharacterColor intensive(COLOR_SPACE_DEFAULT, which);
+    intensive.setIntensive();
+    return color == CharacterColor(COLOR_SPACE_DEFAULT, which) || color == intensive;
+}
+
+AnsiDecoder::AnsiDecoder()
+    : _output(nullptr)
+    , _styled(false)
+    , _lastRendition(DEFAULT_RENDITION)
+    , _lastForeColor(COLOR_SPACE_DEFAULT, DEFAULT_FORE_COLOR)
+    , _lastBackColor(COLOR_SPACE_DEFAULT, DEFAULT_BACK_COLOR)
+{
+}
+
+void AnsiDecoder::begin(QTextStream* output)
+{
+    _output = output;
+}
+
+void AnsiDecoder::end()
+{
+    _output = nullptr;
+}
+
+void AnsiDecoder::appendStyle(QString& text, const Character& character)
+{
+    _lastRendition = character.rendition & ANSI_RENDITIONS;
+    _lastForeColor = character.foregroundColor;
+    _lastBackColor = character.backgroundColor;
+
+    QString sequence = QLatin1String("\033[0");
+    if (_lastRendition & RE_BOLD)
+        sequence.append(QLatin1String(";1"));
+    if (_lastRendition & RE_FAINT)
+        sequence.append(QLatin1String(";2"));
+    if (_lastRendition & RE_ITALIC)
+        sequence.append(QLatin1String(";3"));
+    if (_lastRendition & RE_UNDERLINE)
+        sequence.append(QLatin1String(";4"));
+    if (_lastRendition & RE_BLINK)
+        sequence.append(QLatin1String(";5"));
+    if (_lastRendition & RE_CONCEAL)
+        sequence.append(QLatin1String(";8"));
+    if (_lastRendition & RE_STRIKEOUT)
+        sequence.append(QLatin1String(";9"));
+    if (_lastRendition & RE_OVERLINE)
+        sequence.append(QLatin1String(";53"));
+
+    const bool defaultFore = isDefaultColor(_lastForeColor, DEFAULT_FORE_COLOR);
+    const bool defaultBack = isDefaultColor(_lastBackColor, DEFAULT_BACK_COLOR);
+    if (isDefaultColor(_lastForeColor, DEFAULT_BACK_COLOR) && isDefaultColor(_lastBackColor, DEFAULT_FORE_COLOR)) {
+        // the default colours swapped, which only reverse video can select
+        sequence.append(QLatin1String(";7"));
+        _styled = true;
+    } else {
+        if (!defaultFore && _lastForeColor.isValid())
+            sequence.append(QLatin1Char(';')).append(_lastForeColor.sgrParameters(true));
+        if (!defaultBack && _lastBackColor.isValid())
+            sequence.append(QLatin1Char(';')).append(_lastBackColor.sgrParameters(false));
+        _styled = _lastRendition != DEFAULT_RENDITION || !defaultFore || !defaultBack;
+    }
+    sequence.append(QLatin1Char('m'));
+
+    text.append(sequence);
+}
+
+void AnsiDecoder::decodeLine(const Character* const characters, int count, LineProperty /*properties*/)
+{
+    Q_ASSERT(_output);
+
+    QString text;
+    text.reserve(count);
+
+    // each line starts with the default appearance
+    const Character defaultCharacter;
+    _lastRendition = DEFAULT_RENDITION;
+    _lastForeColor = defaultCharacter.foregroundColor;
+    _lastBackColor = defaultCharacter.backgroundColor;
+    _styled = false;
+
+    // find out the last technically real character in the line, see
+    // PlainTextDecoder::decodeLine()
+    int realCharacterGuard = -1;
+    for (int i = count - 1 ; i >= 0 ; i--) {
+        if (characters[i].isRealCharacter && characters[i].character != '\n') {
+            realCharacterGuard = i;
+            break;
+        }
+    }
+
+    for (int i = 0; i < count;) {
+        const Character& character = characters[i];
+        const bool extended = character.rendition & RE_EXTENDED_CHAR;
+
+        if (!extended && character.character == '\n') {
+            // the appearance ends with the line
+            if (_styled) {
+                text.append(QLatin1String("\033[0m"));
+                _styled = false;
+            }
+            text.append(QLatin1Char('\n'));
+            ++i;
+            continue;
+        }
+        if (!extended && !character.isRealCharacter && i > realCharacterGuard) {
+            ++i;
+            continue;
+        }
+
+        if ((character.rendition & ANSI_RENDITIONS) != _lastRendition
+                || character.foregroundColor != _lastForeColor
+                || character.backgroundColor != _lastBackColor) {
+            appendStyle(text, character);
+        }
+
+        if (extended) {
+            ushort extendedCharLength = 0;
+            const uint* chars = ExtendedCharTable::instance.lookupExtendedChar(character.character, extendedCharLength);
+            if (chars != nullptr) {
+                text.append(QString::fromUcs4(chars, extendedCharLength));
+                i += qMax(1, Character::stringWidth(chars, extendedCharLength));
+            } else {
+                ++i;
+            }
+        } else {
+            const uint ch = character.character;
+            if (QChar::requiresSurrogates(ch)) {
+                text.append(QChar(QChar::highSurrogate(ch)));
+                text.append(QChar(QChar::lowSurrogate(ch)));
+            } else {
+                text.append(QChar(ch));
+            }
+            i += qMax(1, character.width());
+        }
+    }
+
+    if (_styled) {
+        text.append(QLatin1String("\033[0m"));
+        _styled = false;
+    }
+
+    *_output << text;
+}
@@ -133,18 +133,50 @@ public:
     void end() override;
 
 private:
-    void openSpan(std::wstring& text , const QString& style);
-    void closeSpan(std::wstring& text);
+    void openSpan(QString& text , const QString& style);
+    void closeSpan(QString& text);
 
     QTextStream* _output;
     const ColorEntry* _colorTable;
     bool _innerSpanOpen;
-    quint8 _lastRendition;
+    quint16 _lastRendition;
     CharacterColor _lastForeColor;
     CharacterColor _lastBackColor;
 
 };
 
+/**
+ * A terminal character decoder which produces text with ANSI escape
+ * sequences (SGR) for the colours and other appearance-related properties,
+ * so that a terminal or a pager such as "less -R" shows it as it was.
+ *
+ * Each line starts with the default appearance, so lines can be shown on
+ * their own.
+ */
+class AnsiDecoder : public TerminalCharacterDecoder
+{
+public:
+    AnsiDecoder();
+
+    void begin(QTextStream* output) override;
+    void end() override;
+
+    void decodeLine(const Character* const characters,
+                            int count,
+                            LineProperty properties) override;
+
+private:
+    // appends the sequence which selects the appearance of character
+    void appendStyle(QString& text, const Character& character);
+
+    QTextStream* _output;
+    // whether the appearance is not the default one
+    bool _styled;
+    quint16 _lastRendition;
+    CharacterColor _lastForeColor;
+    CharacterColor _lastBackColor;
+};
+
 }
 
 #endif
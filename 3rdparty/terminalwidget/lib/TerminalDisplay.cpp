@@ -24,6 +24,10 @@
 #include "TerminalDisplay.h"
 #include "SessionManager.h"
 
+// System
+#include <cmath>
+#include <cstring>
+
 // Qt
 #include <QApplication>
 #include <QBoxLayout>
@@ -75,6 +79,9 @@ typedef quint16 RenditionFlags;
 
 #define yMouseScroll 1
 
+// Memory the line cache may use for the lines of one screen
+#define LINE_CACHE_BUDGET Q_INT64_C(64 * 1024 * 1024)
+
 #define REPCHAR   "ABCDEFGHIJKLMNOPQRSTUVWXYZ" \
                   "abcdefgjijklmnopqrstuvwxyz" \
                   "0123456789./+@"
@@ -105,9 +112,26 @@ const ColorEntry Konsole::base_color_table[TABLE_COLORS] =
 bool TerminalDisplay::_antialiasText = true;
 bool TerminalDisplay::HAVE_TRANSPARENCY = true;
 
-// we use this to force QPainter to display text in LTR mode
-// more information can be found in: http://unicode.org/reports/tr9/
-const QChar LTR_OVERRIDE_CHAR( 0x202D );
+// Returns the smallest number of logical pixels which covers a whole number of
+// device pixels at a scale, e.g. 4 at 1.25 and 2.75.  Areas whose edges are
+// multiples of it are repainted and flushed exactly, whereas at other edges
+// the scaled paint and the flushed area round to different device pixels and
+// leave a line of the old contents behind.
+static int devicePixelStep(qreal devicePixelRatio)
+{
+    for (int step = 1; step <= 8; step++) {
+        const qreal pixels = step * devicePixelRatio;
+        if (qAbs(pixels - qRound(pixels)) < 0.01)
+            return step;
+    }
+    // the margin of the dirty rects has to do
+    return 1;
+}
+
+static int alignDown(int value, int step)
+{
+    return value >= 0 ? value - value % step : value - (step + value % step) % step;
+}
 
 /* ------------------------------------------------------------------------- */
 /*                                                                           */
@@ -133,6 +157,8 @@ void TerminalDisplay::setScreenWindow(ScreenWindow* window)
     if ( _screenWindow )
     {
         disconnect( _screenWindow , nullptr , this , nullptr );
+        // the old window's frame is not going to be painted here
+        _screenWindow->notifyFrameDropped();
     }
 
     _screenWindow = window;
@@ -140,17 +166,103 @@ void TerminalDisplay::setScreenWindow(ScreenWindow* window)
     if ( window )
     {
 
-// TODO: Determine if this is an issue.
-//#warning "The order here is not specified - does it matter whether updateImage or updateLineProperties comes first?"
-        connect( _screenWindow , SIGNAL(outputChanged()) , this , SLOT(updateLineProperties()) );
-        connect( _screenWindow , SIGNAL(outputChanged()) , this , SLOT(updateImage()) );
-        connect( _screenWindow , SIGNAL(outputChanged()) , this , SLOT(updateFilters()) );
+        connect( _screenWindow , SIGNAL(outputChanged()) , this , SLOT(screenWindowOutputChanged()) );
         connect( _screenWindow , SIGNAL(scrolled(int)) , this , SLOT(updateFilters()) );
         connect( _screenWindow, SIGNAL(selectionCleared()), this, SLOT(selectionCleared()) );
         window->setWindowLines(_lines);
     }
 }
 
+void TerminalDisplay::setOutputDetached(bool detached)
+{
+    if (_outputDetached == detached)
+        return;
+
+    _outputDetached = detached;
+
+    // a hidden display does not paint, so the emulation must not wait for it
+    if (_outputDetached && _screenWindow)
+        _screenWindow->notifyFrameDropped();
+
+    if (!_outputDetached && _refreshPending) {
+        _refreshPending = false;
+        if (_screenWindow) {
+            // the scrolled lines have piled up while detached; the whole image
+            // is compared again anyway, so don't try to scroll the old one
+            _screenWindow->resetScrollCount();
+            screenWindowOutputChanged();
+        }
+    }
+}
+
+bool TerminalDisplay::isOutputDetached() const
+{
+    return _outputDetached;
+}
+
+TerminalDisplay::PaintStatistics TerminalDisplay::paintStatistics() const
+{
+    return _paintStatistics;
+}
+
+static quint64 (*allocationCounter)() = nullptr;
+
+void TerminalDisplay::setAllocationCounter(quint64 (*counter)())
+{
+    allocationCounter = counter;
+}
+
+// the heap allocations made so far, counted in debug builds only
+static quint64 allocationCount()
+{
+#ifndef QT_NO_DEBUG
+    if (allocationCounter != nullptr)
+        return allocationCounter();
+#endif
+    return 0;
+}
+
+void TerminalDisplay::setGlyphCacheEnabled(bool enabled)
+{
+    if (_glyphCacheEnabled == enabled)
+        return;
+
+    _glyphCacheEnabled = enabled;
+    update();
+}
+
+bool TerminalDisplay::isGlyphCacheEnabled() const
+{
+    return _glyphCacheEnabled;
+}
+
+void TerminalDisplay::setLineCacheEnabled(bool enabled)
+{
+    if (_lineCacheEnabled == enabled)
+        return;
+
+    _lineCacheEnabled = enabled;
+    if (!enabled)
+        _lineCache.clear();
+}
+
+bool TerminalDisplay::isLineCacheEnabled() const
+{
+    return _lineCacheEnabled;
+}
+
+void TerminalDisplay::screenWindowOutputChanged()
+{
+    if (_outputDetached) {
+        _refreshPending = true;
+        return;
+    }
+
+    updateLineProperties();
+    updateImage();
+    updateFilters();
+}
+
 const ColorEntry* TerminalDisplay::colorTable() const
 {
   return _colorTable;
@@ -392,6 +504,14 @@ TerminalDisplay::TerminalDisplay(QWidget *parent)
 ,_image(nullptr)
 ,_randomSeed(0)
 ,_resizing(false)
+,_outputDetached(false)
+,_refreshPending(false)
+,_imageAllocations(0)
+,_imageCharGeneration(0)
+,_imageColorGeneration(0)
+,_styledFontMask(0)
+,_glyphCacheEnabled(true)
+,_lineCacheEnabled(true)
 ,_terminalSizeHint(false)
 ,_terminalSizeStartup(true)
 ,_bidiEnabled(false)
@@ -504,6 +624,8 @@ TerminalDisplay::TerminalDisplay(QWidget *parent)
 
 TerminalDisplay::~TerminalDisplay()
 {
+  if (_screenWindow)
+      _screenWindow->notifyFrameDropped();
   disconnect(_blinkTimer);
   disconnect(_blinkCursorTimer);
   qApp->removeEventFilter( this );
@@ -660,10 +782,10 @@ void TerminalDisplay::drawBackground(QPainter& painter, const QRect& rect, const
                 QColor color(backgroundColor);
                 color.setAlpha(qAlpha(_blendColor));
 
-                painter.save();
+                // no save() and restore(), saving the state allocates
                 painter.setCompositionMode(QPainter::CompositionMode_Source);
                 painter.fillRect(rect, color);
-                painter.restore();
+                painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
             }
         }
         else
@@ -681,10 +803,14 @@ void TerminalDisplay::drawCursor(QPainter& painter,
 
     if (!_cursorBlinking)
     {
-       if ( _cursorColor.isValid() )
-           painter.setPen(_cursorColor);
-       else
-           painter.setPen(foregroundColor);
+       // a filled block needs no pen, which would be made for every paint
+       if ( _cursorShape != Emulation::KeyboardCursorShape::BlockCursor || !hasFocus() )
+       {
+           if ( _cursorColor.isValid() )
+               painter.setPen(_cursorColor);
+           else
+               painter.setPen(foregroundColor);
+       }
 
        if ( _cursorShape == Emulation::KeyboardCursorShape::BlockCursor )
        {
@@ -730,7 +856,8 @@ void TerminalDisplay::drawCharacters(QPainter& painter,
                                      const QRect& rect,
                                      const QString& text,
                                      const Character* style,
-                                     bool invertCharacterColor)
+                                     bool invertCharacterColor,
+                                     int columns)
 {
     // don't draw text which is currently blinking
     if ( _blinking && (style->rendition & RE_BLINK) )
@@ -741,41 +868,29 @@ void TerminalDisplay::drawCharacters(QPainter& painter,
             return;
 
     // setup bold and underline
-    bool useBold = ((style->rendition & RE_BOLD) && _boldIntense) || font().bold();
-    const bool useUnderline = style->rendition & RE_UNDERLINE || font().underline();
-    const bool useItalic = style->rendition & RE_ITALIC || font().italic();
-    const bool useStrikeOut = style->rendition & RE_STRIKEOUT || font().strikeOut();
-    const bool useOverline = style->rendition & RE_OVERLINE || font().overline();
-
-    QFont font = painter.font();
-    if (    font.bold() != useBold
-         || font.underline() != useUnderline
-         || font.italic() != useItalic
-         || font.strikeOut() != useStrikeOut
-         || font.overline() != useOverline) {
-       font.setBold(useBold);
-       font.setUnderline(useUnderline);
-       font.setItalic(useItalic);
-       font.setStrikeOut(useStrikeOut);
-       font.setOverline(useOverline);
-       painter.setFont(font);
-    }
+    const QFont& font = styledFont(style->rendition);
 
-    // setup pen
     const CharacterColor& textColor = ( invertCharacterColor ? style->backgroundColor : style->foregroundColor );
     const QColor color = textColor.color(_colorTable);
-    QPen pen = painter.pen();
-    if ( pen.color() != color )
-    {
-        pen.setColor(color);
+
+    // glyphs from the cache need neither the font nor the pen of the
+    // painter, which are only set up for text drawn otherwise
+    const bool lineChars = isLineCharString(text);
+    if ( !lineChars && drawCachedCharacters(painter,rect,style,columns,font,color) )
+        return;
+
+    // setup pen
+    if ( painter.pen().color() != color )
         painter.setPen(color);
-    }
 
     // draw text
-    if ( isLineCharString(text) )
+    if ( lineChars )
         drawLineCharString(painter,rect.x(),rect.y(),text,style);
     else
     {
+        if ( painter.font() != font )
+            painter.setFont(font);
+
         // Force using LTR as the document layout for the terminal area, because
         // there is no use cases for RTL emulator and RTL terminal application.
         //
@@ -794,12 +909,44 @@ void TerminalDisplay::drawCharacters(QPainter& painter,
     }
 }
 
+const QFont& TerminalDisplay::styledFont(uint rendition)
+{
+    const QFont& base = font();
+    if ( !(_styledFontBase == base) )
+    {
+        _styledFontBase = base;
+        _styledFontMask = 0;
+    }
+
+    const bool useBold = ((rendition & RE_BOLD) && _boldIntense) || base.bold();
+    const bool useUnderline = rendition & RE_UNDERLINE || base.underline();
+    const bool useItalic = rendition & RE_ITALIC || base.italic();
+    const bool useStrikeOut = rendition & RE_STRIKEOUT || base.strikeOut();
+    const bool useOverline = rendition & RE_OVERLINE || base.overline();
+    const int index = useBold | useUnderline << 1 | useItalic << 2 | useStrikeOut << 3 | useOverline << 4;
+
+    // a font is made for each style once, changing a copy allocates
+    if ( !(_styledFontMask & (1u << index)) )
+    {
+        QFont font = base;
+        font.setBold(useBold);
+        font.setUnderline(useUnderline);
+        font.setItalic(useItalic);
+        font.setStrikeOut(useStrikeOut);
+        font.setOverline(useOverline);
+        _styledFonts[index] = font;
+        _styledFontMask |= 1u << index;
+    }
+    return _styledFonts[index];
+}
+
 void TerminalDisplay::drawTextFragment(QPainter& painter ,
                                        const QRect& rect,
                                        const QString& text,
-                                       const Character* style)
+                                       const Character* style,
+                                       int columns)
 {
-    painter.save();
+    // the painter is saved once for all fragments, in paintEvent()
 
     // setup painter
     //const QColor foregroundColor = style->foregroundColor.color(_colorTable);
@@ -825,9 +972,107 @@ void TerminalDisplay::drawTextFragment(QPainter& painter ,
     }
 
     // draw text
-    drawCharacters(painter,rect,text,style,invertCharacterColor);
+    drawCharacters(painter,rect,text,style,invertCharacterColor,columns);
+}
+
+// Appends a code point to a string which is reused, like QString::fromUcs4()
+// would convert it but without making a new string
+static void appendCodePoint(QString& text, uint codePoint)
+{
+    if (QChar::requiresSurrogates(codePoint)) {
+        text += QChar(QChar::highSurrogate(codePoint));
+        text += QChar(QChar::lowSurrogate(codePoint));
+    } else {
+        text += QChar(codePoint);
+    }
+}
+
+// Returns true if the glyph of a character does not depend on the characters
+// around it, so it can be drawn on its own
+static bool isCacheableScript(uint character)
+{
+    switch (QChar::script(character)) {
+    case QChar::Script_Common:
+    case QChar::Script_Latin:
+    case QChar::Script_Greek:
+    case QChar::Script_Cyrillic:
+    case QChar::Script_Han:
+    case QChar::Script_Hiragana:
+    case QChar::Script_Katakana:
+    case QChar::Script_Hangul:
+    case QChar::Script_Bopomofo:
+        return true;
+    default:
+        return false;
+    }
+}
 
-    painter.restore();
+bool TerminalDisplay::drawCachedCharacters(QPainter& painter,
+                                           const QRect& rect,
+                                           const Character* cells,
+                                           int columns,
+                                           const QFont& font,
+                                           const QColor& color)
+{
+    // the glyphs are not scaled for double width or double height lines
+    if ( !_glyphCacheEnabled || _bidiEnabled || columns <= 0
+         || painter.worldTransform().type() > QTransform::TxTranslate )
+        return false;
+
+    for (int i = 0; i < columns; i++) {
+        uint character = cells[i].character;
+        if (cells[i].rendition & RE_EXTENDED_CHAR) {
+            ushort length = 0;
+            const uint* chars = ExtendedCharTable::instance.lookupExtendedChar(character, length);
+            if (chars == nullptr)
+                return false;
+            character = chars[0];
+        }
+        if (character != 0 && !isCacheableScript(character))
+            return false;
+    }
+
+    // spaces only need a glyph to draw the lines of underlined text and the like
+    const bool hasLines = font.underline() || font.strikeOut() || font.overline();
+    const QRgb rgb = color.rgba();
+    const QPoint margin = _glyphCache.margin();
+    const qreal scale = 1 / _glyphCache.devicePixelRatio();
+
+    _glyphFragments.resize(0);
+    int page = -1;
+    for (int i = 0; i < columns; i++) {
+        const Character& cell = cells[i];
+        // the second half of a double width character
+        if (cell.character == 0 || (cell.character == ' ' && !hasLines))
+            continue;
+
+        _glyphCluster.resize(0);
+        if (cell.rendition & RE_EXTENDED_CHAR) {
+            ushort length = 0;
+            const uint* chars = ExtendedCharTable::instance.lookupExtendedChar(cell.character, length);
+            for (ushort index = 0; index < length; index++)
+                appendCodePoint(_glyphCluster, chars[index]);
+        }
+        const int cellColumns = (i + 1 < columns && cells[i + 1].character == 0) ? 2 : 1;
+        const GlyphCache::Glyph& glyph = _glyphCache.glyph(cell.character, _glyphCluster, cellColumns, font, rgb);
+
+        if (glyph.page != page) {
+            if (!_glyphFragments.isEmpty())
+                painter.drawPixmapFragments(_glyphFragments.constData(), _glyphFragments.count(),
+                                            _glyphCache.page(page));
+            _glyphFragments.resize(0);
+            page = glyph.page;
+        }
+
+        // the fragments are placed by the centre of their target
+        const QPointF topLeft(rect.x() + i * _fontWidth - margin.x(), rect.y() - margin.y());
+        const QPointF centre = topLeft + QPointF(glyph.source.width(), glyph.source.height()) * scale / 2;
+        _glyphFragments.append(QPainter::PixmapFragment::create(centre, glyph.source, scale, scale));
+    }
+    if (!_glyphFragments.isEmpty())
+        painter.drawPixmapFragments(_glyphFragments.constData(), _glyphFragments.count(),
+                                    _glyphCache.page(page));
+    return true;
 }
 
 void TerminalDisplay::setRandomSeed(uint randomSeed) { _randomSeed = randomSeed; }
@@ -920,6 +1165,7 @@ void TerminalDisplay::scrollImage(int lines , const QRect& screenWindowRegion)
     int bytesToMove = linesToMove *
                       this->_columns *
                       sizeof(Character);
+    int runBytesToMove = linesToMove * styleRunWords(this->_columns) * sizeof(quint32);
 
     Q_ASSERT( linesToMove > 0 );
     Q_ASSERT( bytesToMove > 0 );
@@ -935,6 +1181,7 @@ void TerminalDisplay::scrollImage(int lines , const QRect& screenWindowRegion)
 
         //scroll internal image down
         memmove( firstCharPos , lastCharPos , bytesToMove );
+        memmove( styleRuns(region.top()) , styleRuns(region.top() + abs(lines)) , runBytesToMove );
 
         //set region of display to scroll
         scrollRect.setTop(top);
@@ -947,6 +1194,7 @@ void TerminalDisplay::scrollImage(int lines , const QRect& screenWindowRegion)
 
         //scroll internal image up
         memmove( lastCharPos , firstCharPos , bytesToMove );
+        memmove( styleRuns(region.top() + abs(lines)) , styleRuns(region.top()) , runBytesToMove );
 
         //set region of the display to scroll
         scrollRect.setTop(top + abs(lines) * _fontHeight);
@@ -955,6 +1203,15 @@ void TerminalDisplay::scrollImage(int lines , const QRect& screenWindowRegion)
 
     Q_ASSERT(scrollRect.isValid() && !scrollRect.isEmpty());
 
+    // at a fractional scale the moved pixels only line up with the device
+    // pixels if the area and the distance do, otherwise repaint the area
+    const int step = devicePixelStep(devicePixelRatioF());
+    if (scrollRect.top() % step != 0 || scrollRect.height() % step != 0
+            || (_fontHeight * lines) % step != 0) {
+        update(scrollRect);
+        return;
+    }
+
     //scroll the display vertically to match internal _image
     scroll( 0 , _fontHeight * (-lines) , scrollRect );
 }
@@ -971,25 +1228,25 @@ QRegion TerminalDisplay::hotSpotRegion() const
             r.setTop(hotSpot->startLine());
             r.setRight(hotSpot->endColumn());
             r.setBottom(hotSpot->endLine());
-            region |= imageToWidget(r);;
+            region |= imageToDirtyRect(r);
         } else {
             r.setLeft(hotSpot->startColumn());
             r.setTop(hotSpot->startLine());
             r.setRight(_columns);
             r.setBottom(hotSpot->startLine());
-            region |= imageToWidget(r);;
+            region |= imageToDirtyRect(r);
             for ( int line = hotSpot->startLine()+1 ; line < hotSpot->endLine() ; line++ ) {
                 r.setLeft(0);
                 r.setTop(line);
                 r.setRight(_columns);
                 r.setBottom(line);
-                region |= imageToWidget(r);;
+                region |= imageToDirtyRect(r);
             }
             r.setLeft(0);
             r.setTop(hotSpot->endLine());
             r.setRight(hotSpot->endColumn());
             r.setBottom(hotSpot->endLine());
-            region |= imageToWidget(r);;
+            region |= imageToDirtyRect(r);
         }
     }
     return region;
@@ -1000,6 +1257,8 @@ void TerminalDisplay::processFilters()
     if (!_screenWindow)
         return;
 
+    QMutexLocker locker(_screenWindow->screenLock());
+
     QRegion preUpdateHotSpots = hotSpotRegion();
 
     // use _screenWindow->getImage() here rather than _image because
@@ -1023,6 +1282,9 @@ void TerminalDisplay::updateImage()
   if ( !_screenWindow )
       return;
 
+  // the screen must not change while its image is copied into _image
+  QMutexLocker locker(_screenWindow->screenLock());
+
   // optimization - scroll the existing image where possible and
   // avoid expensive text drawing for parts of the image that
   // can simply be moved up or down
@@ -1035,7 +1297,12 @@ void TerminalDisplay::updateImage()
      updateImageSize();
   }
 
+  // copying and comparing the image should not allocate once the sizes are
+  // settled, what does is added to the statistics of the next paint
+  quint64 allocationsBefore = allocationCount();
   Character* const newimg = _screenWindow->getImage();
+  const quint32* const newRuns = _screenWindow->getStyleRuns();
+  _imageAllocations += allocationCount() - allocationsBefore;
   int lines = _screenWindow->windowLines();
   int columns = _screenWindow->windowColumns();
 
@@ -1048,100 +1315,61 @@ void TerminalDisplay::updateImage()
   Q_ASSERT( this->_usedLines <= this->_lines );
   Q_ASSERT( this->_usedColumns <= this->_columns );
 
-  int y,x,len;
+  int y,x;
 
-  QPoint tL  = contentsRect().topLeft();
-  int    tLx = tL.x();
-  int    tLy = tL.y();
   _hasBlinker = false;
 
-  CharacterColor cf;       // undefined
-
   const int linesToUpdate = qMin(this->_lines, qMax(0,lines  ));
   const int columnsToUpdate = qMin(this->_columns,qMax(0,columns));
+  const int runWords = qMin(styleRunWords(this->_columns), styleRunWords(columns));
 
-  auto dirtyMask = new char[columnsToUpdate + 2];
-  QRegion dirtyRegion;
+  allocationsBefore = allocationCount();
+  // the dirty lines are collected as rects, consecutive lines in one rect,
+  // into a list which keeps its buffer from update to update
+  _dirtyRects.resize(0);
+  int firstDirtyLine = -1;
 
   // debugging variable, this records the number of lines that are found to
   // be 'dirty' ( ie. have changed from the old _image to the new _image ) and
   // which therefore need to be repainted
   int dirtyLineCount = 0;
 
+  // _image keeps extended characters and RGB colors by index, and an index
+  // may stand for something else once the tables have been purged, so
+  // equal cells do not tell that nothing changed any more
+  const int charGeneration = ExtendedCharTable::instance.generation();
+  const int colorGeneration = RgbColorTable::instance.generation();
+  const bool tablesPurged = charGeneration != _imageCharGeneration
+                            || colorGeneration != _imageColorGeneration;
+  _imageCharGeneration = charGeneration;
+  _imageColorGeneration = colorGeneration;
+
   for (y = 0; y < linesToUpdate; ++y)
   {
     const Character* currentLine = &_image[y*this->_columns];
     const Character* const newLine = &newimg[y*columns];
 
-    bool updateLine = false;
+    const quint32* const newLineRuns = newRuns + y*styleRunWords(columns);
 
-    // The dirty mask indicates which characters need repainting. We also
-    // mark surrounding neighbours dirty, in case the character exceeds
-    // its cell boundaries
-    memset(dirtyMask, 0, columnsToUpdate+2);
-
-    for( x = 0 ; x < columnsToUpdate ; ++x)
-    {
-        if ( newLine[x] != currentLine[x] )
-        {
-            dirtyMask[x] = 1;
-        }
-    }
+    bool updateLine = tablesPurged;
 
     if (!_resizing) // not while _resizing, we're expecting a paintEvent
-    for (x = 0; x < columnsToUpdate; ++x)
     {
-      _hasBlinker |= (newLine[x].rendition & RE_BLINK);
-
-      // Start drawing if this character or the next one differs.
-      // We also take the next one into account to handle the situation
-      // where characters exceed their cell width.
-      if (dirtyMask[x])
+      // the line is repainted if a character on it has changed, the
+      // trailing part of a double width character is drawn with it
+      for (x = 0; x < columnsToUpdate; ++x)
       {
-        if (newLine[x + 0].character == 0u)
-        {
-            continue;
-        }
-        bool lineDraw = canDraw(newLine[x + 0].character);
-        bool doubleWidth = (x + 1 == columnsToUpdate) ? false : (newLine[x + 1].character == 0);
-        RenditionFlags cr = newLine[x].rendition;
-        CharacterColor clipboard = newLine[x].backgroundColor;
-        if (newLine[x].foregroundColor != cf)
-        {
-            cf = newLine[x].foregroundColor;
-        }
-        const int lln = columnsToUpdate - x;
-        for (len = 1; len < lln; ++len)
+        if (newLine[x] != currentLine[x] && newLine[x].character != 0u)
         {
-            const Character& ch = newLine[x+len];
-
-            if (!ch.character)
-                continue; // Skip trailing part of multi-col chars.
-
-            bool nextIsDoubleWidth = (x + len + 1 == columnsToUpdate) ? false : (newLine[x + len + 1].character == 0);
-
-            if (ch.foregroundColor != cf ||
-                  ch.backgroundColor != clipboard ||
-                  (ch.rendition & ~RE_EXTENDED_CHAR) != (cr & ~RE_EXTENDED_CHAR) ||
-                  (dirtyMask[x + len] == 0) ||
-                  canDraw(ch.character) != lineDraw ||
-                  nextIsDoubleWidth != doubleWidth) {
-                break;
-            }
+          updateLine = true;
+          break;
         }
-
-        bool saveFixedFont = _fixedFont;
-        if (lineDraw)
-           _fixedFont = false;
-        if (doubleWidth)
-           _fixedFont = false;
-
-        updateLine = true;
-
-        _fixedFont = saveFixedFont;
-        x += len - 1;
       }
 
+      // blinking is part of the style, so the first character of each
+      // run tells
+      for (x = 0; x < columnsToUpdate; x = nextStyleRun(newLineRuns, x, columnsToUpdate))
+        _hasBlinker |= (newLine[x].rendition & RE_BLINK);
     }
 
     //both the top and bottom halves of double height _lines must always be redrawn
@@ -1157,55 +1385,71 @@ void TerminalDisplay::updateImage()
     {
         dirtyLineCount++;
 
-        // add the area occupied by this line to the region which needs to be
-        // repainted
-        QRect dirtyRect = QRect( _leftMargin+tLx ,
-                                 _topMargin+tLy+_fontHeight*y ,
-                                 _fontWidth * columnsToUpdate ,
-                                 _fontHeight );
-
-        dirtyRegion |= dirtyRect;
+        // the area occupied by this line needs to be repainted
+        if (firstDirtyLine < 0)
+            firstDirtyLine = y;
+    }
+    if (firstDirtyLine >= 0 && (!updateLine || y == linesToUpdate - 1))
+    {
+        const int lastDirtyLine = updateLine ? y : y - 1;
+        _dirtyRects.append(imageToDirtyRect(QRect(0, firstDirtyLine, columnsToUpdate,
+                                                  lastDirtyLine - firstDirtyLine + 1)));
+        firstDirtyLine = -1;
     }
 
     // replace the line of characters in the old _image with the
-    // current line of the new _image
+    // current line of the new _image, the runs past columnsToUpdate are
+    // never read
     memcpy((void*)currentLine,(const void*)newLine,columnsToUpdate*sizeof(Character));
+    memcpy(styleRuns(y), newLineRuns, runWords*sizeof(quint32));
   }
+  _imageAllocations += allocationCount() - allocationsBefore;
 
   // if the new _image is smaller than the previous _image, then ensure that the area
   // outside the new _image is cleared
   if ( linesToUpdate < _usedLines )
   {
-    dirtyRegion |= QRect(   _leftMargin+tLx ,
-                            _topMargin+tLy+_fontHeight*linesToUpdate ,
-                            _fontWidth * this->_columns ,
-                            _fontHeight * (_usedLines-linesToUpdate) );
+    _dirtyRects.append(imageToDirtyRect(QRect(0, linesToUpdate,
+                                              this->_columns, _usedLines - linesToUpdate)));
   }
   _usedLines = linesToUpdate;
 
   if ( columnsToUpdate < _usedColumns )
   {
-    dirtyRegion |= QRect(   _leftMargin+tLx+columnsToUpdate*_fontWidth ,
-                            _topMargin+tLy ,
-                            _fontWidth * (_usedColumns-columnsToUpdate) ,
-                            _fontHeight * this->_lines );
+    _dirtyRects.append(imageToDirtyRect(QRect(columnsToUpdate, 0,
+                                              _usedColumns - columnsToUpdate, this->_lines)));
   }
   _usedColumns = columnsToUpdate;
 
-  dirtyRegion |= _inputMethodData.previousPreeditRect;
+  if (!_inputMethodData.previousPreeditRect.isEmpty())
+    _dirtyRects.append(_inputMethodData.previousPreeditRect);
+
+  // the cursor may have moved without any character changing.  Its old and
+  // new place are separate rects, their bounding rect could span the screen.
+  const QRect cursorRect = imageToDirtyRect(QRect(cursorPosition(), QSize(2, 1)));
+  if (_cursorRect != cursorRect)
+    _dirtyRects.append(_cursorRect);
+  _dirtyRects.append(cursorRect);
+  _cursorRect = cursorRect;
 
   _screenWindow->resetScrollCount();
-  // update the parts of the display which have changed
-   //--modified and added by qinyaning(nyq) to solve When the screen zooms to 1.25 and 2.75,
-  /*the terminal interface will display colored lines. time: 2020.4.10 14:18
-   * */
-  //update(dirtyRegion);
-  update();
-  //-------------------------------------------------
+  // update the parts of the display which have changed.  The dirty rects
+  // are grown to whole device pixels, so fractional scales like 1.25 and
+  // 2.75 do not leave coloured lines of the old contents behind.
+  bool paintScheduled = false;
+  for (const QRect &rect : qAsConst(_dirtyRects)) {
+    if (rect.isEmpty())
+      continue;
+    update(rect);
+    paintScheduled = true;
+  }
+  // the emulation holds back its next frame until this one is painted, so
+  // only tell it about paints which really happen
+  if (paintScheduled && isVisible() && updatesEnabled())
+    _screenWindow->notifyFrameScheduled();
 
   if ( _hasBlinker && !_blinkTimer->isActive()) _blinkTimer->start( TEXT_BLINK_DELAY );
   if (!_hasBlinker && _blinkTimer->isActive()) { _blinkTimer->stop(); _blinking = false; }
-  delete[] dirtyMask;
 }
 
 void TerminalDisplay::showResizeNotification()
@@ -1306,6 +1550,7 @@ void TerminalDisplay::focusInEvent(QFocusEvent*)
 {
     //qDebug()<<"focusInEvent";
     emit termGetFocus();
+    SessionManager::instance()->setSessionViewed(_sessionId);
     if (_hasBlinkingCursor)
     {
         _blinkCursorTimer->start();
@@ -1333,24 +1578,215 @@ void TerminalDisplay::paintEvent( QPaintEvent* pe )
     calDrawTextAdditionHeight(paint);
   }
 
-  // Determine which characters should be repainted (1 region unit = 1 character)
-  QRegion dirtyImageRegion;
-  const QRegion region = pe->region() & contentsRect();
-
-  for (const QRect &rect : region) {
-      dirtyImageRegion += widgetToImage(rect);
+  const quint64 cellsBefore = _paintStatistics.totalCellsDrawn;
+  const quint64 allocationsBefore = allocationCount();
+
+  // Determine which characters should be repainted (1 rect = 1 character),
+  // into a list which keeps its buffer from paint to paint
+  const QRect contents = contentsRect();
+  const bool hasImage = _usedLines > 0 && _usedColumns > 0;
+  _paintRects.resize(0);
+  for (const QRect &regionRect : pe->region()) {
+      const QRect rect = regionRect & contents;
+      if (rect.isEmpty())
+          continue;
+      if (hasImage)
+          _paintRects.append(widgetToImage(rect));
       drawBackground(paint, rect, palette().background().color(), true /* use opacity setting */);
   }
 
+  // the columns to draw of each line, so that no cell is drawn twice where
+  // the rectangles overlap
+  _paintColumns.fill(qMakePair(_usedColumns, -1), hasImage ? _usedLines : 0);
+  for (const QRect &rect : qAsConst(_paintRects)) {
+      for (int line = rect.top(); line <= rect.bottom(); line++) {
+          QPair<int, int> &columns = _paintColumns[line];
+          columns.first = qMin(columns.first, rect.left());
+          columns.second = qMax(columns.second, rect.right());
+      }
+  }
+
   // only turn on text anti-aliasing, never turn on normal antialiasing
   // set https://bugreports.qt.io/browse/QTBUG-66036
   paint.setRenderHint(QPainter::TextAntialiasing, _antialiasText);
 
-  for (const QRect &rect : qAsConst(dirtyImageRegion)) {
-      drawContents(paint, rect);
+  // glyphs are drawn like drawCharacters() draws text, from the top of a
+  // line and _drawTextAdditionHeight taller
+  _glyphCache.prepare(font(), _fontWidth, _fontHeight + _drawTextAdditionHeight, devicePixelRatioF());
+
+  // no save() and restore() around the text, saving the state allocates and
+  // the drawing below sets the pen, font and composition mode it uses
+  if (prepareLineCache()) {
+      // whole lines, each once
+      for (int line = 0; line < _paintColumns.count(); line++) {
+          if (_paintColumns.at(line).second >= 0)
+              drawCachedLine(paint, line);
+      }
+  } else {
+      // lines next to each other with the same columns are drawn together
+      int line = 0;
+      while (line < _paintColumns.count()) {
+          const QPair<int, int> columns = _paintColumns.at(line);
+          int end = line + 1;
+          while (end < _paintColumns.count() && _paintColumns.at(end) == columns)
+              end++;
+          if (columns.second >= 0)
+              drawContents(paint, QRect(QPoint(columns.first, line), QPoint(columns.second, end - 1)));
+          line = end;
+      }
   }
   drawInputMethodPreeditString(paint, preeditRect());
   paintFilters(paint);
+
+  // allocations while comparing the image in updateImage() count towards
+  // the frame which draws it
+  const quint64 allocations = allocationCount() - allocationsBefore + _imageAllocations;
+  _imageAllocations = 0;
+  _paintStatistics.lastAllocations = allocations;
+  _paintStatistics.totalAllocations += allocations;
+
+  const quint64 cellsDrawn = _paintStatistics.totalCellsDrawn - cellsBefore;
+  _paintStatistics.framesPainted++;
+  if (cellsDrawn >= quint64(_usedLines) * quint64(_usedColumns))
+      _paintStatistics.fullFrames++;
+  _paintStatistics.lastCellsDrawn = cellsDrawn;
+  _paintStatistics.maximumCellsDrawn = qMax(_paintStatistics.maximumCellsDrawn, cellsDrawn);
+
+  // let the emulation know the frame is on screen, so it can send the next one
+  if (_screenWindow)
+      _screenWindow->notifyFramePainted();
+}
+
+bool TerminalDisplay::prepareLineCache()
+{
+    if (!_lineCacheEnabled || !_backgroundImage.isNull() || _usedLines < 1 || _usedColumns < 1)
+        return false;
+
+    // text is drawn _drawTextAdditionHeight lower than its line, an image of
+    // the line would cut off the descenders
+    if (_drawTextAdditionHeight > 0)
+        return false;
+
+    // the top half of a double height line is drawn over the bottom half
+    for (int line = 0; line < _usedLines && line < _lineProperties.count(); line++) {
+        if (_lineProperties.at(line) & LINE_DOUBLEHEIGHT)
+            return false;
+    }
+
+    // compared as they are, a hash of them could match by chance
+    LineCacheSettings settings;
+    lineCacheSettings(settings);
+    if (settings != _lineCacheSettings) {
+        _lineCache.clear();
+        _lineCacheSettings = settings;
+    }
+
+    // two screens of lines, so that switching between two screens or
+    // scrolling back and forth finds the lines still there.  If not even one
+    // screen fits, the lines would push each other out before they are used.
+    const qreal ratio = devicePixelRatioF();
+    const qint64 lineBytes = qint64(std::ceil(_usedColumns * _fontWidth * ratio))
+                             * qint64(std::ceil(_fontHeight * ratio)) * 4;
+    if (lineBytes * _usedLines > LINE_CACHE_BUDGET) {
+        _lineCache.clear();
+        return false;
+    }
+    _lineCache.setMaxCost(int(qMin(LINE_CACHE_BUDGET, 2 * lineBytes * _usedLines) / 1024));
+    return true;
+}
+
+void TerminalDisplay::lineCacheSettings(LineCacheSettings &settings) const
+{
+    settings.font = font();
+    for (int i = 0; i < TABLE_COLORS; i++) {
+        settings.colors[i] = _colorTable[i].color.rgba();
+        settings.fontWeights[i] = _colorTable[i].fontWeight;
+    }
+    settings.background = palette().background().color().rgba();
+    settings.blendColor = _blendColor;
+    settings.cursorColor = _cursorColor.isValid() ? _cursorColor.rgba() : 0;
+    settings.devicePixelRatio = devicePixelRatioF();
+    settings.fontWidth = _fontWidth;
+    settings.fontHeight = _fontHeight;
+    settings.lineSpacing = int(_lineSpacing);
+    settings.flags = uint(_antialiasText | _boldIntense << 1 | _glyphCacheEnabled << 2
+                          | _bidiEnabled << 3 | _fixedFont << 4 | _drawLineChars << 5
+                          | _colorsInverted << 6);
+    settings.extendedCharGeneration = ExtendedCharTable::instance.generation();
+    settings.rgbColorGeneration = RgbColorTable::instance.generation();
+}
+
+bool TerminalDisplay::LineCacheSettings::operator==(const LineCacheSettings &other) const
+{
+    return font == other.font
+        && memcmp(colors, other.colors, sizeof(colors)) == 0
+        && memcmp(fontWeights, other.fontWeights, sizeof(fontWeights)) == 0
+        && background == other.background
+        && blendColor == other.blendColor
+        && cursorColor == other.cursorColor
+        && devicePixelRatio == other.devicePixelRatio
+        && fontWidth == other.fontWidth
+        && fontHeight == other.fontHeight
+        && lineSpacing == other.lineSpacing
+        && flags == other.flags
+        && extendedCharGeneration == other.extendedCharGeneration
+        && rgbColorGeneration == other.rgbColorGeneration;
+}
+
+void TerminalDisplay::drawCachedLine(QPainter& painter, int line)
+{
+    const Character* cells = &_image[loc(0, line)];
+    const int lineLength = _usedColumns * int(sizeof(Character));
+
+    // the cursor and blinking text look different from paint to paint
+    uint renditions = 0;
+    for (int x = 0; x < _usedColumns; x++)
+        renditions |= cells[x].rendition;
+    uint state = line < _lineProperties.count() ? _lineProperties.at(line) : 0;
+    if (renditions & RE_CURSOR)
+        state |= uint(_cursorBlinking) << 8 | uint(_hideCursor) << 9 | uint(hasFocus()) << 10
+                 | uint(_cursorShape) << 11;
+    if (renditions & RE_BLINK)
+        state |= uint(_blinking) << 16;
+
+    const uint key = qHashBits(cells, size_t(lineLength), state);
+    const QPoint origin = imageOrigin();
+    const QPoint topLeft(origin.x(), origin.y() + _fontHeight * line);
+
+    // the line replaces what the display's background left there
+    painter.setCompositionMode(QPainter::CompositionMode_Source);
+
+    const LineImage* cached = _lineCache.object(key);
+    if (cached != nullptr && cached->state == state && cached->cells.count() == _usedColumns
+            && memcmp(cached->cells.constData(), cells, size_t(lineLength)) == 0) {
+        // drawn straight from the cache, a copy would be one more allocation
+        painter.drawPixmap(topLeft, cached->pixmap);
+        _paintStatistics.linesFromCache++;
+    } else {
+        const QRect lineRect(topLeft, QSize(_usedColumns * _fontWidth, _fontHeight));
+        const qreal ratio = devicePixelRatioF();
+        QPixmap pixmap(int(std::ceil(lineRect.width() * ratio)), int(std::ceil(lineRect.height() * ratio)));
+        pixmap.setDevicePixelRatio(ratio);
+        pixmap.fill(Qt::transparent);
+
+        // drawn like paintEvent() draws it on the display
+        QPainter linePainter(&pixmap);
+        linePainter.setRenderHint(QPainter::TextAntialiasing, _antialiasText);
+        linePainter.setFont(font());
+        linePainter.translate(-topLeft);
+        drawBackground(linePainter, lineRect, palette().background().color(), true);
+        drawContents(linePainter, QRect(0, line, _usedColumns, 1));
+        linePainter.end();
+
+        auto image = new LineImage;
+        image->pixmap = pixmap;
+        image->cells.resize(_usedColumns);
+        memcpy(image->cells.data(), cells, size_t(lineLength));
+        image->state = state;
+        _lineCache.insert(key, image, int(pixmap.width() * qint64(pixmap.height()) * 4 / 1024) + 1);
+        painter.drawPixmap(topLeft, pixmap);
+    }
+    painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
 }
 
 QPoint TerminalDisplay::cursorPosition() const
@@ -1412,8 +1848,8 @@ void TerminalDisplay::paintFilters(QPainter& painter)
 
     getCharacterPosition( cursorPos , cursorLine , cursorColumn );
     Character cursorCharacter = _image[loc(cursorColumn,cursorLine)];
-
-    painter.setPen( QPen(cursorCharacter.foregroundColor.color(colorTable())) );
+    const QColor underlineColor = cursorCharacter.foregroundColor.color(colorTable());
+    const QFontMetrics metrics(font());
 
     /***add begin by ut001121 zhangmeng 20200624 光标悬浮在链接上面时变成手形光标 修复BUG34676***/
     bool bDrawLineForHotSpotLink = false;
@@ -1421,13 +1857,13 @@ void TerminalDisplay::paintFilters(QPainter& painter)
     // iterate over hotspots identified by the display's currently active filters
     // and draw appropriate visuals to indicate the presence of the hotspot
 
-    QList<Filter::HotSpot*> spots = _filterChain->hotSpots();
-    QListIterator<Filter::HotSpot*> iter(spots);
-    while (iter.hasNext())
+    // the list is kept from paint to paint, so that it is not allocated again
+    _filterChain->hotSpots(_paintHotSpots);
+    for (Filter::HotSpot* spot : qAsConst(_paintHotSpots))
     {
-        Filter::HotSpot* spot = iter.next();
-
-        QRegion region;
+        // whether the mouse is over the area of the link, tested on its
+        // rectangles one by one rather than on a region built from them
+        bool mouseOver = false;
         if ( spot->type() == Filter::HotSpot::Link ) {
             QRect r;
             if (spot->startLine()==spot->endLine()) {
@@ -1435,25 +1871,25 @@ void TerminalDisplay::paintFilters(QPainter& painter)
                              spot->startLine()*_fontHeight + 1 + _topBaseMargin,
                              spot->endColumn()*_fontWidth - 1 + leftMargin,
                              (spot->endLine()+1)*_fontHeight - 1 + _topBaseMargin );
-                region |= r;
+                mouseOver = r.contains(cursorPos);
             } else {
                 r.setCoords( spot->startColumn()*_fontWidth + 1 + leftMargin,
                              spot->startLine()*_fontHeight + 1 + _topBaseMargin,
                              _columns*_fontWidth - 1 + leftMargin,
                              (spot->startLine()+1)*_fontHeight - 1 + _topBaseMargin );
-                region |= r;
-                for ( int line = spot->startLine()+1 ; line < spot->endLine() ; line++ ) {
+                mouseOver = r.contains(cursorPos);
+                for ( int line = spot->startLine()+1 ; line < spot->endLine() && !mouseOver ; line++ ) {
                     r.setCoords( 0*_fontWidth + 1 + leftMargin,
                                  line*_fontHeight + 1 + _topBaseMargin,
                                  _columns*_fontWidth - 1 + leftMargin,
                                  (line+1)*_fontHeight - 1 + _topBaseMargin );
-                    region |= r;
+                    mouseOver = r.contains(cursorPos);
                 }
                 r.setCoords( 0*_fontWidth + 1 + leftMargin,
                              spot->endLine()*_fontHeight + 1 + _topBaseMargin,
                              spot->endColumn()*_fontWidth - 1 + leftMargin,
                              (spot->endLine()+1)*_fontHeight - 1 + _topBaseMargin );
-                region |= r;
+                mouseOver = mouseOver || r.contains(cursorPos);
             }
         }
 
@@ -1494,14 +1930,14 @@ void TerminalDisplay::paintFilters(QPainter& painter)
             // Underline link hotspots
             if ( spot->type() == Filter::HotSpot::Link )
             {
-                QFontMetrics metrics(font());
-
                 // find the baseline (which is the invisible line that the characters in the font sit on,
                 // with some having tails dangling below)
                 int baseline = r.bottom() - metrics.descent();
                 // find the position of the underline below that
                 int underlinePos = baseline + metrics.underlinePos();
-                if ( region.contains( mapFromGlobal(QCursor::pos()) ) ){
+                if ( mouseOver ){
+                    if (painter.pen().color() != underlineColor)
+                        painter.setPen(underlineColor);
                     painter.drawLine( r.left() , underlinePos ,
                                       r.right() , underlinePos );
                     /***add begin by ut001121 zhangmeng 20200624 光标悬浮在链接上面时变成手形光标 修复BUG34676***/
@@ -1512,8 +1948,9 @@ void TerminalDisplay::paintFilters(QPainter& painter)
             // drawn on top of them
             else if ( spot->type() == Filter::HotSpot::Marker )
             {
-            //TODO - Do not use a hardcoded colour for this
-                painter.fillRect(r,QBrush(QColor(255,0,0,120)));
+                QColor markerColor = palette().color(QPalette::Highlight);
+                markerColor.setAlpha(120);
+                painter.fillRect(r,markerColor);
             }
         }
     }
@@ -1562,8 +1999,27 @@ static uint baseCodePoint(const Character &ch) {
 void TerminalDisplay::drawContents(QPainter &paint, const QRect &rect)
 {
     const int numberOfColumns = _usedColumns;
-    QVector<uint> univec;
-    univec.reserve(numberOfColumns);
+    const QPoint origin = imageOrigin();
+
+    // the text of a fragment goes into _fragmentText, which keeps its
+    // buffer from fragment to fragment
+    const auto appendCharacter = [this](const Character& ch) {
+        if ((ch.rendition & RE_EXTENDED_CHAR) != 0) {
+            // sequence of characters
+            ushort extendedCharLength = 0;
+            const uint* chars = ExtendedCharTable::instance.lookupExtendedChar(ch.character, extendedCharLength);
+            if (chars != nullptr) {
+                Q_ASSERT(extendedCharLength > 1);
+                for (int index = 0 ; index < extendedCharLength ; index++) {
+                    appendCodePoint(_fragmentText, chars[index]);
+                }
+            }
+        } else if (ch.character != 0u) {
+            // single character
+            appendCodePoint(_fragmentText, ch.character);
+        }
+    };
+
     for (int y = rect.y(); y <= rect.bottom(); y++) {
         int x = rect.x();
         if ((_image[loc(rect.x(), y)].character == 0u) && (x != 0)) {
@@ -1571,53 +2027,21 @@ void TerminalDisplay::drawContents(QPainter &paint, const QRect &rect)
         }
         for (; x <= rect.right(); x++) {
             int len = 1;
-            int p = 0;
-
-            // reset our buffer to the number of columns
-            int bufferSize = numberOfColumns;
-            univec.resize(bufferSize);
-            uint *disstrU = univec.data();
-
-            // is this a single character or a sequence of characters ?
-            if ((_image[loc(x, y)].rendition & RE_EXTENDED_CHAR) != 0) {
-                // sequence of characters
-                ushort extendedCharLength = 0;
-                const uint* chars = ExtendedCharTable::instance.lookupExtendedChar(_image[loc(x, y)].character, extendedCharLength);
-                if (chars != nullptr) {
-                    Q_ASSERT(extendedCharLength > 1);
-                    bufferSize += extendedCharLength - 1;
-                    univec.resize(bufferSize);
-                    disstrU = univec.data();
-                    for (int index = 0 ; index < extendedCharLength ; index++) {
-                        Q_ASSERT(p < bufferSize);
-                        disstrU[p++] = chars[index];
-                    }
-                }
-            } else {
-                // single character
-                const uint c = _image[loc(x, y)].character;
-                if (c != 0u) {
-                    Q_ASSERT(p < bufferSize);
-                    disstrU[p++] = c;
-                }
-            }
+
+            _fragmentText.resize(0);
+            appendCharacter(_image[loc(x, y)]);
 
             const bool lineDraw = canDraw(_image[loc(x, y)].character);
             const bool doubleWidth = (_image[qMin(loc(x, y) + 1, _imageSize - 1)].character == 0);
-            const CharacterColor currentForeground = _image[loc(x, y)].foregroundColor;
-            const CharacterColor currentBackground = _image[loc(x, y)].backgroundColor;
-            const RenditionFlags currentRendition = _image[loc(x, y)].rendition;
-            const QChar::Script currentScript = QChar::script(baseCodePoint(_image[loc(x, y)]));
+            // the screen has split the line where the colors or the rendition
+            // change, the fragment ends with the run at the latest
+            const int runEnd = nextStyleRun(styleRuns(y), x, numberOfColumns);
+            // only needed once a second character joins the fragment
+            QChar::Script currentScript = QChar::Script_Unknown;
+            bool hasCurrentScript = false;
 
             const auto isInsideDrawArea = [&](int column) { return column <= rect.right(); };
-            const auto hasSameColors = [&](int column) {
-                return _image[loc(column, y)].foregroundColor == currentForeground
-                    && _image[loc(column, y)].backgroundColor == currentBackground;
-            };
-            const auto hasSameRendition = [&](int column) {
-                return (_image[loc(column, y)].rendition & ~RE_EXTENDED_CHAR)
-                    == (currentRendition & ~RE_EXTENDED_CHAR);
-            };
+            const auto isInsideRun = [&](int column) { return column < runEnd; };
             const auto hasSameWidth = [&](int column) {
                 const int characterLoc = qMin(loc(column, y) + 1, _imageSize - 1);
                 return (_image[characterLoc].character == 0) == doubleWidth;
@@ -1627,6 +2051,10 @@ void TerminalDisplay::drawContents(QPainter &paint, const QRect &rect)
                     == lineDraw;
             };
             const auto isSameScript = [&](int column) {
+                if (!hasCurrentScript) {
+                    currentScript = QChar::script(baseCodePoint(_image[loc(x, y)]));
+                    hasCurrentScript = true;
+                }
                 const QChar::Script script = QChar::script(baseCodePoint(_image[loc(column, y)]));
                 if (currentScript == QChar::Script_Common || script == QChar::Script_Common
                     || currentScript == QChar::Script_Inherited || script == QChar::Script_Inherited) {
@@ -1641,32 +2069,10 @@ void TerminalDisplay::drawContents(QPainter &paint, const QRect &rect)
             };
 
             if (canBeGrouped(x)) {
-                while (isInsideDrawArea(x + len) && hasSameColors(x + len)
-                       && hasSameRendition(x + len) && hasSameWidth(x + len)
+                while (isInsideDrawArea(x + len) && isInsideRun(x + len) && hasSameWidth(x + len)
                        && hasSameLineDrawStatus(x + len) && isSameScript(x + len)
                        && canBeGrouped(x + len)) {
-                    const uint c = _image[loc(x + len, y)].character;
-                    if ((_image[loc(x + len, y)].rendition & RE_EXTENDED_CHAR) != 0) {
-                        // sequence of characters
-                        ushort extendedCharLength = 0;
-                        const uint* chars = ExtendedCharTable::instance.lookupExtendedChar(c, extendedCharLength);
-                        if (chars != nullptr) {
-                            Q_ASSERT(extendedCharLength > 1);
-                            bufferSize += extendedCharLength - 1;
-                            univec.resize(bufferSize);
-                            disstrU = univec.data();
-                            for (int index = 0 ; index < extendedCharLength ; index++) {
-                                Q_ASSERT(p < bufferSize);
-                                disstrU[p++] = chars[index];
-                            }
-                        }
-                    } else {
-                        // single character
-                        if (c != 0u) {
-                            Q_ASSERT(p < bufferSize);
-                            disstrU[p++] = c;
-                        }
-                    }
+                    appendCharacter(_image[loc(x + len, y)]);
 
                     if (doubleWidth) { // assert((_image[loc(x+len,y)+1].character == 0)), see above if condition
                         len++; // Skip trailing part of multi-column character
@@ -1676,10 +2082,9 @@ void TerminalDisplay::drawContents(QPainter &paint, const QRect &rect)
             } else {
                 // Group spaces following any non-wide character with the character. This allows for
                 // rendering ambiguous characters with wide glyphs without clipping them.
-                while (!doubleWidth && isInsideDrawArea(x + len)
-                        && _image[loc(x + len, y)].character == ' ' && hasSameColors(x + len)
-                        && hasSameRendition(x + len)) {
-                    // disstrU intentionally not modified - trailing spaces are meaningless
+                while (!doubleWidth && isInsideDrawArea(x + len) && isInsideRun(x + len)
+                        && _image[loc(x + len, y)].character == ' ') {
+                    // _fragmentText intentionally not modified - trailing spaces are meaningless
                     len++;
                 }
             }
@@ -1694,7 +2099,6 @@ void TerminalDisplay::drawContents(QPainter &paint, const QRect &rect)
             if (doubleWidth) {
                 _fixedFont = false;
             }
-            univec.resize(p);
 
             // Create a text scaling matrix for double width and double height lines.
             QMatrix textScale;
@@ -1713,8 +2117,8 @@ void TerminalDisplay::drawContents(QPainter &paint, const QRect &rect)
             paint.setWorldTransform(QTransform(textScale), true);
 
             //calculate the area in which the text will be drawn
-            QRect textArea = QRect(contentsRect().left() + contentsRect().left() + _fontWidth * x,
-                                   contentsRect().top() + contentsRect().top() + _fontHeight * y,
+            QRect textArea = QRect(origin.x() + _fontWidth * x,
+                                   origin.y() + _fontHeight * y,
                                    _fontWidth * len,
                                    _fontHeight);
 
@@ -1726,13 +2130,13 @@ void TerminalDisplay::drawContents(QPainter &paint, const QRect &rect)
             //(instead of textArea.topLeft() * painter-scale)
             textArea.moveTopLeft(textScale.inverted().map(textArea.topLeft()));
 
-            QString unistr = QString::fromUcs4(univec.data(), univec.length());
-
-            //paint text fragment
+            //paint text fragment, from the glyph cache if the font is fixed pitch
             drawTextFragment(paint,
                              textArea,
-                             unistr,
-                             &_image[loc(x, y)]);
+                             _fragmentText,
+                             &_image[loc(x, y)],
+                             save__fixedFont ? qMin(len, _usedColumns - x) : 0);
+            _paintStatistics.totalCellsDrawn += len;
 
             _fixedFont = save__fixedFont;
 
@@ -1780,18 +2184,51 @@ QRect TerminalDisplay::imageToWidget(const QRect& imageArea) const
 
 QRect TerminalDisplay::widgetToImage(const QRect &widgetArea) const
 {
+    // every character which is partly inside the area
+    const QRect area = widgetArea.translated(-imageOrigin());
     QRect result;
-    result.setLeft(qMin(_usedColumns - 1, qMax(0, (widgetArea.left()) / _fontWidth )));
-    result.setTop(qMin(_usedLines   - 1, qMax(0, (widgetArea.top()) / _fontHeight)));
-    result.setRight(qMin(_usedColumns - 1, qMax(0, (widgetArea.right()) / _fontWidth )));
-    result.setBottom(qMin(_usedLines   - 1, qMax(0, (widgetArea.bottom()) / _fontHeight)));
+    result.setLeft(qMin(_usedColumns - 1, qMax(0, (area.left()) / _fontWidth )));
+    result.setTop(qMin(_usedLines   - 1, qMax(0, (area.top()) / _fontHeight)));
+    result.setRight(qMin(_usedColumns - 1, qMax(0, (area.right()) / _fontWidth )));
+    result.setBottom(qMin(_usedLines   - 1, qMax(0, (area.bottom()) / _fontHeight)));
     return result;
 }
 
+QPoint TerminalDisplay::imageOrigin() const
+{
+    // drawContents() has always drawn from twice the contents offset
+    return contentsRect().topLeft() * 2;
+}
+
+QRect TerminalDisplay::imageToDirtyRect(const QRect &imageArea) const
+{
+    // antialiased glyphs may reach a pixel beyond their cells, and the text
+    // is drawn _drawTextAdditionHeight taller than the line
+    const QPoint origin = imageOrigin();
+    QRect result(origin.x() + _fontWidth * imageArea.left() - 1,
+                 origin.y() + _fontHeight * imageArea.top() - 1,
+                 _fontWidth * imageArea.width() + 2,
+                 _fontHeight * imageArea.height() + 2 + _drawTextAdditionHeight);
+
+    const int step = devicePixelStep(devicePixelRatioF());
+    if (step > 1) {
+        const int left = alignDown(result.left(), step);
+        const int top = alignDown(result.top(), step);
+        const int right = alignDown(result.left() + result.width() + step - 1, step);
+        const int bottom = alignDown(result.top() + result.height() + step - 1, step);
+        result.setCoords(left, top, right - 1, bottom - 1);
+    }
+    return result & contentsRect();
+}
+
 void TerminalDisplay::updateCursor()
 {
-//  QRect cursorRect = imageToWidget( QRect(cursorPosition(),QSize(1,1)) );
-  update();
+  // two columns, the cursor may be on a double width character
+  const QRect cursorRect = imageToDirtyRect(QRect(cursorPosition(), QSize(2, 1)));
+  if (_cursorRect != cursorRect)
+    update(_cursorRect);
+  update(cursorRect);
+  _cursorRect = cursorRect;
 }
 
 void TerminalDisplay::blinkCursorEvent()
@@ -1845,6 +2282,7 @@ void TerminalDisplay::updateImageSize()
     {
       memcpy((void*)&_image[_columns*line],
              (void*)&oldimg[oldcol*line],columns*sizeof(Character));
+      findStyleRuns(&_image[_columns*line], _columns, styleRuns(line));
     }
     delete[] oldimg;
   }
@@ -1870,10 +2308,17 @@ void TerminalDisplay::updateImageSize()
 //the same signal as the one for a content size change
 void TerminalDisplay::showEvent(QShowEvent*)
 {
+    setOutputDetached(false);
+    SessionManager::instance()->setSessionViewed(_sessionId);
     emit changedContentSizeSignal(_contentHeight,_contentWidth);
 }
 void TerminalDisplay::hideEvent(QHideEvent*)
 {
+    // the output was in view until now
+    SessionManager::instance()->setSessionViewed(_sessionId);
+    // nobody can see the output, so stop rendering it until shown again
+    setOutputDetached(true);
+    _lineCache.clear();
     emit changedContentSizeSignal(_contentHeight,_contentWidth);
 }
 
@@ -2073,10 +2518,6 @@ void TerminalDisplay::mouseMoveEvent(QMouseEvent* ev)
 {
   int charLine = 0;
   int charColumn = 0;
-  int leftMargin = _leftBaseMargin
-                   + ((_scrollbarLocation == QTermWidget::ScrollBarLeft
-                       && !_scrollBar->style()->styleHint(QStyle::SH_ScrollBar_Transient, nullptr, _scrollBar))
-                      ? _scrollBar->width() : 0);
 
   getCharacterPosition(ev->pos(),charLine,charColumn);
 
@@ -2087,31 +2528,11 @@ void TerminalDisplay::mouseMoveEvent(QMouseEvent* ev)
   {
     QRegion previousHotspotArea = _mouseOverHotspotArea;
     _mouseOverHotspotArea = QRegion();
-    QRect r;
-    if (spot->startLine()==spot->endLine()) {
-        r.setCoords( spot->startColumn()*_fontWidth + leftMargin,
-                     spot->startLine()*_fontHeight + _topBaseMargin,
-                     spot->endColumn()*_fontWidth + leftMargin,
-                     (spot->endLine()+1)*_fontHeight - 1 + _topBaseMargin );
-        _mouseOverHotspotArea |= r;
-    } else {
-        r.setCoords( spot->startColumn()*_fontWidth + leftMargin,
-                     spot->startLine()*_fontHeight + _topBaseMargin,
-                     _columns*_fontWidth - 1 + leftMargin,
-                     (spot->startLine()+1)*_fontHeight + _topBaseMargin );
-        _mouseOverHotspotArea |= r;
-        for ( int line = spot->startLine()+1 ; line < spot->endLine() ; line++ ) {
-            r.setCoords( 0*_fontWidth + leftMargin,
-                         line*_fontHeight + _topBaseMargin,
-                         _columns*_fontWidth + leftMargin,
-                         (line+1)*_fontHeight + _topBaseMargin );
-            _mouseOverHotspotArea |= r;
-        }
-        r.setCoords( 0*_fontWidth + leftMargin,
-                     spot->endLine()*_fontHeight + _topBaseMargin,
-                     spot->endColumn()*_fontWidth + leftMargin,
-                     (spot->endLine()+1)*_fontHeight + _topBaseMargin );
-        _mouseOverHotspotArea |= r;
+    // the cells of the link, mapped like every other repaint of the image
+    for ( int line = spot->startLine() ; line <= spot->endLine() ; line++ ) {
+        const int startColumn = line == spot->startLine() ? spot->startColumn() : 0;
+        const int endColumn = line == spot->endLine() ? spot->endColumn() : _columns;
+        _mouseOverHotspotArea |= imageToDirtyRect(QRect(startColumn, line, qMax(endColumn - startColumn, 1), 1));
     }
 
     update( _mouseOverHotspotArea | previousHotspotArea );
@@ -2495,6 +2916,7 @@ void TerminalDisplay::updateLineProperties()
     if ( !_screenWindow )
         return;
 
+    QMutexLocker locker(_screenWindow->screenLock());
     _lineProperties = _screenWindow->getLineProperties();
 }
 
@@ -3297,6 +3719,16 @@ void TerminalDisplay::clearImage()
                                                DEFAULT_BACK_COLOR);
     _image[i].rendition = DEFAULT_RENDITION;
   }
+
+  const int words = styleRunWords(_columns);
+  _styleRuns.fill(0, _lines * words);
+  for (int line = 0; line < _lines; line++)
+    _styleRuns[line * words] = 1u;
+}
+
+quint32* TerminalDisplay::styleRuns(int line)
+{
+  return _styleRuns.data() + line * styleRunWords(_columns);
 }
 
 void TerminalDisplay::calcGeometry()
@@ -22,13 +22,17 @@
 #define TERMINALDISPLAY_H
 
 // Qt
+#include <QCache>
 #include <QColor>
+#include <QPainter>
 #include <QPointer>
+#include <QVector>
 #include <QWidget>
 
 // Konsole
 #include "Filter.h"
 #include "Character.h"
+#include "GlyphCache.h"
 #include "qtermwidget.h"
 //#include "konsole_export.h"
 #include "tools.h"
@@ -424,6 +428,19 @@ public:
     /** Returns the terminal screen section which is displayed in this widget.  See setScreenWindow() */
     ScreenWindow* screenWindow() const;
 
+    /**
+     * Detaches the display from the output of its screen window, or attaches it again.
+     * While detached the emulation keeps running, but output changes no longer fetch the
+     * screen image, update the filters or repaint the display.  Attaching again refreshes
+     * the whole display once if output arrived in the meantime.
+     *
+     * The display detaches itself when it is hidden, for example in a background tab,
+     * and attaches itself when it is shown again.
+     */
+    void setOutputDetached(bool detached);
+    /** Returns true if the display is detached from its screen window's output.  See setOutputDetached() */
+    bool isOutputDetached() const;
+
     static bool HAVE_TRANSPARENCY;
 
     void setMotionAfterPasting(MotionAfterPasting action);
@@ -437,6 +454,71 @@ public:
 
     void setSessionId(int sessionId);
 
+    /**
+     * Counters describing how much each paint of the display draws.
+     * See paintStatistics()
+     */
+    struct PaintStatistics {
+        /** Number of paint events handled */
+        quint64 framesPainted = 0;
+        /** Number of paint events which drew every cell of the display */
+        quint64 fullFrames = 0;
+        /**
+         * Character cells drawn by a paint event: by the last one, the most
+         * drawn by one and the sum over all of them
+         */
+        quint64 lastCellsDrawn = 0;
+        quint64 maximumCellsDrawn = 0;
+        quint64 totalCellsDrawn = 0;
+        /** Number of lines copied from the line cache instead of being drawn */
+        quint64 linesFromCache = 0;
+        /**
+         * Heap allocations made while comparing a new image and drawing the
+         * dirty lines of a frame: by the last frame and over all of them.
+         * Only counted in debug builds, see setAllocationCounter().  Text
+         * drawn from the glyph cache and lines copied from the line cache do
+         * not allocate once the caches hold them.  Glyphs and lines added to
+         * the caches, text drawn with QPainter::drawText() (BiDi, scripts
+         * which are laid out, proportional fonts, double width or height
+         * lines) and a larger image or more dirty rects still allocate.
+         */
+        quint64 lastAllocations = 0;
+        quint64 totalAllocations = 0;
+    };
+
+    /** Returns the paint counters of the display */
+    PaintStatistics paintStatistics() const;
+
+    /**
+     * Sets the function which returns the number of heap allocations made so
+     * far, e.g. by a hook of the allocator, for the allocation counters of
+     * the paint statistics of all displays.  It is not called in release
+     * builds.
+     */
+    static void setAllocationCounter(quint64 (*counter)());
+
+    /**
+     * Sets whether text is drawn from a cache of glyphs instead of being laid
+     * out for every paint.  Text which needs to be laid out with its
+     * neighbours, like Arabic, and all text while BiDi rendering is enabled
+     * is laid out anyway.  Enabled by default.
+     */
+    void setGlyphCacheEnabled(bool enabled);
+    /** Returns true if text is drawn from the glyph cache.  See setGlyphCacheEnabled() */
+    bool isGlyphCacheEnabled() const;
+
+    /**
+     * Sets whether the display keeps the lines it has drawn as images and
+     * copies them when a line with the same contents is painted again.
+     * The cache holds up to two screens of lines and is not used if one
+     * screen of line images would take too much memory, if the display has
+     * a background image, if it shows double height lines or if the font
+     * draws its text lower than the top of the line.  Enabled by default.
+     */
+    void setLineCacheEnabled(bool enabled);
+    /** Returns true if lines are kept in the line cache.  See setLineCacheEnabled() */
+    bool isLineCacheEnabled() const;
+
 public slots:
 
     /**
@@ -653,6 +735,10 @@ private slots:
     void swapColorTable();
     void tripleClickTimeout();  // resets possibleTripleClick
 
+    // fetches line properties, image and filters after an output change of the
+    // screen window, unless the display is detached
+    void screenWindowOutputChanged();
+
 private:
 
     // -- Drawing helpers --
@@ -663,13 +749,19 @@ private:
     QRect calculateTextArea(int topLeftX, int topLeftY, int startColumn, int line, int length);
 
     // divides the part of the display specified by 'rect' into
-    // fragments according to their colors and styles and calls
+    // fragments along the style runs of _image and calls
     // drawTextFragment() to draw the fragments
     void drawContents(QPainter &paint, const QRect &rect);
+    // the style runs of a line of _image, see _styleRuns
+    quint32* styleRuns(int line);
+    // the display's font with the bold, italic and line attributes of
+    // 'rendition', from _styledFonts
+    const QFont& styledFont(uint rendition);
     // draws a section of text, all the text in this section
-    // has a common color and style
+    // has a common color and style.  'columns' is the number of cells of
+    // _image from 'style' on which hold the text, or 0 if it is not from _image
     void drawTextFragment(QPainter& painter, const QRect& rect,
-                          const QString& text, const Character* style);
+                          const QString& text, const Character* style, int columns = 0);
     // draws the background for a text fragment
     // if useOpacitySetting is true then the color's alpha value will be set to
     // the display's transparency (set with setOpacity()), otherwise the background
@@ -681,7 +773,12 @@ private:
                                        const QColor& backgroundColor , bool& invertColors);
     // draws the characters or line graphics in a text fragment
     void drawCharacters(QPainter& painter, const QRect& rect,  const QString& text,
-                                           const Character* style, bool invertCharacterColor);
+                                           const Character* style, bool invertCharacterColor,
+                                           int columns = 0);
+    // draws the characters of a number of cells from the glyph cache, returns
+    // false without drawing anything if any of them cannot be drawn from it
+    bool drawCachedCharacters(QPainter& painter, const QRect& rect, const Character* cells,
+                              int columns, const QFont& font, const QColor& color);
     // draws a string of line graphics
     void drawLineCharString(QPainter& painter, int x, int y,
                             const QString& str, const Character* attributes);
@@ -689,11 +786,46 @@ private:
     // draws the preedit string for input methods
     void drawInputMethodPreeditString(QPainter& painter , const QRect& rect);
 
+    // returns true if the line cache can be used for the next paint, and
+    // drops the cached lines if they were drawn with other settings
+    bool prepareLineCache();
+    // the settings the lines of the line cache are drawn with
+    struct LineCacheSettings
+    {
+        QFont font;
+        QRgb colors[TABLE_COLORS] = {};
+        int fontWeights[TABLE_COLORS] = {};
+        QRgb background = 0;
+        QRgb blendColor = 0;
+        QRgb cursorColor = 0;
+        qreal devicePixelRatio = 0;
+        int fontWidth = 0;
+        int fontHeight = 0;
+        int lineSpacing = 0;
+        uint flags = 0;
+        // the cells refer to combined characters and RGB colors by their
+        // index in tables which reuse the indexes of dropped entries
+        int extendedCharGeneration = -1;
+        int rgbColorGeneration = -1;
+
+        bool operator==(const LineCacheSettings &other) const;
+        bool operator!=(const LineCacheSettings &other) const { return !operator==(other); }
+    };
+    // fills @p settings with the current settings
+    void lineCacheSettings(LineCacheSettings &settings) const;
+    // draws a whole line, copied from the line cache if it was drawn before
+    void drawCachedLine(QPainter& painter, int line);
+
     // --
 
     // maps an area in the character image to an area on the widget
     QRect imageToWidget(const QRect& imageArea) const;
     QRect widgetToImage(const QRect& widgetArea) const;
+    // the area of the widget to repaint when the characters in an area of
+    // the image change, grown to whole device pixels
+    QRect imageToDirtyRect(const QRect& imageArea) const;
+    // the point of the widget the character image is drawn from
+    QPoint imageOrigin() const;
 
     // the area where the preedit string for input methods will be draw
     QRect preeditRect() const;
@@ -774,11 +906,55 @@ private:
 
     int _imageSize;
     QVector<LineProperty> _lineProperties;
+    // the style runs of _image, styleRunWords(_columns) words per line,
+    // as the screen found them.  See Screen::getImage()
+    QVector<quint32> _styleRuns;
 
     ColorEntry _colorTable[TABLE_COLORS];
     uint _randomSeed;
 
     bool _resizing;
+    bool _outputDetached;
+    bool _refreshPending;       // output changed while the display was detached
+
+    QRect _cursorRect;          // where the cursor was drawn last, see updateCursor()
+    PaintStatistics _paintStatistics;
+    quint64 _imageAllocations;  // made by updateImage() since the last paint
+    // generations of ExtendedCharTable and RgbColorTable the cells of _image
+    // were compared with
+    int _imageCharGeneration;
+    int _imageColorGeneration;
+
+    // scratch buffers of updateImage() and the paint, kept so that a frame
+    // does not allocate once they are large enough
+    QVector<QRect> _dirtyRects;
+    QVector<QRect> _paintRects;
+    QString _fragmentText;
+    QString _glyphCluster;
+    QVector<Filter::HotSpot*> _paintHotSpots;
+    // the fonts drawCharacters() uses, for the bits of _styledFontMask, made
+    // from _styledFontBase
+    QFont _styledFonts[32];
+    QFont _styledFontBase;
+    quint32 _styledFontMask;
+
+    bool _glyphCacheEnabled;
+    GlyphCache _glyphCache;
+    QVector<QPainter::PixmapFragment> _glyphFragments;
+
+    // a line as it was drawn, with the cells it shows
+    struct LineImage
+    {
+        QPixmap pixmap;
+        QVector<Character> cells;
+        uint state;
+    };
+    bool _lineCacheEnabled;
+    // keyed by a hash of the cells, the cost is in KiB
+    QCache<uint, LineImage> _lineCache;
+    LineCacheSettings _lineCacheSettings;
+    // the first and last column each line of the current paint draws
+    QVector<QPair<int,int> > _paintColumns;
     bool _terminalSizeHint;
     bool _terminalSizeStartup;
     bool _bidiEnabled;
@@ -0,0 +1,156 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// Own
+#include "Utf8Decoder.h"
+
+// System
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+using namespace Konsole;
+
+static const uint REPLACEMENT_CHARACTER = 0xFFFD;
+
+Utf8Decoder::Utf8Decoder()
+{
+    reset();
+}
+
+void Utf8Decoder::reset()
+{
+    _codePoint = 0;
+    _remaining = 0;
+    _lowerBound = 0x80;
+    _upperBound = 0xBF;
+}
+
+// Converts the leading run of ASCII bytes in [input, end) to code points and
+// returns the number of bytes converted.  Only whole 16 byte blocks are
+// handled here; the scalar loop in decode() takes care of the rest.
+static inline int convertAsciiRun(const uchar *input, const uchar *end, uint *output)
+{
+    const uchar *start = input;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    while (end - input >= 16) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input));
+        if (_mm_movemask_epi8(bytes))
+            break;
+        const __m128i low = _mm_unpacklo_epi8(bytes, zero);
+        const __m128i high = _mm_unpackhi_epi8(bytes, zero);
+        __m128i *out = reinterpret_cast<__m128i *>(output);
+        _mm_storeu_si128(out, _mm_unpacklo_epi16(low, zero));
+        _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(low, zero));
+        _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(high, zero));
+        _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(high, zero));
+        input += 16;
+        output += 16;
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    while (end - input >= 16) {
+        const uint8x16_t bytes = vld1q_u8(input);
+        // any byte with the top bit set ends the run
+        const uint8x16_t high = vshrq_n_u8(bytes, 7);
+        const uint64x2_t mask = vreinterpretq_u64_u8(high);
+        if (vgetq_lane_u64(mask, 0) | vgetq_lane_u64(mask, 1))
+            break;
+        const uint16x8_t low16 = vmovl_u8(vget_low_u8(bytes));
+        const uint16x8_t high16 = vmovl_u8(vget_high_u8(bytes));
+        vst1q_u32(output, vmovl_u16(vget_low_u16(low16)));
+        vst1q_u32(output + 4, vmovl_u16(vget_high_u16(low16)));
+        vst1q_u32(output + 8, vmovl_u16(vget_low_u16(high16)));
+        vst1q_u32(output + 12, vmovl_u16(vget_high_u16(high16)));
+        input += 16;
+        output += 16;
+    }
+#else
+    Q_UNUSED(end);
+    Q_UNUSED(output);
+#endif
+    return int(input - start);
+}
+
+int Utf8Decoder::decode(const char *input, int length, uint *output)
+{
+    const uchar *in = reinterpret_cast<const uchar *>(input);
+    const uchar *end = in + length;
+    uint *out = output;
+
+    while (in < end) {
+        const uchar byte = *in;
+
+        if (_remaining > 0) {
+            if (byte < _lowerBound || byte > _upperBound) {
+                // the pending sequence is truncated; replace it and
+                // process this byte again as the start of a new one
+                *out++ = REPLACEMENT_CHARACTER;
+                reset();
+                continue;
+            }
+            _codePoint = (_codePoint << 6) | (byte & 0x3F);
+            _lowerBound = 0x80;
+            _upperBound = 0xBF;
+            ++in;
+            if (--_remaining == 0)
+                *out++ = _codePoint;
+            continue;
+        }
+
+        if (byte < 0x80) {
+            const int converted = convertAsciiRun(in, end, out);
+            in += converted;
+            out += converted;
+            // finish the run byte by byte
+            while (in < end && *in < 0x80)
+                *out++ = *in++;
+            continue;
+        }
+
+        ++in;
+        if (byte >= 0xC2 && byte <= 0xDF) {
+            _codePoint = byte & 0x1F;
+            _remaining = 1;
+        } else if (byte >= 0xE0 && byte <= 0xEF) {
+            _codePoint = byte & 0x0F;
+            _remaining = 2;
+            // reject overlong forms and UTF-16 surrogates
+            if (byte == 0xE0)
+                _lowerBound = 0xA0;
+            else if (byte == 0xED)
+                _upperBound = 0x9F;
+        } else if (byte >= 0xF0 && byte <= 0xF4) {
+            _codePoint = byte & 0x07;
+            _remaining = 3;
+            // reject overlong forms and code points above U+10FFFF
+            if (byte == 0xF0)
+                _lowerBound = 0x90;
+            else if (byte == 0xF4)
+                _upperBound = 0x8F;
+        } else {
+            // stray continuation byte or a lead byte which is never valid
+            *out++ = REPLACEMENT_CHARACTER;
+        }
+    }
+
+    return int(out - output);
+}
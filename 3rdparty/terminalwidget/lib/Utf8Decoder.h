@@ -0,0 +1,70 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+#ifndef UTF8DECODER_H
+#define UTF8DECODER_H
+
+// Qt
+#include <QtGlobal>
+
+namespace Konsole
+{
+
+/**
+ * A stateful UTF-8 decoder which turns the byte stream received from the
+ * terminal process directly into unicode code points.
+ *
+ * Unlike QTextDecoder it does not produce UTF-16, so code points above
+ * U+FFFF need no surrogate handling, and runs of ASCII are converted in
+ * blocks of 16 bytes where SSE2 or NEON is available.
+ *
+ * Incomplete sequences at the end of a block are kept and completed by
+ * the next call to decode().  Malformed input is replaced by U+FFFD, one
+ * replacement character per maximal invalid subpart, like QTextCodec does.
+ */
+class Utf8Decoder
+{
+public:
+    Utf8Decoder();
+
+    /**
+     * Decodes @p length bytes from @p input and writes the resulting code
+     * points to @p output, which must have room for at least
+     * @p length + 1 entries.
+     *
+     * Returns the number of code points written.
+     */
+    int decode(const char *input, int length, uint *output);
+
+    /** Discards any partially decoded sequence. */
+    void reset();
+
+private:
+    // code point bits collected so far for the pending sequence
+    uint _codePoint;
+    // number of continuation bytes still expected
+    int _remaining;
+    // valid range for the next continuation byte
+    uchar _lowerBound;
+    uchar _upperBound;
+};
+
+}
+
+#endif // UTF8DECODER_H
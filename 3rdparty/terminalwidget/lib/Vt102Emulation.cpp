@@ -59,7 +59,9 @@ using namespace Konsole;
 
 Vt102Emulation::Vt102Emulation()
     : Emulation(),
-     prevCC(0),
+     _parserState(0),
+     _intermediate(0),
+     _privateMarker(0),
      _titleUpdateTimer(new QTimer(this)),
      _reportFocusEvents(false)
 {
@@ -75,12 +77,15 @@ Vt102Emulation::~Vt102Emulation()
 
 void Vt102Emulation::clearEntireScreen()
 {
+  QMutexLocker locker(screenLock());
   _currentScreen->clearEntireScreen();
   bufferedUpdate();
 }
 
 void Vt102Emulation::reset()
 {
+  QMutexLocker locker(screenLock());
+
   resetTokenizer();
   resetModes();
   resetCharset(0);
@@ -174,18 +179,170 @@ void Vt102Emulation::reset()
 
 /* The tokenizer's state
 
-   The state is represented by the buffer (tokenBuffer, tokenBufferPos),
-   and accompanied by decoded arguments kept in (argv,argc).
-   Note that they are kept internal in the tokenizer.
+   The tokenizer is the state machine described by Paul Williams at
+   http://vt100.net/emu/dec_ansi_parser, extended by a few states for
+   the VT52 mode.  Each incoming character selects an entry in a table
+   indexed by the current state, which gives the action to perform and
+   the next state, so no decision needs to look at earlier characters.
+
+   The characters of the pending sequence are still collected in
+   (tokenBuffer, tokenBufferPos), for the text of OSC sequences and for
+   reporting undecodable sequences.  Numeric arguments are accumulated
+   into (argv,argc) as the digits arrive.
 */
 
+namespace {
+
+enum ParserState {
+  ParserGround,
+  ParserEscape,
+  ParserEscapeIntermediate,
+  ParserCsiEntry,
+  ParserCsiParam,
+  ParserCsiIntermediate,
+  ParserCsiIgnore,
+  ParserOscString,
+  ParserIgnoredString,     // DCS, SOS, PM and APC strings, skipped up to ST
+  ParserVt52Escape,
+  ParserVt52CursorRow,
+  ParserVt52CursorColumn,
+  ParserStateCount
+};
+
+enum ParserAction {
+  ActionNone,
+  ActionPrint,             // display a character
+  ActionExecute,           // process a control character
+  ActionCollect,           // remember an intermediate or private marker
+  ActionParam,             // accumulate a digit or start the next argument
+  ActionPut,               // append to the token buffer
+  ActionCancel,            // drop the pending sequence
+  ActionEnterEscape,
+  ActionEnterCsi,          // 8-bit CSI
+  ActionEscDispatch,
+  ActionCsiDispatch,
+  ActionOscEnd,
+  ActionOscEndEnterEscape, // ESC terminating an OSC string
+  ActionVt52Dispatch
+};
+
+// Transition table of the tokenizer.  Each entry holds the action in the
+// upper and the next state in the lower four bits.  Code points above 255
+// use the entry of 0xa0, i.e. they are printable.
+class ParserTable
+{
+public:
+  ParserTable();
+
+  uchar transition(int state, uint cc) const
+  { return table[state][cc < 256 ? cc : 0xa0]; }
+
+private:
+  void set(int state, uint from, uint to, int action, int next)
+  {
+    for (uint cc = from; cc <= to; ++cc)
+      table[state][cc] = uchar((action << 4) | next);
+  }
+  // transitions shared by the states which are not part of a string
+  void setAnywhere(int state)
+  {
+    set(state, 0x00, 0x1f, ActionExecute, state);
+    set(state, 0x18, 0x18, ActionExecute, ParserGround);  // CAN
+    set(state, 0x1a, 0x1a, ActionExecute, ParserGround);  // SUB
+    set(state, 0x1b, 0x1b, ActionEnterEscape, ParserEscape);
+    set(state, 0x7f, 0x7f, ActionNone, state);            // DEL
+    set(state, 0x9b, 0x9b, ActionEnterCsi, ParserCsiEntry);
+  }
+
+  uchar table[ParserStateCount][256];
+};
+
+ParserTable::ParserTable()
+{
+  for (int state = 0; state < ParserStateCount; ++state)
+    set(state, 0x00, 0xff, ActionCancel, ParserGround);
+
+  set(ParserGround, 0x20, 0xff, ActionPrint, ParserGround);
+  setAnywhere(ParserGround);
+
+  set(ParserEscape, 0x20, 0x2f, ActionCollect, ParserEscapeIntermediate);
+  set(ParserEscape, 0x30, 0x7e, ActionEscDispatch, ParserGround);
+  set(ParserEscape, '[', '[', ActionPut, ParserCsiEntry);
+  set(ParserEscape, ']', ']', ActionPut, ParserOscString);
+  set(ParserEscape, 'P', 'P', ActionNone, ParserIgnoredString);
+  set(ParserEscape, 'X', 'X', ActionNone, ParserIgnoredString);
+  set(ParserEscape, '^', '^', ActionNone, ParserIgnoredString);
+  set(ParserEscape, '_', '_', ActionNone, ParserIgnoredString);
+  set(ParserEscape, '\\', '\\', ActionCancel, ParserGround); // ST
+  setAnywhere(ParserEscape);
+
+  set(ParserEscapeIntermediate, 0x20, 0x2f, ActionCollect, ParserEscapeIntermediate);
+  set(ParserEscapeIntermediate, 0x30, 0x7e, ActionEscDispatch, ParserGround);
+  setAnywhere(ParserEscapeIntermediate);
+
+  set(ParserCsiEntry, 0x20, 0x2f, ActionCollect, ParserCsiIntermediate);
+  set(ParserCsiEntry, 0x30, 0x3b, ActionParam, ParserCsiParam);
+  set(ParserCsiEntry, 0x3c, 0x3f, ActionCollect, ParserCsiParam);
+  set(ParserCsiEntry, 0x40, 0x7e, ActionCsiDispatch, ParserGround);
+  setAnywhere(ParserCsiEntry);
+
+  set(ParserCsiParam, 0x20, 0x2f, ActionCollect, ParserCsiIntermediate);
+  set(ParserCsiParam, 0x30, 0x3b, ActionParam, ParserCsiParam);
+  set(ParserCsiParam, 0x3c, 0x3f, ActionNone, ParserCsiIgnore);
+  set(ParserCsiParam, 0x40, 0x7e, ActionCsiDispatch, ParserGround);
+  setAnywhere(ParserCsiParam);
+
+  set(ParserCsiIntermediate, 0x20, 0x2f, ActionCollect, ParserCsiIntermediate);
+  set(ParserCsiIntermediate, 0x30, 0x3f, ActionNone, ParserCsiIgnore);
+  set(ParserCsiIntermediate, 0x40, 0x7e, ActionCsiDispatch, ParserGround);
+  setAnywhere(ParserCsiIntermediate);
+
+  set(ParserCsiIgnore, 0x20, 0x3f, ActionNone, ParserCsiIgnore);
+  set(ParserCsiIgnore, 0x40, 0x7e, ActionCancel, ParserGround);
+  setAnywhere(ParserCsiIgnore);
+
+  // control characters in the text part of OSC sequences are ignored,
+  // this matches what XTERM docs say
+  set(ParserOscString, 0x00, 0xff, ActionPut, ParserOscString);
+  set(ParserOscString, 0x00, 0x1f, ActionNone, ParserOscString);
+  set(ParserOscString, 0x07, 0x07, ActionOscEnd, ParserGround);  // BEL
+  set(ParserOscString, 0x1b, 0x1b, ActionOscEndEnterEscape, ParserEscape);
+  set(ParserOscString, 0x7f, 0x7f, ActionNone, ParserOscString);
+
+  set(ParserIgnoredString, 0x00, 0xff, ActionNone, ParserIgnoredString);
+  set(ParserIgnoredString, 0x18, 0x18, ActionExecute, ParserGround);
+  set(ParserIgnoredString, 0x1a, 0x1a, ActionExecute, ParserGround);
+  set(ParserIgnoredString, 0x1b, 0x1b, ActionEnterEscape, ParserEscape);
+
+  // the VT52 has no 8-bit controls, 0x9b is an ordinary character there
+  set(ParserVt52Escape, 0x20, 0xff, ActionVt52Dispatch, ParserGround);
+  set(ParserVt52Escape, 'Y', 'Y', ActionPut, ParserVt52CursorRow);
+  setAnywhere(ParserVt52Escape);
+  set(ParserVt52Escape, 0x9b, 0x9b, ActionVt52Dispatch, ParserGround);
+
+  set(ParserVt52CursorRow, 0x20, 0xff, ActionPut, ParserVt52CursorColumn);
+  setAnywhere(ParserVt52CursorRow);
+  set(ParserVt52CursorRow, 0x9b, 0x9b, ActionPut, ParserVt52CursorColumn);
+
+  set(ParserVt52CursorColumn, 0x20, 0xff, ActionVt52Dispatch, ParserGround);
+  setAnywhere(ParserVt52CursorColumn);
+  set(ParserVt52CursorColumn, 0x9b, 0x9b, ActionVt52Dispatch, ParserGround);
+}
+
+const ParserTable parserTable;
+
+}
+
 void Vt102Emulation::resetTokenizer()
 {
   tokenBufferPos = 0;
   argc = 0;
   argv[0] = 0;
   argv[1] = 0;
-  prevCC = 0;
+  argv[2] = 0;
+  _intermediate = 0;
+  _privateMarker = 0;
+  _parserState = ParserGround;
 }
 
 void Vt102Emulation::addDigit(int digit)
@@ -206,194 +363,235 @@ void Vt102Emulation::addToCurrentToken(wchar_t cc)
   tokenBufferPos = qMin(tokenBufferPos+1,MAX_TOKEN_LENGTH-1);
 }
 
-// Character Class flags used while decoding
-#define CTL  1  // Control character
-#define CHR  2  // Printable character
-#define CPN  4  // TODO: Document me
-#define DIG  8  // Digit
-#define SCS 16  // TODO: Document me
-#define GRP 32  // TODO: Document me
-#define CPS 64  // Character which indicates end of window resize
-                // escape sequence '\e[8;<row>;<col>t'
+// Character Class flags used while dispatching
+#define CPN  1  // Final character of a CSI sequence taking two numeric arguments
 
 void Vt102Emulation::initTokenizer()
 {
-  int i;
   const char* s;
-  for(i = 0;i < 256; ++i)
+  for(int i = 0;i < 256; ++i)
     charClass[i] = 0;
-  for(i = 0;i < 32; ++i)
-    charClass[i] |= CTL;
-  for(i = 32;i < 256; ++i)
-    charClass[i] |= CHR;
   for(s = "@ABCDGHILMPSTXZbcdfry"; *s; ++s)
     charClass[static_cast<int>(*s)] |= CPN;
-  // resize = \e[8;<row>;<col>t
-  for(s = "t"; *s; ++s)
-    charClass[static_cast<int>(*s)] |= CPS;
-  for(s = "0123456789"; *s; ++s)
-    charClass[static_cast<int>(*s)] |= DIG;
-  for(s = "()+*%"; *s; ++s)
-    charClass[static_cast<int>(*s)] |= SCS;
-  for(s = "()+*#[]%"; *s; ++s)
-    charClass[static_cast<int>(*s)] |= GRP;
 
   resetTokenizer();
 }
 
-/* Ok, here comes the nasty part of the decoder.
-
-   Instead of keeping an explicit state, we deduce it from the
-   token scanned so far. It is then immediately combined with
-   the current character to form a scanning decision.
-
-   This is done by the following defines.
-
-   - P is the length of the token scanned so far.
-   - L (often P-1) is the position on which contents we base a decision.
-   - C is a character or a group of characters (taken from 'charClass').
-
-   - 'cc' is the current character
-   - 's' is a pointer to the start of the token buffer
-   - 'p' is the current position within the token buffer
-
-   Note that they need to applied in proper order.
-*/
-
-#define lec(P,L,C) (p == (P) && s[(L)] == (C))
-#define lun(     ) (p ==  1  && cc >= 32 )
-#define les(P,L,C) (p == (P) && s[L] < 256 && (charClass[s[(L)]] & (C)) == (C))
-#define eec(C)     (p >=  3  && cc == (C))
-#define ees(C)     (p >=  3  && cc < 256 && (charClass[cc] & (C)) == (C))
-#define eps(C)     (p >=  3  && s[2] != '?' && s[2] != '!' && s[2] != '>' && cc < 256 && (charClass[cc] & (C)) == (C))
-#define epp( )     (p >=  3  && s[2] == '?')
-#define epe( )     (p >=  3  && s[2] == '!')
-#define egt( )     (p >=  3  && s[2] == '>')
-#define esp( )     (p ==  4  && s[3] == ' ')
-#define Xpe        (tokenBufferPos >= 2 && tokenBuffer[1] == ']')
-#define Xte        (Xpe      && (cc ==  7 || (prevCC == 27 && cc == 92) )) // 27, 92 => "\e\\" (ST, String Terminator)
-#define ces(C)     (cc < 256 && (charClass[cc] & (C)) == (C) && !Xte)
-
-#define CNTL(c) ((c)-'@')
 #define ESC 27
 #define DEL 127
 
 // process an incoming unicode character
 void Vt102Emulation::receiveChar(wchar_t cc)
 {
-  if (cc == DEL)
-    return; //VT100: ignore.
+  const uchar transition = parserTable.transition(_parserState, uint(cc));
+  _parserState = transition & 0x0f;
 
-  if (ces(CTL))
+  switch (transition >> 4)
   {
-    // ignore control characters in the text part of Xpe (aka OSC) "ESC]"
-    // escape sequences; this matches what XTERM docs say
-    if (Xpe) {
-        prevCC = cc;
-        return;
-    }
+    case ActionNone:
+      break;
+    case ActionPrint:
+      processToken( TY_CHR(), getMode(MODE_Ansi) ? applyCharset(cc) : cc, 0);
+      break;
+    case ActionExecute:
+      // DEC HACK ALERT! Control Characters are allowed *within* esc sequences in VT100
+      // This means, they do neither a resetTokenizer() nor a pushToToken(), except
+      // for CAN and SUB which abort the sequence.
+      if (_parserState == ParserGround)
+        resetTokenizer();
+      processToken( TY_CTL(cc+'@' ), 0, 0);
+      break;
+    case ActionCollect:
+      addToCurrentToken(cc);
+      if (cc >= '<' && cc <= '?')
+        _privateMarker = cc;
+      else
+        _intermediate = _intermediate ? -1 : cc; // only one intermediate is supported
+      break;
+    case ActionParam:
+      addToCurrentToken(cc);
+      if (cc == ';' || cc == ':')
+        addArgument();
+      else
+        addDigit(cc - '0');
+      break;
+    case ActionPut:
+      addToCurrentToken(cc);
+      break;
+    case ActionCancel:
+      resetTokenizer();
+      break;
+    case ActionEnterEscape:
+      enterEscape();
+      break;
+    case ActionEnterCsi:
+      // the ground state is shared with VT52 mode, which prints 0x9b
+      if (!getMode(MODE_Ansi)) {
+        _parserState = ParserGround;
+        processToken( TY_CHR(), cc, 0);
+        break;
+      }
+      resetTokenizer();
+      addToCurrentToken(ESC);
+      addToCurrentToken('[');
+      _parserState = ParserCsiEntry;
+      break;
+    case ActionEscDispatch:
+      addToCurrentToken(cc);
+      dispatchEscape(cc);
+      resetTokenizer();
+      break;
+    case ActionCsiDispatch:
+      addToCurrentToken(cc);
+      dispatchCsi(cc);
+      resetTokenizer();
+      break;
+    case ActionOscEnd:
+      processWindowAttributeChange();
+      resetTokenizer();
+      break;
+    case ActionOscEndEnterEscape:
+      processWindowAttributeChange();
+      enterEscape();
+      break;
+    case ActionVt52Dispatch:
+      addToCurrentToken(cc);
+      if (tokenBufferPos < 4)
+        processToken( TY_VT52(tokenBuffer[1]), 0, 0);
+      else
+        processToken( TY_VT52(tokenBuffer[1]), tokenBuffer[2], tokenBuffer[3]);
+      resetTokenizer();
+      break;
+  }
+}
 
-    // DEC HACK ALERT! Control Characters are allowed *within* esc sequences in VT100
-    // This means, they do neither a resetTokenizer() nor a pushToToken(). Some of them, do
-    // of course. Guess this originates from a weakly layered handling of the X-on
-    // X-off protocol, which comes really below this level.
-    if (cc == CNTL('X') || cc == CNTL('Z') || cc == ESC)
-        resetTokenizer(); //VT100: CAN or SUB
-    if (cc != ESC)
-    {
-        processToken(TY_CTL(cc+'@' ),0,0);
-        return;
-    }
+void Vt102Emulation::enterEscape()
+{
+  resetTokenizer();
+  addToCurrentToken(ESC);
+  _parserState = getMode(MODE_Ansi) ? ParserEscape : ParserVt52Escape;
+}
+
+void Vt102Emulation::dispatchEscape(wchar_t cc)
+{
+  switch (_intermediate)
+  {
+    case 0:
+      processToken( TY_ESC(cc), 0, 0);
+      break;
+    case '(': case ')': case '+': case '*': case '%':
+      processToken( TY_ESC_CS(_intermediate, cc), 0, 0);
+      break;
+    case '#':
+      processToken( TY_ESC_DE(cc), 0, 0);
+      break;
+    default:
+      reportDecodingError();
+      break;
+  }
+}
+
+void Vt102Emulation::dispatchCsi(wchar_t cc)
+{
+  if (_privateMarker == '?')
+  {
+    for (int i=0;i<=argc;i++)
+      processToken( TY_CSI_PR(cc,argv[i]), 0, 0);
+    return;
+  }
+  if (_privateMarker == '>')
+  {
+    processToken( TY_CSI_PG(cc), 0, 0); // spec. case for ESC[>0c or ESC[>c
+    return;
+  }
+  if (_privateMarker != 0)
+  {
+    reportDecodingError();
+    return;
   }
-  // advance the state
-  addToCurrentToken(cc);
 
-  wchar_t* s = tokenBuffer;
-  int  p = tokenBufferPos;
+  if (_intermediate == '!')
+  {
+    processToken( TY_CSI_PE(cc), 0, 0);
+    return;
+  }
+  if (_intermediate == ' ' && cc == 'q')
+  {
+    processToken( TY_CSI_PS_SP(cc, argv[0]), argv[0], 0);
+    return;
+  }
+  if (_intermediate != 0)
+  {
+    reportDecodingError();
+    return;
+  }
 
-  if (getMode(MODE_Ansi))
+  if (cc < 256 && (charClass[cc] & CPN))
   {
-    if (lec(1,0,ESC)) { return; }
-    if (lec(1,0,ESC+128)) { s[0] = ESC; receiveChar('['); return; }
-    if (les(2,1,GRP)) { return; }
-    if (Xte         ) { processWindowAttributeChange(); resetTokenizer(); return; }
-    if (Xpe         ) { prevCC = cc; return; }
-    if (lec(3,2,'?')) { return; }
-    if (lec(3,2,'>')) { return; }
-    if (lec(3,2,'!')) { return; }
-    if (lun(       )) { processToken( TY_CHR(), applyCharset(cc), 0);   resetTokenizer(); return; }
-    if (lec(2,0,ESC)) { processToken( TY_ESC(s[1]), 0, 0);              resetTokenizer(); return; }
-    if (les(3,1,SCS)) { processToken( TY_ESC_CS(s[1],s[2]), 0, 0);      resetTokenizer(); return; }
-    if (lec(3,1,'#')) { processToken( TY_ESC_DE(s[2]), 0, 0);           resetTokenizer(); return; }
-    if (eps(    CPN)) { processToken( TY_CSI_PN(cc), argv[0],argv[1]);  resetTokenizer(); return; }
-    if (esp(       )) { return; }
-    if (lec(5, 4, 'q') && s[3] == ' ') {
-      processToken( TY_CSI_PS_SP(cc, argv[0]), argv[0], 0);
-      resetTokenizer();
-      return;
-    }
+    processToken( TY_CSI_PN(cc), argv[0], argv[1]);
+    return;
+  }
+
+  // resize = \e[8;<row>;<col>t
+  if (cc == 't')
+  {
+    processToken( TY_CSI_PS(cc, argv[0]), argv[1], argv[2]);
+    return;
+  }
 
-    // resize = \e[8;<row>;<col>t
-    if (eps(CPS))
+  for (int i=0;i<=argc;i++)
+  {
+    if (cc == 'm' && argc - i >= 4 && (argv[i] == 38 || argv[i] == 48) && argv[i+1] == 2)
     {
-        processToken( TY_CSI_PS(cc, argv[0]), argv[1], argv[2]);
-        resetTokenizer();
-        return;
+      // ESC[ ... 48;2;<red>;<green>;<blue> ... m -or- ESC[ ... 38;2;<red>;<green>;<blue> ... m
+      i += 2;
+      processToken( TY_CSI_PS(cc, argv[i-2]), COLOR_SPACE_RGB, (argv[i] << 16) | (argv[i+1] << 8) | argv[i+2]);
+      i += 2;
     }
-
-    if (epe(   )) { processToken( TY_CSI_PE(cc), 0, 0); resetTokenizer(); return; }
-    if (ees(DIG)) { addDigit(cc-'0'); return; }
-    if (eec(';') || eec(':')) { addArgument(); return; }
-    for (int i=0;i<=argc;i++)
+    else if (cc == 'm' && argc - i >= 2 && (argv[i] == 38 || argv[i] == 48) && argv[i+1] == 5)
     {
-        if (epp())
-            processToken( TY_CSI_PR(cc,argv[i]), 0, 0);
-        else if (egt())
-            processToken( TY_CSI_PG(cc), 0, 0); // spec. case for ESC]>0c or ESC]>c
-        else if (cc == 'm' && argc - i >= 4 && (argv[i] == 38 || argv[i] == 48) && argv[i+1] == 2)
-        {
-            // ESC[ ... 48;2;<red>;<green>;<blue> ... m -or- ESC[ ... 38;2;<red>;<green>;<blue> ... m
-            i += 2;
-            processToken( TY_CSI_PS(cc, argv[i-2]), COLOR_SPACE_RGB, (argv[i] << 16) | (argv[i+1] << 8) | argv[i+2]);
-            i += 2;
-        }
-        else if (cc == 'm' && argc - i >= 2 && (argv[i] == 38 || argv[i] == 48) && argv[i+1] == 5)
-        {
-            // ESC[ ... 48;5;<index> ... m -or- ESC[ ... 38;5;<index> ... m
-            i += 2;
-            processToken( TY_CSI_PS(cc, argv[i-2]), COLOR_SPACE_256, argv[i]);
-        }
-        else
-            processToken( TY_CSI_PS(cc,argv[i]), 0, 0);
+      // ESC[ ... 48;5;<index> ... m -or- ESC[ ... 38;5;<index> ... m
+      i += 2;
+      processToken( TY_CSI_PS(cc, argv[i-2]), COLOR_SPACE_256, argv[i]);
     }
-    resetTokenizer();
+    else
+      processToken( TY_CSI_PS(cc,argv[i]), 0, 0);
   }
-  else
+}
+
+// Characters which are displayed as they are in the ground state, see the
+// ParserGround transitions above.  ESC+128 is the 8-bit CSI.
+static inline bool isPlainPrintable(uint cc)
+{
+  return cc >= 32 && cc != DEL && cc != ESC+128;
+}
+
+// process a block of incoming unicode characters
+void Vt102Emulation::receiveChars(const uint *chars, int count)
+{
+  int i = 0;
+  while (i < count)
   {
-    // VT52 Mode
-    if (lec(1,0,ESC))
-        return;
-    if (les(1,0,CHR))
+    // Runs of printable characters in the ground state go to the screen in
+    // one call instead of passing through the tokenizer one by one.  Charset
+    // translation is rare enough to leave to the slow path.
+    const CharCodes& charset = _charset[_currentScreen == _screen[1]];
+    if (_parserState == ParserGround && isPlainPrintable(chars[i]) && getMode(MODE_Ansi)
+        && !charset.graphic && !charset.pound)
     {
-        processToken( TY_CHR(), s[0], 0);
-        resetTokenizer();
-        return;
-    }
-    if (lec(2,1,'Y'))
-        return;
-    if (lec(3,1,'Y'))
-        return;
-    if (p < 4)
-    {
-        processToken( TY_VT52(s[1] ), 0, 0);
-        resetTokenizer();
-        return;
+      int end = i + 1;
+      while (end < count && isPlainPrintable(chars[end]))
+        end++;
+      _currentScreen->displayCharacters(chars + i, end - i);
+      i = end;
+      continue;
     }
-    processToken( TY_VT52(s[1]), s[2], s[3]);
-    resetTokenizer();
-    return;
+
+    receiveChar(wchar_t(chars[i]));
+    i++;
   }
 }
+
 void Vt102Emulation::processWindowAttributeChange()
 {
   // Describes the window or terminal session attribute to change
@@ -407,23 +605,25 @@ void Vt102Emulation::processWindowAttributeChange()
     attributeToChange = 10 * attributeToChange + (tokenBuffer[i]-'0');
   }
 
-  if (tokenBuffer[i] != ';')
+  if (i >= tokenBufferPos || tokenBuffer[i] != ';')
   {
     reportDecodingError();
     return;
   }
 
-  // copy from the first char after ';', and skipping the ending delimiter
-  // 0x07 or 0x92. Note that as control characters in OSC text parts are
-  // ignored, only the second char in ST ("\e\\") is appended to tokenBuffer.
-  QString newValue = QString::fromWCharArray(tokenBuffer + i + 1, tokenBufferPos-i-2);
+  // copy from the first char after ';'. The terminating BEL or ESC is not
+  // part of tokenBuffer.
+  QString newValue = QString::fromWCharArray(tokenBuffer + i + 1, tokenBufferPos-i-1);
 
   _pendingTitleUpdates[attributeToChange] = newValue;
-  _titleUpdateTimer->start(20);
+  // the timer lives on the GUI thread, output may be processed on the emulation thread
+  QMetaObject::invokeMethod(_titleUpdateTimer, "start", Q_ARG(int, 20));
 }
 
 void Vt102Emulation::updateTitle()
 {
+    QMutexLocker locker(screenLock());
+
     QListIterator<int> iter( _pendingTitleUpdates.keys() );
     while (iter.hasNext()) {
         int arg = iter.next();
@@ -863,9 +1063,9 @@ void Vt102Emulation::clearScreenAndSetColumns(int columnCount)
 void Vt102Emulation::sendString(const char* s , int length)
 {
   if ( length >= 0 )
-    emit sendData(s,length);
+    emitSendData(s,length);
   else
-    emit sendData(s,static_cast<int>(strlen(s)));
+    emitSendData(s,static_cast<int>(strlen(s)));
 }
 
 void Vt102Emulation::reportCursorPosition()
@@ -942,6 +1142,8 @@ void Vt102Emulation::sendMouseEvent( int cb, int cx, int cy , int eventType )
     if (cx < 1 || cy < 1)
       return;
 
+    QMutexLocker locker(screenLock());
+
     // With the exception of the 1006 mode, button release is encoded in cb.
     // Note that if multiple extensions are enabled, the 1006 is used, so it's okay to check for only that.
     if (eventType == 2 && !getMode(MODE_Mouse1006))
@@ -991,6 +1193,7 @@ void Vt102Emulation::sendMouseEvent( int cb, int cx, int cy , int eventType )
  */
 void Vt102Emulation::focusLost(void)
 {
+    QMutexLocker locker(screenLock());
     if (_reportFocusEvents)
         sendString("\033[O");
 }
@@ -1004,6 +1207,7 @@ void Vt102Emulation::focusLost(void)
  */
 void Vt102Emulation::focusGained(void)
 {
+    QMutexLocker locker(screenLock());
     if (_reportFocusEvents)
         sendString("\033[I");
 }
@@ -1021,6 +1225,8 @@ void Vt102Emulation::sendText( const QString& text )
 }
 void Vt102Emulation::sendKeyEvent( QKeyEvent* event )
 {
+    QMutexLocker locker(screenLock());
+
     Qt::KeyboardModifiers modifiers = event->modifiers();
     KeyboardTranslator::States states = KeyboardTranslator::NoState;
 
@@ -103,6 +103,7 @@ protected:
   void setMode(int mode) override;
   void resetMode(int mode) override;
   void receiveChar(wchar_t cc) override;
+  void receiveChars(const uint *chars, int count) override;
 
 private slots:
   //causes changeTitle() to be emitted for each (int,QString) pair in pendingTitleUpdates
@@ -143,11 +144,18 @@ private:
   int argv[MAXARGS];
   int argc;
   void initTokenizer();
-  int prevCC;
+  // current state of the tokenizer, see the ParserTable in Vt102Emulation.cpp
+  int _parserState;
+  // intermediate character (-1 if there were several) and private marker
+  // ('<', '=', '>' or '?') of the pending escape sequence
+  int _intermediate;
+  int _privateMarker;
+  void enterEscape();
+  void dispatchEscape(wchar_t cc);
+  void dispatchCsi(wchar_t cc);
 
   // Set of flags for each of the ASCII characters which indicates
-  // what category they fall into (printable character, control, digit etc.)
-  // for the purposes of decoding terminal output
+  // how a CSI sequence ending with it is dispatched
   int charClass[256];
 
   void reportDecodingError();
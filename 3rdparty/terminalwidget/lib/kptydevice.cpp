@@ -396,6 +396,42 @@ bool KPtyDevice::isSuspended() const
     return !d->readNotifier->isEnabled();
 }
 
+const char *KPtyDevice::bufferedChunk(int *length)
+{
+    Q_D(KPtyDevice);
+    // a read larger than CHUNKSIZE may leave an empty chunk at the front
+    while (!d->readBuffer.isEmpty() && !d->readBuffer.readSize())
+        d->readBuffer.free(0);
+
+    if (d->readBuffer.isEmpty()) {
+        *length = 0;
+        return nullptr;
+    }
+    *length = d->readBuffer.readSize();
+    return d->readBuffer.readPointer();
+}
+
+void KPtyDevice::releaseBufferedChunk(int length)
+{
+    Q_D(KPtyDevice);
+    d->readBuffer.free(length);
+}
+
+QByteArray KPtyDevice::takeBufferedChunk(int *offset, int *length)
+{
+    Q_D(KPtyDevice);
+    // a read larger than CHUNKSIZE may leave an empty chunk at the front
+    while (!d->readBuffer.isEmpty() && !d->readBuffer.readSize())
+        d->readBuffer.free(0);
+
+    if (d->readBuffer.isEmpty()) {
+        *offset = 0;
+        *length = 0;
+        return QByteArray();
+    }
+    return d->readBuffer.takeFront(offset, length);
+}
+
 // protected
 qint64 KPtyDevice::readData(char *data, qint64 maxlen)
 {
@@ -144,6 +144,34 @@ public:
     bool waitForBytesWritten(int msecs = -1) override;
     bool waitForReadyRead(int msecs = -1) override;
 
+    /**
+     * Returns a pointer to the first contiguous chunk of buffered input
+     * without copying it, or nullptr if nothing is buffered.
+     *
+     * The chunk stays valid until releaseBufferedChunk() or the next read.
+     *
+     * @param length receives the size of the chunk
+     */
+    const char *bufferedChunk(int *length);
+
+    /**
+     * Drops @p length bytes from the front of the input buffer, typically
+     * after the chunk returned by bufferedChunk() has been consumed.
+     */
+    void releaseBufferedChunk(int length);
+
+    /**
+     * Moves the first contiguous chunk of buffered input out of the input
+     * buffer and returns it, or a null array if nothing is buffered.
+     *
+     * The chunk is not copied, so it can be kept, for example by another
+     * thread, while the buffer goes on with new memory.
+     *
+     * @param offset receives the position of the input in the chunk
+     * @param length receives the size of the input
+     */
+    QByteArray takeBufferedChunk(int *offset, int *length);
+
 
 Q_SIGNALS:
     /**
@@ -259,6 +287,26 @@ public:
         return ptr;
     }
 
+    // moves the first chunk out of the buffer without copying it; the
+    // readable bytes start at *offset and there are *length of them
+    QByteArray takeFront(int *offset, int *length)
+    {
+        *offset = head;
+        *length = readSize();
+        totalSize -= *length;
+
+        QByteArray chunk;
+        chunk.swap(buffers.front());
+        if (buffers.size() == 1) {
+            buffers.front().resize(CHUNKSIZE);
+            head = tail = 0;
+        } else {
+            buffers.pop_front();
+            head = 0;
+        }
+        return chunk;
+    }
+
     // release a trailing part of the last reservation
     inline void unreserve(int bytes)
     {
@@ -31,6 +31,8 @@
 #include "TerminalDisplay.h"
 #include "KeyboardTranslator.h"
 #include "ColorScheme.h"
+#include "HistoryExport.h"
+#include "HistorySearch.h"
 #include "SearchBar.h"
 #include "qtermwidget.h"
 
@@ -55,12 +57,19 @@ struct TermWidgetImpl {
 
     TerminalDisplay *m_terminalDisplay;
     Session *m_session;
+    qint64 m_historyMemoryLimit;
+    // keeps the matches of the last search
+    HistorySearch *m_historySearch;
+    HistoryExport *m_historyExport;
 
     Session *createSession(QWidget *parent);
     TerminalDisplay *createTerminalDisplay(Session *session, QWidget *parent);
 };
 
 TermWidgetImpl::TermWidgetImpl(QWidget *parent)
+    : m_historyMemoryLimit(TieredHistoryScroll::DEFAULT_MEMORY_LIMIT)
+    , m_historySearch(nullptr)
+    , m_historyExport(nullptr)
 {
     this->m_session = createSession(parent);
     SessionManager::instance()->saveSession(this->m_session);
@@ -93,7 +102,7 @@ Session *TermWidgetImpl::createSession(QWidget *parent)
     session->setCodec(QTextCodec::codecForName("UTF-8"));
 
     session->setFlowControlEnabled(true);
-    session->setHistoryType(HistoryTypeBuffer(1000));
+    session->setHistoryType(CompactHistoryType(1000));
 
     session->setDarkBackground(true);
 
@@ -168,9 +177,11 @@ void QTermWidget::search(bool forwards, bool next)
         }
         /***mod end by ut001121 zhangmeng 20200814***/
     } else if (next) { // search from just after current selection
+        QMutexLocker locker(m_impl->m_terminalDisplay->screenWindow()->screenLock());
         m_impl->m_terminalDisplay->screenWindow()->screen()->getSelectionEnd(startColumn, startLine);
         startColumn++;
     } else {  // search from start of current selection
+        QMutexLocker locker(m_impl->m_terminalDisplay->screenWindow()->screenLock());
         m_impl->m_terminalDisplay->screenWindow()->screen()->getSelectionStart(startColumn, startLine);
     }
 
@@ -181,12 +192,7 @@ void QTermWidget::search(bool forwards, bool next)
     regExp.setPatternSyntax(m_searchBar->useRegularExpression() ? QRegExp::RegExp : QRegExp::FixedString);
     regExp.setCaseSensitivity(m_searchBar->matchCase() ? Qt::CaseSensitive : Qt::CaseInsensitive);
 
-    HistorySearch *historySearch =
-        new HistorySearch(m_impl->m_session->emulation(), regExp, forwards, startColumn, startLine, this);
-    connect(historySearch, SIGNAL(matchFound(int, int, int, int, int, int)), this, SLOT(matchFound(int, int, int, int, int, int)));
-    connect(historySearch, SIGNAL(sig_noMatchFound()), this, SLOT(clearSelection()));
-    connect(historySearch, SIGNAL(sig_noMatchFound()), m_searchBar, SLOT(clearSelection()));
-    historySearch->search();
+    m_impl->m_historySearch->search(regExp, forwards, startColumn, startLine);
     /***mod end by ut001121***/
 }
 
@@ -211,9 +217,11 @@ void QTermWidget::search(QString txt, bool forwards, bool next)
         }
         /***mod end by ut001121 zhangmeng 20200814***/
     } else if (next) { // search from just after current selection
+        QMutexLocker locker(m_impl->m_terminalDisplay->screenWindow()->screenLock());
         m_impl->m_terminalDisplay->screenWindow()->screen()->getSelectionEnd(startColumn, startLine);
         startColumn++;
     } else { // search from start of current selection
+        QMutexLocker locker(m_impl->m_terminalDisplay->screenWindow()->screenLock());
         m_impl->m_terminalDisplay->screenWindow()->screen()->getSelectionStart(startColumn, startLine);
     }
 
@@ -225,14 +233,7 @@ void QTermWidget::search(QString txt, bool forwards, bool next)
     regExp.setPatternSyntax(QRegExp::FixedString);
     regExp.setCaseSensitivity(Qt::CaseSensitive);
 
-    HistorySearch *historySearch =
-        new HistorySearch(m_impl->m_session->emulation(), regExp, forwards, startColumn, startLine, this);
-    connect(historySearch, SIGNAL(matchFound(int, int, int, int, int, int)), this, SLOT(matchFound(int, int, int, int, int, int)));
-    connect(historySearch, SIGNAL(sig_noMatchFound()), this, SLOT(clearSelection()));
-
-    connect(historySearch, &HistorySearch::noMatchFound, this, [this]() { emit sig_noMatchFound(); });
-    // connect(historySearch, SIGNAL(noMatchFound()), m_searchBar, SLOT(noMatchFound()));
-    historySearch->search();
+    m_impl->m_historySearch->search(regExp, forwards, startColumn, startLine);
     /***mod end by ut001121***/
 }
 
@@ -259,9 +260,23 @@ void QTermWidget::clearSelection()
 {
     /***add by ut001121 zhangmeng 20200515 修复BUG22626***/
     m_bHasSelect = false;
+    // a search still reading the history would select its match later
+    m_impl->m_historySearch->cancel();
     m_impl->m_terminalDisplay->screenWindow()->clearSelection();
 }
 
+void QTermWidget::searchMatchesChanged()
+{
+    m_impl->m_terminalDisplay->processFilters();
+    emit searchMatchCountChanged(m_impl->m_historySearch->currentMatchIndex() + 1,
+                                 m_impl->m_historySearch->matchCount());
+}
+
+void QTermWidget::clearSearchMatches()
+{
+    m_impl->m_historySearch->clear();
+}
+
 void QTermWidget::noMatchFound()
 {
     /***add by ut001121 zhangmeng 20200515 修复BUG22626***/
@@ -426,6 +441,16 @@ void QTermWidget::init(int startnow)
     m_impl = new TermWidgetImpl(this);
     m_layout->addWidget(m_impl->m_terminalDisplay);
 
+    // the history is searched on a worker thread, the matches come back later
+    m_impl->m_historySearch = new HistorySearch(m_impl->m_session->emulation(), this);
+    connect(m_impl->m_historySearch, SIGNAL(matchFound(int, int, int, int, int, int)), this, SLOT(matchFound(int, int, int, int, int, int)));
+    connect(m_impl->m_historySearch, &HistorySearch::noMatchFound, this, [this]() { emit sig_noMatchFound(); });
+    connect(m_impl->m_historySearch, SIGNAL(matchesChanged()), this, SLOT(searchMatchesChanged()));
+
+    m_impl->m_historyExport = new HistoryExport(m_impl->m_session->emulation(), this);
+    connect(m_impl->m_historyExport, SIGNAL(progress(int)), this, SIGNAL(historyExportProgress(int)));
+    connect(m_impl->m_historyExport, SIGNAL(finished(bool)), this, SIGNAL(historyExportFinished(bool)));
+
     connect(m_impl->m_session, SIGNAL(bellRequest(QString)), m_impl->m_terminalDisplay, SLOT(bell(QString)));
     connect(m_impl->m_terminalDisplay, SIGNAL(notifyBell(QString)), this, SIGNAL(bell(QString)));
 
@@ -447,6 +472,8 @@ void QTermWidget::init(int startnow)
     UrlFilter *urlFilter = new UrlFilter();
     connect(urlFilter, &UrlFilter::activated, this, &QTermWidget::urlActivated);
     m_impl->m_terminalDisplay->filterChain()->addFilter(urlFilter);
+    // after the UrlFilter, so that links in matches can still be clicked
+    m_impl->m_terminalDisplay->filterChain()->addFilter(new HistorySearchFilter(m_impl->m_historySearch, m_impl->m_terminalDisplay));
     m_impl->m_terminalDisplay->filterChain()->setSessionId(m_impl->m_session->sessionId());
 
 //    m_searchBar = new SearchBar(this);
@@ -499,6 +526,9 @@ QTermWidget::~QTermWidget()
 {
     SessionManager::instance()->removeSession(m_impl->m_session->sessionId());
 
+    // stop the search and export workers before the emulation goes away
+    delete m_impl->m_historySearch;
+    delete m_impl->m_historyExport;
     delete m_impl;
     emit destroyed();
 }
@@ -658,9 +688,40 @@ void QTermWidget::setSize(const QSize &size)
 void QTermWidget::setHistorySize(int lines)
 {
     if (lines < 0)
-        m_impl->m_session->setHistoryType(HistoryTypeFile());
+        m_impl->m_session->setHistoryType(TieredHistoryType(0, m_impl->m_historyMemoryLimit));
     else
-        m_impl->m_session->setHistoryType(HistoryTypeBuffer(lines));
+        m_impl->m_session->setHistoryType(CompactHistoryType(lines));
+}
+
+void QTermWidget::setHistoryMemoryLimit(qint64 bytes)
+{
+    m_impl->m_historyMemoryLimit = bytes;
+
+    // an unlimited history picks up the new limit right away
+    if (dynamic_cast<const TieredHistoryType *>(&m_impl->m_session->historyType()))
+        setHistorySize(-1);
+}
+
+void QTermWidget::setHistoryMemoryBudget(qint64 bytes)
+{
+    SessionManager::instance()->setHistoryMemoryBudget(bytes);
+}
+
+void QTermWidget::setHistoryJournal(const QString &fileName, bool restore)
+{
+    if (restore && !fileName.isEmpty() && !m_impl->m_session->restoreHistory(fileName))
+        qWarning() << "Cannot restore the history from" << fileName;
+    m_impl->m_session->setHistoryJournal(fileName);
+}
+
+void QTermWidget::removeHistoryJournal()
+{
+    m_impl->m_session->discardHistoryJournal();
+}
+
+qint64 QTermWidget::historyMemoryUsage() const
+{
+    return m_impl->m_session->historyMemoryUsage();
 }
 
 void QTermWidget::setScrollBarPosition(ScrollBarPosition pos)
@@ -781,6 +842,16 @@ bool QTermWidget::flowControlEnabled(void)
     return m_impl->m_session->flowControlEnabled();
 }
 
+void QTermWidget::setReceiveBudget(int bytes)
+{
+    m_impl->m_session->setReceiveBudget(bytes);
+}
+
+void QTermWidget::setEmulationThreaded(bool threaded)
+{
+    m_impl->m_session->setEmulationThreaded(threaded);
+}
+
 void QTermWidget::setFlowControlWarningEnabled(bool enabled)
 {
     if (flowControlEnabled()) {
@@ -801,26 +872,31 @@ void QTermWidget::setMotionAfterPasting(int action)
 
 int QTermWidget::historyLinesCount()
 {
+    QMutexLocker locker(m_impl->m_terminalDisplay->screenWindow()->screenLock());
     return m_impl->m_terminalDisplay->screenWindow()->screen()->getHistLines();
 }
 
 int QTermWidget::screenColumnsCount()
 {
+    QMutexLocker locker(m_impl->m_terminalDisplay->screenWindow()->screenLock());
     return m_impl->m_terminalDisplay->screenWindow()->screen()->getColumns();
 }
 
 int QTermWidget::screenLinesCount()
 {
+    QMutexLocker locker(m_impl->m_terminalDisplay->screenWindow()->screenLock());
     return m_impl->m_terminalDisplay->screenWindow()->screen()->getLines();
 }
 
 void QTermWidget::setSelectionStart(int row, int column)
 {
+    QMutexLocker locker(m_impl->m_terminalDisplay->screenWindow()->screenLock());
     m_impl->m_terminalDisplay->screenWindow()->screen()->setSelectionStart(column, row, true);
 }
 
 void QTermWidget::setSelectionEnd(int row, int column)
 {
+    QMutexLocker locker(m_impl->m_terminalDisplay->screenWindow()->screenLock());
     m_impl->m_terminalDisplay->screenWindow()->screen()->setSelectionEnd(column, row);
 }
 /********************************************************************
@@ -836,11 +912,13 @@ void QTermWidget::setSelectionAll()
 
 void QTermWidget::getSelectionStart(int &row, int &column)
 {
+    QMutexLocker locker(m_impl->m_terminalDisplay->screenWindow()->screenLock());
     m_impl->m_terminalDisplay->screenWindow()->screen()->getSelectionStart(column, row);
 }
 
 void QTermWidget::getSelectionEnd(int &row, int &column)
 {
+    QMutexLocker locker(m_impl->m_terminalDisplay->screenWindow()->screenLock());
     m_impl->m_terminalDisplay->screenWindow()->screen()->getSelectionEnd(column, row);
 }
 
@@ -861,6 +939,7 @@ void QTermWidget::setBackspaceMode(char *key, int length)
 
 QString QTermWidget::selectedText(bool preserveLineBreaks)
 {
+    QMutexLocker locker(m_impl->m_terminalDisplay->screenWindow()->screenLock());
     return m_impl->m_terminalDisplay->screenWindow()->screen()->selectedText(preserveLineBreaks);
 }
 
@@ -972,6 +1051,32 @@ void QTermWidget::saveHistory(QIODevice *device)
     m_impl->m_session->emulation()->writeToStream(&decoder, 0, m_impl->m_session->emulation()->lineCount());
 }
 
+bool QTermWidget::exportHistory(int fd, HistoryFormat format)
+{
+    HistoryExport::Format exportFormat = HistoryExport::PlainText;
+    if (format == AnsiHistory)
+        exportFormat = HistoryExport::AnsiText;
+    else if (format == HtmlHistory)
+        exportFormat = HistoryExport::Html;
+
+    return m_impl->m_historyExport->start(fd, exportFormat, m_impl->m_terminalDisplay->colorTable());
+}
+
+bool QTermWidget::isExportingHistory() const
+{
+    return m_impl->m_historyExport->isRunning();
+}
+
+void QTermWidget::cancelHistoryExport()
+{
+    m_impl->m_historyExport->cancel();
+}
+
+QString QTermWidget::historyExportErrorString() const
+{
+    return m_impl->m_historyExport->errorString();
+}
+
 void QTermWidget::setDrawLineChars(bool drawLineChars)
 {
     m_impl->m_terminalDisplay->setDrawLineChars(drawLineChars);
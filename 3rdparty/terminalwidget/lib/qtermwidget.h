@@ -55,6 +55,18 @@ public:
         ScrollBarRight = 2
     };
 
+    /**
+     * This enum describes the formats exportHistory() can write the output in.
+     */
+    enum HistoryFormat {
+        /** Plain text without colours. */
+        PlainTextHistory = 0,
+        /** Text with ANSI escape sequences for the colours, which "less -R" shows. */
+        AnsiHistory = 1,
+        /** An HTML page. */
+        HtmlHistory = 2
+    };
+
     using KeyboardCursorShape = Konsole::Emulation::KeyboardCursorShape;
 
     //Creation of widget
@@ -133,6 +145,25 @@ public:
     // History size for scrolling
     void setHistorySize(int lines);  // infinite if lines < 0
 
+    // Memory used by an infinite history before older lines are compressed
+    // and moved to a temporary file
+    void setHistoryMemoryLimit(qint64 bytes);
+
+    // Memory the history of all terminals together may use, 0 for no limit.
+    // The history of the terminals viewed least recently is reduced first.
+    static void setHistoryMemoryBudget(qint64 bytes);
+    // Memory used by the history of this terminal
+    qint64 historyMemoryUsage() const;
+
+    // Keeps a copy of the history in the file fileName, which is written on
+    // a worker thread and survives a restart of the application.  If restore
+    // is true, the lines in the file are added to the history first.  An
+    // empty name stops keeping a copy.
+    void setHistoryJournal(const QString &fileName, bool restore = false);
+    // Stops keeping the copy of the history and removes its file, without
+    // waiting for the worker thread to finish writing it
+    void removeHistoryJournal();
+
     // Presence of scrollbar
     void setScrollBarPosition(ScrollBarPosition);
 
@@ -155,6 +186,13 @@ public:
     // Returns whether flow control is enabled
     bool flowControlEnabled(void);
 
+    // Sets how many bytes of output are processed per event loop iteration, 0 for no limit
+    void setReceiveBudget(int bytes);
+
+    // Processes the output of the terminal process on a separate thread,
+    // must be called before the shell program is started
+    void setEmulationThreaded(bool threaded);
+
     /**
      * Sets whether the flow control warning box should be shown
      * when the flow control stop key (Ctrl+S) is pressed.
@@ -316,6 +354,16 @@ signals:
     void isTermIdle(bool bIdle);
     // 将库里返回信号透传出来。原来的noMatchFound方法改名为clearSelection
     void sig_noMatchFound();
+    /**
+     * Emitted when the matches of the search have changed, with the number
+     * of the current match counted from 1 (0 if there is none) and the
+     * number of all matches
+     */
+    void searchMatchCountChanged(int current, int count);
+
+    // Progress of the export started by exportHistory()
+    void historyExportProgress(int percent);
+    void historyExportFinished(bool success);
 
 public slots:
     // Copy selection to clipboard
@@ -351,8 +399,21 @@ public slots:
 
     void noMatchFound();
     /********************* Modify by n014361 wangpeili End ************************/
+    // Forget the matches of the search and stop marking them
+    void clearSearchMatches();
 
     void saveHistory(QIODevice *device);
+    /**
+     * Starts writing the whole output to @p fd in @p format on a worker
+     * thread, see historyExportProgress() and historyExportFinished().  The
+     * descriptor is duplicated, so it may be closed right away.  Returns
+     * false if an export is running already or @p fd is not valid.
+     */
+    bool exportHistory(int fd, HistoryFormat format);
+    bool isExportingHistory() const;
+    void cancelHistoryExport();
+    // Why the last export failed, empty if it succeeded or was cancelled
+    QString historyExportErrorString() const;
 protected:
     void resizeEvent(QResizeEvent *) override;
 
@@ -365,6 +426,7 @@ private slots:
     void findNext();
     void findPrevious();
     void matchFound(int startColumn, int startLine, int endColumn, int endLine, int loseChinese, int matchChinese);
+    void searchMatchesChanged();
 
     /**
      * Emulation::cursorChanged() signal propogates to here and QTermWidget
@@ -211,7 +211,20 @@ void MainWindow::initTabBar()
         return;
     });
 
-    addTab(m_properties);
+    // 开启保存历史记录时，恢复上次退出时的标签页，每个历史记录文件一个标签页
+    const QStringList journals = TermWidget::takeSavedHistoryJournals();
+    if (journals.isEmpty()) {
+        addTab(m_properties);
+        return;
+    }
+    TermProperties properties = m_properties;
+    properties[HistoryJournalFile] = journals.first();
+    addTab(properties);
+    for (int i = 1; i < journals.count(); i++) {
+        TermProperties restoredProperties;
+        restoredProperties[HistoryJournalFile] = journals.at(i);
+        addTab(restoredProperties);
+    }
 }
 
 /*******************************************************************************
@@ -502,6 +515,10 @@ void MainWindow::closeTab(const QString &identifier, bool hasConfirmed)
     m_tabChangeColorMap.remove(currSessionId);
     m_tabbar->removeTab(identifier);
     m_termStackWidget->removeWidget(tabPage);
+    // 用户关闭的标签页下次启动时不再恢复
+    if (!m_keepHistoryJournals) {
+        tabPage->discardHistoryJournals();
+    }
     tabPage->deleteLater();
 
     /******** Add by ut001000 renfeixiang 2020-08-07:关闭tab时改变大小，bug#41436***************/
@@ -898,6 +915,7 @@ void MainWindow::closeEvent(QCloseEvent *event)
         showExitConfirmDialog(Utils::CloseType_Window, runningCount, this);
         return;
     }
+    m_keepHistoryJournals = true;
     closeAllTab();
 
 
@@ -286,6 +286,8 @@ protected:
     // 雷神终端所在桌面
     int m_desktopIndex;
     bool m_hasConfirmedClose = false;
+    // 关闭整个窗口时保留历史记录文件，下次启动时恢复标签页
+    bool m_keepHistoryJournals = false;
 
     // 对应的程序启动时间，主进程或子进程
     qint64 m_ReferedAppStartTime = 0;
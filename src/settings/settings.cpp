@@ -277,6 +277,53 @@ bool Settings::OutputtingScroll()
     return settings->option("advanced.scroll.scroll_on_output")->value().toBool();
 }
 
+/*******************************************************************************
+ 1. @函数:    receiveBudget
+ 2. @说明:    设置界面获取每次事件循环处理的终端输出字节数（配置单位为KiB，0表示不限制）
+*******************************************************************************/
+int Settings::receiveBudget()
+{
+    return settings->option("advanced.scroll.receive_budget")->value().toInt() * 1024;
+}
+
+/*******************************************************************************
+ 1. @函数:    historySize
+ 2. @说明:    设置界面获取历史记录的行数（小于0表示不限制）
+*******************************************************************************/
+int Settings::historySize()
+{
+    return settings->option("advanced.scroll.history_size")->value().toInt();
+}
+
+/*******************************************************************************
+ 1. @函数:    historyMemoryLimit
+ 2. @说明:    设置界面获取不限制行数时历史记录占用的内存上限（配置单位为MiB），
+              超出部分压缩后存放到临时文件
+*******************************************************************************/
+qint64 Settings::historyMemoryLimit()
+{
+    return settings->option("advanced.scroll.history_memory_limit")->value().toLongLong() * 1024 * 1024;
+}
+
+/*******************************************************************************
+ 1. @函数:    historyMemoryBudget
+ 2. @说明:    设置界面获取所有终端的历史记录合计占用的内存上限（配置单位为MiB，0表示不限制），
+              超出时优先压缩或清理最久未查看的终端的历史记录
+*******************************************************************************/
+qint64 Settings::historyMemoryBudget()
+{
+    return settings->option("advanced.scroll.history_memory_budget")->value().toLongLong() * 1024 * 1024;
+}
+
+/*******************************************************************************
+ 1. @函数:    keepScrollback
+ 2. @说明:    设置界面获取是否将历史记录保存到磁盘，在程序重启（升级、崩溃、注销）后恢复标签页
+*******************************************************************************/
+bool Settings::keepScrollback()
+{
+    return settings->option("advanced.scroll.keep_scrollback")->value().toBool();
+}
+
 /*******************************************************************************
  1. @函数:    reload
  2. @作者:    ut001121 zhangmeng
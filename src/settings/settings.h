@@ -60,6 +60,11 @@ public:
     int fontSize();
     bool PressingScroll();
     bool OutputtingScroll();
+    int receiveBudget();
+    int historySize();
+    qint64 historyMemoryLimit();
+    qint64 historyMemoryBudget();
+    bool keepScrollback();
     void reload();
 
     // 设置主题
@@ -41,6 +41,8 @@ void GenerateSettingTranslate()
     Q_UNUSED(advanced_scroll_scroll_on_keyText);
     auto advanced_scroll_scroll_on_outputText = QObject::tr("Scroll on output");
     Q_UNUSED(advanced_scroll_scroll_on_outputText);
+    auto advanced_scroll_keep_scrollbackText = QObject::tr("Keep scrollback after restart");
+    Q_UNUSED(advanced_scroll_keep_scrollbackText);
     auto advanced_window_auto_hide_raytheon_windowText = QObject::tr("Hide Quake window after losing focus");
     Q_UNUSED(advanced_window_auto_hide_raytheon_windowText);
     auto advanced_window_blurred_backgroundText = QObject::tr("Blur background");
@@ -48,11 +48,18 @@ PageSearchBar::PageSearchBar(QWidget *parent) : DFloatingWidget(parent)
     initFindNextButton();
     initFindPrevButton();
 
+    // 匹配项数量，有匹配项时才显示
+    m_matchCountLabel = new DLabel(this);
+    m_matchCountLabel->setObjectName("PageSearchBarMatchCountLabel");
+    m_matchCountLabel->setAlignment(Qt::AlignCenter);
+    m_matchCountLabel->hide();
+
     // Init layout and widgets.
     QHBoxLayout *m_layout = new QHBoxLayout();
     m_layout->setSpacing(widgetSpace);
     m_layout->setContentsMargins(layoutMargins, layoutMargins, layoutMargins, layoutMargins);
     m_layout->addWidget(m_searchEdit);
+    m_layout->addWidget(m_matchCountLabel);
     m_layout->addWidget(m_findPrevButton);
     m_layout->addWidget(m_findNextButton);
     setLayout(m_layout);
@@ -313,3 +320,23 @@ void PageSearchBar::setNoMatchAlert(bool isAlert)
 {
     m_searchEdit->setAlert(isAlert);
 }
+
+/*******************************************************************************
+ 1. @函数:    setMatchCount
+ 2. @说明:    显示当前匹配项的序号和匹配项总数，没有匹配项时隐藏
+*******************************************************************************/
+void PageSearchBar::setMatchCount(int current, int count)
+{
+    if (count <= 0) {
+        m_matchCountLabel->hide();
+        return;
+    }
+
+    // 还没有跳转到匹配项时只显示总数
+    if (current > 0) {
+        m_matchCountLabel->setText(QString("%1/%2").arg(current).arg(count));
+    } else {
+        m_matchCountLabel->setText(QString::number(count));
+    }
+    m_matchCountLabel->show();
+}
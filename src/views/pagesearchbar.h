@@ -29,6 +29,7 @@
 #include <DFloatingWidget>
 #include <DPalette>
 #include <DSearchEdit>
+#include <DLabel>
 #include <DPushButton>
 
 // qt
@@ -53,6 +54,7 @@ public:
     bool isFocus();
     void focus();
     void setNoMatchAlert(bool isAlert);
+    void setMatchCount(int current, int count);
     QString searchKeytxt();
 
     void saveOldHoldContent();
@@ -79,6 +81,7 @@ private:
     DIconButton *m_findNextButton = nullptr;
     DIconButton *m_findPrevButton = nullptr;
     DSearchEdit *m_searchEdit = nullptr;
+    DLabel *m_matchCountLabel = nullptr;
 
     const int barHight = 50;
     const int barWidth = 382;
@@ -34,6 +34,7 @@
 #include <DApplicationHelper>
 #include <DLog>
 #include <DDialog>
+#include <DFileDialog>
 
 #include <QApplication>
 #include <QKeyEvent>
@@ -44,6 +45,10 @@
 #include <QApplication>
 #include <QClipboard>
 #include <QFileInfo>
+#include <QFile>
+#include <QDir>
+#include <QDateTime>
+#include <QStandardPaths>
 
 DWIDGET_USE_NAMESPACE
 using namespace Konsole;
@@ -56,7 +61,15 @@ TermWidget::TermWidget(TermProperties properties, QWidget *parent) : QTermWidget
     m_page = static_cast<TermWidgetPage *>(parentWidget());
     setContextMenuPolicy(Qt::CustomContextMenu);
 
-    setHistorySize(5000);
+    // 不限制行数时，较早的历史记录压缩后存放到临时文件
+    setHistoryMemoryLimit(Settings::instance()->historyMemoryLimit());
+    setHistorySize(Settings::instance()->historySize());
+    setHistoryMemoryBudget(Settings::instance()->historyMemoryBudget());
+    // 启动shell之前恢复上次的历史记录
+    initHistoryJournal();
+
+    // 在独立线程中解析终端输出，避免繁忙的标签页卡住整个窗口
+    setEmulationThreaded(true);
 
     // set shell program
     QString shell{ getenv("SHELL") };
@@ -134,6 +147,9 @@ TermWidget::TermWidget(TermProperties properties, QWidget *parent) : QTermWidget
     // 按键滚动
     setPressingScroll(Settings::instance()->PressingScroll());
 
+    // 每次事件循环处理的输出量，避免大量输出时界面卡死
+    setReceiveBudget(Settings::instance()->receiveBudget());
+
     /******** Modify by ut000439 wangpeili 2020-07-27: fix bug 39371: 分屏线可以拉到边****/
     // 以最小mainwindow分4屏为标准的最小大小
     /******** Modify by ut001000 renfeixiang 2020-08-07:修改成根据全局变量m_MinWidth，m_MinHeight计算出term的最小高度和宽度***************/
@@ -184,6 +200,23 @@ TermWidget::TermWidget(TermProperties properties, QWidget *parent) : QTermWidget
 
     connect(this, &QWidget::customContextMenuRequested, this, &TermWidget::customContextMenuCall);
 
+    // 保存终端输出的进度显示在右键菜单中
+    connect(this, &QTermWidget::historyExportProgress, this, [this](int percent) {
+        m_saveOutputPercent = percent;
+    });
+    connect(this, &QTermWidget::historyExportFinished, this, [this](bool success) {
+        if (success) {
+            return;
+        }
+        // 保存失败或被取消时提示用户，已写入的文件不完整
+        qWarning() << "save output failed or canceled" << historyExportErrorString();
+        if (m_saveOutputCancelled) {
+            showSaveOutputError(tr("Saving the output was cancelled, %1 is incomplete").arg(m_saveOutputFileName));
+        } else {
+            showSaveOutputError(tr("Failed to save the output to %1: %2").arg(m_saveOutputFileName, historyExportErrorString()));
+        }
+    });
+
     connect(DApplicationHelper::instance(),
             &DApplicationHelper::themeTypeChanged,
             this,
@@ -201,6 +234,12 @@ TermWidget::TermWidget(TermProperties properties, QWidget *parent) : QTermWidget
     connect(this, &QTermWidget::sig_noMatchFound, this, [this]() {
         parentPage()->setMismatchAlert(true);
     });
+    // 查找框显示当前终端的匹配项数量
+    connect(this, &QTermWidget::searchMatchCountChanged, this, [this](int current, int count) {
+        if (parentPage()->currentTerminal() == this) {
+            parentPage()->setMatchCount(current, count);
+        }
+    });
     /********************* Modify by n014361 wangpeili End ************************/
 
     connect(this, &QTermWidget::isTermIdle, this, [this](bool bIdle) {
@@ -419,6 +458,18 @@ void TermWidget::addMenuActions(const QPoint &pos)
     m_menu->addAction(tr("Find"), this, [this] {
         parentPage()->parentMainWindow()->showPlugin(MainWindow::PLUGIN_TYPE_SEARCHBAR);
     });
+
+    // 保存过程中可以取消
+    if (isExportingHistory()) {
+        m_menu->addAction(tr("Cancel saving output (%1%)").arg(m_saveOutputPercent), this, [this] {
+            m_saveOutputCancelled = true;
+            cancelHistoryExport();
+        });
+    } else {
+        m_menu->addAction(tr("Save output"), this, [this] {
+            saveOutput();
+        });
+    }
     m_menu->addSeparator();
 
     if (!selectedText().isEmpty()) {
@@ -680,6 +731,69 @@ void TermWidget::setEnterSzCommand(bool enterSzCommand)
     m_enterSzCommand = enterSzCommand;
 }
 
+/*******************************************************************************
+ 1. @函数:    saveOutput
+ 2. @说明:    选择文件和格式（纯文本、带颜色的文本、HTML），在后台线程中保存终端输出
+*******************************************************************************/
+void TermWidget::saveOutput()
+{
+    const QString plainTextFilter = tr("Text files (*.txt)");
+    const QString ansiFilter = tr("Text files with colors (*.ansi)");
+    const QString htmlFilter = tr("HTML files (*.html)");
+
+    DFileDialog dialog(this, tr("Save output"), QDir::homePath());
+    dialog.setAcceptMode(QFileDialog::AcceptSave);
+    dialog.setFileMode(QFileDialog::AnyFile);
+    dialog.setNameFilters(QStringList() << plainTextFilter << ansiFilter << htmlFilter);
+    if (dialog.exec() != QDialog::Accepted || dialog.selectedFiles().isEmpty()) {
+        return;
+    }
+
+    QTermWidget::HistoryFormat format = QTermWidget::PlainTextHistory;
+    QString suffix = "txt";
+    if (dialog.selectedNameFilter() == ansiFilter) {
+        format = QTermWidget::AnsiHistory;
+        suffix = "ansi";
+    } else if (dialog.selectedNameFilter() == htmlFilter) {
+        format = QTermWidget::HtmlHistory;
+        suffix = "html";
+    }
+
+    QString fileName = dialog.selectedFiles().first();
+    if (QFileInfo(fileName).suffix().isEmpty()) {
+        fileName += "." + suffix;
+    }
+
+    // 文件描述符由终端库复制，这里的文件可以随即关闭
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "can not open" << fileName << file.errorString();
+        showSaveOutputError(tr("Failed to save the output to %1: %2").arg(fileName, file.errorString()));
+        return;
+    }
+    m_saveOutputPercent = 0;
+    m_saveOutputFileName = fileName;
+    m_saveOutputCancelled = false;
+    if (!exportHistory(file.handle(), format)) {
+        showSaveOutputError(tr("Failed to save the output to %1").arg(fileName));
+    }
+}
+
+/*******************************************************************************
+ 1. @函数:    showSaveOutputError
+ 2. @说明:    保存终端输出失败或被取消时弹窗提示
+*******************************************************************************/
+void TermWidget::showSaveOutputError(const QString &text)
+{
+    DDialog *dlg = new DDialog(this);
+    dlg->setAttribute(Qt::WA_DeleteOnClose);
+    dlg->setWindowModality(Qt::WindowModal);
+    dlg->setTitle(text);
+    dlg->setIcon(QIcon::fromTheme("dialog-warning"));
+    dlg->addButton(QString(tr("OK")), true, DDialog::ButtonNormal);
+    dlg->show();
+}
+
 /*******************************************************************************
  1. @函数:    customContextMenuCall
  2. @作者:    ut000125 sunchengxi
@@ -918,6 +1032,35 @@ void TermWidget::onSettingValueChanged(const QString &keyName)
         return;
     }
 
+    if (keyName == "advanced.scroll.receive_budget") {
+        setReceiveBudget(Settings::instance()->receiveBudget());
+        return;
+    }
+
+    if (keyName == "advanced.scroll.history_size") {
+        setHistorySize(Settings::instance()->historySize());
+        return;
+    }
+
+    if (keyName == "advanced.scroll.history_memory_limit") {
+        setHistoryMemoryLimit(Settings::instance()->historyMemoryLimit());
+        return;
+    }
+
+    if (keyName == "advanced.scroll.history_memory_budget") {
+        setHistoryMemoryBudget(Settings::instance()->historyMemoryBudget());
+        return;
+    }
+
+    if (keyName == "advanced.scroll.keep_scrollback") {
+        if (Settings::instance()->keepScrollback()) {
+            initHistoryJournal();
+        } else {
+            discardHistoryJournal();
+        }
+        return;
+    }
+
     if (keyName == "basic.interface.theme") {
         return;
     }
@@ -941,6 +1084,85 @@ void TermWidget::onSettingValueChanged(const QString &keyName)
     qDebug() << "settingValue[" << keyName << "] changed is not effective";
 }
 
+/*******************************************************************************
+ 1. @函数:    historyJournalDir
+ 2. @说明:    保存历史记录文件的目录
+*******************************************************************************/
+static QString historyJournalDir()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/scrollback";
+}
+
+/*******************************************************************************
+ 1. @函数:    initHistoryJournal
+ 2. @说明:    开启保存历史记录时，将历史记录写入磁盘上的文件（后台线程批量写入）；
+              恢复的标签页先读回上次的历史记录，之后继续写入同一个文件
+*******************************************************************************/
+void TermWidget::initHistoryJournal()
+{
+    if (!Settings::instance()->keepScrollback() || !m_historyJournal.isEmpty()) {
+        return;
+    }
+
+    bool restore = m_properties.contains(HistoryJournalFile);
+    if (restore) {
+        m_historyJournal = m_properties[HistoryJournalFile].toString();
+    } else {
+        // 文件名按创建顺序排列，恢复时保持标签页的顺序
+        static int journalCount = 0;
+        QDir().mkpath(historyJournalDir());
+        m_historyJournal = QString("%1/%2-%3.journal").arg(historyJournalDir())
+                           .arg(QDateTime::currentMSecsSinceEpoch())
+                           .arg(journalCount++, 4, 10, QChar('0'));
+    }
+    setHistoryJournal(m_historyJournal, restore);
+}
+
+/*******************************************************************************
+ 1. @函数:    discardHistoryJournal
+ 2. @说明:    停止保存历史记录并删除文件，用户关闭的终端下次启动时不再恢复
+*******************************************************************************/
+void TermWidget::discardHistoryJournal()
+{
+    if (m_historyJournal.isEmpty()) {
+        return;
+    }
+
+    // 文件由终端库的写入线程删除，这里不等待它结束
+    removeHistoryJournal();
+    m_historyJournal.clear();
+}
+
+/*******************************************************************************
+ 1. @函数:    takeSavedHistoryJournals
+ 2. @说明:    第一个窗口启动时取出上次退出（升级、崩溃、注销）时保留的历史记录文件，
+              按创建顺序返回，每个文件恢复为一个标签页；未开启保存时删除这些文件
+*******************************************************************************/
+QStringList TermWidget::takeSavedHistoryJournals()
+{
+    static bool taken = false;
+    if (taken) {
+        return QStringList();
+    }
+    taken = true;
+
+    QDir dir(historyJournalDir());
+    // 未写完的临时文件
+    for (const QString &name : dir.entryList(QStringList("*.journal.new"), QDir::Files)) {
+        dir.remove(name);
+    }
+
+    QStringList journals;
+    for (const QString &name : dir.entryList(QStringList("*.journal"), QDir::Files, QDir::Name)) {
+        if (Settings::instance()->keepScrollback()) {
+            journals << dir.filePath(name);
+        } else {
+            dir.remove(name);
+        }
+    }
+    return journals;
+}
+
 /*******************************************************************************
  1. @函数:    onTouchPadSignal
  2. @作者:    ut000610 戴正文
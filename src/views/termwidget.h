@@ -86,6 +86,11 @@ public:
     // 获取该终端距离page的层次
     int getTermLayer();
 
+    // 删除保存到磁盘的历史记录（用户主动关闭终端时不再恢复）
+    void discardHistoryJournal();
+    // 取出上次退出时保留的历史记录文件，每个进程只取一次
+    static QStringList takeSavedHistoryJournals();
+
 public slots:
     void wpasteSelection();
     void onSettingValueChanged(const QString &keyName);
@@ -103,6 +108,12 @@ private slots:
 private:
     /*** 修复 bug 28162 鼠标左右键一起按终端会退出 ***/
     void addMenuActions(const QPoint &pos);
+    // 将终端输出保存到文件
+    void saveOutput();
+    // 保存终端输出失败或被取消时提示用户
+    void showSaveOutputError(const QString &text);
+    // 开始将历史记录保存到磁盘，有上次的记录时先恢复
+    void initHistoryJournal();
 
     TermWidgetPage *m_page = nullptr;
     TermProperties m_properties;
@@ -122,6 +133,13 @@ private:
     EraseMode m_backspaceMode = EraseMode_Ascii_Delete;
     // 当前终端删除信号
     EraseMode m_deleteMode = EraseMode_Escape_Sequeue;
+    // 保存终端输出的进度（百分比）
+    int m_saveOutputPercent = 0;
+    // 正在保存输出的文件，以及保存是否被用户取消
+    QString m_saveOutputFileName;
+    bool m_saveOutputCancelled = false;
+    // 保存历史记录的文件，未开启时为空
+    QString m_historyJournal;
 };
 
 #endif  // TERMWIDGET_H
@@ -227,7 +227,8 @@ void TermWidgetPage::closeSplit(TermWidget *term, bool hasConfirmed)
             qDebug() << "can not found nextTerm in TermWidget";
         }
 
-        // 释放控件
+        // 释放控件，关闭的分屏下次启动时不再恢复
+        term->discardHistoryJournal();
         term->deleteLater();
         upSplit->setParent(nullptr);
         upSplit->deleteLater();
@@ -523,6 +524,18 @@ int TermWidgetPage::runningTerminalCount()
     return count;
 }
 
+/*******************************************************************************
+ 1. @函数:    discardHistoryJournals
+ 2. @说明:    用户关闭标签页时删除其中所有终端保存到磁盘的历史记录
+*******************************************************************************/
+void TermWidgetPage::discardHistoryJournals()
+{
+    QList<TermWidget *> termList = findChildren<TermWidget *>();
+    for (TermWidget *term : termList) {
+        term->discardHistoryJournal();
+    }
+}
+
 /*******************************************************************************
  1. @函数:    createCurrentTerminalProperties
  2. @作者:    ut000439 wangpeili
@@ -797,6 +810,7 @@ void TermWidgetPage::showSearchBar(int state)
         qDebug() << __FUNCTION__ << "show search bar!";
         QTimer::singleShot(10, this, [ = ] { m_findBar->focus(); });
     } else if (SearchBar_Hide == state) {
+        clearSearchMatches();
         m_findBar->hide();
         qDebug() << __FUNCTION__ << "hide search bar!";
     } else if (SearchBar_FocusOut == state) {
@@ -806,6 +820,7 @@ void TermWidgetPage::showSearchBar(int state)
         if (Utils::getMainWindow(this)->isFocusOnList()) {
             Utils::getMainWindow(this)->focusCurrentPage();
         }
+        clearSearchMatches();
          m_findBar->hide();
         /******** Modify by ut001000 renfeixiang 2020-08-28 End***************/
     }
@@ -961,6 +976,8 @@ void TermWidgetPage::handleUpdateSearchKeyword(const QString &keyword)
     setMismatchAlert(false);
     if (keyword.isEmpty()) {
         m_currentTerm->clearSelection();
+        // 清空关键字后不再标记所有匹配项
+        m_currentTerm->clearSearchMatches();
     } else {
         // 输入时直接查找，被禁用
         // m_currentTerm->search(m_findBar->SearchKeytxt(), true, false);
@@ -1055,6 +1072,25 @@ void TermWidgetPage::setMismatchAlert(bool alert)
 {
     m_findBar->setNoMatchAlert(alert);
 }
+/*******************************************************************************
+ 1. @函数:    setMatchCount
+ 2. @说明:    在查找框中显示当前匹配项的序号和匹配项总数
+*******************************************************************************/
+void TermWidgetPage::setMatchCount(int current, int count)
+{
+    m_findBar->setMatchCount(current, count);
+}
+/*******************************************************************************
+ 1. @函数:    clearSearchMatches
+ 2. @说明:    查找框隐藏时，清除所有终端中标记的匹配项
+*******************************************************************************/
+void TermWidgetPage::clearSearchMatches()
+{
+    QList<TermWidget *> termList = findChildren<TermWidget *>();
+    for (TermWidget *term : termList) {
+        term->clearSearchMatches();
+    }
+}
 /*******************************************************************************
  1. @函数:    resizeEvent
  2. @作者:    ut000439 王培利
@@ -71,6 +71,8 @@ public:
     /********************* Modify by n014361 wangpeili End ************************/
     int runningTerminalCount();
     TermProperties createCurrentTerminalProperties();
+    // 删除所有终端保存到磁盘的历史记录
+    void discardHistoryJournals();
 
     void setTerminalOpacity(qreal opacity);
     void setColorScheme(const QString &name);
@@ -104,6 +106,7 @@ public:
     /********************* Modify by n014361 wangpeili End ************************/
     void setTextCodec(QTextCodec *codec);
     void setMismatchAlert(bool alert);
+    void setMatchCount(int current, int count);
 
     // 显示重命名弹窗
     void showRenameTitleDialog(QString oldTitle);
@@ -150,6 +153,7 @@ private slots:
 private:
     TermWidget *createTerm(TermProperties properties);
     void setSplitStyle(DSplitter *splitter);
+    void clearSearchMatches();
 
     TermWidget *m_currentTerm = nullptr;
     PageSearchBar *m_findBar = nullptr;